@@ -111,7 +111,7 @@ blit::File romFile;
 bool turbo = false;
 bool awfulScale = false;
 
-void updateCartRAM(uint8_t *cartRam, unsigned int size);
+void updateCartRAM(uint8_t *cartRam, unsigned int size, const uint32_t *dirtyPages = nullptr);
 
 // menu
 enum class MenuItem
@@ -281,8 +281,9 @@ void getROMBank(uint8_t bank, uint8_t *ptr)
     bankLoadTime += blit::us_diff(start, blit::now_us());
 }
 
-void updateCartRAM(uint8_t *cartRam, unsigned int size)
+void updateCartRAM(uint8_t *cartRam, unsigned int size, const uint32_t *dirtyPages)
 {
+    // always written in full, the whole file is replaced for safety
     auto saveFile = loadedFilename.substr(0, loadedFilename.find_last_of('.') + 1) + "sav";
 
     blit::File f(saveFile + ".tmp", blit::OpenMode::write);
@@ -434,6 +435,9 @@ void init()
 
     mem.setROMBankCallback(getROMBank);
     mem.setCartRamUpdateCallback(updateCartRAM);
+#ifndef DMG_NO_ROM_PREFETCH
+    mem.setROMBankPrefetch(true);
+#endif
 
     // autostart
     auto launchPath = blit::get_launch_path();
@@ -646,6 +650,10 @@ void update(uint32_t time_ms)
 
     if(end - start > 10)
         blit::debugf("running slow! %ims %i banks/%ius\n", end-start, loadedBanks, bankLoadTime);
+#ifndef DMG_NO_ROM_PREFETCH
+    else
+        cpu.getMem().prefetchROMBank(); // no threads, use the spare time to load the next bank
+#endif
 
     // SPEEEEEEEED
     while(turbo && blit::now() - start < 9)
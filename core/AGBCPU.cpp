@@ -12,7 +12,7 @@
 #include "AGBRegs.h"
 #include "GCCBuiltin.h"
 
-AGBCPU::AGBCPU() : apu(*this), display(*this), mem(*this)
+AGBCPU::AGBCPU() : jit(*this), apu(*this), display(*this), mem(*this)
 {}
 
 void AGBCPU::reset()
@@ -20,14 +20,29 @@ void AGBCPU::reset()
     for(auto &reg: regs)
         reg = 0;
 
+    regBankOffset = 0;
     cpsr = Flag_I | Flag_F | 0x13 /*supervisor mode*/;
+#ifndef AGB_EAGER_FLAGS
+    lastFlagOp = FlagOp::None;
+#endif
     modeChanged();
     
     halted = false;
+    biosCycles = 0;
 
     cycleCount = 0;
     lastTimerUpdate = 0;
 
+    scheduler.reset();
+    nextUpdateCycle = 0;
+
+    for(auto &block : codeBlocks)
+        block.addr = ~0u;
+
+    idleLoopStats = {};
+
+    jit.reset();
+
     for(auto &c : timerCounters)
         c = 0;
     for(auto &p : timerPrescalers)
@@ -37,13 +52,15 @@ void AGBCPU::reset()
     apu.reset();
     display.reset();
 
+    m4aMixerAddr = m4aMixerHLE ? findM4AMixer() : 0;
+
     // TODO: also allow skipping if it's loaded?
     if(!mem.hasBIOS())
     {
-        loReg(Reg::LR) = 0x8000000;
-        loReg(Reg::R13) = 0x3007F00;
-        loReg(Reg::R13_svc) = 0x3007FE0;
-        loReg(Reg::R13_irq) = 0x3007FA0;
+        bankedReg(Reg::LR) = 0x8000000;
+        bankedReg(Reg::R13) = 0x3007F00;
+        bankedReg(Reg::R13_svc) = 0x3007FE0;
+        bankedReg(Reg::R13_irq) = 0x3007FA0;
 
         cpsr = 0x1F; // system mode
         modeChanged();
@@ -63,6 +80,14 @@ void AGBCPU::reset()
         updateARMPC(0);
 }
 
+void AGBCPU::setExecMode(ExecMode mode)
+{
+    if(mode == ExecMode::JIT && !jit.init())
+        mode = ExecMode::Cached;
+
+    execMode = mode;
+}
+
 void AGBCPU::run(int ms)
 {
     runCycles((clockSpeed * ms) / 1000);
@@ -73,17 +98,17 @@ void AGBCPU::runFrame()
     lastExtraCycles = runCycles(308 * 228 * 4 + lastExtraCycles);
 }
 
-void AGBCPU::flagInterrupt(int interrupt, bool recalculateUpdate)
+void AGBCPU::flagInterrupt(int interrupt)
 {
     mem.writeIOReg(IO_IF, mem.readIOReg(IO_IF) | interrupt);
 
     currentInterrupts = enabledInterrutps & mem.readIOReg(IO_IF);
 
     if(!interruptDelay && currentInterrupts)
+    {
         interruptDelay = 7; // unsure of this, but 7 seems to pass more tests than 6
-
-    if(recalculateUpdate)
-        calculateNextUpdate(cycleCount);
+        scheduleInterruptDelay();
+    }
 }
 
 void AGBCPU::triggerDMA(int trigger)
@@ -113,6 +138,10 @@ void AGBCPU::triggerDMA(int trigger)
 
 uint16_t AGBCPU::readReg(uint32_t addr, uint16_t val)
 {
+    // only display status, interrupts and input can be assumed not to change until the next event
+    if(idleLoopReadsOk && addr > IO_VCOUNT && addr != IO_KEYINPUT && (addr < IO_IE || addr > IO_IME))
+        idleLoopReadsOk = false;
+
     if(addr < IO_SOUND1CNT_L)
         return display.readReg(addr, val);
     else if(addr <= IO_FIFO_B)
@@ -235,11 +264,7 @@ bool AGBCPU::writeReg(uint32_t addr, uint16_t data, uint16_t mask)
                 timerInterruptEnabled &= ~(1 << index);
             }
 
-            if(timerEnabled)
-            {
-                calculateNextTimerOverflow(cycleCount);
-                calculateNextUpdate(cycleCount);
-            }
+            calculateNextTimerOverflow(cycleCount);
 
             break;
         }
@@ -249,7 +274,8 @@ bool AGBCPU::writeReg(uint32_t addr, uint16_t data, uint16_t mask)
 
             enabledInterrutps = (mem.readIOReg(IO_IME) & 1) ? data : 0;
             currentInterrupts = enabledInterrutps & mem.readIOReg(IO_IF);
-            calculateNextUpdate(cycleCount);
+            scheduleDisplayUpdate();
+            scheduleInterruptDelay();
             break;
 
         case IO_IF: // writing IF bits clears them internally
@@ -271,7 +297,8 @@ bool AGBCPU::writeReg(uint32_t addr, uint16_t data, uint16_t mask)
             enabledInterrutps = (data & 1) ? mem.readIOReg(IO_IE) : 0;
             currentInterrupts = enabledInterrutps & mem.readIOReg(IO_IF);
 
-            calculateNextUpdate(cycleCount);
+            scheduleDisplayUpdate();
+            scheduleInterruptDelay();
             break;
 
         case IO_HALTCNT - 1: // the address of POSTFLG, but we're ignoring that
@@ -354,6 +381,8 @@ void AGBCPU::writeMem32(uint32_t addr, uint32_t data, int &cycles, bool sequenti
 
 int AGBCPU::runCycles(int cycles)
 {
+    auto startCycles = cycles;
+
     while(cycles > 0)
     {
         uint32_t exec = 1;
@@ -373,16 +402,31 @@ int AGBCPU::runCycles(int cycles)
                     break;
             }
         }
+        else if(biosCycles)
+        {
+            // still in a HLE BIOS call or mixer, run up to the next event so that DMA/timers still happen
+            exec = std::min({static_cast<uint32_t>(biosCycles), static_cast<uint32_t>(cycles), nextUpdateCycle - cycleCount});
+            biosCycles -= exec;
+        }
         else if(!halted)
         {
+            // replaced sound mixer, 0 if it can't handle something and the guest code should run instead
+            exec = m4aMixerAddr && loReg(Reg::PC) - 2 == m4aMixerAddr && (cpsr & Flag_T) ? handleM4AMixer() : 0;
+
             // CPU
-            exec = (cpsr & Flag_T) ? executeTHUMBInstruction() : executeARMInstruction();
+            if(!exec)
+            {
+                if(execMode == ExecMode::Interpreter)
+                    exec = (cpsr & Flag_T) ? executeTHUMBInstruction() : executeARMInstruction();
+                else
+                    exec = (cpsr & Flag_T) ? executeBlock<true>(cycles) : executeBlock<false>(cycles);
+            }
         }
 
         // loop until not halted or DMA was triggered
         do
         {
-            if(currentInterrupts)
+            if(currentInterrupts && !biosCycles) // BIOS calls run with interrupts disabled, the mixer holds them until it is done
             {
                 if(interruptDelay <= exec)
                 {
@@ -390,7 +434,7 @@ int AGBCPU::runCycles(int cycles)
                     if(interruptDelay)
                     {
                         interruptDelay = 0;
-                        calculateNextUpdate(cycleCount);
+                        scheduleInterruptDelay();
                     }
                 }
                 else
@@ -403,16 +447,7 @@ int AGBCPU::runCycles(int cycles)
             cycleCount += exec;
 
             if(shouldUpdate)
-            {
-                updateTimers();
-
-                bool displayInterruptsEnabled = enabledInterrutps & (Int_LCDVBlank | Int_LCDHBlank | Int_LCDVCount);
-
-                if(displayInterruptsEnabled)
-                    display.update();
-
-                calculateNextUpdate(cycleCount);
-            }
+                runEvents();
 
             if(halted && cycles > 0)
             {
@@ -428,6 +463,8 @@ int AGBCPU::runCycles(int cycles)
         while(halted && !(dmaTriggered) && cycles > 0);
     }
 
+    idleLoopStats.cyclesRun += startCycles - cycles;
+
     return cycles;
 }
 
@@ -448,269 +485,366 @@ int AGBCPU::executeARMInstruction()
 
     // ... and execute
 
-    // 0-3
-    const auto doDataProcessing = [this](uint32_t opcode, uint32_t op2, bool carry, int pcInc = 0)
-    {
-        auto op1Reg = static_cast<Reg>((opcode >> 16) & 0xF);
-        auto op1 = reg(op1Reg);
-        if(op1Reg == Reg::PC)
-            op1 += pcInc;
-
-        auto instOp = (opcode >> 21) & 0xF;
-        bool setCondCode = (opcode & (1 << 20));
-        auto destReg = static_cast<Reg>((opcode >> 12) & 0xF);
-        return setCondCode ? doALUOp(instOp, destReg, op1, op2, carry) : doALUOpNoCond(instOp, destReg, op1, op2);
-    };
-
     // condition
     if(!checkARMCondition(opcode >> 28))
         return mem.prefetchTiming32(pcSCycles);
 
-    switch((opcode >> 24) & 0xF)
+    return (this->*armTable[((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0xF)])(opcode);
+}
+
+int AGBCPU::executeTHUMBInstruction()
+{
+    auto &pc = loReg(Reg::PC); // not a low reg, but not banked
+    uint16_t opcode = decodeOp;
+
+    decodeOp = fetchOp;
+
+    pc += 2;
+    auto thumbPCPtr = reinterpret_cast<const uint16_t *>(pcPtr + pc);
+    assert(mem.verifyPointer(thumbPCPtr, pc));
+    fetchOp = *thumbPCPtr;
+
+    // a case per handler so that they can be inlined, the table is only used by the block cache/JIT
+#define THUMB_CASE(i) case i: return (this->*getTHUMBHandler<i>())(opcode, pc);
+#define THUMB_CASE4(i) THUMB_CASE(i) THUMB_CASE(i + 1) THUMB_CASE(i + 2) THUMB_CASE(i + 3)
+#define THUMB_CASE16(i) THUMB_CASE4(i) THUMB_CASE4(i + 4) THUMB_CASE4(i + 8) THUMB_CASE4(i + 12)
+#define THUMB_CASE64(i) THUMB_CASE16(i) THUMB_CASE16(i + 16) THUMB_CASE16(i + 32) THUMB_CASE16(i + 48)
+#define THUMB_CASE256(i) THUMB_CASE64(i) THUMB_CASE64(i + 64) THUMB_CASE64(i + 128) THUMB_CASE64(i + 192)
+
+    switch(opcode >> 6)
     {
-        case 0x0: // data processing with register (and halfword transfer/multiply)
-        {
-            if((opcode & 0x90) == 0x90)
-            {
-                if((opcode >> 5) & 3) // halfword transfer
-                    return doARMHalfwordTransfer(opcode, false);
+        THUMB_CASE256(0)
+        THUMB_CASE256(256)
+        THUMB_CASE256(512)
+        THUMB_CASE256(768)
+    }
 
-                return doARMMultiply(opcode);
-            }
+#undef THUMB_CASE256
+#undef THUMB_CASE64
+#undef THUMB_CASE16
+#undef THUMB_CASE4
+#undef THUMB_CASE
+
+    __builtin_unreachable();
+}
 
-            // reg arg2
-            bool carry;
-            auto op2 = getARMShiftedReg(opcode, carry);
+// runs cached instructions until the next one needs handling in runCycles,
+// cycles from all but the last instruction are added here
+template<bool isThumb>
+int AGBCPU::executeBlock(int &cycles)
+{
+    auto &pc = loReg(Reg::PC);
+    const int opSize = isThumb ? 2 : 4;
+    uint32_t addr = pc - opSize; // decodeOp
 
-            bool isRegShift = opcode & (1 << 4);
-            return doDataProcessing(opcode, op2, carry, isRegShift ? 4 : 0) + (isRegShift ? 1 : 0); // +1I if shift by reg
-        }
-        case 0x1: // data processing with register (and branch exchange/swap)
+    auto block = getCodeBlock(addr, isThumb);
+
+    // not cacheable, or the pipeline was fetched before the code was modified
+    if(!block || block->ops[0].opcode != decodeOp || block->ops[1].opcode != fetchOp)
+        return isThumb ? executeTHUMBInstruction() : executeARMInstruction();
+
+    // idle loops stay on the cached path so that they can be checked
+    bool checkIdle = block->idleLoop && idleLoopSkip && !currentInterrupts;
+
+    // the native code only checks for interrupts after instructions it calls the handlers for
+    if(execMode == ExecMode::JIT && !currentInterrupts && !checkIdle)
+    {
+        if(!block->jitCode && ++block->jitHits == jitThreshold)
         {
-            if(((opcode >> 8) & 0xFFFF) == 0x2FFF) // Branch and Exchange (BX)
+            // out of space, start again
+            if(jit.isFull())
             {
-                [[maybe_unused]] auto instOp = (opcode >> 4) & 0xF;
-                assert(instOp == 1); //
-                auto newPC = reg(static_cast<Reg>(opcode & 0xF));
-
-                if(newPC & 1)
+                jit.reset();
+                for(auto &b : codeBlocks)
                 {
-                    cpsr |= Flag_T;
-                    updateTHUMBPC(newPC & ~1);
+                    b.jitCode = nullptr;
+                    b.jitHits = 0;
                 }
-                else
-                    updateARMPC(newPC);
-
-                return pcSCycles * 2 + pcNCycles;
             }
 
-            if((opcode & 0x90) == 0x90)
-            {
-                if((opcode >> 5) & 3) // halfword transfer
-                    return doARMHalfwordTransfer(opcode, true);
+            // stays on the cached path if this fails
+            block->jitCode = jit.compile(addr, isThumb);
+        }
 
-                return doARMSwap(opcode);
-            }
+        if(block->jitCode)
+        {
+            updateFlags(); // translated code uses cpsr directly
+            return block->jitCode(this, &cycles);
+        }
+    }
+
+    auto writeCount = mem.getCodeWriteCount();
+
+    // if a loop ends in the same state it started in, it's going to keep doing that until something else changes
+    uint32_t idleRegs[31], idleCPSR = 0;
+    auto idleStartCycle = cycleCount;
 
-            auto instOp = (opcode >> 21) & 0xF; // 8-F
-            bool setCondCode = (opcode & (1 << 20));
+    if(checkIdle)
+    {
+        idleCPSR = getCPSR();
+        memcpy(idleRegs, regs, sizeof(regs));
+        idleLoopReadsOk = true;
+    }
 
-            if(!setCondCode && instOp <= 0xB /*CMN*/) // PSR Transfer (TST-CMN)
-                return doARMPSRTransfer(opcode);
+    for(int i = 0;; i++)
+    {
+        auto &op = block->ops[i];
 
-            // reg arg2
-            bool carry;
-            auto op2 = getARMShiftedReg(opcode, carry);
+        decodeOp = block->ops[i + 1].opcode;
+        fetchOp = block->ops[i + 2].opcode;
+        pc += opSize;
 
-            bool isRegShift = opcode & (1 << 4);
-            return doDataProcessing(opcode, op2, carry, isRegShift ? 4 : 0) + (isRegShift ? 1 : 0); // +1I if shift by reg
-        }
-        case 0x2: // data processing with immediate
+        int exec;
+
+        if constexpr(isThumb)
+            exec = (this->*op.thumb)(op.opcode, pc);
+        else if(checkARMCondition(op.opcode >> 28))
+            exec = (this->*op.arm)(op.opcode);
+        else
+            exec = mem.prefetchTiming32(pcSCycles);
+
+        // branch or mode switch, pipeline already refilled
+        if(pc != addr + (i + 2) * opSize || !(cpsr & Flag_T) == isThumb)
         {
-            // get the immediate value
-            uint32_t op2 = opcode & 0xFF;
-            int shift = ((opcode >> 8) & 0xF) * 2;
-            op2 = (op2 >> shift) | (op2 << (32 - shift));
-            bool carry = shift ? op2 & (1 << 31) : cpsr & Flag_C;
+            if(checkIdle && !idleLoopReadsOk)
+                block->idleLoop = false; // polling something that isn't going to wait for an event
+            else if(checkIdle && pc == addr + opSize && getCPSR() == idleCPSR && memcmp(regs, idleRegs, sizeof(regs)) == 0)
+                exec += getIdleLoopSkipCycles(cycleCount + exec, cycleCount + exec - idleStartCycle, cycles - exec);
 
-            return doDataProcessing(opcode, op2, carry);
+            return exec;
         }
-        case 0x3: // same as above, but also possibly MSR
-        {
-            auto instOp = (opcode >> 21) & 0xF; // 8-F
-            bool setCondCode = (opcode & (1 << 20));
 
-            // get the immediate value
-            uint32_t op2 = opcode & 0xFF;
-            int shift = ((opcode >> 8) & 0xF) * 2;
+        // end of block, code modified or anything runCycles would do more than count cycles for
+        if(i + 1 == block->numOps || mem.getCodeWriteCount() != writeCount || currentInterrupts || dmaTriggered || halted
+        || nextUpdateCycle - cycleCount <= static_cast<uint32_t>(exec) || cycles <= exec)
+            return exec;
 
-            op2 = (op2 >> shift) | (op2 << (32 - shift));
-            bool carry = shift ? op2 & (1 << 31) : cpsr & Flag_C;
+        cycles -= exec;
+        cycleCount += exec;
+    }
+}
+
+// loads and ALU ops, nothing that can write memory or change mode
+static bool isIdleLoopTHUMBOp(uint16_t opcode)
+{
+    if(opcode < 0x4400) // shift, add/sub, immediate and ALU ops
+        return true;
+
+    if(opcode >> 11 == 0x09 || opcode >> 12 == 0xA) // PC-relative load, load address
+        return true;
 
-            if(!setCondCode && instOp <= 0xB /*CMN*/) // MSR (TST-CMN)
-                return doARMPSRTransfer(opcode, op2);
+    if(opcode >> 12 == 0x5) // register offset, bits 10-11 are 0 for STRH
+        return (opcode & (1 << 9)) ? (opcode & (3 << 10)) != 0 : (opcode & (1 << 11)) != 0;
 
-            return doDataProcessing(opcode, op2, carry);
-        }
-        case 0x4: // Single Data Transfer (I = 0, P = 0)
-            return doARMSingleDataTransfer(opcode, false, false);
-        case 0x5: // Single Data Transfer (I = 0, P = 1)
-            return doARMSingleDataTransfer(opcode, false, true);
-        case 0x6: // Single Data Transfer (I = 1, P = 0)
-            return doARMSingleDataTransfer(opcode, true, false);
-        case 0x7: // Single Data Transfer (I = 1, P = 1)
-            return doARMSingleDataTransfer(opcode, true, true);
-        case 0x8: // Block Data Transfer (P = 0)
-            return doARMBlockDataTransfer(opcode, false);
-        case 0x9: // Block Data Transfer (P = 1)
-            return doARMBlockDataTransfer(opcode, true);
-        case 0xA: // Branch (B)
+    if(opcode >> 13 == 0x3 || opcode >> 12 == 0x8 || opcode >> 12 == 0x9) // immediate offset, halfword, SP-relative
+        return opcode & (1 << 11);
+
+    return false;
+}
+
+static bool isIdleLoopARMOp(uint32_t opcode)
+{
+    if(((opcode >> 12) & 0xF) == 15) // writes PC
+        return false;
+
+    if(((opcode >> 26) & 3) == 1) // single data transfer
+        return opcode & (1 << 20);
+
+    if(((opcode >> 26) & 3) != 0)
+        return false;
+
+    if(!(opcode & (1 << 25)) && (opcode & 0x90) == 0x90) // multiply/swap/halfword transfer
+        return (opcode & 0x60) && (opcode & (1 << 20)); // halfword/signed loads
+
+    return (opcode & 0x01900000) != 0x01000000; // not MRS/MSR/BX
+}
+
+// returns the cycles for a whole number of loop iterations that won't pass anything that could end the loop
+int AGBCPU::getIdleLoopSkipCycles(uint32_t cycleCount, int iterationCycles, int cycles)
+{
+    // the display registers change at the next mode change, even if there's no event for it
+    int maxSkip = std::min(cycles, display.getCyclesToNextUpdate(cycleCount));
+    maxSkip = std::min(maxSkip, static_cast<int>(nextUpdateCycle - cycleCount));
+
+    if(iterationCycles <= 0 || maxSkip < iterationCycles)
+        return 0;
+
+    int skip = maxSkip - maxSkip % iterationCycles;
+
+    idleLoopStats.cyclesSkipped += skip;
+    idleLoopStats.loopsSkipped++;
+
+    return skip;
+}
+
+AGBCPU::CodeBlock *AGBCPU::getCodeBlock(uint32_t addr, bool isThumb)
+{
+    uint32_t tag = isThumb ? addr | 1 : addr;
+    auto &block = codeBlocks[((addr >> 1) ^ (addr >> 16)) & (numCodeBlocks - 1)];
+
+    if(block.addr == tag && *block.version == block.builtVersion)
+        return &block;
+
+    // only ROM and RAM
+    int region = addr >> 24;
+    if(region == 0 ? !mem.hasBIOS() : (region != 2 && region != 3 && (region < 8 || region > 0xD)))
+        return nullptr;
+
+    // don't cross a page so that one version covers the whole block
+    const int opSize = isThumb ? 2 : 4;
+    int numOps = std::min(maxBlockOps, static_cast<int>(((addr | 0xFF) + 1 - addr) / opSize) - 2);
+
+    auto ptr = std::as_const(mem).mapAddress(addr);
+
+    // too close to the end of the page or past the end of the ROM
+    if(numOps < 1 || !ptr || !std::as_const(mem).mapAddress(addr + (numOps + 2) * opSize - 1))
+        return nullptr;
+
+    block.addr = tag;
+    block.version = mem.getCodePageVersion(addr);
+    block.builtVersion = *block.version;
+    block.numOps = numOps;
+    block.jitCode = nullptr;
+    block.jitHits = 0;
+
+    for(int i = 0; i < numOps + 2; i++)
+    {
+        auto &op = block.ops[i];
+
+        if(isThumb)
+            op.opcode = reinterpret_cast<const uint16_t *>(ptr)[i];
+        else
+            op.opcode = reinterpret_cast<const uint32_t *>(ptr)[i];
+
+        if(i >= block.numOps)
+            continue;
+
+        bool isBranch;
+
+        if(isThumb)
         {
-            auto offset = (static_cast<int32_t>(opcode & 0xFFFFFF) << 8) >> 6;
-            updateARMPC(pc + offset);
-            return pcSCycles * 2 + pcNCycles;
+            op.thumb = thumbTable[op.opcode >> 6];
+            isBranch = (op.opcode & 0xFF80) == 0x4700 /*BX*/ || (op.opcode & 0xFF00) == 0xBD00 /*POP PC*/
+                    || (op.opcode & 0xFF00) == 0xDF00 /*SWI*/ || (op.opcode >> 11) == 0x1C /*B*/ || (op.opcode >> 11) == 0x1F /*BL*/;
         }
-        case 0xB: // Branch with Link (BL)
+        else
         {
-            auto offset = (static_cast<int32_t>(opcode & 0xFFFFFF) << 8) >> 6;
-            reg(Reg::LR) = pc - 4;
-            updateARMPC(pc + offset);
-            return pcSCycles * 2 + pcNCycles;
+            op.arm = armTable[((op.opcode >> 16) & 0xFF0) | ((op.opcode >> 4) & 0xF)];
+            isBranch = (op.opcode >> 28) == 0xE
+                    && ((op.opcode & 0x0FFFFFF0) == 0x012FFF10 /*BX*/ || ((op.opcode >> 25) & 7) == 5 /*B/BL*/ || ((op.opcode >> 24) & 0xF) == 0xF /*SWI*/);
         }
 
-        case 0xF: // SWI
-        {
-            auto ret = pc - 4;
-            spsr[1/*svc*/] = cpsr;
+        // nothing after an unconditional branch is going to run
+        if(isBranch)
+            block.numOps = i + 1;
+    }
 
-            cpsr = (cpsr & ~0x1F) | Flag_I | 0x13; //supervisor mode
-            modeChanged();
-            loReg(curLR) = ret;
-            updateARMPC(8);
+    // look for a loop that doesn't modify anything other than registers
+    block.idleLoop = false;
 
-            return pcSCycles * 2 + pcNCycles;
+    for(int i = 0; i < block.numOps; i++)
+    {
+        auto opcode = block.ops[i].opcode;
+        uint32_t opAddr = addr + i * opSize;
+        uint32_t target;
+
+        if(isThumb)
+        {
+            if((opcode >> 12) == 0xD && ((opcode >> 8) & 0xF) < 0xE) // conditional branch
+                target = opAddr + 4 + static_cast<int8_t>(opcode & 0xFF) * 2;
+            else if((opcode >> 11) == 0x1C) // branch
+                target = opAddr + 4 + (static_cast<int32_t>(opcode << 21) >> 20);
+            else if(isIdleLoopTHUMBOp(opcode))
+                continue;
+            else
+                break;
+        }
+        else
+        {
+            if(((opcode >> 24) & 0xF) == 0xA && (opcode >> 28) != 0xF) // branch without link
+                target = opAddr + 8 + (static_cast<int32_t>(opcode << 8) >> 6);
+            else if(isIdleLoopARMOp(opcode))
+                continue;
+            else
+                break;
         }
 
-        default:
-            printf("ARM op %x @%x\n", opcode & 0xFFFFFFF, pc - 4);
-            exit(0);
-            break;
+        block.idleLoop = target == addr;
+        break;
     }
 
-    __builtin_unreachable();
+    return &block;
 }
 
-int AGBCPU::executeTHUMBInstruction()
+// bit n of each entry is set if the condition passes with NZCV == n
+static constexpr std::array<uint16_t, 16> makeARMConditionTable()
 {
-    auto &pc = loReg(Reg::PC); // not a low reg, but not banked
-    uint16_t opcode = decodeOp;
-
-    decodeOp = fetchOp;
+    std::array<uint16_t, 16> ret{};
 
-    pc += 2;
-    auto thumbPCPtr = reinterpret_cast<const uint16_t *>(pcPtr + pc);
-    assert(mem.verifyPointer(thumbPCPtr, pc));
-    fetchOp = *thumbPCPtr;
+    for(int flags = 0; flags < 16; flags++)
+    {
+        bool n = flags & 8, z = flags & 4, c = flags & 2, v = flags & 1;
 
-    switch(opcode >> 12)
-    {
-        case 0x0: // format 1
-            return doTHUMB01MoveShifted(opcode, pc);
-        case 0x1: // formats 1-2
-            return doTHUMB0102(opcode, pc);
-        case 0x2: // format 3, mov/cmp immediate
-        case 0x3: // format 3, add/sub immediate
-            return doTHUMB03(opcode, pc);
-        case 0x4: // formats 4-6
-            return doTHUMB040506(opcode, pc);
-        case 0x5: // formats 7-8
-            return doTHUMB0708(opcode, pc);
-        case 0x6: // format 9, load/store with imm offset (words)
-            return doTHUMB09LoadStoreWord(opcode, pc);
-        case 0x7: // ... (bytes)
-            return doTHUMB09LoadStoreByte(opcode, pc);
-        case 0x8: // format 10, load/store halfword
-            return doTHUMB10LoadStoreHalf(opcode, pc);
-        case 0x9: // format 11, SP-relative load/store
-            return doTHUMB11SPRelLoadStore(opcode, pc);
-        case 0xA: // format 12, load address
-            return doTHUMB12LoadAddr(opcode, pc);
-        case 0xB: // formats 13-14
-            return doTHUMB1314(opcode, pc);
-        case 0xC: // format 15, multiple load/store
-            return doTHUMB15MultiLoadStore(opcode, pc);
-        case 0xD: // formats 16-17
-            return doTHUMB1617(opcode, pc);
-        case 0xE: // format 18, unconditional branch
-            return doTHUMB18UncondBranch(opcode, pc);
-        case 0xF: // format 19, long branch with link
-            return doTHUMB19LongBranchLink(opcode, pc);
+        bool pass[16]
+        {
+            z, !z, // EQ NE
+            c, !c, // CS CC
+            n, !n, // MI PL
+            v, !v, // VS VC
+            c && !z, !c || z, // HI LS
+            n == v, n != v, // GE LT
+            !z && n == v, z || n != v, // GT LE
+            true, // AL
+            true // F is reserved
+        };
+
+        for(int cond = 0; cond < 16; cond++)
+        {
+            if(pass[cond])
+                ret[cond] |= 1 << flags;
+        }
     }
 
-    __builtin_unreachable();
+    return ret;
 }
 
-bool AGBCPU::checkARMCondition(int cond) const
+const std::array<uint16_t, 16> AGBCPU::armConditionTable = makeARMConditionTable();
+
+bool AGBCPU::checkARMCondition(int cond)
 {
-    switch(cond)
-    {
-        case 0x0: // equal
-            return cpsr & Flag_Z;
-        case 0x1: // not equal
-            return !(cpsr & Flag_Z);
-        case 0x2: // carry set
-            return cpsr & Flag_C;
-        case 0x3: // carry clear
-            return !(cpsr & Flag_C);
-        case 0x4: // negative
-            return cpsr & Flag_N;
-        case 0x5: // positive or zero
-            return !(cpsr & Flag_N);
-        case 0x6: // overflow
-            return cpsr & Flag_V;
-        case 0x7: // no overflow
-            return !(cpsr & Flag_V);
-        case 0x8: // unsigned higher
-            return (cpsr & Flag_C) && !(cpsr & Flag_Z);
-        case 0x9: // unsigned lower or same
-            return !(cpsr & Flag_C) || (cpsr & Flag_Z);
-        case 0xA: // greater or equal
-            return !!(cpsr & Flag_N) == !!(cpsr & Flag_V);
-        case 0xB: // less than
-            return !!(cpsr & Flag_N) != !!(cpsr & Flag_V);
-        case 0xC: // greater than
-            return !(cpsr & Flag_Z) && !!(cpsr & Flag_N) == !!(cpsr & Flag_V);
-        case 0xD: // less than or equal
-            return (cpsr & Flag_Z) || !!(cpsr & Flag_N) != !!(cpsr & Flag_V);
-        case 0xE: // always
-            return true;
-        // F is reserved
-        default:
-            assert(!"Invalid condition");
-    }
+    assert(cond != 0xF); // reserved
+
+#ifdef AGB_EAGER_FLAGS
+    return armConditionTable[cond] & (1 << (cpsr >> 28));
+#else
+    if(cond == 0xE) // always
+        return true;
+
+    // EQ/NE only need the result
+    if(cond < 2 && lastFlagOp != FlagOp::None)
+        return (flagRes == 0) != (cond & 1);
 
-    return true;
+    return armConditionTable[cond] & (1 << (getCPSR() >> 28));
+#endif
 }
 
 // shift is usually the bottom 12 bits of the opcode
+template<int shiftType, bool byReg>
 uint32_t AGBCPU::getARMShiftedReg(uint16_t shift, bool &carry)
 {
     auto r = static_cast<Reg>(shift & 0xF);
     auto ret = reg(r);
 
-    bool byReg = shift & (1 << 4);
-
     // prefetch
     if(r == Reg::PC && byReg)
         ret += 4;
 
-    if(!((shift >> 4) & 0xFF)) // left shift by immediate 0, do nothing and preserve carry
+    if(!byReg && shiftType == 0 && !((shift >> 7) & 0x1F)) // left shift by immediate 0, do nothing and preserve carry
     {
-        carry = cpsr & Flag_C;
+        carry = getCarryFlag();
         return ret;
     }
 
-    int shiftType = (shift >> 5) & 3;
     int shiftAmount;
     if(byReg)
     {
@@ -719,7 +853,7 @@ uint32_t AGBCPU::getARMShiftedReg(uint16_t shift, bool &carry)
 
         if(!shiftAmount)
         {
-            carry = cpsr & Flag_C;
+            carry = getCarryFlag();
             return ret;
         }
     }
@@ -778,7 +912,7 @@ uint32_t AGBCPU::getARMShiftedReg(uint16_t shift, bool &carry)
 
                 ret >>= 1;
 
-                if(cpsr & Flag_C) // carry in
+                if(getCarryFlag()) // carry in
                     ret |= 0x80000000;
             }
             else // ROR
@@ -797,18 +931,16 @@ uint32_t AGBCPU::getARMShiftedReg(uint16_t shift, bool &carry)
     return ret;
 }
 
-int AGBCPU::doARMHalfwordTransfer(uint32_t opcode, bool isPre)
+// sh is bits 5-6 of the opcode
+template<bool isPre, bool isUp, bool isImm, bool writeBack, bool isLoad, int sh>
+int AGBCPU::doARMHalfwordTransfer(uint32_t opcode)
 {
-    //bool isUp = opcode & (1 << 23);
-    //bool isImm = opcode & (1 << 22);
-    //bool writeBack = opcode & (1 << 21);
-    //bool isLoad = opcode & (1 << 20);
-    auto baseReg = mapReg(static_cast<Reg>((opcode >> 16) & 0xF));
-    auto srcDestReg = mapReg(static_cast<Reg>((opcode >> 12) & 0xF));
+    auto baseReg = static_cast<Reg>((opcode >> 16) & 0xF);
+    auto srcDestReg = static_cast<Reg>((opcode >> 12) & 0xF);
 
     int offset;
 
-    if(opcode & (1 << 22)) // immediate
+    if constexpr(isImm)
         offset = ((opcode >> 4) & 0xF0) | (opcode & 0xF);
     else
     {
@@ -816,7 +948,7 @@ int AGBCPU::doARMHalfwordTransfer(uint32_t opcode, bool isPre)
         assert((opcode & 0xF00) == 0);
     }
 
-    if(!(opcode & (1 << 23))) // !up
+    if(!isUp)
         offset = -offset;
 
     auto addr = loReg(baseReg);
@@ -824,22 +956,22 @@ int AGBCPU::doARMHalfwordTransfer(uint32_t opcode, bool isPre)
     // get value for store before write back
     auto val = loReg(srcDestReg);
 
-    if(isPre)
+    if constexpr(isPre)
     {
         addr += offset;
-        if(opcode & (1 << 21)) // write back
+        if(writeBack)
             loReg(baseReg) = addr;
     }
     else
     {
-        assert(!(opcode & (1 << 21))); // writeback should not be set
+        assert(!writeBack); // writeback should not be set
         loReg(baseReg) += offset; // always writes back
     }
 
-    if(opcode & (1 << 20)) // load
+    if constexpr(isLoad)
     {
-        bool sign = opcode & (1 << 6);
-        bool halfWords = opcode & (1 << 5);
+        const bool sign = sh & 2;
+        const bool halfWords = sh & 1;
 
         int cycles = 0;
 
@@ -855,8 +987,7 @@ int AGBCPU::doARMHalfwordTransfer(uint32_t opcode, bool isPre)
     else
     {
         // only unsigned halfword stores
-        assert(opcode & (1 << 5)); // half
-        assert(!(opcode & (1 << 6))); // sign
+        assert(sh == 1);
 
         if(srcDestReg == Reg::PC)
             val += 4;
@@ -869,13 +1000,11 @@ int AGBCPU::doARMHalfwordTransfer(uint32_t opcode, bool isPre)
     }
 }
 
+template<bool isLong, bool isSigned, bool accumulate, bool setCondCode>
 int AGBCPU::doARMMultiply(uint32_t opcode)
 {
-    if(opcode & (1 << 23)) // MULL/MLAL
+    if constexpr(isLong) // MULL/MLAL
     {
-        bool isSigned = opcode & (1 << 22);
-        bool accumulate = opcode & (1 << 21);
-        bool setCondCode = opcode & (1 << 20);
         auto destHiReg = static_cast<Reg>((opcode >> 16) & 0xF);
         auto destLoReg = static_cast<Reg>((opcode >> 12) & 0xF);
         auto op2Reg = static_cast<Reg>((opcode >> 8) & 0xF);
@@ -885,7 +1014,7 @@ int AGBCPU::doARMMultiply(uint32_t opcode)
 
         uint64_t res;
 
-        if(isSigned) // SMULL
+        if constexpr(isSigned) // SMULL
             res = static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(reg(op1Reg))) * static_cast<int32_t>(op2));
         else // UMULL
             res = static_cast<uint64_t>(reg(op1Reg)) * op2;
@@ -899,6 +1028,7 @@ int AGBCPU::doARMMultiply(uint32_t opcode)
         if(setCondCode)
         {
             // v and c are meaningless
+            updateFlags();
             cpsr = (cpsr & ~(Flag_N | Flag_Z))
                     | (res & (1ull << 63) ? Flag_N : 0)
                     | (res == 0 ? Flag_Z : 0);
@@ -914,8 +1044,6 @@ int AGBCPU::doARMMultiply(uint32_t opcode)
     }
     else // MUL/MLA
     {
-        bool accumulate = opcode & (1 << 21);
-        bool setCondCode = opcode & (1 << 20);
         auto destReg = static_cast<Reg>((opcode >> 16) & 0xF);
         auto op3Reg = static_cast<Reg>((opcode >> 12) & 0xF);
         auto op2Reg = static_cast<Reg>((opcode >> 8) & 0xF);
@@ -935,9 +1063,7 @@ int AGBCPU::doARMMultiply(uint32_t opcode)
         if(setCondCode)
         {
             // v is unaffected, c is meaningless
-            cpsr = (cpsr & ~(Flag_N | Flag_Z))
-                    | (res & signBit ? Flag_N : 0)
-                    | (res == 0 ? Flag_Z : 0);
+            setNZFlags(res);
         }
 
         // leading 0s or 1s
@@ -950,10 +1076,10 @@ int AGBCPU::doARMMultiply(uint32_t opcode)
     }
 }
 
+template<bool isByte>
 int AGBCPU::doARMSwap(uint32_t opcode)
 {
     // SWP
-    bool isByte = opcode & (1 << 22);
     auto baseReg = static_cast<Reg>((opcode >> 16) & 0xF);
     auto destReg = static_cast<Reg>((opcode >> 12) & 0xF);
     auto srcReg = static_cast<Reg>(opcode & 0xF);
@@ -962,7 +1088,7 @@ int AGBCPU::doARMSwap(uint32_t opcode)
 
     int cycles = 0;
 
-    if(isByte)
+    if constexpr(isByte)
     {
         auto v = readMem8(addr, cycles);
         writeMem8(addr, reg(srcReg), cycles);
@@ -978,31 +1104,34 @@ int AGBCPU::doARMSwap(uint32_t opcode)
     return cycles + mem.iCycle() + mem.prefetchTiming32(pcSCycles);
 }
 
-// op2 is only for the immediate version
-int AGBCPU::doARMPSRTransfer(uint32_t opcode, uint32_t op2)
+template<bool isImm, bool isSPSR, bool isMSR>
+int AGBCPU::doARMPSRTransfer(uint32_t opcode)
 {
-    if(opcode & (1 << 25)) // immediate
+    if constexpr(isImm)
     {
-        bool isSPSR = opcode & (1 << 22);
-
         assert((opcode & 0xF000) == 0xF000);
-        assert(opcode & (1 << 21));
+        assert(isMSR);
 
         bool wF = opcode & (1 << 19);
         // 17/18 should be 0
         bool wC = opcode & (1 << 16);
-        auto val = op2;
+
+        // get the immediate value
+        uint32_t val = opcode & 0xFF;
+        int shift = ((opcode >> 8) & 0xF) * 2;
+        val = (val >> shift) | (val << (32 - shift));
 
         uint32_t mask = (wF ? 0xFF000000 : 0) |
                         (wC ? 0x000000FF : 0);
 
-        if(isSPSR)
+        if constexpr(isSPSR)
         {
             auto &spsr = getSPSR();
             spsr = (spsr & ~mask) | (val & mask);
         }
         else
         {
+            updateFlags();
             cpsr = (cpsr & ~mask) | (val & mask);
             modeChanged();
         }
@@ -1011,8 +1140,7 @@ int AGBCPU::doARMPSRTransfer(uint32_t opcode, uint32_t op2)
     }
     else
     {
-        bool isSPSR = opcode & (1 << 22);
-        if(opcode & (1 << 21)) // MSR
+        if constexpr(isMSR)
         {
             assert((opcode & 0xFFF0) == 0xF000);
 
@@ -1024,13 +1152,14 @@ int AGBCPU::doARMPSRTransfer(uint32_t opcode, uint32_t op2)
             uint32_t mask = (wF ? 0xFF000000 : 0) |
                             (wC ? 0x000000FF : 0);
 
-            if(isSPSR)
+            if constexpr(isSPSR)
             {
                 auto &spsr = getSPSR();
                 spsr = (spsr & ~mask) | (val & mask);
             }
             else
             {
+                updateFlags();
                 cpsr = (cpsr & ~mask) | (val & mask);
                 modeChanged();
             }
@@ -1039,35 +1168,33 @@ int AGBCPU::doARMPSRTransfer(uint32_t opcode, uint32_t op2)
         {
             assert((opcode & 0xF0FFF) == 0xF0000);
             auto destReg = static_cast<Reg>((opcode >> 12) & 0xF);
-            if(isSPSR)
+            if constexpr(isSPSR)
                 reg(destReg) = getSPSR();
             else
-                reg(destReg) = cpsr;
+                reg(destReg) = getCPSR();
         }
 
         return mem.prefetchTiming32(pcSCycles);
     }
 }
 
-int AGBCPU::doARMSingleDataTransfer(uint32_t opcode, bool isReg, bool isPre)
+template<bool isReg, bool isPre, bool isUp, bool isByte, bool writeBack, bool isLoad, int shiftType>
+int AGBCPU::doARMSingleDataTransfer(uint32_t opcode)
 {
-    //bool isUp = opcode & (1 << 23);
-    //bool writeBack = opcode & (1 << 21);
-    //bool isLoad = opcode & (1 << 20);
-    auto baseReg = mapReg(static_cast<Reg>((opcode >> 16) & 0xF));
-    auto srcDestReg = mapReg(static_cast<Reg>((opcode >> 12) & 0xF));
+    auto baseReg = static_cast<Reg>((opcode >> 16) & 0xF);
+    auto srcDestReg = static_cast<Reg>((opcode >> 12) & 0xF);
     int offset;
 
-    if(!isReg) // immediate
+    if constexpr(!isReg) // immediate
         offset = opcode & 0xFFF;
     else
     {
         assert((opcode & (1 << 4)) == 0); // no reg shift
         bool carry;
-        offset = getARMShiftedReg(opcode, carry);
+        offset = getARMShiftedReg<shiftType, false>(opcode, carry);
     }
 
-    if(!(opcode & (1 << 23))) // !up
+    if(!isUp)
         offset = -offset;
 
     auto addr = loReg(baseReg);
@@ -1075,20 +1202,19 @@ int AGBCPU::doARMSingleDataTransfer(uint32_t opcode, bool isReg, bool isPre)
     // get value for store before write back
     auto val = loReg(srcDestReg);
 
-    if(isPre)
+    if constexpr(isPre)
     {
         addr += offset;
-        if(opcode & (1 << 21)) // write back
+        if(writeBack)
             loReg(baseReg) = addr;
     }
     else
     {
-        assert(!(opcode & (1 << 21))); // non-privileged transfer
+        assert(!writeBack); // non-privileged transfer
         loReg(baseReg) += offset; // always writes back
     }
 
-    bool isByte = opcode & (1 << 22);
-    if(opcode & (1 << 20)) // load
+    if constexpr(isLoad)
     {
         int cycles = 0;
         uint32_t val = isByte ? readMem8(addr, cycles) : readMem32(addr, cycles);
@@ -1119,7 +1245,8 @@ int AGBCPU::doARMSingleDataTransfer(uint32_t opcode, bool isReg, bool isPre)
     }
 }
 
-int AGBCPU::doARMBlockDataTransfer(uint32_t opcode, bool preIndex)
+template<bool preIndex, bool isUp, bool isLoadForce, bool writeBack, bool isLoad>
+int AGBCPU::doARMBlockDataTransfer(uint32_t opcode)
 {
     uint16_t regList = opcode;
 
@@ -1148,8 +1275,7 @@ int AGBCPU::doARMBlockDataTransfer(uint32_t opcode, bool preIndex)
     uint32_t writeBackAddr;
 
     // flip decrement addressing around so that regs are stored in the right order
-    bool isUp = opcode & (1 << 23);
-    if(!isUp)
+    if constexpr(!isUp)
     {
         addr -= numRegs * 4;
         writeBackAddr = addr;
@@ -1168,11 +1294,7 @@ int AGBCPU::doARMBlockDataTransfer(uint32_t opcode, bool preIndex)
     if(addr < 0xE000000)
         addr &= ~3;
 
-    bool writeBack = opcode & (1 << 21);
-    bool isLoad = opcode & (1 << 20);
-
-    bool isLoadForce = opcode & (1 << 22);
-    if(isLoadForce)
+    if constexpr(isLoadForce)
     {
         //assert(!writeBack); // "should not be used"
         assert(!isLoad || !(regList & (1 << 15))); // TODO: load with r15 (mode change)
@@ -1180,7 +1302,7 @@ int AGBCPU::doARMBlockDataTransfer(uint32_t opcode, bool preIndex)
 
     int cycles = 0;
 
-    if(isLoad)
+    if constexpr(isLoad)
     {
         if(writeBack && !(regList & (1 << static_cast<int>(baseReg))))
             reg(baseReg) = writeBackAddr;
@@ -1192,11 +1314,12 @@ int AGBCPU::doARMBlockDataTransfer(uint32_t opcode, bool preIndex)
             if(!(regList & 1))
                 continue;
 
-            // directly index to force user
-            auto reg = isLoadForce ? static_cast<Reg>(i) : mapReg(static_cast<Reg>(i));
+            auto reg = static_cast<Reg>(i);
 
             if(reg == Reg::PC)
                 updateARMPC(readMem32(addr, cycles, first));
+            else if(isLoadForce)
+                bankedReg(reg) = readMem32(addr, cycles, first); // force user
             else
                 loReg(reg) = readMem32(addr, cycles, first);
 
@@ -1210,20 +1333,17 @@ int AGBCPU::doARMBlockDataTransfer(uint32_t opcode, bool preIndex)
     {
         bool first = true;
 
-        baseReg = mapReg(baseReg);
-
         for(int i = 0; regList; regList >>= 1, i++)
         {
             if(!(regList & 1))
                 continue;
 
-            // directly index to force user
-            auto reg = isLoadForce ? static_cast<Reg>(i) : mapReg(static_cast<Reg>(i));
+            auto reg = static_cast<Reg>(i);
 
             if(reg == Reg::PC)
                 writeMem32(addr, loReg(reg) + 4, cycles);
             else
-                writeMem32(addr, loReg(reg), cycles);
+                writeMem32(addr, isLoadForce ? bankedReg(reg) : loReg(reg), cycles); // force user
 
             addr += 4;
             if(first && writeBack)
@@ -1238,15 +1358,19 @@ int AGBCPU::doARMBlockDataTransfer(uint32_t opcode, bool preIndex)
     }
 }
 
-int AGBCPU::doALUOp(int op, Reg destReg, uint32_t op1, uint32_t op2, bool carry)
+template<int op>
+int AGBCPU::doALUOp(Reg destReg, uint32_t op1, uint32_t op2, bool carry)
 {
     if(destReg == Reg::PC)
     {
         // don't attempt to restore in user/system mode as SPSR doesn't exist (a test ends up doing this...)
         if(regBankOffset)
+        {
+            updateFlags();
             cpsr = getSPSR(); // restore
+        }
 
-        int ret = doALUOpNoCond(op, destReg, op1, op2);
+        int ret = doALUOpNoCond<op>(destReg, op1, op2);
 
         modeChanged();
 
@@ -1259,24 +1383,14 @@ int AGBCPU::doALUOp(int op, Reg destReg, uint32_t op1, uint32_t op2, bool carry)
     auto doAdd = [this](uint32_t a, uint32_t b, int c = 0)
     {
         uint32_t res = a + b + c;
-        bool carry = res < a || (res == a && c) /*for adc*/;
-        bool overflow = !((a ^ b) & signBit) && ((a ^ res) & signBit);  // same sign and sign changed
-
-        assert(carry == !!((static_cast<uint64_t>(a) + b + c) & (1ull << 32)));
-
-        cpsr = (cpsr & 0x0FFFFFFF) | (res & signBit ? Flag_N : 0) | (res == 0 ? Flag_Z : 0) | (carry ? Flag_C : 0) | (overflow ? Flag_V : 0);
+        setAddFlags(a, b, res, c);
         return res;
     };
 
     auto doSub = [this](uint32_t a, uint32_t b, int c = 1)
     {
         uint32_t res = a - b + c - 1;
-        bool carry = !(b > a || (b == a && !c) /*for sbc*/);
-        bool overflow = ((a ^ b) & signBit) && ((a ^ res) & signBit);  // different sign and sign changed
-
-        assert(carry == !((static_cast<uint64_t>(a) - b + c - 1) & (1ull << 32)));
-
-        cpsr = (cpsr & 0x0FFFFFFF) | (res & signBit ? Flag_N : 0) | (res == 0 ? Flag_Z : 0) | (carry ? Flag_C : 0) | (overflow ? Flag_V : 0);
+        setSubFlags(a, b, res, c);
         return res;
     };
 
@@ -1284,11 +1398,11 @@ int AGBCPU::doALUOp(int op, Reg destReg, uint32_t op1, uint32_t op2, bool carry)
     {
         case 0x0: // AND
             reg(destReg) = res = op1 & op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | (carry ? Flag_C : 0);
+            setLogicalFlags(res, carry);
             break;
         case 0x1: // EOR
             reg(destReg) = res = op1 ^ op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | (carry ? Flag_C : 0);
+            setLogicalFlags(res, carry);
             break;
         case 0x2: // SUB
             reg(destReg) = doSub(op1, op2);
@@ -1300,21 +1414,21 @@ int AGBCPU::doALUOp(int op, Reg destReg, uint32_t op1, uint32_t op2, bool carry)
             reg(destReg) = doAdd(op1, op2);
             break;
         case 0x5: // ADC
-            reg(destReg) = doAdd(op1, op2, cpsr & Flag_C ? 1 : 0);
+            reg(destReg) = doAdd(op1, op2, getCarryFlag() ? 1 : 0);
             break;
         case 0x6: // SBC
-            reg(destReg) = doSub(op1, op2, cpsr & Flag_C ? 1 : 0);
+            reg(destReg) = doSub(op1, op2, getCarryFlag() ? 1 : 0);
             break;
         case 0x7: // RSC
-            reg(destReg) = doSub(op2, op1, cpsr & Flag_C ? 1 : 0);
+            reg(destReg) = doSub(op2, op1, getCarryFlag() ? 1 : 0);
             break;
         case 0x8: // TST
             res = op1 & op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | (carry ? Flag_C : 0);
+            setLogicalFlags(res, carry);
             break;
         case 0x9: // TEQ
             res = op1 ^ op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | (carry ? Flag_C : 0);
+            setLogicalFlags(res, carry);
             break;
         case 0xA: // CMP
             doSub(op1, op2);
@@ -1324,19 +1438,19 @@ int AGBCPU::doALUOp(int op, Reg destReg, uint32_t op1, uint32_t op2, bool carry)
             break;
         case 0xC: // ORR
             reg(destReg) = res = op1 | op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | (carry ? Flag_C : 0);
+            setLogicalFlags(res, carry);
             break;
         case 0xD: // MOV
             reg(destReg) = res = op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | (carry ? Flag_C : 0);
+            setLogicalFlags(res, carry);
             break;
         case 0xE: // BIC
             reg(destReg) = res = op1 & ~op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | (carry ? Flag_C : 0);
+            setLogicalFlags(res, carry);
             break;
         case 0xF: // MVN
             reg(destReg) = res = ~op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | (carry ? Flag_C : 0);
+            setLogicalFlags(res, carry);
             break;
         default:
             __builtin_unreachable();
@@ -1345,7 +1459,8 @@ int AGBCPU::doALUOp(int op, Reg destReg, uint32_t op1, uint32_t op2, bool carry)
     return mem.prefetchTiming32(pcSCycles);
 }
 
-int AGBCPU::doALUOpNoCond(int op, Reg destReg, uint32_t op1, uint32_t op2)
+template<int op>
+int AGBCPU::doALUOpNoCond(Reg destReg, uint32_t op1, uint32_t op2)
 {
     uint32_t dest;
 
@@ -1367,13 +1482,13 @@ int AGBCPU::doALUOpNoCond(int op, Reg destReg, uint32_t op1, uint32_t op2)
             dest = op1 + op2;
             break;
         case 0x5: // ADC
-            dest = op1 + op2 + (cpsr & Flag_C ? 1 : 0);
+            dest = op1 + op2 + (getCarryFlag() ? 1 : 0);
             break;
         case 0x6: // SBC
-            dest = op1 - op2 + (cpsr & Flag_C ? 1 : 0) - 1;
+            dest = op1 - op2 + (getCarryFlag() ? 1 : 0) - 1;
             break;
         case 0x7: // RSC
-            dest = op2 - op1 + (cpsr & Flag_C ? 1 : 0) - 1;
+            dest = op2 - op1 + (getCarryFlag() ? 1 : 0) - 1;
             break;
         // TST-CMN should not get here
         case 0x8:
@@ -1413,154 +1528,243 @@ int AGBCPU::doALUOpNoCond(int op, Reg destReg, uint32_t op1, uint32_t op2)
     return mem.prefetchTiming32(pcSCycles);
 }
 
-int AGBCPU::doTHUMB01MoveShifted(uint16_t opcode, uint32_t pc)
+template<int instOp, bool setCondCode, bool isImm, int shiftType, bool byReg>
+int AGBCPU::doARMDataProcessing(uint32_t opcode)
 {
-    auto instOp = (opcode >> 11) & 0x1;
-    auto srcReg = static_cast<Reg>((opcode >> 3) & 7);
-    auto dstReg = static_cast<Reg>(opcode & 7);
+    uint32_t op2;
+    bool carry;
 
-    auto offset = (opcode >> 6) & 0x1F;
-    auto res = loReg(srcReg);
-
-    uint32_t carry;
-    switch(instOp)
+    if constexpr(isImm)
     {
-        case 0: // LSL
-            if(offset != 0)
-            {
-                carry = res & (1 << (32 - offset)) ? Flag_C : 0;
-                res <<= offset;
-            }
-            else
-                carry = cpsr & Flag_C; // preserve
-            break;
-        case 1: // LSR
-            if(!offset) offset = 32; // shift by 0 is really 32
-
-            carry = res & (1 << (offset - 1)) ? Flag_C : 0;
-            if(offset == 32)
-                res = 0;
-            else
-                res >>= offset;
-            break;
-        default:
-            assert(!"Invalid format 1 shift type");
+        // get the immediate value
+        op2 = opcode & 0xFF;
+        int shift = ((opcode >> 8) & 0xF) * 2;
+        op2 = (op2 >> shift) | (op2 << (32 - shift));
+        carry = shift ? op2 & (1 << 31) : getCarryFlag();
     }
+    else
+        op2 = getARMShiftedReg<shiftType, byReg>(opcode, carry);
 
-    loReg(dstReg) = res;
+    auto op1Reg = static_cast<Reg>((opcode >> 16) & 0xF);
+    auto op1 = reg(op1Reg);
+    if(byReg && op1Reg == Reg::PC)
+        op1 += 4;
+
+    auto destReg = static_cast<Reg>((opcode >> 12) & 0xF);
 
-    cpsr = (cpsr & 0x1FFFFFFF)
-         | (res & signBit ? Flag_N : 0)
-         | (res == 0 ? Flag_Z : 0)
-         | carry;
+    int cycles;
+    if constexpr(setCondCode)
+        cycles = doALUOp<instOp>(destReg, op1, op2, carry);
+    else
+        cycles = doALUOpNoCond<instOp>(destReg, op1, op2);
 
-    return mem.prefetchTiming16(pcSCycles);
+    return byReg ? cycles + 1 : cycles; // +1I if shift by reg
 }
 
-int AGBCPU::doTHUMB0102(uint16_t opcode, uint32_t pc)
+int AGBCPU::doARMBranchExchange(uint32_t opcode)
 {
-    auto instOp = (opcode >> 11) & 0x3;
-    auto srcReg = static_cast<Reg>((opcode >> 3) & 7);
-    auto dstReg = static_cast<Reg>(opcode & 7);
+    assert(((opcode >> 8) & 0xFFF) == 0xFFF);
+    auto newPC = reg(static_cast<Reg>(opcode & 0xF));
 
-    if(instOp == 3) // format 2, add/sub
+    if(newPC & 1)
     {
-        bool isImm = opcode & (1 << 10);
-        bool isSub = opcode & (1 << 9);
-        uint32_t op1 = loReg(srcReg), op2 = (opcode >> 6) & 7;
-
-        uint32_t res;
+        cpsr |= Flag_T;
+        updateTHUMBPC(newPC & ~1);
+    }
+    else
+        updateARMPC(newPC);
 
-        if(!isImm)
-            op2 = loReg(static_cast<Reg>(op2));
+    return pcSCycles * 2 + pcNCycles;
+}
 
-        uint32_t carry, overflow;
+template<bool link>
+int AGBCPU::doARMBranch(uint32_t opcode)
+{
+    auto pc = loReg(Reg::PC);
+    auto offset = (static_cast<int32_t>(opcode & 0xFFFFFF) << 8) >> 6;
 
-        cpsr &= 0x0FFFFFFF;
+    if constexpr(link)
+        reg(Reg::LR) = pc - 4;
 
-        if(isSub)
-        {
-            res = op1 - op2;
-            carry = !(res > op1) ? Flag_C : 0;
-            overflow = ((op1 ^ op2) & (op1 ^ res)) & signBit;
-        }
-        else
-        {
-            res = op1 + op2;
-            carry = res < op1 ? Flag_C : 0;
-            overflow = (~(op1 ^ op2) & (op1 ^ res)) & signBit;
-        }
+    updateARMPC(pc + offset);
+    return pcSCycles * 2 + pcNCycles;
+}
 
-        loReg(dstReg) = res;
+int AGBCPU::doARMSWI(uint32_t opcode)
+{
+    auto ret = loReg(Reg::PC) - 4;
+    updateFlags();
+    spsr[1/*svc*/] = cpsr;
 
-        cpsr |= (res & signBit ? Flag_N : 0)
-             | (res == 0 ? Flag_Z : 0)
-             | carry
-             | (overflow >> 3);
-    }
-    else // format 1, move shifted register
-    {
-        auto offset = (opcode >> 6) & 0x1F;
-        auto res = loReg(srcReg);
+    cpsr = (cpsr & ~0x1F) | Flag_I | 0x13; //supervisor mode
+    modeChanged();
+    loReg(Reg::LR) = ret;
+    updateARMPC(8);
 
-        assert(instOp == 2); // others are handled elsewhere
+    return pcSCycles * 2 + pcNCycles;
+}
 
-        uint32_t carry;
+int AGBCPU::doARMUndefined(uint32_t opcode)
+{
+    printf("ARM op %x @%x\n", opcode & 0xFFFFFFF, loReg(Reg::PC) - 4);
+    exit(0);
+}
 
-        if(!offset) offset = 32;
+// i is bits 20-27 and 4-7 of the opcode
+template<int i>
+constexpr AGBCPU::ARMHandler AGBCPU::getARMHandler()
+{
+    constexpr int op = i >> 4; // bits 20-27
+    constexpr int lo = i & 0xF; // bits 4-7
 
-        auto sign = res & signBit;
-        carry = res & (1 << (offset - 1)) ? Flag_C : 0;
-        if(offset == 32)
-            res = sign ? 0xFFFFFFFF : 0;
+    if constexpr((op >> 5) == 0) // data processing with register (and halfword transfer/multiply/swap/branch exchange)
+    {
+        if constexpr((lo & 9) == 9)
+        {
+            if constexpr(lo & 6) // halfword transfer
+                return &AGBCPU::doARMHalfwordTransfer<(op >> 4) & 1, (op >> 3) & 1, (op >> 2) & 1, (op >> 1) & 1, op & 1, (lo >> 1) & 3>;
+            else if constexpr(op & 0x10) // swap
+                return &AGBCPU::doARMSwap<(op >> 2) & 1>;
+            else // multiply (signed is only valid for long)
+                return &AGBCPU::doARMMultiply<(op >> 3) & 1, (op >> 3) & (op >> 2) & 1, (op >> 1) & 1, op & 1>;
+        }
+        else if constexpr(op == 0x12 && lo == 1) // Branch and Exchange (BX)
+            return &AGBCPU::doARMBranchExchange;
+        else if constexpr((op & 0x19) == 0x10) // PSR Transfer (TST-CMN without S)
+            return &AGBCPU::doARMPSRTransfer<false, (op >> 2) & 1, (op >> 1) & 1>;
         else
-            res = static_cast<int32_t>(res) >> offset;
-
-        loReg(dstReg) = res;
-
-        cpsr = (cpsr & 0x1FFFFFFF)
-             | (res & signBit ? Flag_N : 0)
-             | (res == 0 ? Flag_Z : 0)
-             | carry;
+            return &AGBCPU::doARMDataProcessing<(op >> 1) & 0xF, op & 1, false, (lo >> 1) & 3, lo & 1>;
     }
+    else if constexpr((op >> 5) == 1) // data processing with immediate (and MSR)
+    {
+        if constexpr((op & 0x19) == 0x10) // MSR (TST-CMN without S)
+            return &AGBCPU::doARMPSRTransfer<true, (op >> 2) & 1, (op >> 1) & 1>;
+        else
+            return &AGBCPU::doARMDataProcessing<(op >> 1) & 0xF, op & 1, true, 0, false>;
+    }
+    else if constexpr((op >> 6) == 1) // Single Data Transfer
+        return &AGBCPU::doARMSingleDataTransfer<(op >> 5) & 1, (op >> 4) & 1, (op >> 3) & 1, (op >> 2) & 1, (op >> 1) & 1, op & 1, (op & 0x20) ? (lo >> 1) & 3 : 0>;
+    else if constexpr((op >> 5) == 4) // Block Data Transfer
+        return &AGBCPU::doARMBlockDataTransfer<(op >> 4) & 1, (op >> 3) & 1, (op >> 2) & 1, (op >> 1) & 1, op & 1>;
+    else if constexpr((op >> 5) == 5) // Branch (B/BL)
+        return &AGBCPU::doARMBranch<(op >> 4) & 1>;
+    else if constexpr((op >> 4) == 0xF) // SWI
+        return &AGBCPU::doARMSWI;
+    else // coprocessor
+        return &AGBCPU::doARMUndefined;
+}
 
-    return mem.prefetchTiming16(pcSCycles);
+template<size_t... i>
+constexpr std::array<AGBCPU::ARMHandler, 4096> AGBCPU::makeARMTable(std::index_sequence<i...>)
+{
+    return {getARMHandler<i>()...};
 }
 
-int AGBCPU::doTHUMB03(uint16_t opcode, uint32_t pc)
+const std::array<AGBCPU::ARMHandler, 4096> AGBCPU::armTable = makeARMTable(std::make_index_sequence<4096>{});
+
+template<int instOp, int offset>
+int AGBCPU::doTHUMB01MoveShifted(uint16_t opcode, uint32_t pc)
 {
-    auto instOp = (opcode >> 11) & 0x3;
-    auto dstReg = static_cast<Reg>((opcode >> 8) & 7);
-    uint8_t offset = opcode & 0xFF;
+    auto srcReg = static_cast<Reg>((opcode >> 3) & 7);
+    auto dstReg = static_cast<Reg>(opcode & 7);
 
-    auto dst = loReg(dstReg);
+    auto res = loReg(srcReg);
 
-    uint32_t res;
-    uint32_t carry, overflow;
+    bool carry;
 
-    switch(instOp)
+    if constexpr(instOp == 0) // LSL
+    {
+        if constexpr(offset != 0)
+        {
+            carry = res & (1u << (32 - offset));
+            res <<= offset;
+        }
+        else
+            carry = getCarryFlag(); // preserve
+    }
+    else if constexpr(instOp == 1) // LSR
+    {
+        constexpr int shift = offset ? offset : 32; // shift by 0 is really 32
+
+        carry = res & (1u << (shift - 1));
+        if constexpr(shift == 32)
+            res = 0;
+        else
+            res >>= shift;
+    }
+    else // ASR
+    {
+        static_assert(instOp == 2); // 3 is format 2
+        constexpr int shift = offset ? offset : 32;
+
+        auto sign = res & signBit;
+        carry = res & (1u << (shift - 1));
+        if constexpr(shift == 32)
+            res = sign ? 0xFFFFFFFF : 0;
+        else
+            res = static_cast<int32_t>(res) >> shift;
+    }
+
+    loReg(dstReg) = res;
+
+    setLogicalFlags(res, carry);
+
+    return mem.prefetchTiming16(pcSCycles);
+}
+
+template<bool isImm, bool isSub, int op2Val>
+int AGBCPU::doTHUMB02AddSub(uint16_t opcode, uint32_t pc)
+{
+    auto srcReg = static_cast<Reg>((opcode >> 3) & 7);
+    auto dstReg = static_cast<Reg>(opcode & 7);
+
+    uint32_t op1 = loReg(srcReg);
+    uint32_t op2 = isImm ? op2Val : loReg(static_cast<Reg>(op2Val));
+
+    uint32_t res;
+
+    if(isSub)
+    {
+        res = op1 - op2;
+        setSubFlags(op1, op2, res, true);
+    }
+    else
+    {
+        res = op1 + op2;
+        setAddFlags(op1, op2, res, false);
+    }
+
+    loReg(dstReg) = res;
+
+    return mem.prefetchTiming16(pcSCycles);
+}
+
+template<int instOp, AGBCPU::Reg dstReg>
+int AGBCPU::doTHUMB03(uint16_t opcode, uint32_t pc)
+{
+    uint8_t offset = opcode & 0xFF;
+
+    auto dst = loReg(dstReg);
+
+    uint32_t res;
+
+    switch(instOp)
     {
         case 0: // MOV
             loReg(dstReg) = offset;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z)) | (offset == 0 ? Flag_Z : 0); // N not possible
+            setNZFlags(offset);
             break;
         case 1: // CMP
             res = dst - offset;
-            carry = !(res > dst) ? Flag_C : 0;
-            overflow = (dst & ~res) & signBit; // offset cannot be negative, simplifies overflow checks
-            cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C | Flag_V)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | carry | (overflow >> 3); // overflow is either 0 or 0x80000000, shift it down
+            setSubFlags(dst, offset, res, true);
             break;
         case 2: // ADD
             loReg(dstReg) = res = dst + offset;
-            carry = res < dst ? Flag_C : 0;
-            overflow = (~dst & res) & signBit;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C | Flag_V)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | carry | (overflow >> 3);
+            setAddFlags(dst, offset, res, false);
             break;
         case 3: // SUB
             loReg(dstReg) = res = dst - offset;
-            carry = !(res > dst) ? Flag_C : 0;
-            overflow = (dst & ~res) & signBit;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C | Flag_V)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | carry | (overflow >> 3);
+            setSubFlags(dst, offset, res, true);
             break;
         default:
             __builtin_unreachable();
@@ -1569,19 +1773,9 @@ int AGBCPU::doTHUMB03(uint16_t opcode, uint32_t pc)
     return mem.prefetchTiming16(pcSCycles);
 }
 
-int AGBCPU::doTHUMB040506(uint16_t opcode, uint32_t pc)
-{
-    if(opcode & (1 << 11)) // format 6, PC-relative load
-        return doTHUMB06PCRelLoad(opcode, pc);
-    else if(opcode & (1 << 10)) // format 5, Hi reg/branch exchange
-        return doTHUMB05HiReg(opcode, pc);
-    else // format 4, alu
-        return doTHUMB04ALU(opcode, pc);
-}
-
+template<int instOp>
 int AGBCPU::doTHUMB04ALU(uint16_t opcode, uint32_t pc)
 {
-    auto instOp = (opcode >> 6) & 0xF;
     auto srcReg = static_cast<Reg>((opcode >> 3) & 7);
     auto dstReg = static_cast<Reg>(opcode & 7);
 
@@ -1589,75 +1783,73 @@ int AGBCPU::doTHUMB04ALU(uint16_t opcode, uint32_t pc)
     auto op2 = loReg(srcReg);
 
     uint32_t res;
-    uint32_t carry, overflow; // preserved if logical op
+    bool carry;
 
     switch(instOp)
     {
         case 0x0: // AND
             reg(dstReg) = res = op1 & op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z)) | (res & signBit) | (res == 0 ? Flag_Z : 0);
+            setNZFlags(res);
             break;
         case 0x1: // EOR
             reg(dstReg) = res = op1 ^ op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z)) | (res & signBit) | (res == 0 ? Flag_Z : 0);
+            setNZFlags(res);
             break;
         case 0x2: // LSL
-            carry = cpsr & Flag_C;
+            carry = getCarryFlag();
 
             op2 &= 0xFF;
 
             if(op2 >= 32)
             {
                 carry = op2 == 32 ? (op1 & 1) : 0;
-                carry = carry ? Flag_C : 0;
                 reg(dstReg) = res = 0;
             }
             else if(op2)
             {
-                carry = op1 & (1 << (32 - op2)) ? Flag_C : 0;
+                carry = op1 & (1 << (32 - op2));
                 reg(dstReg) = res = op1 << op2;
             }
             else
                 reg(dstReg) = res = op1;
 
-            cpsr = (cpsr & ~(Flag_C | Flag_N | Flag_Z)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | carry;
+            setLogicalFlags(res, carry);
             return mem.iCycle() + mem.prefetchTiming16(pcSCycles); // +1I for shift by register
         case 0x3: // LSR
-            carry = cpsr & Flag_C;
+            carry = getCarryFlag();
 
             op2 &= 0xFF;
 
             if(op2 >= 32)
             {
                 carry = op2 == 32 ? (op1 & (1 << 31)) : 0;
-                carry = carry ? Flag_C : 0;
                 reg(dstReg) = res = 0;
             }
             else if(op2)
             {
-                carry = op1 & (1 << (op2 - 1)) ? Flag_C : 0;
+                carry = op1 & (1 << (op2 - 1));
                 reg(dstReg) = res = op1 >> op2;
             }
             else
                 reg(dstReg) = res = op1;
 
-            cpsr = (cpsr & ~(Flag_C | Flag_N | Flag_Z)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | carry;
+            setLogicalFlags(res, carry);
             return mem.iCycle() + mem.prefetchTiming16(pcSCycles);
         case 0x4: // ASR
         {
-            carry = cpsr & Flag_C;
+            carry = getCarryFlag();
             auto sign = op1 & signBit;
 
             op2 &= 0xFF;
 
             if(op2 >= 32)
             {
-                carry = sign ? Flag_C : 0;
+                carry = sign;
                 reg(dstReg) = res = sign ? 0xFFFFFFFF : 0;
             }
             else if(op2)
             {
-                carry = op1 & (1 << (op2 - 1)) ? Flag_C : 0;
+                carry = op1 & (1 << (op2 - 1));
                 res = static_cast<int32_t>(op1) >> op2;
 
                 reg(dstReg) = res;
@@ -1665,73 +1857,63 @@ int AGBCPU::doTHUMB04ALU(uint16_t opcode, uint32_t pc)
             else
                 reg(dstReg) = res = op1;
 
-            cpsr = (cpsr & ~(Flag_C | Flag_N | Flag_Z)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | carry;
+            setLogicalFlags(res, carry);
             return mem.iCycle() + mem.prefetchTiming16(pcSCycles);
         }
         case 0x5: // ADC
         {
-            int c = (cpsr & Flag_C) ? 1 : 0;
+            int c = getCarryFlag() ? 1 : 0;
             reg(dstReg) = res = op1 + op2 + c;
-            carry = res < op1 || (res == op1 && c) ? Flag_C : 0;
-            overflow = ~((op1 ^ op2) & signBit) & ((op1 ^ res) & signBit);
-            cpsr = (cpsr & 0x0FFFFFFF) | (res & signBit) | (res == 0 ? Flag_Z : 0) | carry | (overflow >> 3);
+            setAddFlags(op1, op2, res, c);
             break;
         }
         case 0x6: // SBC
         {
-            int c = (cpsr & Flag_C) ? 1 : 0;
+            int c = getCarryFlag() ? 1 : 0;
             reg(dstReg) = res = op1 - op2 + c - 1;
-            carry = !(op2 > op1 || (op2 == op1 && !c)) ? Flag_C : 0;
-            overflow = ((op1 ^ op2) & signBit) & ((op1 ^ res) & signBit);
-            cpsr = (cpsr & 0x0FFFFFFF) | (res & signBit) | (res == 0 ? Flag_Z : 0) | carry | (overflow >> 3);
+            setSubFlags(op1, op2, res, c);
             break;
         }
         case 0x7: // ROR
         {
-            carry = cpsr & Flag_C;
+            carry = getCarryFlag();
             int shift = op2 & 0x1F;
 
             reg(dstReg) = res = (op1 >> shift) | (op1 << (32 - shift));
 
             if(op2 & 0xFF)
-                carry = res & (1 << 31) ? Flag_C : 0;
+                carry = res & (1 << 31);
 
-            cpsr = (cpsr & ~(Flag_C | Flag_N | Flag_Z)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | carry;
+            setLogicalFlags(res, carry);
             return pcSCycles + 1;
         }
         case 0x8: // TST
             res = op1 & op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z)) | (res & signBit) | (res == 0 ? Flag_Z : 0);
+            setNZFlags(res);
             break;
         case 0x9: // NEG
         {
             reg(dstReg) = res = 0 - op2;
-            carry = !(op2 > 0) ? Flag_C : 0; //?
-            overflow = (op2 & signBit) & (res & signBit);
-            cpsr = (cpsr & 0x0FFFFFFF) | (res & signBit) | (res == 0 ? Flag_Z : 0) | carry | (overflow >> 3);
+            setSubFlags(0, op2, res, true);
             break;
         }
         case 0xA: // CMP
             res = op1 - op2;
-            carry = !(op2 > op1) ? Flag_C : 0;
-            overflow = ((op1 ^ op2) & signBit) & ((op1 ^ res) & signBit); // different signs and sign changed
-            cpsr = (cpsr & 0x0FFFFFFF) | (res & signBit) | (res == 0 ? Flag_Z : 0) | carry | (overflow >> 3);
+            setSubFlags(op1, op2, res, true);
             break;
         case 0xB: // CMN
             res = op1 + op2;
-            carry = res < op1 ? Flag_C : 0;
-            overflow = ~((op1 ^ op2) & signBit) & ((op1 ^ res) & signBit); // same signs and sign changed
-            cpsr = (cpsr & 0x0FFFFFFF) | (res & signBit) | (res == 0 ? Flag_Z : 0) | carry | (overflow >> 3);
+            setAddFlags(op1, op2, res, false);
             break;
         case 0xC: // ORR
             reg(dstReg) = res = op1 | op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z)) | (res & signBit) | (res == 0 ? Flag_Z : 0);
+            setNZFlags(res);
             break;
         case 0xD: // MUL
         {
             // carry is meaningless, v is unaffected
             reg(dstReg) = res = op1 * op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z)) | (res & signBit) | (res == 0 ? Flag_Z : 0);
+            setNZFlags(res);
 
             // leading 0s or 1s
             int tmp = op1 & (1 << 31) ? ~op1 : op1;
@@ -1743,23 +1925,20 @@ int AGBCPU::doTHUMB04ALU(uint16_t opcode, uint32_t pc)
         }
         case 0xE: // BIC
             reg(dstReg) = res = op1 & ~op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z)) | (res & signBit) | (res == 0 ? Flag_Z : 0);
+            setNZFlags(res);
             break;
         case 0xF: // MVN
             reg(dstReg) = res = ~op2;
-            cpsr = (cpsr & ~(Flag_N | Flag_Z)) | (res & signBit) | (res == 0 ? Flag_Z : 0);
+            setNZFlags(res);
             break;
     }
 
     return mem.prefetchTiming16(pcSCycles);
 }
 
+template<int op, bool h1, bool h2>
 int AGBCPU::doTHUMB05HiReg(uint16_t opcode, uint32_t pc)
 {
-    auto op = (opcode >> 8) & 3;
-    bool h1 = opcode & (1 << 7);
-    bool h2 = opcode & (1 << 6);
-
     auto srcReg = static_cast<Reg>(((opcode >> 3) & 7) + (h2 ? 8 : 0));
     auto dstReg = static_cast<Reg>((opcode & 7) + (h1 ? 8 : 0));
 
@@ -1782,13 +1961,7 @@ int AGBCPU::doTHUMB05HiReg(uint16_t opcode, uint32_t pc)
             auto dst = reg(dstReg);
 
             auto res = dst - src;
-            bool carry = !(src > dst);
-
-            cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C | Flag_V))
-                    | ((res & signBit) ? Flag_N : 0)
-                    | (res == 0 ? Flag_Z : 0)
-                    | (carry ? Flag_C : 0)
-                    | (((dst ^ src) & signBit) && ((dst ^ res) & signBit) ? Flag_V : 0);
+            setSubFlags(dst, src, res, true);
             break;
         }
         case 2: // MOV
@@ -1823,9 +1996,9 @@ int AGBCPU::doTHUMB05HiReg(uint16_t opcode, uint32_t pc)
     return mem.prefetchTiming16(pcSCycles);
 }
 
+template<AGBCPU::Reg dstReg>
 int AGBCPU::doTHUMB06PCRelLoad(uint16_t opcode, uint32_t pc)
 {
-    auto dstReg = static_cast<Reg>((opcode >> 8) & 7);
     uint8_t word = opcode & 0xFF;
 
     // pc + 4, bit 1 forced to 0
@@ -1835,92 +2008,89 @@ int AGBCPU::doTHUMB06PCRelLoad(uint16_t opcode, uint32_t pc)
     return cycles + mem.iCycle() + mem.prefetchTiming16(pcSCycles, pcNCycles);
 }
 
-int AGBCPU::doTHUMB0708(uint16_t opcode, uint32_t pc)
+template<bool isLoad, bool isByte, AGBCPU::Reg offReg>
+int AGBCPU::doTHUMB07LoadStoreReg(uint16_t opcode, uint32_t pc)
 {
-    auto offReg = static_cast<Reg>((opcode >> 6) & 7);
     auto baseReg = static_cast<Reg>((opcode >> 3) & 7);
     auto dstReg = static_cast<Reg>(opcode & 7);
 
     auto addr = loReg(baseReg) + loReg(offReg);
 
-    if(opcode & (1 << 9)) // format 8, load/store sign-extended byte/halfword
+    if(isLoad)
     {
-        bool hFlag = opcode & (1 << 11);
-        bool signEx = opcode & (1 << 10);
+        int cycles = 0;
+        if(isByte) // LDRB
+            loReg(dstReg) = readMem8(addr, cycles);
+        else // LDR
+            loReg(dstReg) = readMem32(addr, cycles);
 
-        if(signEx)
-        {
-            if(hFlag && !(addr & 1)) // LDRSH, (misaligned gets treated as a byte!)
-            {
-                int cycles = 0;
-                auto val = readMem16(addr, cycles);
-                if(val & 0x8000)
-                    loReg(dstReg) = val | 0xFFFF0000;
-                else
-                    loReg(dstReg) = val;
+        return cycles + mem.iCycle() + mem.prefetchTiming16(pcSCycles, pcNCycles);
+    }
+    else
+    {
+        int cycles = 0;
+        if(isByte) // STRB
+            writeMem8(addr, loReg(dstReg), cycles);
+        else // STR
+            writeMem32(addr, loReg(dstReg), cycles);
 
-                return cycles + mem.iCycle() + mem.prefetchTiming16(pcSCycles, pcNCycles);
-            }
-            else // LDRSB
-            {
-                int cycles = 0;
-                auto val = readMem8(addr, cycles);
-                if(val & 0x80)
-                    loReg(dstReg) = val | 0xFFFFFF00;
-                else
-                    loReg(dstReg) = val;
+        return cycles + mem.prefetchTiming16(pcNCycles);
+    }
+}
 
-                return cycles + mem.iCycle() + mem.prefetchTiming16(pcSCycles, pcNCycles);
-            }
+template<bool hFlag, bool signEx, AGBCPU::Reg offReg>
+int AGBCPU::doTHUMB08LoadStoreSignEx(uint16_t opcode, uint32_t pc)
+{
+    auto baseReg = static_cast<Reg>((opcode >> 3) & 7);
+    auto dstReg = static_cast<Reg>(opcode & 7);
+
+    auto addr = loReg(baseReg) + loReg(offReg);
+
+    if(signEx)
+    {
+        if(hFlag && !(addr & 1)) // LDRSH, (misaligned gets treated as a byte!)
+        {
+            int cycles = 0;
+            auto val = readMem16(addr, cycles);
+            if(val & 0x8000)
+                loReg(dstReg) = val | 0xFFFF0000;
+            else
+                loReg(dstReg) = val;
+
+            return cycles + mem.iCycle() + mem.prefetchTiming16(pcSCycles, pcNCycles);
         }
-        else
+        else // LDRSB
         {
-            if(hFlag) // LDRH
-            {
-                int cycles = 0;
-                loReg(dstReg) = readMem16(addr, cycles);
-                return cycles + mem.iCycle() + mem.prefetchTiming16(pcSCycles, pcNCycles);
-            }
-            else // STRH
-            {
-                int cycles = 0;
-                writeMem16(addr, loReg(dstReg), cycles);
-                return cycles + mem.prefetchTiming16(pcNCycles);
-            }
+            int cycles = 0;
+            auto val = readMem8(addr, cycles);
+            if(val & 0x80)
+                loReg(dstReg) = val | 0xFFFFFF00;
+            else
+                loReg(dstReg) = val;
+
+            return cycles + mem.iCycle() + mem.prefetchTiming16(pcSCycles, pcNCycles);
         }
     }
-    else // format 7, load/store with reg offset
+    else
     {
-        bool isLoad = opcode & (1 << 11);
-        bool isByte = opcode & (1 << 10);
-
-        if(isLoad)
+        if(hFlag) // LDRH
         {
             int cycles = 0;
-            if(isByte) // LDRB
-                loReg(dstReg) = readMem8(addr, cycles);
-            else // LDR
-                loReg(dstReg) = readMem32(addr, cycles);
-
+            loReg(dstReg) = readMem16(addr, cycles);
             return cycles + mem.iCycle() + mem.prefetchTiming16(pcSCycles, pcNCycles);
         }
-        else
+        else // STRH
         {
             int cycles = 0;
-            if(isByte) // STRB
-                writeMem8(addr, loReg(dstReg), cycles);
-            else // STR
-                writeMem32(addr, loReg(dstReg), cycles);
-
+            writeMem16(addr, loReg(dstReg), cycles);
             return cycles + mem.prefetchTiming16(pcNCycles);
         }
     }
 }
 
+template<bool isLoad, int offset>
 int AGBCPU::doTHUMB09LoadStoreWord(uint16_t opcode, uint32_t pc)
 {
-    bool isLoad = opcode & (1 << 11);
-    auto offset = ((opcode >> 6) & 0x1F);
     auto baseReg = static_cast<Reg>((opcode >> 3) & 7);
     auto dstReg = static_cast<Reg>(opcode & 7);
 
@@ -1939,10 +2109,9 @@ int AGBCPU::doTHUMB09LoadStoreWord(uint16_t opcode, uint32_t pc)
     }
 }
 
+template<bool isLoad, int offset>
 int AGBCPU::doTHUMB09LoadStoreByte(uint16_t opcode, uint32_t pc)
 {
-    bool isLoad = opcode & (1 << 11);
-    auto offset = ((opcode >> 6) & 0x1F);
     auto baseReg = static_cast<Reg>((opcode >> 3) & 7);
     auto dstReg = static_cast<Reg>(opcode & 7);
 
@@ -1961,14 +2130,13 @@ int AGBCPU::doTHUMB09LoadStoreByte(uint16_t opcode, uint32_t pc)
     }
 }
 
+template<bool isLoad, int offset>
 int AGBCPU::doTHUMB10LoadStoreHalf(uint16_t opcode, uint32_t pc)
 {
-    bool isLoad = opcode & (1 << 11);
-    auto offset = ((opcode >> 6) & 0x1F) << 1;
     auto baseReg = static_cast<Reg>((opcode >> 3) & 7);
     auto dstReg = static_cast<Reg>(opcode & 7);
 
-    auto addr = loReg(baseReg) + offset;
+    auto addr = loReg(baseReg) + (offset << 1);
     if(isLoad) // LDRH
     {
         int cycles = 0;
@@ -1983,13 +2151,12 @@ int AGBCPU::doTHUMB10LoadStoreHalf(uint16_t opcode, uint32_t pc)
     }
 }
 
+template<bool isLoad, AGBCPU::Reg dstReg>
 int AGBCPU::doTHUMB11SPRelLoadStore(uint16_t opcode, uint32_t pc)
 {
-    bool isLoad = opcode & (1 << 11);
-    auto dstReg = static_cast<Reg>((opcode >> 8) & 7);
     auto word = (opcode & 0xFF) << 2;
 
-    auto addr = loReg(curSP) + word;
+    auto addr = loReg(Reg::SP) + word;
 
     if(isLoad)
     {
@@ -2005,54 +2172,45 @@ int AGBCPU::doTHUMB11SPRelLoadStore(uint16_t opcode, uint32_t pc)
     }
 }
 
+template<bool isSP, AGBCPU::Reg dstReg>
 int AGBCPU::doTHUMB12LoadAddr(uint16_t opcode, uint32_t pc)
 {
-    bool isSP = opcode & (1 << 11);
-    auto dstReg = static_cast<Reg>((opcode >> 8) & 7);
     auto word = (opcode & 0xFF) << 2;
 
     if(isSP)
-        loReg(dstReg) = loReg(curSP) + word;
+        loReg(dstReg) = loReg(Reg::SP) + word;
     else
         loReg(dstReg) = (pc & ~2) + word; // + 4, bit 1 forced to 0
 
     return mem.prefetchTiming16(pcSCycles);
 }
 
-int AGBCPU::doTHUMB1314(uint16_t opcode, uint32_t pc)
-{
-    if(opcode & (1 << 10)) // format 14, push/pop
-        return doTHUMB14PushPop(opcode, pc);
-    else // format 13, add offset to SP
-        return doTHUMB13SPOffset(opcode, pc);
-}
-
+template<bool isNeg>
 int AGBCPU::doTHUMB13SPOffset(uint16_t opcode, uint32_t pc)
 {
-    bool isNeg = opcode & (1 << 7);
     int off = (opcode & 0x7F) << 2;
 
     if(isNeg)
-        loReg(curSP) -= off;
+        loReg(Reg::SP) -= off;
     else
-        loReg(curSP) += off;
+        loReg(Reg::SP) += off;
 
     return mem.prefetchTiming16(pcSCycles);
 }
 
+template<bool isLoad, bool pclr>
 int AGBCPU::doTHUMB14PushPop(uint16_t opcode, uint32_t pc)
 {
     // timings here are probably off
 
-    bool isLoad = opcode & (1 << 11);
-    bool pclr = opcode & (1 << 8); // store LR/load PC
+    // pclr: store LR/load PC
     uint8_t regList = opcode & 0xFF;
 
     int cycles = 0;
 
     if(isLoad) // POP
     {
-        auto addr = loReg(curSP);
+        auto addr = loReg(Reg::SP);
         auto ptr = reinterpret_cast<uint32_t *>(mem.mapAddress(addr & ~3));
         auto loadCycles = mem.getAccessCycles(addr, 4, true);
 
@@ -2077,13 +2235,14 @@ int AGBCPU::doTHUMB14PushPop(uint16_t opcode, uint32_t pc)
 
         cycles++; // I cycle
 
-        loReg(curSP) = addr;
+        loReg(Reg::SP) = addr;
 
         return mem.iCycle(cycles) + mem.prefetchTiming16(pcSCycles, pcNCycles);
     }
     else // PUSH
     {
-        auto addr = loReg(curSP) - (pclr ? 4 : 0);
+        auto oldSP = loReg(Reg::SP);
+        auto addr = oldSP - (pclr ? 4 : 0);
 
         // offset
         for(uint8_t t = regList; t; t >>= 1)
@@ -2091,7 +2250,7 @@ int AGBCPU::doTHUMB14PushPop(uint16_t opcode, uint32_t pc)
             if(t & 1)
                 addr -= 4;
         }
-        loReg(curSP) = addr;
+        loReg(Reg::SP) = addr;
 
         auto ptr = reinterpret_cast<uint32_t *>(mem.mapAddress(addr & ~3));
         auto storeCycles = mem.getAccessCycles(addr, 4, true);
@@ -2108,18 +2267,19 @@ int AGBCPU::doTHUMB14PushPop(uint16_t opcode, uint32_t pc)
 
         if(pclr)
         {
-            *ptr++ = loReg(curLR);
+            *ptr++ = loReg(Reg::LR);
             cycles += storeCycles;
         }
 
+        mem.invalidateCode(addr & ~3, oldSP - addr);
+
         return mem.iCycle(cycles) +  mem.prefetchTiming16(pcNCycles);
     }
 }
 
+template<bool isLoad, AGBCPU::Reg baseReg>
 int AGBCPU::doTHUMB15MultiLoadStore(uint16_t opcode, uint32_t pc)
 {
-    bool isLoad = opcode & (1 << 11);
-    auto baseReg = static_cast<Reg>((opcode >> 8) & 7);
     uint8_t regList = opcode & 0xFF;
 
     auto addr = loReg(baseReg);
@@ -2187,72 +2347,57 @@ int AGBCPU::doTHUMB15MultiLoadStore(uint16_t opcode, uint32_t pc)
     return cycles;
 }
 
-int AGBCPU::doTHUMB1617(uint16_t opcode, uint32_t pc)
+template<int cond>
+int AGBCPU::doTHUMB16CondBranch(uint16_t opcode, uint32_t pc)
 {
-    // format 16, conditional branch (+ SWI)
-    auto cond = (opcode >> 8) & 0xF;
-
     int offset = static_cast<int8_t>(opcode & 0xFF);
     bool condVal = false;
     switch(cond)
     {
         case 0x0: // BEQ
-            condVal = cpsr & Flag_Z;
+            condVal = getZeroFlag();
             break;
         case 0x1: // BNE
-            condVal = !(cpsr & Flag_Z);
+            condVal = !getZeroFlag();
             break;
         case 0x2: // BCS
-            condVal = cpsr & Flag_C;
+            condVal = getCarryFlag();
             break;
         case 0x3: // BCC
-            condVal = !(cpsr & Flag_C);
+            condVal = !getCarryFlag();
             break;
         case 0x4: // BMI
-            condVal = cpsr & Flag_N;
+            condVal = getNegativeFlag();
             break;
         case 0x5: // BPL
-            condVal = !(cpsr & Flag_N);
+            condVal = !(getNegativeFlag());
             break;
         case 0x6: // BVS
-            condVal = cpsr & Flag_V;
+            condVal = getOverflowFlag();
             break;
         case 0x7: // BVC
-            condVal = !(cpsr & Flag_V);
+            condVal = !(getOverflowFlag());
             break;
         case 0x8: // BHI
-            condVal = (cpsr & Flag_C) && !(cpsr & Flag_Z);
+            condVal = getCarryFlag() && !getZeroFlag();
             break;
         case 0x9: // BLS
-            condVal = !(cpsr & Flag_C) || (cpsr & Flag_Z);
+            condVal = !getCarryFlag() || getZeroFlag();
             break;
         case 0xA: // BGE
-            condVal = !!(cpsr & Flag_N) == !!(cpsr & Flag_V);
+            condVal = getNegativeFlag() == getOverflowFlag();
             break;
         case 0xB: // BLT
-            condVal = !!(cpsr & Flag_N) != !!(cpsr & Flag_V);
+            condVal = getNegativeFlag() != getOverflowFlag();
             break;
         case 0xC: // BGT
-            condVal = !(cpsr & Flag_Z) && !!(cpsr & Flag_N) == !!(cpsr & Flag_V);
+            condVal = !getZeroFlag() && getNegativeFlag() == getOverflowFlag();
             break;
         case 0xD: // BLE
-            condVal = (cpsr & Flag_Z) || !!(cpsr & Flag_N) != !!(cpsr & Flag_V);
+            condVal = getZeroFlag() || getNegativeFlag() != getOverflowFlag();
             break;
 
-        // E undefined
-
-        case 0xF: // format 17, SWI
-        {
-            auto ret = (pc - 2) & ~1;
-            spsr[1/*svc*/] = cpsr;
-
-            cpsr = (cpsr & ~(0x1F | Flag_T)) | Flag_I | 0x13; //supervisor mode
-            modeChanged();
-            loReg(curLR) = ret;
-            updateARMPC(8);
-
-            return pcSCycles * 2 + pcNCycles;
-        }
+        // E undefined, F is SWI
 
         default:
             assert(!"Invalid THUMB cond");
@@ -2260,12 +2405,26 @@ int AGBCPU::doTHUMB1617(uint16_t opcode, uint32_t pc)
 
     if(!condVal)
         return pcSCycles; // no extra cycles if branch not taken
-    
+
     updateTHUMBPC(pc + offset * 2);
 
     return pcSCycles * 2 + pcNCycles;
 }
 
+int AGBCPU::doTHUMB17SWI(uint16_t opcode, uint32_t pc)
+{
+    auto ret = (pc - 2) & ~1;
+    updateFlags();
+    spsr[1/*svc*/] = cpsr;
+
+    cpsr = (cpsr & ~(0x1F | Flag_T)) | Flag_I | 0x13; //supervisor mode
+    modeChanged();
+    loReg(Reg::LR) = ret;
+    updateARMPC(8);
+
+    return pcSCycles * 2 + pcNCycles;
+}
+
 int AGBCPU::doTHUMB18UncondBranch(uint16_t opcode, uint32_t pc)
 {
     uint32_t offset = static_cast<int16_t>(opcode << 5) >> 4; // sign extend and * 2
@@ -2275,9 +2434,9 @@ int AGBCPU::doTHUMB18UncondBranch(uint16_t opcode, uint32_t pc)
     return pcSCycles * 2 + pcNCycles; // 2S + 1N
 }
 
+template<bool high>
 int AGBCPU::doTHUMB19LongBranchLink(uint16_t opcode, uint32_t pc)
 {
-    bool high = opcode & (1 << 11);
     uint32_t offset = opcode & 0x7FF;
 
     if(!high) // first half
@@ -2285,14 +2444,14 @@ int AGBCPU::doTHUMB19LongBranchLink(uint16_t opcode, uint32_t pc)
         offset <<= 12;
         if(offset & (1 << 22))
             offset |= 0xFF800000; //sign extend
-        loReg(curLR) = pc + offset;
+        loReg(Reg::LR) = pc + offset;
 
         return pcSCycles;
     }
     else // second half
     {
-        auto newPC = loReg(curLR) + (offset << 1);
-        loReg(curLR) = (pc - 2) | 1; // magic switch to thumb bit...
+        auto newPC = loReg(Reg::LR) + (offset << 1);
+        loReg(Reg::LR) = (pc - 2) | 1; // magic switch to thumb bit...
 
         updateTHUMBPC(newPC);
 
@@ -2300,6 +2459,77 @@ int AGBCPU::doTHUMB19LongBranchLink(uint16_t opcode, uint32_t pc)
     }
 }
 
+// i is bits 6-15 of the opcode
+template<int i>
+constexpr AGBCPU::THUMBHandler AGBCPU::getTHUMBHandler()
+{
+    constexpr int op = i >> 6;
+
+    if constexpr(op <= 0x1) // formats 1-2
+    {
+        if constexpr(((i >> 5) & 3) == 3) // format 2, add/sub
+            return &AGBCPU::doTHUMB02AddSub<(i >> 4) & 1, (i >> 3) & 1, i & 7>;
+        else // format 1, move shifted register
+            return &AGBCPU::doTHUMB01MoveShifted<(i >> 5) & 3, i & 0x1F>;
+    }
+    else if constexpr(op <= 0x3) // format 3, mov/cmp/add/sub immediate
+        return &AGBCPU::doTHUMB03<(i >> 5) & 3, static_cast<Reg>((i >> 2) & 7)>;
+    else if constexpr(op == 0x4) // formats 4-6
+    {
+        if constexpr(i & (1 << 5)) // format 6, PC-relative load
+            return &AGBCPU::doTHUMB06PCRelLoad<static_cast<Reg>((i >> 2) & 7)>;
+        else if constexpr(i & (1 << 4)) // format 5, Hi reg/branch exchange
+            return &AGBCPU::doTHUMB05HiReg<(i >> 2) & 3, (i >> 1) & 1, i & 1>;
+        else // format 4, alu
+            return &AGBCPU::doTHUMB04ALU<i & 0xF>;
+    }
+    else if constexpr(op == 0x5) // formats 7-8
+    {
+        if constexpr(i & (1 << 3)) // format 8, load/store sign-extended byte/halfword
+            return &AGBCPU::doTHUMB08LoadStoreSignEx<(i >> 5) & 1, (i >> 4) & 1, static_cast<Reg>(i & 7)>;
+        else // format 7, load/store with reg offset
+            return &AGBCPU::doTHUMB07LoadStoreReg<(i >> 5) & 1, (i >> 4) & 1, static_cast<Reg>(i & 7)>;
+    }
+    else if constexpr(op == 0x6) // format 9, load/store with imm offset (words)
+        return &AGBCPU::doTHUMB09LoadStoreWord<(i >> 5) & 1, i & 0x1F>;
+    else if constexpr(op == 0x7) // ... (bytes)
+        return &AGBCPU::doTHUMB09LoadStoreByte<(i >> 5) & 1, i & 0x1F>;
+    else if constexpr(op == 0x8) // format 10, load/store halfword
+        return &AGBCPU::doTHUMB10LoadStoreHalf<(i >> 5) & 1, i & 0x1F>;
+    else if constexpr(op == 0x9) // format 11, SP-relative load/store
+        return &AGBCPU::doTHUMB11SPRelLoadStore<(i >> 5) & 1, static_cast<Reg>((i >> 2) & 7)>;
+    else if constexpr(op == 0xA) // format 12, load address
+        return &AGBCPU::doTHUMB12LoadAddr<(i >> 5) & 1, static_cast<Reg>((i >> 2) & 7)>;
+    else if constexpr(op == 0xB) // formats 13-14
+    {
+        if constexpr(i & (1 << 4)) // format 14, push/pop
+            return &AGBCPU::doTHUMB14PushPop<(i >> 5) & 1, (i >> 2) & 1>;
+        else // format 13, add offset to SP
+            return &AGBCPU::doTHUMB13SPOffset<(i >> 1) & 1>;
+    }
+    else if constexpr(op == 0xC) // format 15, multiple load/store
+        return &AGBCPU::doTHUMB15MultiLoadStore<(i >> 5) & 1, static_cast<Reg>((i >> 2) & 7)>;
+    else if constexpr(op == 0xD) // formats 16-17
+    {
+        if constexpr(((i >> 2) & 0xF) == 0xF) // format 17, SWI
+            return &AGBCPU::doTHUMB17SWI;
+        else // format 16, conditional branch
+            return &AGBCPU::doTHUMB16CondBranch<(i >> 2) & 0xF>;
+    }
+    else if constexpr(op == 0xE) // format 18, unconditional branch
+        return &AGBCPU::doTHUMB18UncondBranch;
+    else // format 19, long branch with link
+        return &AGBCPU::doTHUMB19LongBranchLink<(i >> 5) & 1>;
+}
+
+template<size_t... i>
+constexpr std::array<AGBCPU::THUMBHandler, 1024> AGBCPU::makeTHUMBTable(std::index_sequence<i...>)
+{
+    return {getTHUMBHandler<i>()...};
+}
+
+const std::array<AGBCPU::THUMBHandler, 1024> AGBCPU::thumbTable = makeTHUMBTable(std::make_index_sequence<1024>{});
+
 void AGBCPU::updateARMPC(uint32_t pc)
 {
     assert(!(pc & 3));
@@ -2378,11 +2608,12 @@ int AGBCPU::serviceInterrupts()
     if(cpsr & Flag_T)
         ret += 2;
 
+    updateFlags();
     spsr[3/*irq*/] = cpsr;
 
     cpsr = (cpsr & ~(0x1F | Flag_T)) | Flag_I | 0x12; // irq mode
     modeChanged();
-    loReg(curLR) = ret;
+    loReg(Reg::LR) = ret;
     updateARMPC(0x18);
 
     return pcSCycles * 2 + pcNCycles; // I'm assuming this is like a branch...
@@ -2440,6 +2671,31 @@ int AGBCPU::dmaTransfer(int channel)
     // stop to allow other DMA triggers
     int maxCycles = nextUpdateCycle - cycleCount;
 
+    // copy as much as we can in one go if it's between plain memory
+    if(isValidSrc && srcMode != 1 && (dstMode == 0 || dstMode == 3) && count > 0 && cycles < maxCycles)
+    {
+        // same count as the loop below, which stops after the transfer that reaches maxCycles
+        int firstCycles = mem.getAccessCycles(srcAddr, width, started) + mem.getAccessCycles(dstAddr, width, started);
+        int seqCycles = mem.getAccessCycles(srcAddr, width, true) + mem.getAccessCycles(dstAddr, width, true);
+        int remaining = maxCycles - cycles - firstCycles;
+
+        int n = std::min(count, 1 + (remaining > 0 ? (remaining + seqCycles - 1) / seqCycles : 0));
+
+        bool fixedSrc = srcMode != 0;
+        bool copied = is32Bit ? mem.dmaCopy<uint32_t>(srcAddr, dstAddr, n, fixedSrc, cycles, started, lastVal)
+                              : mem.dmaCopy<uint16_t>(srcAddr, dstAddr, n, fixedSrc, cycles, started, lastVal);
+
+        if(copied)
+        {
+            count -= n;
+            dstAddr += n * width;
+            if(!fixedSrc)
+                srcAddr += n * width;
+
+            started = true;
+        }
+    }
+
     while(cycles < maxCycles && count--)
     {
         if(is32Bit)
@@ -2565,7 +2821,7 @@ void AGBCPU::updateTimers()
                 overflow |= (1 << i);
                 timerCounters[i] = mem.readIOReg(IO_TM0CNT_L + i * 4);
                 if(timerInterruptEnabled & (1 << i))
-                    flagInterrupt(Int_Timer0 << i, false);
+                    flagInterrupt(Int_Timer0 << i);
 
                 if(i < 2)
                     apu.timerOverflow(i, timer);
@@ -2590,15 +2846,16 @@ void AGBCPU::calculateNextTimerOverflow(uint32_t cycleCount)
 {
     uint32_t nextOverflow = ~0;
 
-    auto enabled = timerEnabled;
-    for(int i = 0; enabled; i++, enabled >>= 1)
+    for(int i = 0; i < 4; i++)
     {
-        if(!(enabled & 1))
-            continue;
+        auto event = static_cast<Event>(static_cast<int>(Event::Timer0) + i);
 
         // count-up timer is updated when the previous timer overflows
-        if(timerPrescalers[i] == -1)
+        if(!(timerEnabled & (1 << i)) || timerPrescalers[i] == -1)
+        {
+            scheduler.remove(event);
             continue;
+        }
 
         // increments to overflow
         int incs = 0xFFFF - timerCounters[i];
@@ -2608,31 +2865,76 @@ void AGBCPU::calculateNextTimerOverflow(uint32_t cycleCount)
 
         if(thisTimerOverflow < nextOverflow)
             nextOverflow = thisTimerOverflow;
+
+        scheduler.schedule(event, cycleCount + thisTimerOverflow);
     }
 
     nextTimerUpdate = cycleCount + nextOverflow;
+    updateNextUpdateCycle();
 }
 
-void AGBCPU::calculateNextUpdate(uint32_t cycleCount)
+// handles any events at or before the current cycle
+void AGBCPU::runEvents()
 {
-    bool displayInterruptsEnabled = enabledInterrutps & (Int_LCDVBlank | Int_LCDHBlank | Int_LCDVCount);
+    while(!scheduler.empty() && static_cast<int32_t>(scheduler.getNextCycle() - cycleCount) <= 0)
+    {
+        auto event = scheduler.getNextEvent();
+        scheduler.remove(event);
+
+        switch(event)
+        {
+            case Event::Timer0:
+            case Event::Timer1:
+            case Event::Timer2:
+            case Event::Timer3:
+                updateTimers(); // reschedules on overflow
+                break;
+
+            case Event::Display:
+                display.update();
+                scheduleDisplayUpdate();
+                break;
+
+            case Event::InterruptDelay:
+                scheduleInterruptDelay(); // still set if there were no interrupts to count down for
+                break;
+
+            case Event::Count:
+                break;
+        }
+    }
+
+    updateNextUpdateCycle();
+}
 
-    int toUpdate = std::numeric_limits<int>::max();
+void AGBCPU::scheduleDisplayUpdate()
+{
+    bool displayInterruptsEnabled = enabledInterrutps & (Int_LCDVBlank | Int_LCDHBlank | Int_LCDVCount);
 
-    // limit to display interrupt
     if(displayInterruptsEnabled)
-        toUpdate = std::min(toUpdate, display.getCyclesToNextUpdate(cycleCount));
+        scheduler.schedule(Event::Display, cycleCount + display.getCyclesToNextUpdate(cycleCount));
+    else
+        scheduler.remove(Event::Display);
 
-    // limit to next timer overflow
-    if(timerEnabled)
-        toUpdate = std::min(toUpdate, static_cast<int>(nextTimerUpdate - cycleCount));
+    updateNextUpdateCycle();
+}
 
+void AGBCPU::scheduleInterruptDelay()
+{
     if(interruptDelay)
-        toUpdate = std::min(toUpdate, static_cast<int>(interruptDelay + this->cycleCount - cycleCount));
+        scheduler.schedule(Event::InterruptDelay, cycleCount + interruptDelay);
+    else
+        scheduler.remove(Event::InterruptDelay);
 
-    assert(toUpdate >= 0 || nextUpdateCycle == cycleCount + toUpdate);
+    updateNextUpdateCycle();
+}
 
-    nextUpdateCycle = cycleCount + toUpdate;
+void AGBCPU::updateNextUpdateCycle()
+{
+    if(scheduler.empty())
+        nextUpdateCycle = cycleCount + std::numeric_limits<int>::max();
+    else
+        nextUpdateCycle = scheduler.getNextCycle();
 }
 
 // high-level BIOS emulation
@@ -2644,26 +2946,28 @@ void AGBCPU::handleBIOSBranch(uint32_t pc)
         case 0x348: // halt in IntrWait
         {
             int cycles = 0; // TODO
-            int swiNum = readMem8(loReg(Reg::R14_svc) - 2, cycles);
+            int swiNum = readMem8(bankedReg(Reg::R14_svc) - 2, cycles);
 
             if(pc == 0x8)
             {
                 // push r11-12, lr
                 // TODO: only need to do this if not returning immediately?
-                auto &sp = loReg(Reg::R13_svc);
+                auto &sp = bankedReg(Reg::R13_svc);
                 sp -= 3 * 4;
 
                 auto ptr = reinterpret_cast<uint32_t *>(mem.mapAddress(sp));
 
-                *ptr++ = loReg(Reg::R11);
-                *ptr++ = loReg(Reg::R12);
-                *ptr++ = loReg(Reg::R14_svc);
+                *ptr++ = bankedReg(Reg::R11);
+                *ptr++ = bankedReg(Reg::R12);
+                *ptr++ = bankedReg(Reg::R14_svc);
 
                 // push SPSR
                 sp -= 4;
                 ptr = reinterpret_cast<uint32_t *>(mem.mapAddress(sp));
                 *ptr = getSPSR();
 
+                mem.invalidateCode(sp, 4 * 4);
+
                 cpsr = (getSPSR() & Flag_I) | 0x1F; // switch back to system mode
 
                 // push r2, lr to SYSTEM stack?
@@ -2679,7 +2983,7 @@ void AGBCPU::handleBIOSBranch(uint32_t pc)
         case 0x18: // IRQ
         {
             // push some regs
-            auto &sp = loReg(Reg::R13_irq);
+            auto &sp = bankedReg(Reg::R13_irq);
             sp -= 6 * 4;
 
             auto ptr = reinterpret_cast<uint32_t *>(mem.mapAddress(sp));
@@ -2687,10 +2991,12 @@ void AGBCPU::handleBIOSBranch(uint32_t pc)
             for(int i = 0; i < 4; i++)
                 *ptr++ = regs[i];
 
-            *ptr++ = loReg(Reg::R12);
-            *ptr++ = loReg(Reg::R14_irq);
+            *ptr++ = bankedReg(Reg::R12);
+            *ptr++ = bankedReg(Reg::R14_irq);
 
-            loReg(Reg::R14_irq) = 0x138;
+            mem.invalidateCode(sp, 6 * 4);
+
+            bankedReg(Reg::R14_irq) = 0x138;
 
             // jump to user handler
             int cycles = 3 + 3 /*B*/ + 7 /*STM*/ + 1 /*MOV*/ + 1 /*ADD*/ + 1 /*LDR (I)*/;
@@ -2704,18 +3010,19 @@ void AGBCPU::handleBIOSBranch(uint32_t pc)
         case 0x138: // return from IRQ
         {
             // pop some regs
-            auto &sp = loReg(Reg::R13_irq);
+            auto &sp = bankedReg(Reg::R13_irq);
             auto ptr = reinterpret_cast<uint32_t *>(mem.mapAddress(sp));
             sp += 6 * 4;
 
             for(int i = 0; i < 4; i++)
                 regs[i] = *ptr++;
 
-            loReg(Reg::R12) = *ptr++;
-            loReg(Reg::R14_irq) = *ptr++;
+            bankedReg(Reg::R12) = *ptr++;
+            bankedReg(Reg::R14_irq) = *ptr++;
 
             // return
-            auto retAddr = loReg(Reg::R14_irq) - 4;
+            auto retAddr = bankedReg(Reg::R14_irq) - 4;
+            updateFlags();
             cpsr = getSPSR();
             modeChanged();
 
@@ -2736,6 +3043,8 @@ void AGBCPU::handleBIOSBranch(uint32_t pc)
 
 void AGBCPU::handleSWI(int num)
 {
+    int cycles = 0; // for the functions that take a while
+
     switch(num)
     {
         case 0x0: // SoftReset
@@ -2778,11 +3087,11 @@ void AGBCPU::handleSWI(int num)
             break;
 
         case 0xB: // CpuSet
-            swiCPUSet();
+            swiCPUSet(cycles);
             break;
 
         case 0xC: // CpuFastSet
-            swiCPUFastSet();
+            swiCPUFastSet(cycles);
             break;
 
         case 0xE: // BgAffineSet
@@ -2794,31 +3103,54 @@ void AGBCPU::handleSWI(int num)
             break;
 
         case 0x10: // BitUnPack
-            swiBitUnpack();
+            swiBitUnpack(cycles);
             break;
 
         case 0x11: // LZ77 8-bit write
-            swiLZ77Write8();
+            swiLZ77Write8(cycles);
             break;
 
         case 0x12: // LZ77 16-bit write
-            swiLZ77Write16();
+            swiLZ77Write16(cycles);
             break;
 
         case 0x13: // Huffman
-            swiHuffmanDecode();
+            swiHuffmanDecode(cycles);
+            break;
+
+        case 0x14: // RL 8-bit write
+            swiRLUncomp(false, cycles);
+            break;
+
+        case 0x15: // RL 16-bit write
+            swiRLUncomp(true, cycles);
+            break;
+
+        case 0x16: // Diff8bitUnFilter 8-bit write
+            swiDiff8bitUnFilter(false, cycles);
+            break;
+
+        case 0x17: // Diff8bitUnFilter 16-bit write
+            swiDiff8bitUnFilter(true, cycles);
+            break;
+
+        case 0x18: // Diff16bitUnFilter
+            swiDiff16bitUnFilter(cycles);
             break;
 
         default:
             printf("SWI %x\n", num);
     }
 
+    biosCycles = cycles;
+
     // pop r2, lr from sys stack
 
+    updateFlags();
     cpsr = Flag_I | 0x13; // back to SVC
 
     // pop SPSR
-    auto &sp = loReg(Reg::R13_svc);
+    auto &sp = bankedReg(Reg::R13_svc);
     auto ptr = reinterpret_cast<uint32_t *>(mem.mapAddress(sp));
     sp += 4;
 
@@ -2827,12 +3159,12 @@ void AGBCPU::handleSWI(int num)
     // pop some regs
     sp += 3 * 4;
 
-    loReg(Reg::R11) = *ptr++;
-    loReg(Reg::R12) = *ptr++;
-    loReg(Reg::R14_svc) = *ptr++;
+    bankedReg(Reg::R11) = *ptr++;
+    bankedReg(Reg::R12) = *ptr++;
+    bankedReg(Reg::R14_svc) = *ptr++;
 
     // return
-    auto retAddr = loReg(Reg::R14_svc);
+    auto retAddr = bankedReg(Reg::R14_svc);
     cpsr = getSPSR();
     modeChanged();
 
@@ -2851,22 +3183,24 @@ void AGBCPU::swiSoftReset()
 
     // clear last 512 bytes of IWRAM
     memset(mem.mapAddress(0x3000000 + 0x8000 - 512), 0, 512);
+    mem.invalidateCode(0x3000000 + 0x8000 - 512, 512);
 
-    loReg(Reg::LR) = toRAM ? 0x2000000 : 0x8000000;
+    bankedReg(Reg::LR) = toRAM ? 0x2000000 : 0x8000000;
 
     // reset stack ptrs
-    loReg(Reg::R13) = 0x3007F00;
-    loReg(Reg::R13_svc) = 0x3007FE0;
-    loReg(Reg::R13_irq) = 0x3007FA0;
+    bankedReg(Reg::R13) = 0x3007F00;
+    bankedReg(Reg::R13_svc) = 0x3007FE0;
+    bankedReg(Reg::R13_irq) = 0x3007FA0;
 
     // clear regs
     for(int i = 0; i < 13; i++)
         regs[i] = 0;
 
-    loReg(Reg::R14_irq) = 0;
+    bankedReg(Reg::R14_irq) = 0;
     spsr[1] = 0; // SVC
     spsr[3] = 0; // IRQ
 
+    updateFlags();
     cpsr = 0x1F; // system mode
     modeChanged();
 
@@ -2880,10 +3214,16 @@ void AGBCPU::swiRegisterRAMReset()
     display.writeReg(IO_DISPCNT, DISPCNT_ForceBlank);
 
     if(flags & (1 << 0)) // clear EWRAM
+    {
         memset(mem.mapAddress(0x2000000), 0, 256 * 1024);
+        mem.invalidateCode(0x2000000, 256 * 1024);
+    }
 
     if(flags & (1 << 1)) // clear IWRAM
+    {
         memset(mem.mapAddress(0x3000000), 0, 32 * 1024 - 512);
+        mem.invalidateCode(0x3000000, 32 * 1024 - 512);
+    }
 
     if(flags & (1 << 2)) // clear palette
         memset(mem.getPalRAM(), 0, 1024);
@@ -3066,7 +3406,7 @@ uint32_t AGBCPU::swiArcTan2()
     return 0xC000 - swiArcTan((x << 14) / y);
 }
 
-void AGBCPU::swiCPUSet()
+void AGBCPU::swiCPUSet(int &cycles)
 {
     auto src = regs[0];
     auto dst = regs[1];
@@ -3086,8 +3426,33 @@ void AGBCPU::swiCPUSet()
     if(isWords && dst < 0xE000000)
         dst &= ~3;
 
-    int cycles = 0; // TODO
+    int width = isWords ? 4 : 2;
+
+    // copy directly if both are plain memory
+    if(count && !((src | dst) & (width - 1)))
+    {
+        int dmaCycles = 0; // not the timing we want
+        uint32_t lastVal;
+
+        bool copied = isWords ? mem.dmaCopy<uint32_t>(src, dst, count, isFill, dmaCycles, false, lastVal)
+                              : mem.dmaCopy<uint16_t>(src, dst, count, isFill, dmaCycles, false, lastVal);
+
+        if(copied)
+        {
+            // same as the loops below
+            int srcCycles = mem.getAccessCycles(src, width, false);
+            int dstCycles = mem.getAccessCycles(dst, width, false);
+
+            if(isFill)
+                cycles += srcCycles + count * (dstCycles + 5);
+            else
+                cycles += count * (srcCycles + dstCycles + 7);
+
+            return;
+        }
+    }
 
+    // each loop is ldr/str/cmp/b running from the BIOS
     if(isFill)
     {
         if(isWords)
@@ -3097,6 +3462,7 @@ void AGBCPU::swiCPUSet()
             {
                 writeMem32(dst, val, cycles);
                 dst += 4;
+                cycles += 5;
             }
         }
         else
@@ -3106,6 +3472,7 @@ void AGBCPU::swiCPUSet()
             {
                 writeMem16(dst, val, cycles);
                 dst += 2;
+                cycles += 5;
             }
         }
     }
@@ -3118,6 +3485,7 @@ void AGBCPU::swiCPUSet()
                 writeMem32(dst, readMem32(src, cycles), cycles);
                 src += 4;
                 dst += 4;
+                cycles += 7;
             }
         }
         else
@@ -3127,20 +3495,19 @@ void AGBCPU::swiCPUSet()
                 writeMem16(dst, readMem16(src, cycles), cycles);
                 src += 2;
                 dst += 2;
+                cycles += 7;
             }
         }
     }
 }
 
-void AGBCPU::swiCPUFastSet()
+void AGBCPU::swiCPUFastSet(int &cycles)
 {
     auto src = regs[0];
     auto dst = regs[1];
     auto count = regs[2] & 0x1FFFFF;
     bool isFill = regs[2] & (1 << 24);
 
-    int cycles = 0; // TODO
-
     // force to multiple of 8
     count = (count + 7) & ~7;
 
@@ -3155,20 +3522,48 @@ void AGBCPU::swiCPUFastSet()
     if(dst < 0xE000000)
         dst &= ~3;
 
+    // copy directly if both are plain memory
+    if(count && !((src | dst) & 3))
+    {
+        int dmaCycles = 0;
+        uint32_t lastVal;
+
+        if(mem.dmaCopy<uint32_t>(src, dst, count, isFill, dmaCycles, false, lastVal))
+        {
+            // same as the loops below
+            int srcN = mem.getAccessCycles(src, 4, false), srcS = mem.getAccessCycles(src, 4, true);
+            int dstN = mem.getAccessCycles(dst, 4, false), dstS = mem.getAccessCycles(dst, 4, true);
+
+            if(isFill)
+                cycles += srcN + (count / 8) * (dstN + dstS * 7 + 5);
+            else
+                cycles += (count / 8) * (srcN + srcS * 7 + dstN + dstS * 7 + 7);
+
+            return;
+        }
+    }
+
+    // copies 8 words at a time with ldm/stm
     if(isFill)
     {
         auto val = readMem32(src, cycles);
-        while(count--)
+        for(uint32_t i = 0; i < count; i++)
         {
-            writeMem32(dst, val, cycles);
+            if(!(i & 7))
+                cycles += 5;
+
+            writeMem32(dst, val, cycles, i & 7);
             dst += 4;
         }
     }
     else
     {
-        while(count--)
+        for(uint32_t i = 0; i < count; i++)
         {
-            writeMem32(dst, readMem32(src, cycles), cycles);
+            if(!(i & 7))
+                cycles += 7;
+
+            writeMem32(dst, readMem32(src, cycles, i & 7), cycles, i & 7);
             src += 4;
             dst += 4;
         }
@@ -3259,14 +3654,12 @@ void AGBCPU::swiObjAffineSet()
     }
 }
 
-void AGBCPU::swiBitUnpack()
+void AGBCPU::swiBitUnpack(int &cycles)
 {
     auto src = regs[0];
     auto dst = regs[1];
     auto infoPtr = regs[2];
 
-    int cycles = 0; // TODO
-
     int len = readMem16(infoPtr, cycles);
     int srcWidth = readMem8(infoPtr + 2, cycles);
     int dstWidth = readMem8(infoPtr + 3, cycles);
@@ -3274,12 +3667,32 @@ void AGBCPU::swiBitUnpack()
     bool zeroFlag = offset & (1 << 31);
     offset &= ~(1 << 31);
 
+    // access memory directly where possible
+    auto srcStart = src, dstStart = dst;
+    auto srcPtr = std::as_const(mem).mapAddress(src);
+    auto srcSize = mem.getContiguousSize(src);
+    auto dstPtr = mem.mapAddress(dst);
+    auto dstSize = dstPtr && !(dst & 3) ? mem.getContiguousSize(dst) : 0;
+
+    int srcCycles = mem.getAccessCycles(src, 1, false);
+    int dstCycles = mem.getAccessCycles(dst, 4, false);
+
     uint32_t outData = 0;
     int outBits = 0;
 
     for(int i = 0; i < len; i++)
     {
-        uint8_t byte = readMem8(src++, cycles);
+        uint8_t byte;
+        if(src - srcStart < srcSize)
+        {
+            byte = srcPtr[src - srcStart];
+            cycles += srcCycles;
+        }
+        else
+            byte = readMem8(src, cycles);
+
+        src++;
+        cycles += 4;
 
         for(int bit = 0; bit < 8; bit += srcWidth)
         {
@@ -3293,30 +3706,61 @@ void AGBCPU::swiBitUnpack()
             // append to output data
             outData |= val << outBits;
             outBits += dstWidth;
+            cycles += 6;
 
             // write when we have a word
             if(outBits == 32)
             {
-                writeMem32(dst, outData, cycles);
+                if(dst - dstStart < dstSize)
+                {
+                    *reinterpret_cast<uint32_t *>(dstPtr + (dst - dstStart)) = outData;
+                    cycles += dstCycles;
+                }
+                else
+                    writeMem32(dst, outData, cycles);
+
                 dst += 4;
                 outData = 0;
                 outBits = 0;
+                cycles++;
             }
         }
     }
+
+    if(dstSize)
+        mem.invalidateCode(dstStart, std::min(dst - dstStart, dstSize));
 }
 
-void AGBCPU::swiLZ77Write8()
+void AGBCPU::swiLZ77Write8(int &cycles)
 {
     auto src = regs[0];
     auto dst = regs[1];
 
-    int cycles = 0; // TODO
-
     auto header = readMem32(src, cycles);
     src += 4;
     auto decompressedSize = header >> 8;
 
+    // access memory directly where possible, byte writes to video memory are special
+    auto srcStart = src, dstStart = dst;
+    auto srcPtr = std::as_const(mem).mapAddress(src);
+    auto srcSize = mem.getContiguousSize(src);
+    auto dstPtr = mem.mapAddress(dst);
+    auto dstSize = dstPtr && (dst >> 24) < 5 ? mem.getContiguousSize(dst) : 0;
+
+    int srcCycles = mem.getAccessCycles(src, 1, false);
+    int dstCycles = mem.getAccessCycles(dst, 1, false);
+
+    auto readSrc = [&]() -> uint8_t
+    {
+        if(src - srcStart < srcSize)
+        {
+            cycles += srcCycles;
+            return srcPtr[src++ - srcStart];
+        }
+
+        return readMem8(src++, cycles);
+    };
+
     int flags = 0;
     int flagBits = 0;
 
@@ -3326,108 +3770,192 @@ void AGBCPU::swiLZ77Write8()
     {
         if(!flagBits)
         {
-            flags = readMem8(src++, cycles);
+            flags = readSrc();
             flagBits = 8;
+            cycles += 3;
         }
 
-        auto b = readMem8(src++, cycles);
+        auto b = readSrc();
 
         if(flags & 0x80)
         {
             auto count = (b >> 4) + 3;
-            auto disp = (b & 0xF) << 8 | readMem8(src++, cycles);
+            auto disp = (b & 0xF) << 8 | readSrc();
 
             auto off = dst - disp - 1;
+            cycles += 8;
+
+            for(int j = 0; j < count; j++, off++, dst++)
+            {
+                if(off - dstStart < dstSize && dst - dstStart < dstSize)
+                {
+                    dstPtr[dst - dstStart] = dstPtr[off - dstStart];
+                    cycles += dstCycles * 2;
+                }
+                else
+                    writeMem8(dst, readMem8(off, cycles), cycles);
 
-            for(int j = 0; j < count; j++)
-                writeMem8(dst++, readMem8(off++, cycles), cycles);
+                cycles += 7;
+            }
         }
         else
-            writeMem8(dst++, b, cycles);
+        {
+            if(dst - dstStart < dstSize)
+            {
+                dstPtr[dst - dstStart] = b;
+                cycles += dstCycles;
+            }
+            else
+                writeMem8(dst, b, cycles);
+
+            dst++;
+            cycles += 8;
+        }
 
         flagBits--;
         flags <<= 1;
     }
+
+    if(dstSize)
+        mem.invalidateCode(dstStart, std::min(dst - dstStart, dstSize));
 }
 
-void AGBCPU::swiLZ77Write16()
+void AGBCPU::swiLZ77Write16(int &cycles)
 {
     auto src = regs[0];
     auto dst = regs[1];
 
-    int cycles = 0; // TODO
-
     auto header = readMem32(src, cycles);
     src += 4;
     auto decompressedSize = header >> 8;
 
-    int flags = 0;
-    int flagBits = 0;
+    // access memory directly where possible
+    auto srcStart = src, dstStart = dst;
+    auto srcPtr = std::as_const(mem).mapAddress(src);
+    auto srcSize = mem.getContiguousSize(src);
+    auto dstPtr = mem.mapAddress(dst);
+    auto dstSize = dstPtr && !(dst & 1) ? mem.getContiguousSize(dst) : 0;
 
-    // save byte to write 16-bits
+    int srcCycles = mem.getAccessCycles(src, 1, false);
+    int dstReadCycles = mem.getAccessCycles(dst, 1, false);
+    int dstWriteCycles = mem.getAccessCycles(dst, 2, false);
+
+    auto readSrc = [&]() -> uint8_t
+    {
+        if(src - srcStart < srcSize)
+        {
+            cycles += srcCycles;
+            return srcPtr[src++ - srcStart];
+        }
+
+        return readMem8(src++, cycles);
+    };
+
+    int flags = 0;
+    int flagBits = 0;
+
+    // save byte to write 16-bits
     bool low = true;
     uint8_t savedByte;
 
+    auto writeByte = [&](uint8_t b)
+    {
+        if(low)
+            savedByte = b;
+        else if(dst - 1 - dstStart < dstSize)
+        {
+            *reinterpret_cast<uint16_t *>(dstPtr + (dst - 1 - dstStart)) = b << 8 | savedByte;
+            cycles += dstWriteCycles;
+        }
+        else
+            writeMem16(dst - 1, b << 8 | savedByte, cycles);
+
+        dst++;
+        low = !low;
+    };
+
     auto dstEnd = dst + decompressedSize;
 
     while(dst < dstEnd)
     {
         if(!flagBits)
         {
-            flags = readMem8(src++, cycles);
+            flags = readSrc();
             flagBits = 8;
+            cycles += 3;
         }
 
-        auto b = readMem8(src++, cycles);
+        auto b = readSrc();
 
         if(flags & 0x80)
         {
             auto count = (b >> 4) + 3;
-            auto disp = (b & 0xF) << 8 | readMem8(src++, cycles);
+            auto disp = (b & 0xF) << 8 | readSrc();
 
             auto off = dst - disp - 1;
+            cycles += 8;
 
-            for(int j = 0; j < count; j++)
+            for(int j = 0; j < count; j++, off++)
             {
-                b = readMem8(off++, cycles);
-                if(low)
-                    savedByte = b;
+                if(off - dstStart < dstSize)
+                {
+                    b = dstPtr[off - dstStart];
+                    cycles += dstReadCycles;
+                }
                 else
-                    writeMem16(dst - 1, b << 8 | savedByte, cycles);
+                    b = readMem8(off, cycles);
 
-                dst++;
-                low = !low;
+                writeByte(b);
+                cycles += 8;
             }
         }
         else
         {
-            if(low)
-                savedByte = b;
-            else
-                writeMem16(dst - 1, b << 8 | savedByte, cycles);
-
-            dst++;
-            low = !low;
+            writeByte(b);
+            cycles += 9;
         }
 
         flagBits--;
         flags <<= 1;
     }
+
+    if(dstSize)
+        mem.invalidateCode(dstStart, std::min(dst - dstStart, dstSize));
 }
 
-void AGBCPU::swiHuffmanDecode()
+void AGBCPU::swiHuffmanDecode(int &cycles)
 {
     auto src = regs[0];
     auto dst = regs[1];
 
-    int cycles = 0; // TODO
-
     auto header = readMem32(src, cycles);
     src += 4;
     auto dataBits = header & 0xF;
     auto decompressedSize = header >> 8;
 
-    int treeSize = (readMem8(src++, cycles) + 1) * 2;
+    // access memory directly where possible (tree and data are both after the header)
+    auto srcStart = src, dstStart = dst;
+    auto srcPtr = std::as_const(mem).mapAddress(src);
+    auto srcSize = mem.getContiguousSize(src);
+    auto dstPtr = mem.mapAddress(dst);
+    auto dstSize = dstPtr && !(dst & 3) ? mem.getContiguousSize(dst) : 0;
+
+    int srcCycles8 = mem.getAccessCycles(src, 1, false);
+    int srcCycles32 = mem.getAccessCycles(src, 4, false);
+    int dstCycles = mem.getAccessCycles(dst, 4, false);
+
+    auto readSrc8 = [&](uint32_t addr) -> uint8_t
+    {
+        if(addr - srcStart < srcSize)
+        {
+            cycles += srcCycles8;
+            return srcPtr[addr - srcStart];
+        }
+
+        return readMem8(addr, cycles);
+    };
+
+    int treeSize = (readSrc8(src++) + 1) * 2;
     auto treeAddr = src;
 
     src += treeSize - 1; // skip tree
@@ -3442,12 +3970,23 @@ void AGBCPU::swiHuffmanDecode()
 
     while(dst < dstEnd)
     {
-        uint32_t bits = readMem32(src, cycles);
+        uint32_t bits;
+
+        // unaligned reads rotate
+        if(!(src & 3) && src - srcStart < srcSize && srcSize - (src - srcStart) >= 4)
+        {
+            bits = *reinterpret_cast<const uint32_t *>(srcPtr + (src - srcStart));
+            cycles += srcCycles32;
+        }
+        else
+            bits = readMem32(src, cycles);
+
         src += 4;
+        cycles += 3;
 
         for(int i = 0; i < 32; i++, bits <<= 1)
         {
-            auto node = readMem8(ptr, cycles);
+            auto node = readSrc8(ptr);
 
             // get offset to child
             ptr = (ptr & ~1) + ((node & 0x3F) + 1) * 2;
@@ -3461,23 +4000,34 @@ void AGBCPU::swiHuffmanDecode()
             else
                 isLeaf = node & (1 << 7);
 
+            cycles += 7;
+
             if(isLeaf)
             {
-                node = readMem8(ptr, cycles);
+                node = readSrc8(ptr);
                 assert(!(node & (0xFF << dataBits))); // unused high bits should be 0
 
                 // add data bits
                 outData |= node << outBits;
                 outBits += dataBits;
+                cycles += 5;
 
                 // write when we have a word
                 if(outBits == 32)
                 {
-                    writeMem32(dst, outData, cycles);
+                    if(dst - dstStart < dstSize)
+                    {
+                        *reinterpret_cast<uint32_t *>(dstPtr + (dst - dstStart)) = outData;
+                        cycles += dstCycles;
+                    }
+                    else
+                        writeMem32(dst, outData, cycles);
+
                     dst += 4;
 
                     outBits = 0;
                     outData = 0;
+                    cycles++;
                 }
 
                 // back to root
@@ -3485,4 +4035,608 @@ void AGBCPU::swiHuffmanDecode()
             }
         }
     }
-}
\ No newline at end of file
+
+    if(dstSize)
+        mem.invalidateCode(dstStart, std::min(dst - dstStart, dstSize));
+}
+
+void AGBCPU::swiRLUncomp(bool write16, int &cycles)
+{
+    auto src = regs[0];
+    auto dst = regs[1];
+
+    auto header = readMem32(src, cycles);
+    src += 4;
+    auto decompressedSize = header >> 8;
+
+    // access memory directly where possible, byte writes to video memory are special
+    auto srcStart = src, dstStart = dst;
+    auto srcPtr = std::as_const(mem).mapAddress(src);
+    auto srcSize = mem.getContiguousSize(src);
+    auto dstPtr = mem.mapAddress(dst);
+    auto dstSize = dstPtr && (write16 ? !(dst & 1) : (dst >> 24) < 5) ? mem.getContiguousSize(dst) : 0;
+
+    int srcCycles = mem.getAccessCycles(src, 1, false);
+    int dstCycles = mem.getAccessCycles(dst, write16 ? 2 : 1, false);
+
+    auto readSrc = [&]() -> uint8_t
+    {
+        if(src - srcStart < srcSize)
+        {
+            cycles += srcCycles;
+            return srcPtr[src++ - srcStart];
+        }
+
+        return readMem8(src++, cycles);
+    };
+
+    // save byte to write 16-bits
+    bool low = true;
+    uint8_t savedByte = 0;
+
+    auto writeByte = [&](uint8_t b)
+    {
+        if(!write16)
+        {
+            if(dst - dstStart < dstSize)
+            {
+                dstPtr[dst - dstStart] = b;
+                cycles += dstCycles;
+            }
+            else
+                writeMem8(dst, b, cycles);
+        }
+        else if(low)
+            savedByte = b;
+        else if(dst - 1 - dstStart < dstSize)
+        {
+            *reinterpret_cast<uint16_t *>(dstPtr + (dst - 1 - dstStart)) = b << 8 | savedByte;
+            cycles += dstCycles;
+        }
+        else
+            writeMem16(dst - 1, b << 8 | savedByte, cycles);
+
+        dst++;
+        low = !low;
+    };
+
+    auto dstEnd = dst + decompressedSize;
+
+    while(dst < dstEnd)
+    {
+        auto flag = readSrc();
+        int count = flag & 0x7F;
+        cycles += 4;
+
+        if(flag & 0x80)
+        {
+            // run of one byte
+            auto b = readSrc();
+
+            for(int i = 0; i < count + 3; i++)
+            {
+                writeByte(b);
+                cycles += 5;
+            }
+        }
+        else
+        {
+            // uncompressed bytes
+            for(int i = 0; i < count + 1; i++)
+            {
+                writeByte(readSrc());
+                cycles += 7;
+            }
+        }
+    }
+
+    if(dstSize)
+        mem.invalidateCode(dstStart, std::min(dst - dstStart, dstSize));
+}
+
+void AGBCPU::swiDiff8bitUnFilter(bool write16, int &cycles)
+{
+    auto src = regs[0];
+    auto dst = regs[1];
+
+    auto header = readMem32(src, cycles);
+    src += 4;
+    auto size = header >> 8;
+
+    // access memory directly where possible, byte writes to video memory are special
+    auto srcStart = src, dstStart = dst;
+    auto srcPtr = std::as_const(mem).mapAddress(src);
+    auto srcSize = mem.getContiguousSize(src);
+    auto dstPtr = mem.mapAddress(dst);
+    auto dstSize = dstPtr && (write16 ? !(dst & 1) : (dst >> 24) < 5) ? mem.getContiguousSize(dst) : 0;
+
+    int srcCycles = mem.getAccessCycles(src, 1, false);
+    int dstCycles = mem.getAccessCycles(dst, write16 ? 2 : 1, false);
+
+    // save byte to write 16-bits
+    bool low = true;
+    uint8_t savedByte = 0;
+
+    // first byte is the value, the rest are differences
+    uint8_t val = 0;
+
+    for(auto dstEnd = dst + size; dst < dstEnd; dst++, src++)
+    {
+        if(src - srcStart < srcSize)
+        {
+            val += srcPtr[src - srcStart];
+            cycles += srcCycles;
+        }
+        else
+            val += readMem8(src, cycles);
+
+        if(!write16)
+        {
+            if(dst - dstStart < dstSize)
+            {
+                dstPtr[dst - dstStart] = val;
+                cycles += dstCycles;
+            }
+            else
+                writeMem8(dst, val, cycles);
+        }
+        else if(low)
+            savedByte = val;
+        else if(dst - 1 - dstStart < dstSize)
+        {
+            *reinterpret_cast<uint16_t *>(dstPtr + (dst - 1 - dstStart)) = val << 8 | savedByte;
+            cycles += dstCycles;
+        }
+        else
+            writeMem16(dst - 1, val << 8 | savedByte, cycles);
+
+        low = !low;
+        cycles += 6;
+    }
+
+    if(dstSize)
+        mem.invalidateCode(dstStart, std::min(dst - dstStart, dstSize));
+}
+
+void AGBCPU::swiDiff16bitUnFilter(int &cycles)
+{
+    auto src = regs[0];
+    auto dst = regs[1];
+
+    auto header = readMem32(src, cycles);
+    src += 4;
+    auto size = header >> 8;
+
+    // access memory directly where possible
+    auto srcStart = src, dstStart = dst;
+    auto srcPtr = std::as_const(mem).mapAddress(src);
+    auto srcSize = !(src & 1) ? mem.getContiguousSize(src) : 0;
+    auto dstPtr = mem.mapAddress(dst);
+    auto dstSize = dstPtr && !(dst & 1) ? mem.getContiguousSize(dst) : 0;
+
+    int srcCycles = mem.getAccessCycles(src, 2, false);
+    int dstCycles = mem.getAccessCycles(dst, 2, false);
+
+    // first halfword is the value, the rest are differences
+    uint16_t val = 0;
+
+    for(auto dstEnd = dst + size; dst < dstEnd; dst += 2, src += 2)
+    {
+        if(src - srcStart < srcSize)
+        {
+            val += *reinterpret_cast<const uint16_t *>(srcPtr + (src - srcStart));
+            cycles += srcCycles;
+        }
+        else
+            val += readMem16(src, cycles);
+
+        if(dst - dstStart < dstSize)
+        {
+            *reinterpret_cast<uint16_t *>(dstPtr + (dst - dstStart)) = val;
+            cycles += dstCycles;
+        }
+        else
+            writeMem16(dst, val, cycles);
+
+        cycles += 6;
+    }
+
+    if(dstSize)
+        mem.invalidateCode(dstStart, std::min(dst - dstStart, dstSize));
+}
+
+// m4a/MusicPlayer2000 sound driver HLE
+// SoundMain runs the sequencer/CGB channels, then jumps to a mixer in IWRAM (SoundMainRAM) that we replace
+uint32_t AGBCPU::findM4AMixer() const
+{
+    // start of SoundMain, up to setting up its stack frame
+    static const uint16_t soundMain[][2]
+    {
+        {0x4800, 0xFF00}, // ldr r0, =SOUND_INFO_PTR
+        {0x6800, 0xFFFF}, // ldr r0, [r0]
+        {0x4A00, 0xFF00}, // ldr r2, =ID_NUMBER
+        {0x6803, 0xFFFF}, // ldr r3, [r0]
+        {0x429A, 0xFFFF}, // cmp r2, r3
+        {0xD000, 0xFFFF}, // beq
+        {0x4770, 0xFFFF}, // bx lr
+        {0x3301, 0xFFFF}, // adds r3, 1
+        {0x6003, 0xFFFF}, // str r3, [r0]
+        {0xB5F0, 0xFFFF}, // push {r4-r7, lr}
+        {0x4641, 0xFFFF}, // mov r1, r8
+        {0x464A, 0xFFFF}, // mov r2, r9
+        {0x4653, 0xFFFF}, // mov r3, r10
+        {0x465C, 0xFFFF}, // mov r4, r11
+        {0xB41F, 0xFFFF}, // push {r0-r4}
+        {0xB086, 0xFFFF}, // sub sp, 0x18
+    };
+
+    const int sigLen = std::size(soundMain);
+
+    for(uint32_t base = 0x8000000; base < 0xA000000; base += 0x1000000)
+    {
+        auto rom = reinterpret_cast<const uint16_t *>(mem.mapAddress(base));
+        uint32_t len = mem.getContiguousSize(base) / 2;
+
+        for(uint32_t i = 0; i + sigLen < len; i++)
+        {
+            if(rom[i + 1] != soundMain[1][0])
+                continue;
+
+            int matched = 0;
+            while(matched < sigLen && (rom[i + matched] & soundMain[matched][1]) == soundMain[matched][0])
+                matched++;
+
+            if(matched != sigLen)
+                continue;
+
+            // ldr r3, =SoundMainRAM + 1, bx r3
+            for(uint32_t j = i + sigLen; j < i + sigLen + 64 && j + 1 < len; j++)
+            {
+                if((rom[j] & 0xFF00) != 0x4B00 || rom[j + 1] != 0x4718)
+                    continue;
+
+                uint32_t litOff = ((j * 2 + 4) & ~3) + (rom[j] & 0xFF) * 4;
+                if(litOff + 4 > len * 2)
+                    break;
+
+                auto mixerAddr = *reinterpret_cast<const uint32_t *>(reinterpret_cast<const uint8_t *>(rom) + litOff);
+
+                if((mixerAddr >> 24) == 3 && (mixerAddr & 1))
+                    return mixerAddr & ~1;
+
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// returns cycles or 0 if it isn't safe to replace the mixer and the guest code should run
+int AGBCPU::handleM4AMixer()
+{
+    const uint32_t idNumber = 0x68736D53;
+    const uint32_t pcmBufferOffset = 0x350, pcmBufferSize = 0x630; // the mixer has the size hardcoded
+    const uint32_t channelOffset = 0x50, channelSize = 0x40;
+
+    auto read32 = [](const uint8_t *p){return *reinterpret_cast<const uint32_t *>(p);};
+    auto write32 = [](uint8_t *p, uint32_t v){*reinterpret_cast<uint32_t *>(p) = v;};
+
+    // make sure this is the mixer we know, it's copied to RAM by the game
+    auto code = reinterpret_cast<const uint16_t *>(std::as_const(mem).mapAddress(m4aMixerAddr));
+    if(!code || mem.getContiguousSize(m4aMixerAddr) < 10 || code[0] != 0x7943 /*ldrb r3, [r0, reverb]*/ || code[1] != 0x2B00 /*cmp r3, 0*/
+    || (code[2] & 0xFF00) != 0xD000 /*beq*/ || (code[3] & 0xFF00) != 0xA100 /*adr r1*/ || code[4] != 0x4708 /*bx r1*/)
+        return 0;
+
+    // state from SoundMain
+    auto infoAddr = regs[0];
+    auto dmaCounter = regs[4];
+    auto bufAddr = regs[5];
+    auto numSamples = reg(Reg::R8);
+    auto sp = loReg(Reg::SP);
+
+    auto info = mem.mapAddress(infoAddr);
+    auto buf = mem.mapAddress(bufAddr);
+    auto stack = std::as_const(mem).mapAddress(sp);
+
+    if(!info || (infoAddr & 3) || mem.getContiguousSize(infoAddr) < pcmBufferOffset || read32(info) != idNumber + 1)
+        return 0;
+
+    if(regs[6] != pcmBufferSize || !numSamples || numSamples > pcmBufferSize || !buf || mem.getContiguousSize(bufAddr) < pcmBufferSize + numSamples)
+        return 0;
+
+    if(!stack || (sp & 3) || mem.getContiguousSize(sp) < 0x40)
+        return 0;
+
+    auto reverb = info[5];
+    auto prevBuf = dmaCounter == 2 ? info + pcmBufferOffset : buf + numSamples;
+
+    if(reverb && dmaCounter != 2 && mem.getContiguousSize(bufAddr) < pcmBufferSize + numSamples * 2)
+        return 0;
+
+    int maxChans = info[6];
+    if(maxChans > 12)
+        return 0;
+
+    // check that we can handle all the channels before changing anything
+    for(int i = 0; i < maxChans; i++)
+    {
+        auto chan = info + channelOffset + i * channelSize;
+        if(!(chan[0] & 0xC7))
+            continue;
+
+        // compressed/reversed samples aren't supported by this version of the mixer
+        if(chan[1] & 0x30)
+            return 0;
+
+        auto wavAddr = read32(chan + 0x24);
+        auto wav = std::as_const(mem).mapAddress(wavAddr);
+        if(!wav || (wavAddr & 3) || mem.getContiguousSize(wavAddr) < 16)
+            return 0;
+
+        // + 1 for interpolating the last sample
+        auto wavSize = read32(wav + 12);
+        if(wavSize > 0xFFFFFF || mem.getContiguousSize(wavAddr) < 16 + wavSize + 1)
+            return 0;
+
+        // starting resets the pointer
+        if(!(chan[0] & 0x80) && read32(chan + 0x28) - (wavAddr + 16) > wavSize)
+            return 0;
+    }
+
+    // reverb from the previous buffer or clear
+    auto right = buf, left = buf + pcmBufferSize;
+
+    if(reverb)
+    {
+        for(uint32_t i = 0; i < numSamples; i++)
+        {
+            int val = int8_t(left[i]) + int8_t(right[i]) + int8_t(prevBuf[i + pcmBufferSize]) + int8_t(prevBuf[i]);
+            val = (val * reverb) >> 9;
+
+            if(val & 0x80)
+                val++;
+
+            left[i] = right[i] = val;
+        }
+    }
+    else
+    {
+        memset(right, 0, numSamples);
+        memset(left, 0, numSamples);
+    }
+
+    // the mixer gives up if it runs past this line
+    int cycles = 0;
+    int maxLine = read32(stack + 0x14);
+    if(maxLine)
+    {
+        int line = readMem16(0x4000000 | IO_VCOUNT, cycles) & 0xFF;
+        if(line < 160)
+            line += 228;
+
+        if(line >= maxLine)
+            maxChans = 0;
+    }
+
+    // roughly what the guest mixer takes (measured with a reimplementation of it): setup and clearing/reverb...
+    cycles += 320 + (reverb ? numSamples * 28 : numSamples * 5 / 4);
+
+    for(int i = 0; i < maxChans; i++)
+    {
+        auto chan = info + channelOffset + i * channelSize;
+        auto flags = chan[0];
+
+        if(!(flags & 0xC7))
+            continue;
+
+        auto wavAddr = read32(chan + 0x24);
+        auto wav = std::as_const(mem).mapAddress(wavAddr);
+        int env = chan[9];
+        bool attack = false, echo = false;
+
+        if(flags & 0x80)
+        {
+            // start
+            if(flags & 0x40)
+            {
+                chan[0] = 0;
+                continue;
+            }
+
+            flags = 3;
+            write32(chan + 0x28, wavAddr + 16);
+            write32(chan + 0x18, read32(wav + 12));
+            write32(chan + 0x1C, 0);
+            env = 0;
+
+            if(wav[3] & 0xC0)
+                flags |= 0x10; // loop
+
+            attack = true;
+        }
+        else if(flags & 4)
+        {
+            // echo
+            if(--chan[0xD] == 0 || chan[0xD] == 0xFF)
+            {
+                chan[0] = 0;
+                continue;
+            }
+        }
+        else if(flags & 0x40)
+        {
+            // release
+            env = (env * chan[7]) >> 8;
+            echo = env <= chan[0xC];
+        }
+        else if((flags & 3) == 2)
+        {
+            // decay
+            env = (env * chan[5]) >> 8;
+
+            if(env <= chan[6])
+            {
+                env = chan[6];
+
+                if(env)
+                    flags--; // sustain
+                else
+                    echo = true;
+            }
+        }
+        else if((flags & 3) == 3)
+            attack = true;
+
+        if(attack)
+        {
+            env += chan[4];
+            if(env >= 0xFF)
+            {
+                env = 0xFF;
+                flags--; // decay
+            }
+        }
+
+        if(echo)
+        {
+            env = chan[0xC];
+            if(!env)
+            {
+                chan[0] = 0;
+                continue;
+            }
+
+            flags |= 4;
+        }
+
+        chan[0] = flags;
+        chan[9] = env;
+
+        int vol = ((info[7] + 1) * env) >> 4;
+        int rightVol = chan[0xA] = (chan[2] * vol) >> 8;
+        int leftVol = chan[0xB] = (chan[3] * vol) >> 8;
+
+        // ... and each channel, most of it is the per-sample loop
+        cycles += (chan[1] & 8) ? 110 + numSamples * 35 : 140 + numSamples * 43;
+
+        // sample data
+        auto data = wav + 16;
+        int wavSize = read32(wav + 12);
+        int loopStart = read32(wav + 8), loopLen = 0;
+
+        if(flags & 0x10)
+            loopLen = wavSize - loopStart;
+
+        int count = read32(chan + 0x18);
+        int pos = read32(chan + 0x28) - (wavAddr + 16);
+        uint32_t frac = read32(chan + 0x1C); // 9.23 fixed point
+        bool stopped = false;
+
+        if(chan[1] & 8)
+        {
+            // fixed frequency
+            for(uint32_t s = 0; s < numSamples; s++)
+            {
+                if(count <= 0)
+                {
+                    if(loopLen <= 0)
+                    {
+                        stopped = true;
+                        break;
+                    }
+
+                    pos = loopStart;
+                    count = loopLen;
+                }
+
+                int val = int8_t(data[pos++]);
+                count--;
+
+                right[s] += (val * rightVol) >> 8;
+                left[s] += (val * leftVol) >> 8;
+            }
+        }
+        else
+        {
+            uint32_t step = read32(chan + 0x20) * read32(info + 0x18);
+
+            int val0 = int8_t(data[pos]);
+            int delta = int8_t(data[pos + 1]) - val0;
+
+            for(uint32_t s = 0; s < numSamples; s++)
+            {
+                int val = val0 + ((int(frac) * delta) >> 23);
+
+                right[s] += (val * rightVol) >> 8;
+                left[s] += (val * leftVol) >> 8;
+
+                frac += step;
+                int adv = frac >> 23;
+
+                if(!adv)
+                    continue;
+
+                frac &= 0x7FFFFF;
+                count -= adv;
+
+                if(count <= 0)
+                {
+                    if(loopLen <= 0)
+                    {
+                        stopped = true;
+                        break;
+                    }
+
+                    while(count <= 0)
+                        count += loopLen;
+
+                    pos = wavSize - count;
+                }
+                else
+                    pos += adv;
+
+                val0 = int8_t(data[pos]);
+                delta = int8_t(data[pos + 1]) - val0;
+            }
+        }
+
+        if(stopped)
+        {
+            chan[0] = 0;
+            continue;
+        }
+
+        write32(chan + 0x18, count);
+        write32(chan + 0x1C, frac);
+        write32(chan + 0x28, wavAddr + 16 + pos);
+    }
+
+    mem.invalidateCode(infoAddr, pcmBufferOffset);
+    mem.invalidateCode(bufAddr, pcmBufferSize + numSamples);
+
+    // unlock and return from SoundMain
+    write32(info, idNumber);
+
+    for(int i = 0; i < 4; i++)
+        regs[i] = reg(static_cast<Reg>(static_cast<int>(Reg::R8) + i)) = read32(stack + 0x1C + i * 4);
+
+    for(int i = 4; i < 8; i++)
+        regs[i] = read32(stack + 0x2C + (i - 4) * 4);
+
+    auto retAddr = regs[3] = read32(stack + 0x3C);
+    loReg(Reg::SP) = sp + 0x40;
+
+    if(retAddr & 1)
+        updateTHUMBPC(retAddr & ~1);
+    else
+    {
+        cpsr &= ~Flag_T;
+        updateARMPC(retAddr & ~3);
+    }
+
+    // stall for the estimate like a HLE BIOS call, so that timing-dependent code doesn't run ahead
+    biosCycles = cycles;
+
+    return pcSCycles * 2 + pcNCycles;
+}
@@ -1,9 +1,13 @@
 #pragma once
+#include <array>
 #include <cstdint>
+#include <utility>
 
 #include "AGBAPU.h"
 #include "AGBDisplay.h"
+#include "AGBJIT.h"
 #include "AGBMemory.h"
+#include "Scheduler.h"
 
 class AGBCPU final
 {
@@ -34,14 +38,39 @@ public:
         Trig_SoundB
     };
 
+    enum class ExecMode
+    {
+        Interpreter, // one instruction at a time
+        Cached,      // predecoded blocks
+        JIT          // blocks translated to native code, same as Cached if unsupported
+    };
+
+    struct IdleLoopStats
+    {
+        uint64_t cyclesRun;     // since reset
+        uint64_t cyclesSkipped; // not executed because the CPU was polling something that couldn't change yet
+        uint32_t loopsSkipped;
+    };
+
     AGBCPU();
 
     void reset();
 
+    void setExecMode(ExecMode mode);
+    ExecMode getExecMode() const {return execMode;}
+
+    // skipping idle loops needs the block cache, so does nothing in the interpreter
+    void setIdleLoopSkip(bool enabled) {idleLoopSkip = enabled;}
+    const IdleLoopStats &getIdleLoopStats() const {return idleLoopStats;}
+
+    // replaces the mixer of the m4a/MusicPlayer2000 sound driver with a native one, the ROM is checked for it on reset
+    void setM4AMixerHLE(bool enabled) {m4aMixerHLE = enabled;}
+    bool isM4AMixerReplaced() const {return m4aMixerAddr != 0;} // enabled and found on the last reset
+
     void run(int ms);
     void runFrame();
 
-    void flagInterrupt(int interrupt, bool recalculateUpdate = true);
+    void flagInterrupt(int interrupt);
     void triggerDMA(int trigger);
 
     uint16_t readReg(uint32_t addr, uint16_t val);
@@ -56,6 +85,8 @@ public:
     void setInputs(uint16_t newInputs);
 
 private:
+    friend class AGBJIT;
+
     enum class Reg
     {
         R0 = 0,
@@ -117,24 +148,166 @@ private:
         Flag_N = (1 << 31)
     };
 
-    Reg mapReg(Reg r) const
+#ifndef AGB_EAGER_FLAGS
+    // op that last set the condition flags, they're only written to cpsr when needed
+    enum class FlagOp : uint8_t
+    {
+        None = 0, // cpsr is up to date
+        Logical,  // N/Z from the result, C saved, V in cpsr
+        Add,
+        Sub
+    };
+#endif
+
+    // the current mode's banked registers are swapped into R8-R14 by modeChanged
+    uint32_t reg(Reg r) const {return regs[static_cast<int>(r)];}
+    uint32_t &reg(Reg r) {return regs[static_cast<int>(r)];}
+
+    // THUMB, first 8 regs
+    uint32_t loReg(Reg r) const {return regs[static_cast<int>(r)];}
+    uint32_t &loReg(Reg r) {return regs[static_cast<int>(r)];}
+
+    // register of a specific mode (R8-R14 are the user/system ones), wherever it currently is
+    uint32_t &bankedReg(Reg r)
     {
         int iReg = static_cast<int>(r);
-        if(!regBankOffset || iReg < 8 || r == Reg::PC)
-            return r;
 
-        if(regBankOffset != 8/*FIQ*/ && iReg < 13)
-            return r;
+        if(regBankOffset)
+        {
+            int firstBanked = regBankOffset == 8/*FIQ*/ ? 8 : 13;
+
+            if(iReg >= firstBanked && iReg < 15) // swapped out
+                iReg += regBankOffset;
+            else if(iReg - regBankOffset >= firstBanked && iReg - regBankOffset < 15) // swapped in
+                iReg -= regBankOffset;
+        }
 
-        return static_cast<Reg>(iReg + regBankOffset);
+        return regs[iReg];
     }
 
-    uint32_t reg(Reg r) const {return regs[static_cast<int>(mapReg(r))];}
-    uint32_t &reg(Reg r) {return regs[static_cast<int>(mapReg(r))];}
+    // condition flags, written to cpsr as they're set
+    // (build without AGB_EAGER_FLAGS to record the last op and compute them when read instead)
+#ifdef AGB_EAGER_FLAGS
+    void setLogicalFlags(uint32_t res, bool carry)
+    {
+        cpsr = (cpsr & ~(Flag_N | Flag_Z | Flag_C)) | (res & signBit) | (res == 0 ? Flag_Z : 0) | (carry ? Flag_C : 0);
+    }
 
-    // THUMB, first 8 regs, also used when we don't want to map
-    uint32_t loReg(Reg r) const {return regs[static_cast<int>(r)];}
-    uint32_t &loReg(Reg r) {return regs[static_cast<int>(r)];}
+    void setNZFlags(uint32_t res)
+    {
+        cpsr = (cpsr & ~(Flag_N | Flag_Z)) | (res & signBit) | (res == 0 ? Flag_Z : 0);
+    }
+
+    // carry is the carry in for ADC/SBC, 0 for ADD, 1 for SUB
+    void setAddFlags(uint32_t a, uint32_t b, uint32_t res, bool carry)
+    {
+        bool carryOut = res < a || (res == a && carry);
+        bool overflow = !((a ^ b) & signBit) && ((a ^ res) & signBit);  // same sign and sign changed
+
+        cpsr = (cpsr & 0x0FFFFFFF) | (res & signBit) | (res == 0 ? Flag_Z : 0) | (carryOut ? Flag_C : 0) | (overflow ? Flag_V : 0);
+    }
+
+    void setSubFlags(uint32_t a, uint32_t b, uint32_t res, bool carry)
+    {
+        bool carryOut = !(b > a || (b == a && !carry));
+        bool overflow = ((a ^ b) & signBit) && ((a ^ res) & signBit);  // different sign and sign changed
+
+        cpsr = (cpsr & 0x0FFFFFFF) | (res & signBit) | (res == 0 ? Flag_Z : 0) | (carryOut ? Flag_C : 0) | (overflow ? Flag_V : 0);
+    }
+
+    bool getNegativeFlag() const {return cpsr & Flag_N;}
+    bool getZeroFlag() const {return cpsr & Flag_Z;}
+    bool getCarryFlag() const {return cpsr & Flag_C;}
+    bool getOverflowFlag() const {return cpsr & Flag_V;}
+
+    uint32_t getCPSR() const {return cpsr;}
+
+    void updateFlags() {}
+#else
+    void setLogicalFlags(uint32_t res, bool carry)
+    {
+        // V is unaffected, keep the one from the last add/sub
+        if(lastFlagOp >= FlagOp::Add)
+            cpsr = (cpsr & ~Flag_V) | (getOverflowFlag() ? Flag_V : 0);
+
+        lastFlagOp = FlagOp::Logical;
+        flagRes = res;
+        flagCarry = carry;
+    }
+
+    void setNZFlags(uint32_t res) {setLogicalFlags(res, getCarryFlag());}
+
+    // carry is the carry in for ADC/SBC, 0 for ADD, 1 for SUB
+    void setAddFlags(uint32_t a, uint32_t b, uint32_t res, bool carry)
+    {
+        lastFlagOp = FlagOp::Add;
+        flagOp1 = a;
+        flagOp2 = b;
+        flagRes = res;
+        flagCarry = carry;
+    }
+
+    void setSubFlags(uint32_t a, uint32_t b, uint32_t res, bool carry)
+    {
+        lastFlagOp = FlagOp::Sub;
+        flagOp1 = a;
+        flagOp2 = b;
+        flagRes = res;
+        flagCarry = carry;
+    }
+
+    bool getNegativeFlag() const {return lastFlagOp == FlagOp::None ? cpsr & Flag_N : flagRes & signBit;}
+    bool getZeroFlag() const {return lastFlagOp == FlagOp::None ? cpsr & Flag_Z : flagRes == 0;}
+
+    bool getCarryFlag() const
+    {
+        switch(lastFlagOp)
+        {
+            case FlagOp::None:
+                return cpsr & Flag_C;
+            case FlagOp::Logical:
+                return flagCarry;
+            case FlagOp::Add:
+                return flagRes < flagOp1 || (flagRes == flagOp1 && flagCarry);
+            case FlagOp::Sub:
+                return !(flagOp2 > flagOp1 || (flagOp2 == flagOp1 && !flagCarry));
+        }
+
+        return false;
+    }
+
+    bool getOverflowFlag() const
+    {
+        if(lastFlagOp == FlagOp::Add) // same sign and sign changed
+            return !((flagOp1 ^ flagOp2) & signBit) && ((flagOp1 ^ flagRes) & signBit);
+        if(lastFlagOp == FlagOp::Sub) // different sign and sign changed
+            return ((flagOp1 ^ flagOp2) & signBit) && ((flagOp1 ^ flagRes) & signBit);
+
+        return cpsr & Flag_V;
+    }
+
+    uint32_t getCPSR() const
+    {
+        if(lastFlagOp == FlagOp::None)
+            return cpsr;
+
+        return (cpsr & 0x0FFFFFFF)
+             | (flagRes & signBit)
+             | (flagRes == 0 ? Flag_Z : 0)
+             | (getCarryFlag() ? Flag_C : 0)
+             | (getOverflowFlag() ? Flag_V : 0);
+    }
+
+    // before reading or writing the flags in cpsr directly
+    void updateFlags()
+    {
+        if(lastFlagOp == FlagOp::None)
+            return;
+
+        cpsr = getCPSR();
+        lastFlagOp = FlagOp::None;
+    }
+#endif
 
     uint32_t &getSPSR()
     {
@@ -160,33 +333,54 @@ private:
 
     void modeChanged() // possibly
     {
+        int newOffset = 0;
+
         switch(cpsr & 0x1F)
         {
             case 0x10: // User
             case 0x1F: // System
-                regBankOffset = 0;
+                newOffset = 0;
                 break;
             case 0x11: // FIQ
-                regBankOffset = static_cast<int>(Reg::R8_fiq) - static_cast<int>(Reg::R8);
+                newOffset = static_cast<int>(Reg::R8_fiq) - static_cast<int>(Reg::R8);
                 break;
             case 0x13: // SVC
-                regBankOffset = static_cast<int>(Reg::R13_svc) - static_cast<int>(Reg::R13);
+                newOffset = static_cast<int>(Reg::R13_svc) - static_cast<int>(Reg::R13);
                 break;
             case 0x17: // ABT
-                regBankOffset = static_cast<int>(Reg::R13_abt) - static_cast<int>(Reg::R13);
+                newOffset = static_cast<int>(Reg::R13_abt) - static_cast<int>(Reg::R13);
                 break;
             case 0x12: // IRQ
-                regBankOffset = static_cast<int>(Reg::R13_irq) - static_cast<int>(Reg::R13);
+                newOffset = static_cast<int>(Reg::R13_irq) - static_cast<int>(Reg::R13);
                 break;
             case 0x1B: // UND
-                regBankOffset = static_cast<int>(Reg::R13_und) - static_cast<int>(Reg::R13);
+                newOffset = static_cast<int>(Reg::R13_und) - static_cast<int>(Reg::R13);
                 break;
             default:
                 assert(!"Bad CPSR mode");
         }
 
-        curSP = mapReg(Reg::SP);
-        curLR = mapReg(Reg::LR);
+        if(newOffset != regBankOffset)
+        {
+            swapRegBank(regBankOffset); // swap the old bank back out
+            swapRegBank(newOffset);
+            regBankOffset = newOffset;
+        }
+    }
+
+    void swapRegBank(int offset)
+    {
+        // constant counts so that these can be unrolled
+        if(offset == 8/*FIQ*/)
+        {
+            for(int i = 8; i < 15; i++)
+                std::swap(regs[i], regs[i + 8]);
+        }
+        else if(offset)
+        {
+            std::swap(regs[13], regs[13 + offset]);
+            std::swap(regs[14], regs[14 + offset]);
+        }
     }
 
     uint8_t readMem8(uint32_t addr, int &cycles, bool sequential = false) const;
@@ -203,38 +397,95 @@ private:
     int executeARMInstruction();
     int executeTHUMBInstruction();
 
-    bool checkARMCondition(int cond) const;
+    struct CodeBlock;
 
+    template<bool isThumb>
+    int executeBlock(int &cycles);
+    CodeBlock *getCodeBlock(uint32_t addr, bool isThumb);
+    int getIdleLoopSkipCycles(uint32_t cycleCount, int iterationCycles, int cycles);
+
+    bool checkARMCondition(int cond);
+
+    // ARM handlers, indexed by bits 20-27 and 4-7 of the opcode
+    using ARMHandler = int(AGBCPU::*)(uint32_t opcode);
+
+    template<int i>
+    static constexpr ARMHandler getARMHandler();
+    template<size_t... i>
+    static constexpr std::array<ARMHandler, 4096> makeARMTable(std::index_sequence<i...>);
+
+    template<int shiftType, bool byReg>
     uint32_t getARMShiftedReg(uint16_t shift, bool &carry);
-    int doARMHalfwordTransfer(uint32_t opcode, bool isPre);
+    template<int instOp, bool setCondCode, bool isImm, int shiftType, bool byReg>
+    int doARMDataProcessing(uint32_t opcode);
+    template<bool isPre, bool isUp, bool isImm, bool writeBack, bool isLoad, int sh>
+    int doARMHalfwordTransfer(uint32_t opcode);
+    template<bool isLong, bool isSigned, bool accumulate, bool setCondCode>
     int doARMMultiply(uint32_t opcode);
+    template<bool isByte>
     int doARMSwap(uint32_t opcode);
-    int doARMPSRTransfer(uint32_t opcode, uint32_t op2 = 0);
-    int doARMSingleDataTransfer(uint32_t opcode, bool isReg, bool isPre);
-    int doARMBlockDataTransfer(uint32_t opcode, bool isPre);
-
-    int doALUOp(int op, Reg destReg, uint32_t op1, uint32_t op2, bool carry);
-    int doALUOpNoCond(int op, Reg destReg, uint32_t op1, uint32_t op2);
-
+    template<bool isImm, bool isSPSR, bool isMSR>
+    int doARMPSRTransfer(uint32_t opcode);
+    int doARMBranchExchange(uint32_t opcode);
+    template<bool isReg, bool isPre, bool isUp, bool isByte, bool writeBack, bool isLoad, int shiftType>
+    int doARMSingleDataTransfer(uint32_t opcode);
+    template<bool isPre, bool isUp, bool isLoadForce, bool writeBack, bool isLoad>
+    int doARMBlockDataTransfer(uint32_t opcode);
+    template<bool link>
+    int doARMBranch(uint32_t opcode);
+    int doARMSWI(uint32_t opcode);
+    int doARMUndefined(uint32_t opcode);
+
+    template<int op>
+    int doALUOp(Reg destReg, uint32_t op1, uint32_t op2, bool carry);
+    template<int op>
+    int doALUOpNoCond(Reg destReg, uint32_t op1, uint32_t op2);
+
+    // THUMB handlers, indexed by bits 6-15 of the opcode
+    using THUMBHandler = int(AGBCPU::*)(uint16_t opcode, uint32_t pc);
+
+    template<int i>
+    static constexpr THUMBHandler getTHUMBHandler();
+    template<size_t... i>
+    static constexpr std::array<THUMBHandler, 1024> makeTHUMBTable(std::index_sequence<i...>);
+
+    template<int instOp, int offset>
     int doTHUMB01MoveShifted(uint16_t opcode, uint32_t pc);
-    int doTHUMB0102(uint16_t opcode, uint32_t pc);
+    template<bool isImm, bool isSub, int op2Val>
+    int doTHUMB02AddSub(uint16_t opcode, uint32_t pc);
+    template<int instOp, Reg dstReg>
     int doTHUMB03(uint16_t opcode, uint32_t pc);
-    int doTHUMB040506(uint16_t opcode, uint32_t pc);
+    template<int instOp>
     int doTHUMB04ALU(uint16_t opcode, uint32_t pc);
+    template<int op, bool h1, bool h2>
     int doTHUMB05HiReg(uint16_t opcode, uint32_t pc);
+    template<Reg dstReg>
     int doTHUMB06PCRelLoad(uint16_t opcode, uint32_t pc);
-    int doTHUMB0708(uint16_t opcode, uint32_t pc);
+    template<bool isLoad, bool isByte, Reg offReg>
+    int doTHUMB07LoadStoreReg(uint16_t opcode, uint32_t pc);
+    template<bool hFlag, bool signEx, Reg offReg>
+    int doTHUMB08LoadStoreSignEx(uint16_t opcode, uint32_t pc);
+    template<bool isLoad, int offset>
     int doTHUMB09LoadStoreWord(uint16_t opcode, uint32_t pc);
+    template<bool isLoad, int offset>
     int doTHUMB09LoadStoreByte(uint16_t opcode, uint32_t pc);
+    template<bool isLoad, int offset>
     int doTHUMB10LoadStoreHalf(uint16_t opcode, uint32_t pc);
+    template<bool isLoad, Reg dstReg>
     int doTHUMB11SPRelLoadStore(uint16_t opcode, uint32_t pc);
+    template<bool isSP, Reg dstReg>
     int doTHUMB12LoadAddr(uint16_t opcode, uint32_t pc);
-    int doTHUMB1314(uint16_t opcode, uint32_t pc);
+    template<bool isNeg>
     int doTHUMB13SPOffset(uint16_t opcode, uint32_t pc);
+    template<bool isLoad, bool pclr>
     int doTHUMB14PushPop(uint16_t opcode, uint32_t pc);
+    template<bool isLoad, Reg baseReg>
     int doTHUMB15MultiLoadStore(uint16_t opcode, uint32_t pc);
-    int doTHUMB1617(uint16_t opcode, uint32_t pc);
+    template<int cond>
+    int doTHUMB16CondBranch(uint16_t opcode, uint32_t pc);
+    int doTHUMB17SWI(uint16_t opcode, uint32_t pc);
     int doTHUMB18UncondBranch(uint16_t opcode, uint32_t pc);
+    template<bool high>
     int doTHUMB19LongBranchLink(uint16_t opcode, uint32_t pc);
 
     void updateARMPC(uint32_t pc);
@@ -247,7 +498,10 @@ private:
     void updateTimers();
     void calculateNextTimerOverflow(uint32_t cycleCount);
 
-    void calculateNextUpdate(uint32_t cycleCount);
+    void runEvents();
+    void scheduleDisplayUpdate();
+    void scheduleInterruptDelay();
+    void updateNextUpdateCycle();
 
     void handleBIOSBranch(uint32_t pc);
     void handleSWI(int num);
@@ -258,14 +512,24 @@ private:
     void swiDiv();
     uint32_t swiArcTan(int tan);
     uint32_t swiArcTan2();
-    void swiCPUSet();
-    void swiCPUFastSet();
+    void swiCPUSet(int &cycles);
+    void swiCPUFastSet(int &cycles);
     void swiBgAffineSet();
     void swiObjAffineSet();
-    void swiBitUnpack();
-    void swiLZ77Write8();
-    void swiLZ77Write16();
-    void swiHuffmanDecode();
+    void swiBitUnpack(int &cycles);
+    void swiLZ77Write8(int &cycles);
+    void swiLZ77Write16(int &cycles);
+    void swiHuffmanDecode(int &cycles);
+    void swiRLUncomp(bool write16, int &cycles);
+    void swiDiff8bitUnFilter(bool write16, int &cycles);
+    void swiDiff16bitUnFilter(int &cycles);
+
+    uint32_t findM4AMixer() const;
+    int handleM4AMixer();
+
+    static const std::array<ARMHandler, 4096> armTable;
+    static const std::array<THUMBHandler, 1024> thumbTable; // for the block cache/JIT, the interpreter switches on the same index
+    static const std::array<uint16_t, 16> armConditionTable;
 
     static const uint32_t clockSpeed = 16*1024*1024;
     static const uint32_t signBit = 0x80000000;
@@ -275,8 +539,13 @@ private:
     uint32_t cpsr;
     uint32_t spsr[6]; // fiq, svc, abt, irq, und
 
-    Reg curSP = Reg::SP, curLR = Reg::LR;
-    int regBankOffset = 0;
+#ifndef AGB_EAGER_FLAGS
+    FlagOp lastFlagOp = FlagOp::None;
+    bool flagCarry = false; // out for Logical, in for Add/Sub
+    uint32_t flagOp1 = 0, flagOp2 = 0, flagRes = 0;
+#endif
+
+    int regBankOffset = 0; // of the registers swapped into R8-R14
 
     const uint8_t *pcPtr = nullptr;
     int pcSCycles = 0, pcNCycles = 0;
@@ -284,10 +553,50 @@ private:
     // pipeline
     uint32_t fetchOp = 0, decodeOp = 0;
 
+    // block cache, decoded runs of instructions
+    static constexpr int maxBlockOps = 16;
+    static const int numCodeBlocks = 2048;
+    static const int jitThreshold = 4; // times a block runs before it's translated
+
+    struct CachedOp
+    {
+        union
+        {
+            ARMHandler arm;
+            THUMBHandler thumb;
+        };
+        uint32_t opcode;
+    };
+
+    struct CodeBlock
+    {
+        uint32_t addr = ~0u; // bit 0 set for THUMB
+        const uint32_t *version; // from AGBMemory::getCodePageVersion
+        uint32_t builtVersion;
+        int numOps;
+        AGBJIT::BlockFunc jitCode = nullptr;
+        uint8_t jitHits;
+        bool idleLoop; // branches back to the start and doesn't write anything
+        CachedOp ops[maxBlockOps + 2]; // last two are the following ops, for refilling the pipeline
+    };
+
+    CodeBlock codeBlocks[numCodeBlocks];
+
+    ExecMode execMode = ExecMode::Cached;
+    AGBJIT jit;
+
+    bool idleLoopSkip = true;
+    bool idleLoopReadsOk = false; // cleared by reading a register that can change outside of an event
+    IdleLoopStats idleLoopStats{};
+
+    bool m4aMixerHLE = false;
+    uint32_t m4aMixerAddr = 0; // where SoundMain jumps to in IWRAM, 0 if not found
+
     // internal state
     //bool stopped, halted;
     bool halted;
     uint16_t swiWaitFlags = 0; // interrupt flags for IntrWait
+    int biosCycles = 0; // remaining time for the last HLE BIOS call or m4a mixer, the CPU is stalled until it's done
 
     uint16_t currentInterrupts = 0; // IME ? (IE & IF) : 0
     uint16_t enabledInterrutps = 0;
@@ -304,7 +613,23 @@ private:
     uint32_t cycleCount = 0;
     int lastExtraCycles = 0; // used to keep runFrame in sync
 
-    uint32_t nextUpdateCycle = 0; // next cycle where something needs updated
+    // events that need handling at a specific cycle
+    // timers are first so that they're updated before the display if both are at the same cycle
+    enum class Event
+    {
+        Timer0 = 0, // overflows, not scheduled for count-up timers
+        Timer1,
+        Timer2,
+        Timer3,
+        Display, // next mode change, only while display interrupts are enabled
+        InterruptDelay,
+
+        Count
+    };
+
+    Scheduler<Event, static_cast<int>(Event::Count)> scheduler;
+
+    uint32_t nextUpdateCycle = 0; // next cycle where something needs updated, cached from the scheduler
 
     // timers
     uint32_t lastTimerUpdate = 0;
@@ -1224,7 +1224,7 @@ void AGBDisplay::drawScanLine(int y)
     // get enabled layers for window
     // (avoid some work for lines outside the window)
     const int anyWindowEnabled = DISPCNT_Window0On | DISPCNT_Window1On | DISPCNT_OBJWindowOn;
-    uint16_t winIn, winOut;
+    uint16_t winIn = 0, winOut = 0;
     uint16_t win0h = 0, win1h = 0;
     if(dispControl & anyWindowEnabled)
     {
@@ -1254,10 +1254,11 @@ void AGBDisplay::drawScanLine(int y)
 
     // draw sprites first
     int spritePriorities;
+    memset(objMask, 0, screenWidth); // read when compositing even if there are no objects
+
     if(layerEnables & Layer_OBJ)
     {
         memset(objData[0], 0, screenWidth * 2);
-        memset(objMask, 0, screenWidth);
 
         if(dispControl & DISPCNT_OBJWindowOn)
             memset(objData[4], 0, screenWidth * 2);
@@ -1345,7 +1346,7 @@ void AGBDisplay::drawScanLine(int y)
     };
 
     int numActiveLayers = 0;
-    std::tuple<uint16_t *, int> layers[9];
+    std::tuple<uint16_t *, int> layers[8];
 
     for(int priority = 0; priority < 4; priority++)
     {
@@ -1361,8 +1362,6 @@ void AGBDisplay::drawScanLine(int y)
         }
     }
 
-    layers[numActiveLayers++] = {nullptr, 0};
-
     // start with window enabled if start/end are flipped
     bool xInWin0 = yInWin0 && (win0h & 0xFF) < (win0h >> 8), xInWin1 = yInWin1 && (win1h & 0xFF) < (win1h >> 8);
 
@@ -1380,14 +1379,21 @@ void AGBDisplay::drawScanLine(int y)
         blendDstAlpha = std::min(16, blendAlpha >> 8);
     }
 
-    // merge layers
+    int blendMode = (blendControl & BLDCNT_Effect) >> 6;
+
+    // objects that force alpha blending
+    bool semiTransparentOBJs = memchr(objMask, 2, screenWidth);
+
+    // layers enabled by the window for each pixel, bit 5 set if effects are enabled (same as the window regs)
+    const int effectsEnabled = 1 << 5;
+    uint8_t windowMask[screenWidth];
+
     for(int x = 0; x < screenWidth;)
     {
         int curLayerEnables = layerEnables;
+        bool curEffectsEnabled = true;
 
-        int blendMode = (blendControl & BLDCNT_Effect) >> 6;
-
-        // attempt to draw as many pixels as possible before checking window again
+        // attempt to do as many pixels as possible before checking window again
         int end = screenWidth;
 
         if(windowEnabled)
@@ -1412,7 +1418,7 @@ void AGBDisplay::drawScanLine(int y)
             {
                 curLayerEnables &= winIn;
                 if(!(winIn & WININ_Win0Effect))
-                    blendMode = 0;
+                    curEffectsEnabled = false;
 
                 // end of win 0, unless the coords are flipped
                 if((win0h & 0xFF) > x)
@@ -1422,7 +1428,7 @@ void AGBDisplay::drawScanLine(int y)
             {
                 curLayerEnables &= (winIn >> 8);
                 if(!(winIn & WININ_Win1Effect))
-                    blendMode = 0;
+                    curEffectsEnabled = false;
 
                 // end of win 1 or start of win 0
                 if((win1h & 0xFF) > x)
@@ -1434,7 +1440,7 @@ void AGBDisplay::drawScanLine(int y)
             {
                 curLayerEnables &= (winOut >> 8);
                 if(!(winOut & WINOUT_ObjWinEffect))
-                    blendMode = 0;
+                    curEffectsEnabled = false;
 
                 // "end" of object window
                 end = x + 1;
@@ -1451,7 +1457,7 @@ void AGBDisplay::drawScanLine(int y)
             {
                 curLayerEnables &= winOut;
                 if(!(winOut & WINOUT_OutsideEffect))
-                    blendMode = 0;
+                    curEffectsEnabled = false;
 
                 // start of win 0
                 if(yInWin0 && (win0h >> 8) > x)
@@ -1472,115 +1478,86 @@ void AGBDisplay::drawScanLine(int y)
             }
         }
 
-        for(; x < end;x++)
-        {
-            for(int i = 0; i < 9; i++)
-            {
-                uint16_t *data;
-                int mask;
-                std::tie(data, mask) = layers[i];
-
-                uint16_t col;
-
-                // backdrop
-                if(!data)
-                {
-                    col = palRAM[0];
-                    mask = BLDCNT_SrcBackdrop; // for blending check
-                }
-                else
-                {
-                    if(!data[x])
-                        continue;
-
-                    // check if disabled by window
-                    if(!(curLayerEnables & mask))
-                        continue;
-
-                    col = data[x];
-                }
-
-                int curBlendMode = blendMode;
-
-                // forced blend for objects
-                if(mask == Layer_OBJ && objMask[x] == 2)
-                    curBlendMode = 1;
-                // make sure layer is src (masks conveniently line up)
-                else if(!(blendControl & mask))
-                    curBlendMode = 0;
-
-                if(curBlendMode == 1 && data && (blendSrcAlpha < 16 || blendDstAlpha)) // alpha, ignore if backdrop (nothing to blend with)
-                {
-                    // get next layer
-                    uint16_t *nextData;
-                    int nextMask;
-                    int nextLayer = i + 1;
+        memset(windowMask + x, curLayerEnables | (curEffectsEnabled ? effectsEnabled : 0), end - x);
+        x = end;
+    }
 
-                    // find next non-transparent layer
-                    do
-                    {
-                        std::tie(nextData, nextMask) = layers[nextLayer++];
-                    } while(nextMask && (!nextData[x] || !(curLayerEnables & nextMask)));
+    // find the top two visible layers for each pixel and the BLDCNT_Src* bit for the layer
+    // (back to front without branches, so the compiler can vectorise it)
+    uint16_t top[screenWidth], bottom[screenWidth];
+    uint16_t topLayer[screenWidth], bottomLayer[screenWidth];
 
-                    nextMask = nextMask ? nextMask << 8 : (1 << 13); // shift up, handle 0 for backdrop
+    for(int x = 0; x < screenWidth; x++)
+    {
+        top[x] = bottom[x] = palRAM[0];
+        topLayer[x] = bottomLayer[x] = BLDCNT_SrcBackdrop;
+    }
 
-                    // check if its a dst target
-                    if(!(blendControl & nextMask))
-                    {
-                        scanLine[x] = (col & 0x1F) | (col & 0x7FE0) << 1;
-                        break;
-                    }
+    for(int l = numActiveLayers - 1; l >= 0; l--)
+    {
+        // (copied so the compiler knows it doesn't overlap the output)
+        uint16_t data[screenWidth];
+        memcpy(data, std::get<0>(layers[l]), sizeof(data));
+        const uint16_t mask = std::get<1>(layers[l]);
 
-                    // do blend
-                    auto dstCol = nextData ? nextData[x] : palRAM[0]; // handle backdrop
+        for(int x = 0; x < screenWidth; x++)
+        {
+            // all 1s if there's something here and it isn't disabled by the window
+            uint16_t opaque = -uint16_t((data[x] != 0) & ((windowMask[x] & mask) != 0));
 
-                    int srcR = (col >> 10) & 0x1F;
-                    int srcG = (col >> 5) & 0x1F;
-                    int srcB = col & 0x1F;
+            bottom[x] = (top[x] & opaque) | (bottom[x] & ~opaque);
+            bottomLayer[x] = (topLayer[x] & opaque) | (bottomLayer[x] & ~opaque);
+            top[x] = (data[x] & opaque) | (top[x] & ~opaque);
+            topLayer[x] = (mask & opaque) | (topLayer[x] & ~opaque);
+        }
+    }
 
-                    int dstR = (dstCol >> 10) & 0x1F;
-                    int dstG = (dstCol >> 5) & 0x1F;
-                    int dstB = dstCol & 0x1F;
+    // no blending
+    if(!blendMode && !semiTransparentOBJs)
+    {
+        for(int x = 0; x < screenWidth; x++)
+            top[x] = (top[x] & 0x1F) | (top[x] & 0x7FE0) << 1;
 
-                    int r = std::min(31, (srcR * blendSrcAlpha + dstR * blendDstAlpha) / 16);
-                    int g = std::min(31, (srcG * blendSrcAlpha + dstG * blendDstAlpha) / 16);
-                    int b = std::min(31, (srcB * blendSrcAlpha + dstB * blendDstAlpha) / 16);
+        memcpy(scanLine, top, sizeof(top));
+        return;
+    }
 
-                    scanLine[x] = r << 11 | g << 6 | b;
-                }
-                else if(curBlendMode == 2) // lighten
-                {
-                    int evy = blendY;
+    // blend
+    // all the effects are (src * srcFactor + dst * dstFactor) / 16, lighten/darken use white/black as dst
+    // (everything is 16 bit and selected with masks instead of branches so that this vectorises too)
+    auto select = [](bool cond, uint16_t a, uint16_t b) -> uint16_t
+    {
+        uint16_t mask = -uint16_t(cond);
+        return (a & mask) | (b & ~mask);
+    };
 
-                    int srcR = (col >> 10) & 0x1F;
-                    int srcG = (col >> 5) & 0x1F;
-                    int srcB = col & 0x1F;
+    for(int x = 0; x < screenWidth; x++)
+    {
+        uint16_t src = topLayer[x], dst = bottomLayer[x];
+        uint16_t col = top[x];
 
-                    int r = srcR + ((31 - srcR) * evy) / 16;
-                    int g = srcG + ((31 - srcG) * evy) / 16;
-                    int b = srcB + ((31 - srcB) * evy) / 16;
+        // make sure layer is src (masks conveniently line up)
+        bool isSrc = ((blendControl & src) != 0) & ((windowMask[x] & effectsEnabled) != 0);
+        // forced blend for objects
+        bool semiTransparent = (src == Layer_OBJ) & (objMask[x] == 2);
 
-                    scanLine[x] = r << 11 | g << 6 | b;
-                }
-                else if(curBlendMode == 3) // darken
-                {
-                    int evy = blendY;
+        uint16_t curBlendMode = select(semiTransparent, 1, select(isSrc, blendMode, 0));
 
-                    int srcR = (col >> 10) & 0x1F;
-                    int srcG = (col >> 5) & 0x1F;
-                    int srcB = col & 0x1F;
+        // alpha, ignore if backdrop (nothing to blend with) or the next layer isn't a dst target
+        bool alpha = (curBlendMode == 1) & (src != BLDCNT_SrcBackdrop) & ((blendControl & dst << 8) != 0);
+        bool lighten = curBlendMode == 2, darken = curBlendMode == 3;
 
-                    int r = srcR - (srcR * evy) / 16;
-                    int g = srcG - (srcG * evy) / 16;
-                    int b = srcB - (srcB * evy) / 16;
+        uint16_t srcFactor = select(alpha, blendSrcAlpha, select(lighten | darken, 16 - blendY, 16));
+        uint16_t dstFactor = select(alpha, blendDstAlpha, select(lighten, blendY, 0));
+        uint16_t round = select(darken, 15, 0); // src - src * evy / 16
+        uint16_t dstCol = select(lighten, 0x7FFF, bottom[x]);
 
-                    scanLine[x] = r << 11 | g << 6 | b;
-                }
-                else
-                    scanLine[x] = (col & 0x1F) | (col & 0x7FE0) << 1;
+        uint16_t r = std::min<uint16_t>(31, (((col >> 10) & 0x1F) * srcFactor + ((dstCol >> 10) & 0x1F) * dstFactor + round) >> 4);
+        uint16_t g = std::min<uint16_t>(31, (((col >> 5) & 0x1F) * srcFactor + ((dstCol >> 5) & 0x1F) * dstFactor + round) >> 4);
+        uint16_t b = std::min<uint16_t>(31, ((col & 0x1F) * srcFactor + (dstCol & 0x1F) * dstFactor + round) >> 4);
 
-                break;
-            }
-        }
+        top[x] = r << 11 | g << 6 | b;
     }
+
+    memcpy(scanLine, top, sizeof(top));
 }
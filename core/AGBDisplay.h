@@ -34,7 +34,7 @@ private:
     int32_t refPointX[2]{0}, refPointY[2]{0};
 
     static const int scanlineDots = 308; // * 4 cpu cycles
-    static const int screenWidth = 240, screenHeight = 160;
+    static constexpr int screenWidth = 240, screenHeight = 160;
 
     unsigned int remainingScanlineDots = scanlineDots;
     unsigned int remainingModeDots = screenWidth;
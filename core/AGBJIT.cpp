@@ -0,0 +1,1157 @@
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "AGBJIT.h"
+#include "AGBCPU.h"
+
+#ifdef AGB_JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Generated code follows AGBCPU::executeBlock: instructions that only touch registers and flags are translated,
+// everything else calls the same handler the interpreter would. ARM registers stay in the CPU struct and are
+// only cached in x86 registers within an instruction, so there is nothing to write back at a call or exit.
+//
+// Register use:
+//  rbx: cpu
+//  r12: remaining cycles (int *)
+//  r13: code write count on entry
+//  r14: flag table
+//  eax: cycles for the current instruction (after it ran)
+//  ecx/edx/r8: scratch
+
+namespace
+{
+    enum X86Reg
+    {
+        RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15
+    };
+
+    enum X86Cond
+    {
+        CC_O  = 0x0,
+        CC_B  = 0x2, // carry set
+        CC_AE = 0x3, // carry clear
+        CC_NE = 0x5,
+        CC_BE = 0x6,
+        CC_LE = 0xE
+    };
+
+    enum X86ALUOp
+    {
+        ALU_ADD = 0,
+        ALU_OR,
+        ALU_ADC,
+        ALU_SBB,
+        ALU_AND,
+        ALU_SUB,
+        ALU_XOR,
+        ALU_CMP
+    };
+
+    enum X86ShiftOp
+    {
+        Shift_ROR = 1,
+        Shift_RCR = 3,
+        Shift_SHL = 4,
+        Shift_SHR = 5,
+        Shift_SAR = 7
+    };
+
+    // [base + index << scale + disp]
+    struct X86Mem
+    {
+        X86Reg base;
+        int32_t disp = 0;
+        int index = -1;
+        int scale = 0;
+    };
+
+    // just enough x86-64 for the translator, all ops are 32-bit unless stated
+    class X86Emitter final
+    {
+    public:
+        X86Emitter(uint8_t *ptr) : ptr(ptr) {}
+
+        uint8_t *getPtr() const {return ptr;}
+
+        void mov(X86Reg dst, X86Reg src) {op(0x89, src, dst);}
+        void mov(X86Reg dst, X86Mem src) {op(0x8B, dst, src);}
+        void mov(X86Mem dst, X86Reg src) {op(0x89, src, dst);}
+        void mov(X86Reg dst, uint32_t imm) {rex(false, 0, 0, dst); byte(0xB8 | (dst & 7)); dword(imm);}
+        void mov(X86Mem dst, uint32_t imm) {op(0xC7, 0, dst); dword(imm);}
+
+        void mov64(X86Reg dst, X86Reg src) {op(0x89, src, dst, true);}
+        void mov64(X86Reg dst, uintptr_t imm) {rex(true, 0, 0, dst); byte(0xB8 | (dst & 7)); qword(imm);}
+        void lea64(X86Reg dst, X86Mem src) {op(0x8D, dst, src, true);}
+
+        void movzx8(X86Reg dst, X86Reg src) {op0F(0xB6, dst, src);}
+        void movzx8(X86Reg dst, X86Mem src) {op0F(0xB6, dst, src);}
+        void movzx16(X86Reg dst, X86Reg src) {op0F(0xB7, dst, src);}
+        void movzx16(X86Reg dst, X86Mem src) {op0F(0xB7, dst, src);}
+
+        // movzx dst, ah (can't have a REX prefix)
+        void movzxAH(X86Reg dst)
+        {
+            assert(dst < R8);
+            byte(0x0F); byte(0xB6); byte(0xC0 | dst << 3 | 4);
+        }
+
+        void alu(X86ALUOp aluOp, X86Reg dst, X86Reg src) {op(0x01 | aluOp << 3, src, dst);}
+        void alu(X86ALUOp aluOp, X86Reg dst, X86Mem src) {op(0x03 | aluOp << 3, dst, src);}
+        void alu(X86ALUOp aluOp, X86Mem dst, X86Reg src) {op(0x01 | aluOp << 3, src, dst);}
+        void alu(X86ALUOp aluOp, X86Reg dst, uint32_t imm) {op(0x81, aluOp, dst); dword(imm);}
+        void alu(X86ALUOp aluOp, X86Mem dst, uint32_t imm) {op(0x81, aluOp, dst); dword(imm);}
+
+        void test(X86Reg a, X86Reg b) {op(0x85, b, a);}
+        void notOp(X86Reg dst) {op(0xF7, 2, dst);}
+        void neg(X86Reg dst) {op(0xF7, 3, dst);}
+
+        void shift(X86ShiftOp shiftOp, X86Reg dst, int count) {op(0xC1, shiftOp, dst); byte(count);}
+        void rol16(X86Reg dst, int count) {byte(0x66); op(0xC1, 0, dst); byte(count);}
+
+        void bt(X86Reg src, int bit) {op0F(0xBA, 4, src); byte(bit);}
+        void bt(X86Mem src, int bit) {op0F(0xBA, 4, src); byte(bit);}
+        void bt(X86Reg src, X86Reg bit) {op0F(0xA3, bit, src);}
+
+        void setcc(X86Cond cond, X86Reg dst)
+        {
+            assert(dst < RSP || dst >= R8); // spl-dil would need a REX prefix
+            op0F(0x90 | cond, 0, dst);
+        }
+
+        void lahf() {byte(0x9F);}
+        void cmc() {byte(0xF5);}
+
+        void push(X86Reg reg) {rex(false, 0, 0, reg); byte(0x50 | (reg & 7));}
+        void pop(X86Reg reg) {rex(false, 0, 0, reg); byte(0x58 | (reg & 7));}
+        void call(X86Reg reg) {op(0xFF, 2, reg);}
+        void ret() {byte(0xC3);}
+
+        // returns the offset to patch with bind
+        uint8_t *jcc(X86Cond cond) {byte(0x0F); byte(0x80 | cond); return rel32();}
+        uint8_t *jmp() {byte(0xE9); return rel32();}
+
+        void jmp(const uint8_t *target)
+        {
+            byte(0xE9);
+            bind(rel32(), target);
+        }
+
+        void bind(uint8_t *rel) {bind(rel, ptr);}
+
+        void bind(uint8_t *rel, const uint8_t *target)
+        {
+            int32_t off = static_cast<int32_t>(target - (rel + 4));
+            memcpy(rel, &off, 4);
+        }
+
+    private:
+        void byte(uint8_t b) {*ptr++ = b;}
+        void dword(uint32_t d) {memcpy(ptr, &d, 4); ptr += 4;}
+        void qword(uint64_t q) {memcpy(ptr, &q, 8); ptr += 8;}
+
+        uint8_t *rel32()
+        {
+            auto ret = ptr;
+            dword(0);
+            return ret;
+        }
+
+        void rex(bool w, int reg, int index, int base)
+        {
+            uint8_t r = 0x40 | (w ? 8 : 0) | (reg & 8 ? 4 : 0) | (index & 8 ? 2 : 0) | (base & 8 ? 1 : 0);
+            if(r != 0x40)
+                byte(r);
+        }
+
+        void modrm(int reg, X86Reg rm) {byte(0xC0 | (reg & 7) << 3 | (rm & 7));}
+
+        // always uses a 32-bit displacement
+        void modrm(int reg, X86Mem mem)
+        {
+            if(mem.index < 0 && (mem.base & 7) != RSP)
+                byte(0x80 | (reg & 7) << 3 | (mem.base & 7));
+            else
+            {
+                byte(0x84 | (reg & 7) << 3); // SIB
+                byte(mem.scale << 6 | ((mem.index < 0 ? RSP : mem.index) & 7) << 3 | (mem.base & 7));
+            }
+
+            dword(mem.disp);
+        }
+
+        void op(uint8_t opcode, int reg, X86Reg rm, bool w = false)
+        {
+            rex(w, reg, 0, rm);
+            byte(opcode);
+            modrm(reg, rm);
+        }
+
+        void op(uint8_t opcode, int reg, X86Mem mem, bool w = false)
+        {
+            rex(w, reg, mem.index < 0 ? 0 : mem.index, mem.base);
+            byte(opcode);
+            modrm(reg, mem);
+        }
+
+        void op0F(uint8_t opcode, int reg, X86Reg rm)
+        {
+            rex(false, reg, 0, rm);
+            byte(0x0F);
+            byte(opcode);
+            modrm(reg, rm);
+        }
+
+        void op0F(uint8_t opcode, int reg, X86Mem mem)
+        {
+            rex(false, reg, mem.index < 0 ? 0 : mem.index, mem.base);
+            byte(0x0F);
+            byte(opcode);
+            modrm(reg, mem);
+        }
+
+        uint8_t *ptr;
+    };
+
+    // ARM flags from x86 flags, indexed by OF << 8 | AH after LAHF
+    static constexpr std::array<uint32_t, 512> makeFlagTable()
+    {
+        std::array<uint32_t, 512> ret{};
+
+        for(int i = 0; i < 512; i++)
+        {
+            ret[i] = (i & 0x80 ? 1u << 31 : 0) // SF -> N
+                   | (i & 0x40 ? 1u << 30 : 0) // ZF -> Z
+                   | (i & 0x01 ? 1u << 29 : 0) // CF -> C
+                   | (i & 0x100 ? 1u << 28 : 0); // OF -> V
+        }
+
+        return ret;
+    }
+
+    static constexpr auto flagTable = makeFlagTable();
+
+    static const uint32_t Flag_N = 1u << 31, Flag_Z = 1 << 30, Flag_C = 1 << 29, Flag_T = 1 << 5;
+
+    // where everything is relative to the cpu
+    struct CPULayout
+    {
+        int32_t regs[16];
+        int32_t cpsr, decodeOp, fetchOp;
+        int32_t pcSCycles, pcNCycles;
+        int32_t currentInterrupts, dmaTriggered, halted;
+        int32_t cycleCount, nextUpdateCycle;
+        int32_t mem, codeWriteCount;
+
+        const uint16_t *conditionTable;
+
+        uintptr_t callARMOp, callTHUMBOp;
+        uintptr_t prefetchTiming16, prefetchTiming32, updatePC;
+    };
+
+    class BlockTranslator final
+    {
+    public:
+        BlockTranslator(uint8_t *ptr, const CPULayout &layout, uint32_t addr, bool isThumb, int numOps, const uint32_t *opcodes)
+        : e(ptr), layout(layout), addr(addr), isThumb(isThumb), isROM(addr >> 24 >= 8), opSize(isThumb ? 2 : 4), numOps(numOps), opcodes(opcodes)
+        {}
+
+        uint8_t *translate();
+
+    private:
+        enum class Carry
+        {
+            Keep,
+            Clear,
+            Set,
+            X86, // from CF
+            R8   // in r8b
+        };
+
+        static const int returnDirect = -2; // exit without writing back the pipeline
+
+        X86Mem cpuMem(int32_t off) const {return {RBX, off};}
+        X86Mem regMem(int reg) const {return {RBX, layout.regs[reg]};}
+
+        uint32_t pcValue(int i) const {return addr + (i + 2) * opSize;}
+
+        void loadReg(X86Reg dst, int reg, int i);
+
+        void exitIf(X86Cond cond, int index);
+        void storePipeline(int i);
+        uint8_t *checkCondition(int cond);
+        void checkCycles(int exitIndex);
+        void emitTiming();
+
+        void setFlagsNZCV(bool isSub);
+        void setFlagsNZ(Carry carry);
+        void mergeFlags(uint32_t mask);
+
+        bool isLoopBranch(uint32_t opcode, int i) const;
+        void translateLoopBranch(uint32_t opcode, int i);
+        void translateCall(uint32_t opcode, int i, bool last);
+        bool translateARM(uint32_t opcode, int i);
+        bool translateTHUMB(uint16_t opcode, int i);
+
+        X86Emitter e;
+        const CPULayout &layout;
+
+        uint32_t addr;
+        bool isThumb, isROM;
+        int opSize;
+        int numOps;
+        const uint32_t *opcodes;
+
+        const uint8_t *loopStart = nullptr;
+        std::vector<std::pair<int, uint8_t *>> exitJumps; // op index, rel
+        std::vector<uint8_t *> returnJumps;
+    };
+
+    uint8_t *BlockTranslator::translate()
+    {
+        e.push(RBX);
+        e.push(RBP); // alignment
+        e.push(R12);
+        e.push(R13);
+        e.push(R14);
+
+        e.mov64(RBX, RDI);
+        e.mov64(R12, RSI);
+        e.mov(R13, cpuMem(layout.codeWriteCount));
+        e.mov64(R14, reinterpret_cast<uintptr_t>(flagTable.data()));
+
+        loopStart = e.getPtr();
+
+        for(int i = 0; i < numOps; i++)
+        {
+            bool last = i + 1 == numOps;
+            auto opcode = opcodes[i];
+
+            if(last && isLoopBranch(opcode, i))
+                translateLoopBranch(opcode, i);
+            else if(isThumb ? translateTHUMB(opcode, i) : translateARM(opcode, i))
+            {
+                if(last)
+                    exitJumps.emplace_back(i, e.jmp());
+                else
+                    checkCycles(i);
+            }
+            else
+                translateCall(opcode, i, last);
+        }
+
+        // exits from translated instructions, need to write back the pipeline
+        std::sort(exitJumps.begin(), exitJumps.end());
+
+        for(auto it = exitJumps.begin(); it != exitJumps.end();)
+        {
+            int index = it->first;
+            for(; it != exitJumps.end() && it->first == index; ++it)
+                e.bind(it->second);
+
+            storePipeline(index);
+            returnJumps.push_back(e.jmp());
+        }
+
+        for(auto rel : returnJumps)
+            e.bind(rel);
+
+        e.pop(R14);
+        e.pop(R13);
+        e.pop(R12);
+        e.pop(RBP);
+        e.pop(RBX);
+        e.ret();
+
+        return e.getPtr();
+    }
+
+    void BlockTranslator::loadReg(X86Reg dst, int reg, int i)
+    {
+        if(reg == 15)
+            e.mov(dst, pcValue(i));
+        else
+            e.mov(dst, regMem(reg));
+    }
+
+    // index is the instruction the pipeline should be written back for (-1 for the start of the block)
+    void BlockTranslator::exitIf(X86Cond cond, int index)
+    {
+        auto rel = e.jcc(cond);
+
+        if(index == returnDirect)
+            returnJumps.push_back(rel);
+        else
+            exitJumps.emplace_back(index, rel);
+    }
+
+    // the state executeBlock would have set up before running instruction i
+    void BlockTranslator::storePipeline(int i)
+    {
+        e.mov(cpuMem(layout.regs[15]), pcValue(i));
+        e.mov(cpuMem(layout.decodeOp), opcodes[i + 1]);
+        e.mov(cpuMem(layout.fetchOp), opcodes[i + 2]);
+    }
+
+    // returns a jump taken if the condition fails
+    uint8_t *BlockTranslator::checkCondition(int cond)
+    {
+        e.mov(RAX, cpuMem(layout.cpsr));
+        e.shift(Shift_SHR, RAX, 28);
+        e.mov(RCX, layout.conditionTable[cond]);
+        e.bt(RCX, RAX);
+        return e.jcc(CC_AE);
+    }
+
+    // same as the end of executeBlock's loop
+    void BlockTranslator::checkCycles(int exitIndex)
+    {
+        e.mov(RCX, cpuMem(layout.nextUpdateCycle));
+        e.alu(ALU_SUB, RCX, cpuMem(layout.cycleCount));
+        e.alu(ALU_CMP, RCX, RAX);
+        exitIf(CC_BE, exitIndex);
+
+        e.alu(ALU_CMP, X86Mem{R12}, RAX);
+        exitIf(CC_LE, exitIndex);
+
+        e.alu(ALU_SUB, X86Mem{R12}, RAX);
+        e.alu(ALU_ADD, cpuMem(layout.cycleCount), RAX);
+    }
+
+    // prefetchTiming16/32(pcSCycles), which is just pcSCycles outside of ROM
+    void BlockTranslator::emitTiming()
+    {
+        if(isROM)
+        {
+            e.lea64(RDI, cpuMem(layout.mem));
+            e.mov(RSI, cpuMem(layout.pcSCycles));
+            e.mov64(RAX, isThumb ? layout.prefetchTiming16 : layout.prefetchTiming32);
+            e.call(RAX);
+        }
+        else
+            e.mov(RAX, cpuMem(layout.pcSCycles));
+    }
+
+    // after an add/sub, C is inverted for subtraction
+    void BlockTranslator::setFlagsNZCV(bool isSub)
+    {
+        if(isSub)
+            e.cmc();
+
+        e.lahf();
+        e.setcc(CC_O, RAX);
+        e.rol16(RAX, 8);
+        e.movzx16(RAX, RAX);
+        e.mov(RAX, X86Mem{R14, 0, RAX, 2});
+
+        mergeFlags(0xF0000000);
+    }
+
+    // after a logical op or TEST, V is never affected
+    void BlockTranslator::setFlagsNZ(Carry carry)
+    {
+        e.lahf();
+        e.movzxAH(RAX);
+        e.mov(RAX, X86Mem{R14, 0, RAX, 2});
+
+        switch(carry)
+        {
+            case Carry::Keep:
+                mergeFlags(Flag_N | Flag_Z);
+                break;
+            case Carry::Clear:
+                e.alu(ALU_AND, RAX, Flag_N | Flag_Z);
+                mergeFlags(Flag_N | Flag_Z | Flag_C);
+                break;
+            case Carry::Set:
+                e.alu(ALU_OR, RAX, Flag_C);
+                mergeFlags(Flag_N | Flag_Z | Flag_C);
+                break;
+            case Carry::X86:
+                mergeFlags(Flag_N | Flag_Z | Flag_C);
+                break;
+            case Carry::R8:
+                e.alu(ALU_AND, RAX, Flag_N | Flag_Z);
+                e.movzx8(RCX, R8);
+                e.shift(Shift_SHL, RCX, 29);
+                e.alu(ALU_OR, RAX, RCX);
+                mergeFlags(Flag_N | Flag_Z | Flag_C);
+                break;
+        }
+    }
+
+    // cpsr = (cpsr & ~mask) | (eax & mask)
+    void BlockTranslator::mergeFlags(uint32_t mask)
+    {
+        e.alu(ALU_AND, RAX, mask);
+        e.mov(RCX, cpuMem(layout.cpsr));
+        e.alu(ALU_AND, RCX, ~mask);
+        e.alu(ALU_OR, RCX, RAX);
+        e.mov(cpuMem(layout.cpsr), RCX);
+    }
+
+    // branch back to the start of the block
+    bool BlockTranslator::isLoopBranch(uint32_t opcode, int i) const
+    {
+        uint32_t target;
+
+        if(isThumb)
+        {
+            if((opcode >> 12) == 0xD && ((opcode >> 8) & 0xF) < 0xE) // conditional
+                target = pcValue(i) + static_cast<int8_t>(opcode & 0xFF) * 2;
+            else if((opcode >> 11) == 0x1C) // unconditional
+                target = pcValue(i) + (static_cast<int16_t>(opcode << 5) >> 4);
+            else
+                return false;
+        }
+        else
+        {
+            // B, not BL
+            if((opcode & 0x0F000000) != 0x0A000000 || (opcode >> 28) == 0xF)
+                return false;
+
+            target = pcValue(i) + ((static_cast<int32_t>(opcode & 0xFFFFFF) << 8) >> 6);
+        }
+
+        return target == addr;
+    }
+
+    // loops without going back through runCycles if it wouldn't have done anything
+    void BlockTranslator::translateLoopBranch(uint32_t opcode, int i)
+    {
+        int cond = 0xE;
+        if(!isThumb)
+            cond = opcode >> 28;
+        else if((opcode >> 12) == 0xD)
+            cond = (opcode >> 8) & 0xF;
+
+        auto notTaken = cond == 0xE ? nullptr : checkCondition(cond);
+
+        // what's left of updateARM/THUMBPC, the region didn't change
+        if(isROM)
+        {
+            e.lea64(RDI, cpuMem(layout.mem));
+            e.mov(RSI, addr);
+            e.mov64(RAX, layout.updatePC);
+            e.call(RAX);
+        }
+
+        e.mov(RAX, cpuMem(layout.pcSCycles));
+        e.alu(ALU_ADD, RAX, RAX);
+        e.alu(ALU_ADD, RAX, cpuMem(layout.pcNCycles));
+
+        // runCycles would service interrupts or update timers/display
+        e.movzx16(RCX, cpuMem(layout.currentInterrupts));
+        e.test(RCX, RCX);
+        exitIf(CC_NE, -1);
+
+        checkCycles(-1);
+        e.jmp(loopStart);
+
+        if(notTaken)
+        {
+            e.bind(notTaken);
+
+            if(isThumb)
+                e.mov(RAX, cpuMem(layout.pcSCycles));
+            else
+                emitTiming();
+
+            exitJumps.emplace_back(i, e.jmp());
+        }
+    }
+
+    // anything not translated, calls the handler with the same checks as executeBlock
+    void BlockTranslator::translateCall(uint32_t opcode, int i, bool last)
+    {
+        storePipeline(i);
+
+        uint8_t *condFailed = nullptr;
+        if(!isThumb && (opcode >> 28) != 0xE)
+            condFailed = checkCondition(opcode >> 28);
+
+        e.mov64(RDI, RBX);
+        e.mov(RSI, opcode);
+        e.mov64(RAX, isThumb ? layout.callTHUMBOp : layout.callARMOp);
+        e.call(RAX);
+
+        if(condFailed)
+        {
+            auto done = e.jmp();
+            e.bind(condFailed);
+            emitTiming();
+            e.bind(done);
+        }
+
+        // branch or mode switch, pipeline already refilled
+        e.alu(ALU_CMP, cpuMem(layout.regs[15]), pcValue(i));
+        exitIf(CC_NE, returnDirect);
+
+        e.bt(cpuMem(layout.cpsr), 5); // T
+        exitIf(isThumb ? CC_AE : CC_B, returnDirect);
+
+        if(last)
+        {
+            returnJumps.push_back(e.jmp());
+            return;
+        }
+
+        e.alu(ALU_CMP, R13, cpuMem(layout.codeWriteCount));
+        exitIf(CC_NE, returnDirect);
+
+        e.movzx16(RCX, cpuMem(layout.currentInterrupts));
+        e.movzx8(RDX, cpuMem(layout.dmaTriggered));
+        e.alu(ALU_OR, RCX, RDX);
+        e.movzx8(RDX, cpuMem(layout.halted));
+        e.alu(ALU_OR, RCX, RDX);
+        exitIf(CC_NE, returnDirect);
+
+        checkCycles(returnDirect);
+    }
+
+    // data processing with an immediate or immediate shift, not writing PC
+    bool BlockTranslator::translateARM(uint32_t opcode, int i)
+    {
+        int cond = opcode >> 28;
+        if(cond == 0xF || ((opcode >> 26) & 3))
+            return false;
+
+        bool isImm = opcode & (1 << 25);
+        if(!isImm && (opcode & (1 << 4))) // shift by register/multiply/...
+            return false;
+
+        int instOp = (opcode >> 21) & 0xF;
+        bool setCondCode = opcode & (1 << 20);
+        if(instOp >= 0x8 && instOp <= 0xB && !setCondCode) // PSR transfer/BX
+            return false;
+
+        int destReg = (opcode >> 12) & 0xF;
+        if(destReg == 15)
+            return false;
+
+        bool isLogical = instOp <= 0x1 || instOp == 0x8 || instOp == 0x9 || instOp >= 0xC;
+        bool needCarry = setCondCode && isLogical;
+
+        auto condFailed = cond == 0xE ? nullptr : checkCondition(cond);
+
+        // op2 in ecx
+        Carry carry = Carry::Keep;
+
+        if(isImm)
+        {
+            uint32_t imm = opcode & 0xFF;
+            int shift = ((opcode >> 8) & 0xF) * 2;
+            if(shift)
+            {
+                imm = (imm >> shift) | (imm << (32 - shift));
+                carry = imm & (1u << 31) ? Carry::Set : Carry::Clear;
+            }
+
+            e.mov(RCX, imm);
+        }
+        else
+        {
+            loadReg(RCX, opcode & 0xF, i);
+
+            int shiftType = (opcode >> 5) & 3;
+            int shift = (opcode >> 7) & 0x1F;
+
+            if(shiftType == 0 && shift == 0) // LSL 0, carry preserved
+                carry = Carry::Keep;
+            else
+            {
+                carry = Carry::R8;
+
+                if(shiftType == 3 && shift == 0) // RRX
+                {
+                    e.bt(cpuMem(layout.cpsr), 29);
+                    e.shift(Shift_RCR, RCX, 1);
+                }
+                else if(shift == 0) // LSR/ASR 32, carry is the top bit
+                {
+                    if(needCarry)
+                        e.bt(RCX, 31);
+                }
+                else
+                {
+                    static const X86ShiftOp shiftOps[]{Shift_SHL, Shift_SHR, Shift_SAR, Shift_ROR};
+                    e.shift(shiftOps[shiftType], RCX, shift);
+                }
+
+                // last bit shifted out
+                if(needCarry)
+                    e.setcc(CC_B, R8);
+
+                if(shiftType != 3 && shift == 0)
+                {
+                    if(shiftType == 1)
+                        e.alu(ALU_XOR, RCX, RCX);
+                    else
+                        e.shift(Shift_SAR, RCX, 31);
+                }
+            }
+        }
+
+        // op1 in edx, result in edx
+        if(instOp != 0xD && instOp != 0xF)
+            loadReg(RDX, (opcode >> 16) & 0xF, i);
+
+        bool isSub = false;
+
+        switch(instOp)
+        {
+            case 0x0: // AND
+            case 0x8: // TST
+                e.alu(ALU_AND, RDX, RCX);
+                break;
+            case 0x1: // EOR
+            case 0x9: // TEQ
+                e.alu(ALU_XOR, RDX, RCX);
+                break;
+            case 0x2: // SUB
+                e.alu(ALU_SUB, RDX, RCX);
+                isSub = true;
+                break;
+            case 0x3: // RSB
+                e.alu(ALU_SUB, RCX, RDX);
+                e.mov(RDX, RCX);
+                isSub = true;
+                break;
+            case 0x4: // ADD
+            case 0xB: // CMN
+                e.alu(ALU_ADD, RDX, RCX);
+                break;
+            case 0x5: // ADC
+                e.bt(cpuMem(layout.cpsr), 29);
+                e.alu(ALU_ADC, RDX, RCX);
+                break;
+            case 0x6: // SBC
+                e.bt(cpuMem(layout.cpsr), 29);
+                e.cmc();
+                e.alu(ALU_SBB, RDX, RCX);
+                isSub = true;
+                break;
+            case 0x7: // RSC
+                e.bt(cpuMem(layout.cpsr), 29);
+                e.cmc();
+                e.alu(ALU_SBB, RCX, RDX);
+                e.mov(RDX, RCX);
+                isSub = true;
+                break;
+            case 0xA: // CMP
+                e.alu(ALU_CMP, RDX, RCX);
+                isSub = true;
+                break;
+            case 0xC: // ORR
+                e.alu(ALU_OR, RDX, RCX);
+                break;
+            case 0xD: // MOV
+                e.mov(RDX, RCX);
+                if(setCondCode)
+                    e.test(RDX, RDX);
+                break;
+            case 0xE: // BIC
+                e.notOp(RCX);
+                e.alu(ALU_AND, RDX, RCX);
+                break;
+            case 0xF: // MVN
+                e.notOp(RCX);
+                e.mov(RDX, RCX);
+                if(setCondCode)
+                    e.test(RDX, RDX);
+                break;
+        }
+
+        if(instOp < 0x8 || instOp >= 0xC)
+            e.mov(regMem(destReg), RDX);
+
+        if(setCondCode)
+        {
+            if(isLogical)
+                setFlagsNZ(carry);
+            else
+                setFlagsNZCV(isSub);
+        }
+
+        if(condFailed)
+            e.bind(condFailed);
+
+        emitTiming();
+
+        return true;
+    }
+
+    // formats 1-5 (except shift by register, ROR, MUL and anything with PC), 12 and 13
+    bool BlockTranslator::translateTHUMB(uint16_t opcode, int i)
+    {
+        int lowReg0 = opcode & 7, lowReg3 = (opcode >> 3) & 7;
+
+        switch(opcode >> 11)
+        {
+            case 0x0: // format 1, LSL
+            case 0x1: // LSR
+            case 0x2: // ASR
+            {
+                int shiftType = opcode >> 11;
+                int shift = (opcode >> 6) & 0x1F;
+
+                e.mov(RDX, regMem(lowReg3));
+
+                Carry carry = Carry::X86;
+
+                if(shiftType == 0 && shift == 0)
+                {
+                    e.test(RDX, RDX);
+                    carry = Carry::Keep;
+                }
+                else if(shift == 0) // shift by 32
+                {
+                    e.bt(RDX, 31);
+                    e.setcc(CC_B, R8);
+                    carry = Carry::R8;
+
+                    if(shiftType == 1)
+                        e.alu(ALU_XOR, RDX, RDX);
+                    else
+                        e.shift(Shift_SAR, RDX, 31);
+                }
+                else
+                    e.shift(shiftType == 0 ? Shift_SHL : (shiftType == 1 ? Shift_SHR : Shift_SAR), RDX, shift);
+
+                e.mov(regMem(lowReg0), RDX);
+                setFlagsNZ(carry);
+                break;
+            }
+
+            case 0x3: // format 2
+            {
+                bool isImm = opcode & (1 << 10), isSub = opcode & (1 << 9);
+                int op2 = (opcode >> 6) & 7;
+                auto aluOp = isSub ? ALU_SUB : ALU_ADD;
+
+                e.mov(RDX, regMem(lowReg3));
+
+                if(isImm)
+                    e.alu(aluOp, RDX, static_cast<uint32_t>(op2));
+                else
+                {
+                    e.mov(RCX, regMem(op2));
+                    e.alu(aluOp, RDX, RCX);
+                }
+
+                e.mov(regMem(lowReg0), RDX);
+                setFlagsNZCV(isSub);
+                break;
+            }
+
+            case 0x4: // format 3, MOV
+            {
+                uint32_t offset = opcode & 0xFF;
+                auto dstReg = (opcode >> 8) & 7;
+
+                e.mov(regMem(dstReg), offset);
+                e.alu(ALU_AND, cpuMem(layout.cpsr), ~(Flag_N | Flag_Z));
+                if(!offset)
+                    e.alu(ALU_OR, cpuMem(layout.cpsr), Flag_Z);
+                break;
+            }
+
+            case 0x5: // CMP
+            case 0x6: // ADD
+            case 0x7: // SUB
+            {
+                uint32_t offset = opcode & 0xFF;
+                auto dstReg = (opcode >> 8) & 7;
+                int instOp = (opcode >> 11) & 3;
+
+                e.mov(RDX, regMem(dstReg));
+                e.alu(instOp == 1 ? ALU_CMP : (instOp == 2 ? ALU_ADD : ALU_SUB), RDX, offset);
+
+                if(instOp != 1)
+                    e.mov(regMem(dstReg), RDX);
+
+                setFlagsNZCV(instOp != 2);
+                break;
+            }
+
+            case 0x8:
+            {
+                if(opcode & (1 << 10)) // format 5
+                {
+                    int op = (opcode >> 8) & 3;
+                    int srcReg = (opcode >> 3) & 0xF;
+                    int dstReg = (opcode & 7) | ((opcode >> 4) & 8);
+
+                    if(op == 3 || srcReg == 15 || dstReg == 15)
+                        return false;
+
+                    e.mov(RCX, regMem(srcReg));
+
+                    if(op == 0) // ADD
+                        e.alu(ALU_ADD, regMem(dstReg), RCX);
+                    else if(op == 1) // CMP
+                    {
+                        e.mov(RDX, regMem(dstReg));
+                        e.alu(ALU_CMP, RDX, RCX);
+                        setFlagsNZCV(true);
+                    }
+                    else // MOV
+                        e.mov(regMem(dstReg), RCX);
+
+                    break;
+                }
+
+                // format 4
+                int instOp = (opcode >> 6) & 0xF;
+
+                switch(instOp)
+                {
+                    case 0x0: // AND
+                    case 0x1: // EOR
+                    case 0x8: // TST
+                    case 0xC: // ORR
+                    case 0xE: // BIC
+                    {
+                        e.mov(RDX, regMem(lowReg0));
+                        e.mov(RCX, regMem(lowReg3));
+
+                        if(instOp == 0xE)
+                            e.notOp(RCX);
+
+                        e.alu(instOp == 0x1 ? ALU_XOR : (instOp == 0xC ? ALU_OR : ALU_AND), RDX, RCX);
+
+                        if(instOp != 0x8)
+                            e.mov(regMem(lowReg0), RDX);
+
+                        setFlagsNZ(Carry::Keep);
+                        break;
+                    }
+                    case 0x5: // ADC
+                    case 0x6: // SBC
+                    case 0xA: // CMP
+                    case 0xB: // CMN
+                    {
+                        e.mov(RDX, regMem(lowReg0));
+                        e.mov(RCX, regMem(lowReg3));
+
+                        bool isSub = instOp == 0x6 || instOp == 0xA;
+
+                        if(instOp == 0x5 || instOp == 0x6)
+                        {
+                            e.bt(cpuMem(layout.cpsr), 29);
+                            if(isSub)
+                                e.cmc();
+                            e.alu(isSub ? ALU_SBB : ALU_ADC, RDX, RCX);
+                            e.mov(regMem(lowReg0), RDX);
+                        }
+                        else
+                            e.alu(isSub ? ALU_CMP : ALU_ADD, RDX, RCX);
+
+                        setFlagsNZCV(isSub);
+                        break;
+                    }
+                    case 0x9: // NEG
+                        e.mov(RCX, regMem(lowReg3));
+                        e.neg(RCX);
+                        e.mov(regMem(lowReg0), RCX);
+                        setFlagsNZCV(true);
+                        break;
+                    case 0xF: // MVN
+                        e.mov(RCX, regMem(lowReg3));
+                        e.notOp(RCX);
+                        e.mov(regMem(lowReg0), RCX);
+                        e.test(RCX, RCX);
+                        setFlagsNZ(Carry::Keep);
+                        break;
+
+                    default: // shifts/ROR/MUL have extra timing
+                        return false;
+                }
+                break;
+            }
+
+            case 0x14: // format 12, PC
+            case 0x15: // SP
+            {
+                uint32_t word = (opcode & 0xFF) << 2;
+                auto dstReg = (opcode >> 8) & 7;
+
+                if(opcode & (1 << 11))
+                {
+                    e.mov(RCX, regMem(13));
+                    e.alu(ALU_ADD, RCX, word);
+                    e.mov(regMem(dstReg), RCX);
+                }
+                else
+                    e.mov(regMem(dstReg), (pcValue(i) & ~2u) + word);
+                break;
+            }
+
+            case 0x16:
+            {
+                if((opcode >> 8) != 0xB0) // format 13
+                    return false;
+
+                uint32_t off = (opcode & 0x7F) << 2;
+                e.alu(opcode & (1 << 7) ? ALU_SUB : ALU_ADD, regMem(13), off);
+                break;
+            }
+
+            default:
+                return false;
+        }
+
+        emitTiming();
+
+        return true;
+    }
+}
+#endif
+
+AGBJIT::AGBJIT(AGBCPU &cpu) : cpu(cpu)
+{}
+
+AGBJIT::~AGBJIT()
+{
+#ifdef AGB_JIT_X86_64
+    if(codeBuffer)
+        munmap(codeBuffer, codeBufferSize);
+#endif
+}
+
+bool AGBJIT::init()
+{
+#ifdef AGB_JIT_X86_64
+    if(!codeBuffer)
+    {
+        // never writable and executable at the same time, compile switches pages between the two
+        auto ptr = mmap(nullptr, codeBufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(ptr == MAP_FAILED)
+            return false;
+
+        codeBuffer = static_cast<uint8_t *>(ptr);
+        pageSize = sysconf(_SC_PAGESIZE);
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void AGBJIT::reset()
+{
+    codeBufferUsed = 0;
+}
+
+AGBJIT::BlockFunc AGBJIT::compile(uint32_t addr, bool isThumb)
+{
+#ifdef AGB_JIT_X86_64
+    if(!codeBuffer || isFull())
+        return nullptr;
+
+    auto block = cpu.getCodeBlock(addr, isThumb);
+    assert(block);
+
+    auto offset = [this](const void *ptr)
+    {
+        return static_cast<int32_t>(reinterpret_cast<const uint8_t *>(ptr) - reinterpret_cast<const uint8_t *>(&cpu));
+    };
+
+    CPULayout layout;
+
+    for(int i = 0; i < 16; i++)
+        layout.regs[i] = offset(&cpu.reg(static_cast<AGBCPU::Reg>(i)));
+
+    layout.cpsr = offset(&cpu.cpsr);
+    layout.decodeOp = offset(&cpu.decodeOp);
+    layout.fetchOp = offset(&cpu.fetchOp);
+    layout.pcSCycles = offset(&cpu.pcSCycles);
+    layout.pcNCycles = offset(&cpu.pcNCycles);
+    layout.currentInterrupts = offset(&cpu.currentInterrupts);
+    layout.dmaTriggered = offset(&cpu.dmaTriggered);
+    layout.halted = offset(&cpu.halted);
+    layout.cycleCount = offset(&cpu.cycleCount);
+    layout.nextUpdateCycle = offset(&cpu.nextUpdateCycle);
+    layout.mem = offset(&cpu.mem);
+    layout.codeWriteCount = offset(&cpu.mem.codeWriteCount);
+
+    layout.conditionTable = AGBCPU::armConditionTable.data();
+
+    layout.callARMOp = reinterpret_cast<uintptr_t>(&callARMOp);
+    layout.callTHUMBOp = reinterpret_cast<uintptr_t>(&callTHUMBOp);
+    layout.prefetchTiming16 = reinterpret_cast<uintptr_t>(&prefetchTiming16);
+    layout.prefetchTiming32 = reinterpret_cast<uintptr_t>(&prefetchTiming32);
+    layout.updatePC = reinterpret_cast<uintptr_t>(&updatePC);
+
+    uint32_t opcodes[AGBCPU::maxBlockOps + 2];
+    for(int i = 0; i < block->numOps + 2; i++)
+        opcodes[i] = block->ops[i].opcode;
+
+    auto start = codeBuffer + codeBufferUsed;
+
+    // the first page may be shared with the previous block, which can't be running while we're compiling
+    if(!protect(codeBufferUsed, codeBufferUsed + maxBlockCodeSize, PROT_READ | PROT_WRITE))
+        return nullptr;
+
+    BlockTranslator translator(start, layout, addr, isThumb, block->numOps, opcodes);
+    auto end = translator.translate();
+
+    assert(static_cast<size_t>(end - start) <= maxBlockCodeSize);
+
+    if(!protect(codeBufferUsed, end - codeBuffer, PROT_READ | PROT_EXEC))
+        return nullptr;
+
+    codeBufferUsed = (end - codeBuffer + 15) & ~15;
+
+    return reinterpret_cast<BlockFunc>(start);
+#else
+    return nullptr;
+#endif
+}
+
+#ifdef AGB_JIT_X86_64
+bool AGBJIT::protect(size_t startOffset, size_t endOffset, int prot)
+{
+    startOffset &= ~(pageSize - 1);
+    endOffset = std::min((endOffset + pageSize - 1) & ~(pageSize - 1), codeBufferSize);
+
+    return mprotect(codeBuffer + startOffset, endOffset - startOffset, prot) == 0;
+}
+#endif
+
+// translated code expects the flags in cpsr
+int AGBJIT::callARMOp(AGBCPU *cpu, uint32_t opcode)
+{
+    int ret = (cpu->*AGBCPU::armTable[((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0xF)])(opcode);
+    cpu->updateFlags();
+    return ret;
+}
+
+int AGBJIT::callTHUMBOp(AGBCPU *cpu, uint32_t opcode)
+{
+    int ret = (cpu->*AGBCPU::thumbTable[opcode >> 6])(opcode, cpu->loReg(AGBCPU::Reg::PC));
+    cpu->updateFlags();
+    return ret;
+}
+
+int AGBJIT::prefetchTiming16(AGBMemory *mem, int cycles)
+{
+    return mem->prefetchTiming16(cycles);
+}
+
+int AGBJIT::prefetchTiming32(AGBMemory *mem, int cycles)
+{
+    return mem->prefetchTiming32(cycles);
+}
+
+void AGBJIT::updatePC(AGBMemory *mem, uint32_t pc)
+{
+    mem->updatePC(pc);
+}
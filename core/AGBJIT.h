@@ -0,0 +1,48 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+class AGBCPU;
+class AGBMemory;
+
+// native code is only generated for x86-64 (SysV ABI)
+#if defined(__x86_64__) && defined(__unix__)
+#define AGB_JIT_X86_64
+#endif
+
+// translates the CPU's cached blocks to native code
+class AGBJIT final
+{
+public:
+    // returns cycles taken by the last instruction, like AGBCPU::executeBlock
+    using BlockFunc = int(*)(AGBCPU *cpu, int *cycles);
+
+    AGBJIT(AGBCPU &cpu);
+    ~AGBJIT();
+
+    bool init(); // allocates the code buffer, false if unsupported
+    void reset();
+
+    bool isFull() const {return codeBufferSize - codeBufferUsed < maxBlockCodeSize;} // reset before compiling anything else
+    BlockFunc compile(uint32_t addr, bool isThumb); // nullptr if the code buffer is full or couldn't be made executable
+
+private:
+    static int callARMOp(AGBCPU *cpu, uint32_t opcode);
+    static int callTHUMBOp(AGBCPU *cpu, uint32_t opcode);
+    static int prefetchTiming16(AGBMemory *mem, int cycles);
+    static int prefetchTiming32(AGBMemory *mem, int cycles);
+    static void updatePC(AGBMemory *mem, uint32_t pc);
+
+#ifdef AGB_JIT_X86_64
+    bool protect(size_t startOffset, size_t endOffset, int prot); // rounds out to pages
+#endif
+
+    static constexpr size_t codeBufferSize = 4 * 1024 * 1024;
+    static constexpr size_t maxBlockCodeSize = 16 * 1024;
+
+    AGBCPU &cpu;
+
+    uint8_t *codeBuffer = nullptr;
+    size_t codeBufferUsed = 0;
+    size_t pageSize = 4096;
+};
@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <utility>
 
 #include "AGBMemory.h"
 
@@ -27,14 +29,37 @@ enum MemoryRegion
     Region_SaveH     = 0xF,
 };
 
-template uint8_t AGBMemory::read(uint32_t addr, int &cycles, bool sequential) const;
-template uint16_t AGBMemory::read(uint32_t addr, int &cycles, bool sequential) const;
-template uint32_t AGBMemory::read(uint32_t addr, int &cycles, bool sequential) const;
-template void AGBMemory::write(uint32_t addr, uint8_t val, int &cycles, bool sequential);
-template void AGBMemory::write(uint32_t addr, uint16_t val, int &cycles, bool sequential);
-template void AGBMemory::write(uint32_t addr, uint32_t val, int &cycles, bool sequential);
+template uint8_t AGBMemory::readSlow(uint32_t addr, int &cycles, bool sequential) const;
+template uint16_t AGBMemory::readSlow(uint32_t addr, int &cycles, bool sequential) const;
+template uint32_t AGBMemory::readSlow(uint32_t addr, int &cycles, bool sequential) const;
+template void AGBMemory::writeSlow(uint32_t addr, uint8_t val, int &cycles, bool sequential);
+template void AGBMemory::writeSlow(uint32_t addr, uint16_t val, int &cycles, bool sequential);
+template void AGBMemory::writeSlow(uint32_t addr, uint32_t val, int &cycles, bool sequential);
+template bool AGBMemory::dmaCopy<uint16_t>(uint32_t srcAddr, uint32_t dstAddr, int count, bool fixedSrc, int &cycles, bool sequential, uint32_t &lastVal);
+template bool AGBMemory::dmaCopy<uint32_t>(uint32_t srcAddr, uint32_t dstAddr, int count, bool fixedSrc, int &cycles, bool sequential, uint32_t &lastVal);
 
-AGBMemory::AGBMemory(AGBCPU &cpu) : cpu(cpu){}
+AGBMemory::AGBMemory(AGBCPU &cpu) : cpu(cpu)
+{
+    for(auto &page : readPages)
+        page = nullptr;
+
+    for(uint32_t addr = 0; addr < 0x1000000; addr += pageSize)
+    {
+        // EWRAM/IWRAM mirror every 256K/32K
+        wramPages[addr >> pageShift] = wram + (addr & 0x3FFFF);
+        wramPages[(0x1000000 | addr) >> pageShift] = wram + iwramOffset;
+
+        readPages[(Region_EWRAM << 24 | addr) >> pageShift] = wram + (addr & 0x3FFFF);
+        readPages[(Region_IWRAM << 24 | addr) >> pageShift] = wram + iwramOffset;
+
+        // VRAM mirrors every 128K, the last 32K is the previous 32K
+        auto vramAddr = addr & 0x1FFFF;
+        if(vramAddr >= 0x18000)
+            vramAddr &= ~0x8000;
+
+        readPages[(Region_VRAM << 24 | addr) >> pageShift] = vram + vramAddr;
+    }
+}
 
 void AGBMemory::setBIOSROM(const uint8_t *rom)
 {
@@ -45,6 +70,16 @@ void AGBMemory::setCartROM(const uint8_t *rom, uint32_t size)
 {
     cartROM = rom;
     cartROMSize = size;
+
+    // only whole pages, reading past the end returns the address
+    for(int region = Region_ROMWait0L; region <= Region_ROMWait2L; region += 2)
+    {
+        // not Wait2H, could be EEPROM
+        uint32_t end = region == Region_ROMWait2L ? 0x1000000 : 0x2000000;
+
+        for(uint32_t addr = 0; addr < end; addr += pageSize)
+            readPages[(region << 24 | addr) >> pageShift] = rom && addr + pageSize <= size ? rom + addr : nullptr;
+    }
 }
 
 void AGBMemory::loadCartridgeSave(const uint8_t *data, uint32_t len)
@@ -63,6 +98,42 @@ void AGBMemory::loadCartridgeSave(const uint8_t *data, uint32_t len)
         saveType = SaveType::Flash;
 }
 
+uint32_t AGBMemory::getCartridgeSaveSize() const
+{
+    switch(saveType)
+    {
+        case SaveType::Unknown:
+            return 0;
+        case SaveType::EEPROM_512:
+            return 512;
+        case SaveType::EEPROM_8K:
+            return 8 * 1024;
+        case SaveType::RAM:
+            return 32 * 1024;
+        case SaveType::Flash:
+            return 128 * 1024; // TODO: possibly 64k
+    }
+
+    __builtin_unreachable();
+}
+
+void AGBMemory::setCartRamUpdateCallback(CartRamUpdateCallback callback)
+{
+    cartRamUpdateCallback = callback;
+}
+
+void AGBMemory::syncCartridgeSave()
+{
+    if(!saveWritten)
+        return;
+
+    if(cartRamUpdateCallback)
+        cartRamUpdateCallback(cartSaveData, getCartridgeSaveSize(), saveDirtyPages);
+
+    memset(saveDirtyPages, 0, sizeof(saveDirtyPages));
+    saveWritten = false;
+}
+
 void AGBMemory::reset()
 {
     saveType = SaveType::Unknown;
@@ -70,6 +141,8 @@ void AGBMemory::reset()
     flashBank = 0;
 
     memset(cartSaveData, 0xFF, sizeof(cartSaveData));
+    memset(saveDirtyPages, 0, sizeof(saveDirtyPages));
+    saveWritten = false;
 
     cartAccessN[0] = 5;
     cartAccessS[0] = 3;
@@ -79,10 +152,13 @@ void AGBMemory::reset()
     cartAccessS[2] = 9;
 
     cartAccessN[3] = cartAccessS[3] = 5;
+
+    updateAccessCycles();
 }
 
+// anything that isn't in a page
 template<class T>
-T AGBMemory::read(uint32_t addr, int &cycles, bool sequential) const
+T AGBMemory::readSlow(uint32_t addr, int &cycles, bool sequential) const
 {
     auto accessCycles = [&cycles, this](int c)
     {
@@ -100,10 +176,10 @@ T AGBMemory::read(uint32_t addr, int &cycles, bool sequential) const
             return doOpenRead<T>(addr);
         case Region_EWRAM:
             accessCycles(sizeof(T) == 4 ? 6 : 3);
-            return doRead<T>(ewram, addr);
+            return *reinterpret_cast<const T *>(wram + (addr & (0x40000 - sizeof(T))));
         case Region_IWRAM:
             accessCycles(1);
-            return doRead<T>(iwram, addr);
+            return *reinterpret_cast<const T *>(wram + iwramOffset + (addr & (0x8000 - sizeof(T))));
         case Region_IO:
             accessCycles(1);
             return doIORead<T>(addr);
@@ -142,8 +218,9 @@ T AGBMemory::read(uint32_t addr, int &cycles, bool sequential) const
     return doOpenRead<T>(addr);
 }
 
+// anything but EWRAM/IWRAM
 template<class T>
-void AGBMemory::write(uint32_t addr, T data, int &cycles, bool sequential)
+void AGBMemory::writeSlow(uint32_t addr, T data, int &cycles, bool sequential)
 {
     auto accessCycles = [&cycles, this](int c)
     {
@@ -157,14 +234,6 @@ void AGBMemory::write(uint32_t addr, T data, int &cycles, bool sequential)
         case Region_Unused:
             accessCycles(1);
             return;
-        case Region_EWRAM:
-            accessCycles(sizeof(T) == 4 ? 6 : 3);
-            doWrite(ewram, addr, data);
-            return;
-        case Region_IWRAM:
-            accessCycles(1);
-            doWrite(iwram, addr, data);
-            return;
         case Region_IO:
             accessCycles(1);
             doIOWrite(addr, data);
@@ -204,15 +273,18 @@ void AGBMemory::write(uint32_t addr, T data, int &cycles, bool sequential)
 
 const uint8_t *AGBMemory::mapAddress(uint32_t addr) const
 {
+    if(addr < 0x10000000 && readPages[addr >> pageShift])
+        return readPages[addr >> pageShift] + (addr & (pageSize - 1));
+
     switch(addr >> 24)
     {
         case Region_BIOS:
             return biosROM ? biosROM + (addr & 0x3FFF) : nullptr;
 
         case Region_EWRAM:
-            return ewram + (addr & 0x3FFFF);
+            return wram + (addr & 0x3FFFF);
         case Region_IWRAM:
-            return iwram + (addr & 0x7FFF);
+            return wram + iwramOffset + (addr & 0x7FFF);
 
         case Region_Palette:
             return palRAM + (addr & 0x3FF);
@@ -243,9 +315,9 @@ uint8_t *AGBMemory::mapAddress(uint32_t addr)
     switch(addr >> 24)
     {
         case Region_EWRAM:
-            return ewram + (addr & 0x3FFFF);
+            return wram + (addr & 0x3FFFF);
         case Region_IWRAM:
-            return iwram + (addr & 0x7FFF);
+            return wram + iwramOffset + (addr & 0x7FFF);
 
         case Region_Palette:
             return palRAM + (addr & 0x3FF);
@@ -261,37 +333,121 @@ uint8_t *AGBMemory::mapAddress(uint32_t addr)
     return nullptr;
 }
 
-int AGBMemory::getAccessCycles(uint32_t addr, int width, bool sequential) const
+uint32_t AGBMemory::getContiguousSize(uint32_t addr) const
 {
     switch(addr >> 24)
     {
-        case Region_BIOS:
-        case Region_IWRAM:
-        case Region_IO:
-        case Region_OAM:
-            return 1;
-
         case Region_EWRAM:
-            return width == 4 ? 6 : 3;
+            return 0x40000 - (addr & 0x3FFFF);
+        case Region_IWRAM:
+            return 0x8000 - (addr & 0x7FFF);
 
         case Region_Palette:
+        case Region_OAM:
+            return 0x400 - (addr & 0x3FF);
         case Region_VRAM:
-            return width == 4 ? 2 : 1;
+            addr &= 0x1FFFF;
+            return (addr < 0x18000 ? 0x18000 : 0x20000) - addr; // last 32K is the previous 32K
 
+        // not the last region, that might be EEPROM
         case Region_ROMWait0L:
         case Region_ROMWait0H:
         case Region_ROMWait1L:
         case Region_ROMWait1H:
         case Region_ROMWait2L:
-        case Region_ROMWait2H:
-        case Region_SaveL:
-        case Region_SaveH:
-            return (sequential ? cartAccessS[(addr >> 25) - 4] : cartAccessN[(addr >> 25) - 4])
-                   + (width == 4 ? cartAccessS[(addr >> 25) - 4] : 0); // extra time for reading 32bit value is always sequential
+        {
+            uint32_t offset = addr & 0x1FFFFFF;
+            if(offset >= cartROMSize)
+                return 0;
 
+            return std::min(cartROMSize - offset, 0x1000000 - (addr & 0xFFFFFF));
+        }
     }
 
-    return 1;
+    return 0;
+}
+
+template<class T>
+bool AGBMemory::dmaCopy(uint32_t srcAddr, uint32_t dstAddr, int count, bool fixedSrc, int &cycles, bool sequential, uint32_t &lastVal)
+{
+    int srcRegion = srcAddr >> 24, dstRegion = dstAddr >> 24;
+
+    uint32_t len = count * sizeof(T);
+    uint32_t srcLen = fixedSrc ? sizeof(T) : len;
+
+    // RAM or ROM to RAM, both need to be contiguous (not wrapping around a mirror or past the end of ROM)
+    if(dstRegion >= Region_ROMWait0L || getContiguousSize(srcAddr) < srcLen || getContiguousSize(dstAddr) < len)
+        return false;
+
+    auto src = std::as_const(*this).mapAddress(srcAddr);
+    auto dst = mapAddress(dstAddr);
+
+    if(fixedSrc)
+    {
+        T val = *reinterpret_cast<const T *>(src);
+
+        for(uint32_t i = 0; i < len; i += sizeof(T))
+            *reinterpret_cast<T *>(dst + i) = val;
+
+        lastVal = val;
+    }
+    else
+    {
+        // copying forwards into an overlapping later address would repeat the start
+        if(dst > src && dst < src + len)
+            return false;
+
+        lastVal = *reinterpret_cast<const T *>(src + len - sizeof(T));
+        memmove(dst, src, len);
+    }
+
+    invalidateCode(dstAddr, len);
+
+    // same timing as doing each read/write, only the first can be non-sequential
+    int is32 = sizeof(T) == 4;
+    int firstCycles = regionCycles[srcRegion][sequential][is32] + regionCycles[dstRegion][sequential][is32];
+    int seqCycles = regionCycles[srcRegion][1][is32] + regionCycles[dstRegion][1][is32];
+    int total = firstCycles + (count - 1) * seqCycles;
+
+    cycles += total;
+
+    if(srcRegion >= Region_ROMWait0L)
+        prefetchCycles = cartAccessN[(srcAddr >> 25) - 4] + 1 - regionCycles[dstRegion][count > 1 || sequential][is32];
+    else
+        prefetchCycles -= total;
+
+    return true;
+}
+
+int AGBMemory::getAccessCycles(uint32_t addr, int width, bool sequential) const
+{
+    if(addr >> 28)
+        return 1;
+
+    return regionCycles[addr >> 24][sequential][width == 4];
+}
+
+// returns a counter that changes when the page containing addr is written to
+const uint32_t *AGBMemory::getCodePageVersion(uint32_t addr)
+{
+    static const uint32_t readOnlyVersion = 0;
+
+    int page = getCodePage(addr);
+    if(page < 0)
+        return &readOnlyVersion;
+
+    codePages[page] = true;
+    return &codePageVersion[page];
+}
+
+void AGBMemory::invalidateCode(uint32_t addr, uint32_t len)
+{
+    for(uint32_t pageAddr = addr & ~((1 << codePageShift) - 1); pageAddr < addr + len; pageAddr += 1 << codePageShift)
+    {
+        int page = getCodePage(pageAddr);
+        if(page >= 0 && codePages[page])
+            invalidateCodePage(page);
+    }
 }
 
 void AGBMemory::updateWaitControl(uint16_t waitcnt)
@@ -310,6 +466,8 @@ void AGBMemory::updateWaitControl(uint16_t waitcnt)
     cartAccessN[3] = cartAccessS[3] = nTimings[waitcnt & WAITCNT_SRAM] + 1;
 
     cartPrefetchEnabled = waitcnt & WAITCNT_Prefetch;
+
+    updateAccessCycles();
 }
 
 void AGBMemory::updatePC(uint32_t pc)
@@ -546,6 +704,7 @@ void AGBMemory::doEEPROMWrite(uint32_t addr, uint16_t data)
         uint64_t data = eepromCommandData[0] << 8 | eepromCommandData[1] >> 56;
 
         reinterpret_cast<uint64_t *>(cartSaveData)[eepromAddr] = __builtin_bswap64(data);
+        markSaveDirty(eepromAddr * 8, 8);
     }
     // end of read request for 8k
     else if(bit == 16 && (eepromCommandData[0] >> 62) == 3)
@@ -562,6 +721,7 @@ void AGBMemory::doEEPROMWrite(uint32_t addr, uint16_t data)
         uint64_t data = eepromCommandData[0] << 16 | eepromCommandData[1] >> 48;
 
         reinterpret_cast<uint64_t *>(cartSaveData)[eepromAddr] = __builtin_bswap64(data);
+        markSaveDirty(eepromAddr * 8, 8);
     }
 }
 
@@ -616,7 +776,10 @@ void AGBMemory::doSRAMWrite(uint32_t addr, uint8_t data)
     if(saveType == SaveType::Flash)
         writeFlash(addr, data);
     else if(saveType == SaveType::RAM)
+    {
         cartSaveData[addr & 0x7FFF] = data;
+        markSaveDirty(addr & 0x7FFF, 1);
+    }
 }
 
 template<class T>
@@ -625,6 +788,61 @@ T AGBMemory::doOpenRead(uint32_t addr) const
     return static_cast<T>(0xBADADD55); // TODO
 }
 
+void AGBMemory::updateAccessCycles()
+{
+    for(int region = 0; region < 16; region++)
+    {
+        for(int seq = 0; seq < 2; seq++)
+        {
+            int cycles16 = 1, cycles32 = 1;
+
+            if(region == Region_EWRAM)
+            {
+                cycles16 = 3;
+                cycles32 = 6;
+            }
+            else if(region == Region_Palette || region == Region_VRAM)
+                cycles32 = 2;
+            else if(region >= Region_ROMWait0L)
+            {
+                int i = (region >> 1) - 4;
+                cycles16 = seq ? cartAccessS[i] : cartAccessN[i];
+                cycles32 = cycles16 + cartAccessS[i]; // extra time for reading 32bit value is always sequential
+            }
+
+            regionCycles[region][seq][0] = cycles16;
+            regionCycles[region][seq][1] = cycles32;
+        }
+    }
+}
+
+int AGBMemory::getCodePage(uint32_t addr)
+{
+    if(addr >> 24 == Region_EWRAM)
+        return (addr & 0x3FFFF) >> codePageShift;
+    if(addr >> 24 == Region_IWRAM)
+        return (iwramOffset + (addr & 0x7FFF)) >> codePageShift;
+
+    return -1;
+}
+
+void AGBMemory::invalidateCodePage(int page)
+{
+    codePages[page] = false;
+    codePageVersion[page]++;
+    codeWriteCount++;
+}
+
+void AGBMemory::markSaveDirty(uint32_t offset, uint32_t len)
+{
+    uint32_t end = std::min(offset + len, uint32_t(sizeof(cartSaveData)));
+
+    for(uint32_t page = offset >> savePageShift; page < (end + (1 << savePageShift) - 1) >> savePageShift; page++)
+        saveDirtyPages[page / 32] |= 1u << (page % 32);
+
+    saveWritten = true;
+}
+
 void AGBMemory::writeFlash(uint32_t addr, uint8_t data)
 {
     // bank switch
@@ -638,6 +856,7 @@ void AGBMemory::writeFlash(uint32_t addr, uint8_t data)
     else if(flashState == FlashState::Write)
     {
         cartSaveData[(addr & 0xFFFF) + (flashBank << 16)] = data;
+        markSaveDirty((addr & 0xFFFF) + (flashBank << 16), 1);
         flashState = FlashState::Read;
         return;
     }
@@ -653,12 +872,14 @@ void AGBMemory::writeFlash(uint32_t addr, uint8_t data)
         {
             // erase all
             memset(cartSaveData, 0xFF, sizeof(cartSaveData));
+            markSaveDirty(0, sizeof(cartSaveData));
             flashState = FlashState::Read;
         }
         else if(data == 0x30 && flashState == FlashState::Erase)
         {
             // erase 4k sector
             memset(cartSaveData + (addr & 0xF000) + (flashBank << 16), 0xFF, 0x1000);
+            markSaveDirty((addr & 0xF000) + (flashBank << 16), 0x1000);
             flashState = FlashState::Read;
         }
         else if(data == 0x80 && addr == 0xE005555)
@@ -18,7 +18,8 @@ public:
 
     AGBMemory(AGBCPU &cpu);
 
-    //using CartRamUpdateCallback = void(*)(uint8_t *, unsigned int);
+    // save data, size and a bitmap of the 256 byte pages written since the last call
+    using CartRamUpdateCallback = void(*)(uint8_t *, unsigned int, const uint32_t *);
 
     void setBIOSROM(const uint8_t *rom);
     bool hasBIOS() const {return biosROM;}
@@ -28,9 +29,43 @@ public:
     void reset();
 
     template<class T>
-    T read(uint32_t addr, int &cycles, bool sequential) const;
+    T read(uint32_t addr, int &cycles, bool sequential) const
+    {
+        // plain RAM/ROM, everything else goes through readSlow
+        auto page = addr < 0x10000000 ? readPages[addr >> pageShift] : nullptr;
+
+        if(!page)
+            return readSlow<T>(addr, cycles, sequential);
+
+        int c = regionCycles[addr >> 24][sequential][sizeof(T) == 4];
+        cycles += c;
+
+        if(addr >= 0x8000000)
+            prefetchCycles = cartAccessN[(addr >> 25) - 4] + 1; // cart bus active, interrupt prefetch
+        else
+            prefetchCycles -= c;
+
+        return *reinterpret_cast<const T *>(page + (addr & (pageSize - sizeof(T))));
+    }
+
     template<class T>
-    void write(uint32_t addr, T data, int &cycles, bool sequential);
+    void write(uint32_t addr, T data, int &cycles, bool sequential)
+    {
+        // EWRAM/IWRAM, everything else goes through writeSlow
+        if((addr >> 25) != 1)
+            return writeSlow(addr, data, cycles, sequential);
+
+        int c = regionCycles[addr >> 24][0][sizeof(T) == 4];
+        cycles += c;
+        prefetchCycles -= c;
+
+        auto ptr = wramPages[(addr >> pageShift) & (numWRAMPages - 1)] + (addr & (pageSize - sizeof(T)));
+        *reinterpret_cast<T *>(ptr) = data;
+
+        int page = (ptr - wram) >> codePageShift;
+        if(codePages[page])
+            invalidateCodePage(page);
+    }
 
     // fast access to IO regs
     uint16_t readIOReg(uint16_t addr) const {return *reinterpret_cast<const uint16_t *>(ioRegs + addr);}
@@ -43,13 +78,28 @@ public:
   
     uint8_t *getCartridgeSave() {return cartSaveData;}
     SaveType getCartridgeSaveType() {return saveType;}
-    /*void setCartRamUpdateCallback(CartRamUpdateCallback callback);*/
+    uint32_t getCartridgeSaveSize() const;
+    void setCartRamUpdateCallback(CartRamUpdateCallback callback);
+    void syncCartridgeSave(); // calls the update callback if anything was written
 
     const uint8_t *mapAddress(uint32_t addr) const;
     uint8_t *mapAddress(uint32_t addr);
 
+    // bytes of plain memory (RAM or ROM, not IO/save/EEPROM) that can be accessed through mapAddress(addr), 0 if it isn't plain memory
+    uint32_t getContiguousSize(uint32_t addr) const;
+
+    // DMA fast path for incrementing or fixed src to incrementing dst when both are plain memory
+    // returns false without doing anything if the transfer needs to go through read/write
+    template<class T>
+    bool dmaCopy(uint32_t srcAddr, uint32_t dstAddr, int count, bool fixedSrc, int &cycles, bool sequential, uint32_t &lastVal);
+
     int getAccessCycles(uint32_t addr, int width, bool sequential) const;
 
+    // write tracking for the CPU's block cache, RAM is split into 256 byte pages
+    const uint32_t *getCodePageVersion(uint32_t addr);
+    uint32_t getCodeWriteCount() const {return codeWriteCount;}
+    void invalidateCode(uint32_t addr, uint32_t len); // for writes that don't go through write()
+
     void updateWaitControl(uint16_t waitcnt);
     void updatePC(uint32_t pc);
 
@@ -144,7 +194,7 @@ public:
         auto tmpCycles = prefetchCycles;
         auto tmpHalfWords = prefetchedHalfWords;
 
-        int tmp;
+        int tmp = 0;
         bool ret = read<T>(addr, tmp, false) == *ptr;
 
         prefetchCycles = tmpCycles;
@@ -154,6 +204,7 @@ public:
     }
 
 private:
+    friend class AGBJIT; // generated code checks codeWriteCount
 
     enum class FlashState : uint8_t
     {
@@ -164,6 +215,11 @@ private:
         Bank,
     };
 
+    template<class T>
+    T readSlow(uint32_t addr, int &cycles, bool sequential) const;
+    template<class T>
+    void writeSlow(uint32_t addr, T data, int &cycles, bool sequential);
+
     template<class T, size_t size>
     T doRead(const uint8_t (&mem)[size], uint32_t addr) const;
     template<class T, size_t size>
@@ -204,6 +260,12 @@ private:
     T doOpenRead(uint32_t addr) const;
 
     void writeFlash(uint32_t addr, uint8_t data);
+    void markSaveDirty(uint32_t offset, uint32_t len);
+
+    void updateAccessCycles();
+
+    static int getCodePage(uint32_t addr);
+    void invalidateCodePage(int page);
 
     AGBCPU &cpu;
 
@@ -214,8 +276,9 @@ private:
     int prefetchedHalfWords = 0;
 
     const uint8_t *biosROM = nullptr;
-    uint8_t ewram[0x40000]; // external wram, two wait states, 16bit bus
-    uint8_t iwram[0x8000]; // internal wram
+    // external wram (two wait states, 16bit bus) followed by internal wram, code pages are indexed from the start
+    static const uint32_t iwramOffset = 0x40000;
+    uint8_t wram[0x48000];
 
     uint8_t ioRegs[0x400];
     
@@ -232,6 +295,10 @@ private:
     uint64_t eepromReadData;
     uint8_t cartSaveData[128 * 1024]; // RAM/flash
 
+    static const int savePageShift = 8;
+    uint32_t saveDirtyPages[sizeof(cartSaveData) >> (savePageShift + 5)]{}; // one bit per page
+    bool saveWritten = false;
+
     FlashState flashState = FlashState::Read;
     uint8_t flashCmdState = 0;
     uint8_t flashBank = 0;
@@ -241,5 +308,25 @@ private:
 
     int8_t cartAccessN[4], cartAccessS[4]; // ROM and RAM
 
-    //CartRamUpdateCallback cartRamUpdateCallback;
+    // direct pointers to 32K pages of everything below 0x10000000 that doesn't need special handling on read
+    // (EWRAM/IWRAM/VRAM/ROM, not EEPROM or anything smaller than a page)
+    static const int pageShift = 15;
+    static const uint32_t pageSize = 1 << pageShift;
+    static const int numPages = 0x10000000 >> pageShift;
+    const uint8_t *readPages[numPages];
+
+    // the same for writes to EWRAM/IWRAM only
+    static const int numWRAMPages = 0x2000000 >> pageShift;
+    uint8_t *wramPages[numWRAMPages];
+
+    int8_t regionCycles[16][2][2]; // region, sequential, 32-bit
+
+    // EWRAM pages, then IWRAM pages
+    static const int codePageShift = 8;
+    static const int numCodePages = sizeof(wram) >> codePageShift;
+    bool codePages[numCodePages]{}; // contains cached code
+    uint32_t codePageVersion[numCodePages]{};
+    uint32_t codeWriteCount = 0;
+
+    CartRamUpdateCallback cartRamUpdateCallback = nullptr;
 };
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include <cstdio>
 #include <cstring>
+#include <limits>
 
 #include "DMGCPU.h"
 #include "DMGMemory.h"
@@ -33,6 +34,19 @@ void DMGCPU::reset()
     serialStart = serialMaster = false;
     lastSerialUpdate = 0;
 
+    scheduler.reset();
+    nextUpdateCycle = 0;
+
+    idleLoopTag = ~0u;
+    idleLoopCycles = 0;
+    idleLoopStats = {};
+
+#ifndef DMG_NO_BLOCK_CACHE
+    // might be a different ROM
+    for(auto &block : codeBlocks)
+        block.tag = ~0u;
+#endif
+
     // values after boot rom
     pc = 0x100;
     sp = 0xFFFE;
@@ -89,6 +103,8 @@ void DMGCPU::reset()
 
     apu.reset();
     display.reset();
+
+    scheduleDisplayUpdate();
 }
 
 void DMGCPU::loadSaveState(uint32_t fileLen, std::function<uint32_t(uint32_t, uint32_t, uint8_t *)> readFunc)
@@ -269,6 +285,12 @@ void DMGCPU::loadSaveState(uint32_t fileLen, std::function<uint32_t(uint32_t, ui
 
             display.loadSaveState(core, daftState, readFunc);
             apu.loadSaveState(daftState);
+
+            // the cycle count changed, reschedule everything
+            scheduler.reset();
+            caclulateNextTimerInterrupt(cycleCount, divCounter);
+            calculateNextSerialUpdate();
+            scheduleDisplayUpdate();
         }
         else if(memcmp("MBC ", buf, 4) == 0)
         {
@@ -454,12 +476,17 @@ void DMGCPU::run(int ms)
         cycles *= 2;
 
     cyclesToRun += cycles;
+    idleLoopStats.cyclesRun += cycles;
 
     while(!stopped && cyclesToRun > 0)
     {
         if(!halted)
         {
+#ifdef DMG_NO_BLOCK_CACHE
             executeInstruction();
+#else
+            executeBlock();
+#endif
 
             if(gdmaTriggered) // GDMA (stops execution)
                 doGDMA();
@@ -469,34 +496,16 @@ void DMGCPU::run(int ms)
         {
             if(halted)
             {
-                // skip to next (display/timer) interrupt
-                int skip = display.getCyclesToNextUpdate();
-
-                skip = std::min(skip, cyclesToRun);
-                if(nextTimerInterrupt)
-                    skip = std::min(skip, static_cast<int>(nextTimerInterrupt - cycleCount));
-                if(nextSerialBitCycle)
-                    skip = std::min(skip, static_cast<int>(nextSerialBitCycle - cycleCount));
+                // skip to next event, rounded up to a whole cycle
+                int skip = std::min(cyclesToRun, static_cast<int>(nextUpdateCycle - cycleCount));
+                skip = skip > 0 ? (skip + 3) & ~3 : 4;
 
-                do
-                {
-                    // inlined cycleExecuted without the !halted stuff
-                    cyclesToRun -= 4;
-                    cycleCount += 4;
-                    skip -= 4;
-                }
-                while(skip > 0);
+                cyclesToRun -= skip;
+                cycleCount += skip;
             }
 
-            // sync timer if interrupts enabled
-            if(nextTimerInterrupt && (static_cast<int>(nextTimerInterrupt - cycleCount) <= 0 || timerReload))
-                updateTimer();
-
-            if(nextSerialBitCycle)
-                updateSerial();
-
-            // sync display if interrupts enabled
-            display.updateForInterrupts();
+            if(static_cast<int>(nextUpdateCycle - cycleCount) <= 0)
+                runEvents();
 
             if(serviceableInterrupts)
                 serviceInterrupts();
@@ -571,6 +580,13 @@ bool DMGCPU::writeReg(uint16_t addr, uint8_t data)
 
     switch(addr & 0xFF)
     {
+        // these can change the display interrupt timing
+        case IO_LCDC:
+        case IO_STAT:
+        case IO_LYC:
+            scheduleDisplayUpdate();
+            break;
+
         case IO_SC:
             updateSerial();
 
@@ -685,6 +701,7 @@ bool DMGCPU::writeReg(uint16_t addr, uint8_t data)
 
             mem.writeIOReg(IO_IE, data);
             caclulateNextTimerInterrupt(cycleCount, divCounter);
+            scheduleDisplayUpdate();
             return true;
 
         case IO_RP: // IR, not implemented
@@ -1012,6 +1029,9 @@ void DMGCPU::executeInstruction()
         {
             pc += off;
             cycleExecuted();
+
+            if(off < 0)
+                checkIdleLoop(-off);
         }
     };
 
@@ -1176,6 +1196,8 @@ void DMGCPU::executeInstruction()
 
                 writeReg(0xFF00 | IO_DIV, 0); // this also syncs the APU
                 doubleSpeed = !doubleSpeed;
+
+                scheduleDisplayUpdate();
             }
             else
             {
@@ -2769,6 +2791,640 @@ void DMGCPU::executeExInstruction()
     }
 }
 
+#ifndef DMG_NO_BLOCK_CACHE
+// runs a cached block, falling back to executeInstruction for anything it can't handle
+void DMGCPU::executeBlock()
+{
+    // anything that needs checking between instructions
+    if(pc >= 0x8000 || oamDMACount || oamDMADelay || enableInterruptsNextCycle || haltBug || timerReload
+    || (serviceableInterrupts && masterInterruptEnable))
+        return executeInstruction();
+
+    auto block = getCodeBlock(pc);
+
+    // stop at the first instruction that ends after the next event
+    int limit = std::min(cyclesToRun, static_cast<int>(nextUpdateCycle - cycleCount) - 1);
+
+    int cycles = 0;
+
+    for(int i = 0; i < block->numOps && cycles < limit; i++)
+    {
+        if(!executeCachedOp(block->ops[i], cycles))
+            break;
+    }
+
+    cycleCount += cycles;
+    cyclesToRun -= cycles;
+
+    // the instruction ending the block, or one that needs the exact cycle count
+    if(cycles < limit || !cycles)
+        executeInstruction();
+}
+
+// returns false without doing anything if the op accesses memory that depends on the cycle count
+bool DMGCPU::executeCachedOp(const CachedOp &op, int &cycles)
+{
+    static const Reg regMap[]{Reg::B, Reg::C, Reg::D, Reg::E, Reg::H, Reg::L, Reg::F/*(HL)*/, Reg::A};
+    static const WReg wregMap[]{WReg::BC, WReg::DE, WReg::HL, WReg::AF/*SP*/};
+
+    // no IO, cart RAM/RTC, unusable area or MBC writes
+    const auto canRead = [](uint16_t addr)
+    {
+        return addr < 0xA000 || (addr >= 0xC000 && addr < 0xFEA0) || (addr >= 0xFF80 && addr != 0xFFFF);
+    };
+
+    const auto canWrite = [](uint16_t addr)
+    {
+        return (addr >= 0x8000 && addr < 0xA000) || (addr >= 0xC000 && addr < 0xFF00) || (addr >= 0xFF80 && addr != 0xFFFF);
+    };
+
+    const auto doAdd = [this](uint8_t a, uint8_t b, uint8_t c)
+    {
+        uint16_t v = a + b + c;
+        reg(Reg::A) = v;
+
+        auto hV = (a & 0xF) + (b & 0xF) + c;
+
+        reg(Reg::F) = (v > 0xFF ? Flag_C : 0) |
+                      (hV > 0xF ? Flag_H : 0) |
+                      ((v & 0xFF) == 0 ? Flag_Z : 0);
+    };
+
+    const auto doSub = [this](uint8_t a, uint8_t b, uint8_t c)
+    {
+        int v = a - (b + c);
+
+        int hV = (a & 0xF) - (b & 0xF) - c;
+
+        return (v < 0 ? Flag_C : 0) |
+               (hV < 0 ? Flag_H : 0) |
+               Flag_N |
+               ((v & 0xFF) == 0 ? Flag_Z : 0);
+    };
+
+    auto opcode = op.opcode;
+
+    // LD r,r
+    if(opcode >= 0x40 && opcode < 0x80)
+    {
+        int dst = (opcode >> 3) & 7, src = opcode & 7;
+
+        if(src == 6) // LD r,(HL)
+        {
+            if(!canRead(reg(WReg::HL)))
+                return false;
+
+            reg(regMap[dst]) = mem.read(reg(WReg::HL));
+            cycles += 8;
+        }
+        else if(dst == 6) // LD (HL),r
+        {
+            if(!canWrite(reg(WReg::HL)))
+                return false;
+
+            mem.write(reg(WReg::HL), reg(regMap[src]));
+            cycles += 8;
+        }
+        else
+        {
+            reg(regMap[dst]) = reg(regMap[src]);
+            cycles += 4;
+        }
+
+        pc += op.len;
+        return true;
+    }
+
+    // ALU A,r/(HL)/n
+    if((opcode >= 0x80 && opcode < 0xC0) || (opcode & 0xC7) == 0xC6)
+    {
+        uint8_t b;
+
+        if(opcode >= 0xC0)
+        {
+            b = op.operand;
+            cycles += 8;
+        }
+        else if((opcode & 7) == 6)
+        {
+            if(!canRead(reg(WReg::HL)))
+                return false;
+
+            b = mem.read(reg(WReg::HL));
+            cycles += 8;
+        }
+        else
+        {
+            b = reg(regMap[opcode & 7]);
+            cycles += 4;
+        }
+
+        auto a = reg(Reg::A);
+        uint8_t carry = (reg(Reg::F) & Flag_C) ? 1 : 0;
+
+        switch((opcode >> 3) & 7)
+        {
+            case 0: // ADD
+                doAdd(a, b, 0);
+                break;
+            case 1: // ADC
+                doAdd(a, b, carry);
+                break;
+            case 2: // SUB
+                reg(Reg::F) = doSub(a, b, 0);
+                reg(Reg::A) = a - b;
+                break;
+            case 3: // SBC
+                reg(Reg::F) = doSub(a, b, carry);
+                reg(Reg::A) = a - b - carry;
+                break;
+            case 4: // AND
+                reg(Reg::A) = a & b;
+                reg(Reg::F) = Flag_H | (reg(Reg::A) == 0 ? Flag_Z : 0);
+                break;
+            case 5: // XOR
+                reg(Reg::A) = a ^ b;
+                reg(Reg::F) = reg(Reg::A) == 0 ? Flag_Z : 0;
+                break;
+            case 6: // OR
+                reg(Reg::A) = a | b;
+                reg(Reg::F) = reg(Reg::A) == 0 ? Flag_Z : 0;
+                break;
+            case 7: // CP
+                reg(Reg::F) = doSub(a, b, 0);
+                break;
+        }
+
+        pc += op.len;
+        return true;
+    }
+
+    switch(opcode)
+    {
+        case 0x00: // NOP
+            cycles += 4;
+            break;
+
+        case 0x01: // LD BC,nn
+        case 0x11: // LD DE,nn
+        case 0x21: // LD HL,nn
+            reg(wregMap[opcode >> 4]) = op.operand;
+            cycles += 12;
+            break;
+        case 0x31: // LD SP,nn
+            sp = op.operand;
+            cycles += 12;
+            break;
+
+        case 0x02: // LD (BC),A
+        case 0x12: // LD (DE),A
+        {
+            auto addr = reg(wregMap[opcode >> 4]);
+            if(!canWrite(addr))
+                return false;
+
+            mem.write(addr, reg(Reg::A));
+            cycles += 8;
+            break;
+        }
+        case 0x22: // LDI (HL),A
+        case 0x32: // LDD (HL),A
+        {
+            auto &hl = reg(WReg::HL);
+            if(!canWrite(hl))
+                return false;
+
+            mem.write(hl, reg(Reg::A));
+            hl += opcode == 0x22 ? 1 : -1;
+            cycles += 8;
+            break;
+        }
+
+        case 0x0A: // LD A,(BC)
+        case 0x1A: // LD A,(DE)
+        {
+            auto addr = reg(wregMap[opcode >> 4]);
+            if(!canRead(addr))
+                return false;
+
+            reg(Reg::A) = mem.read(addr);
+            cycles += 8;
+            break;
+        }
+        case 0x2A: // LDI A,(HL)
+        case 0x3A: // LDD A,(HL)
+        {
+            auto &hl = reg(WReg::HL);
+            if(!canRead(hl))
+                return false;
+
+            reg(Reg::A) = mem.read(hl);
+            hl += opcode == 0x2A ? 1 : -1;
+            cycles += 8;
+            break;
+        }
+
+        case 0x03: // INC BC
+        case 0x13: // INC DE
+        case 0x23: // INC HL
+            reg(wregMap[opcode >> 4])++;
+            cycles += 8;
+            break;
+        case 0x33: // INC SP
+            sp++;
+            cycles += 8;
+            break;
+        case 0x0B: // DEC BC
+        case 0x1B: // DEC DE
+        case 0x2B: // DEC HL
+            reg(wregMap[opcode >> 4])--;
+            cycles += 8;
+            break;
+        case 0x3B: // DEC SP
+            sp--;
+            cycles += 8;
+            break;
+
+        case 0x04: // INC r
+        case 0x0C:
+        case 0x14:
+        case 0x1C:
+        case 0x24:
+        case 0x2C:
+        case 0x3C:
+        {
+            auto v = reg(regMap[opcode >> 3])++;
+
+            reg(Reg::F) = (reg(Reg::F) & Flag_C) |
+                          ((v & 0xF) == 0xF ? Flag_H : 0) |
+                          (v == 0xFF ? Flag_Z : 0);
+            cycles += 4;
+            break;
+        }
+        case 0x05: // DEC r
+        case 0x0D:
+        case 0x15:
+        case 0x1D:
+        case 0x25:
+        case 0x2D:
+        case 0x3D:
+        {
+            auto v = reg(regMap[opcode >> 3])--;
+
+            reg(Reg::F) = (reg(Reg::F) & Flag_C) |
+                          ((v & 0xF) == 0 ? Flag_H : 0) |
+                          Flag_N |
+                          (v == 1 ? Flag_Z : 0);
+            cycles += 4;
+            break;
+        }
+        case 0x34: // INC (HL)
+        case 0x35: // DEC (HL)
+        {
+            auto addr = reg(WReg::HL);
+            if(!canWrite(addr))
+                return false;
+
+            auto v = mem.read(addr);
+
+            if(opcode == 0x34)
+            {
+                mem.write(addr, v + 1);
+                reg(Reg::F) = (reg(Reg::F) & Flag_C) |
+                              ((v & 0xF) == 0xF ? Flag_H : 0) |
+                              (v == 0xFF ? Flag_Z : 0);
+            }
+            else
+            {
+                mem.write(addr, v - 1);
+                reg(Reg::F) = (reg(Reg::F) & Flag_C) |
+                              ((v & 0xF) == 0 ? Flag_H : 0) |
+                              Flag_N |
+                              (v == 1 ? Flag_Z : 0);
+            }
+            cycles += 12;
+            break;
+        }
+
+        case 0x06: // LD r,n
+        case 0x0E:
+        case 0x16:
+        case 0x1E:
+        case 0x26:
+        case 0x2E:
+        case 0x3E:
+            reg(regMap[opcode >> 3]) = op.operand;
+            cycles += 8;
+            break;
+        case 0x36: // LD (HL),n
+            if(!canWrite(reg(WReg::HL)))
+                return false;
+
+            mem.write(reg(WReg::HL), op.operand);
+            cycles += 12;
+            break;
+
+        case 0x07: // RLCA
+        {
+            auto v = reg(Reg::A);
+            reg(Reg::A) = (v << 1) | (v >> 7);
+            reg(Reg::F) = (v & 0x80) ? Flag_C : 0;
+            cycles += 4;
+            break;
+        }
+        case 0x0F: // RRCA
+        {
+            auto v = reg(Reg::A);
+            reg(Reg::A) = (v >> 1) | (v << 7);
+            reg(Reg::F) = (v & 0x01) ? Flag_C : 0;
+            cycles += 4;
+            break;
+        }
+        case 0x17: // RLA
+        {
+            auto v = reg(Reg::A);
+            reg(Reg::A) = (v << 1) | ((reg(Reg::F) & Flag_C) ? 0x01 : 0);
+            reg(Reg::F) = (v & 0x80) ? Flag_C : 0;
+            cycles += 4;
+            break;
+        }
+        case 0x1F: // RRA
+        {
+            auto v = reg(Reg::A);
+            reg(Reg::A) = (v >> 1) | ((reg(Reg::F) & Flag_C) ? 0x80 : 0);
+            reg(Reg::F) = (v & 0x01) ? Flag_C : 0;
+            cycles += 4;
+            break;
+        }
+
+        case 0x09: // ADD HL,BC
+        case 0x19: // ADD HL,DE
+        case 0x29: // ADD HL,HL
+        case 0x39: // ADD HL,SP
+        {
+            uint16_t a = reg(WReg::HL);
+            uint16_t b = opcode == 0x39 ? sp : reg(wregMap[opcode >> 4]);
+            uint32_t v = a + b;
+            reg(WReg::HL) = v;
+
+            reg(Reg::F) = (v > 0xFFFF ? Flag_C : 0) |
+                          ((a & 0xFFF) + (b & 0xFFF) > 0xFFF ? Flag_H : 0) |
+                          (reg(Reg::F) & Flag_Z);
+            cycles += 8;
+            break;
+        }
+
+        case 0x2F: // CPL
+            reg(Reg::A) = ~reg(Reg::A);
+            reg(Reg::F) |= Flag_H | Flag_N;
+            cycles += 4;
+            break;
+        case 0x37: // SCF
+            reg(Reg::F) = Flag_C | (reg(Reg::F) & Flag_Z);
+            cycles += 4;
+            break;
+        case 0x3F: // CCF
+            reg(Reg::F) = (~reg(Reg::F) & Flag_C) | (reg(Reg::F) & Flag_Z);
+            cycles += 4;
+            break;
+
+        case 0xC1: // POP BC
+        case 0xD1: // POP DE
+        case 0xE1: // POP HL
+        case 0xF1: // POP AF
+        {
+            if(!canRead(sp) || !canRead(sp + 1))
+                return false;
+
+            uint16_t val = mem.read(sp) | mem.read(sp + 1) << 8;
+            sp += 2;
+
+            if(opcode == 0xF1)
+                reg(WReg::AF) = val & 0xFFF0;
+            else
+                reg(wregMap[(opcode >> 4) - 0xC]) = val;
+
+            cycles += 12;
+            break;
+        }
+        case 0xC5: // PUSH BC
+        case 0xD5: // PUSH DE
+        case 0xE5: // PUSH HL
+        case 0xF5: // PUSH AF
+        {
+            uint16_t hi = sp - 1, lo = sp - 2;
+            if(!canWrite(hi) || !canWrite(lo))
+                return false;
+
+            auto val = opcode == 0xF5 ? reg(WReg::AF) : reg(wregMap[(opcode >> 4) - 0xC]);
+            mem.write(hi, val >> 8);
+            mem.write(lo, val & 0xFF);
+            sp -= 2;
+
+            cycles += 16;
+            break;
+        }
+
+        case 0xE0: // LDH (n),A
+        case 0xE2: // LDH (C),A
+        case 0xEA: // LD (nn),A
+        {
+            uint16_t addr = opcode == 0xEA ? op.operand : 0xFF00 | (opcode == 0xE0 ? op.operand : reg(Reg::C));
+            if(!canWrite(addr))
+                return false;
+
+            mem.write(addr, reg(Reg::A));
+            cycles += op.len * 4 + 4;
+            break;
+        }
+        case 0xF0: // LDH A,(n)
+        case 0xF2: // LDH A,(C)
+        case 0xFA: // LD A,(nn)
+        {
+            uint16_t addr = opcode == 0xFA ? op.operand : 0xFF00 | (opcode == 0xF0 ? op.operand : reg(Reg::C));
+            if(!canRead(addr))
+                return false;
+
+            reg(Reg::A) = mem.read(addr);
+            cycles += op.len * 4 + 4;
+            break;
+        }
+
+        case 0xE8: // ADD SP,n
+        case 0xF8: // LDHL SP,n
+        {
+            // flags are set as if this is an 8 bit op
+            auto a = sp & 0xFF;
+            auto b = op.operand;
+            uint16_t v = a + b;
+            auto hV = (a & 0xF) + (b & 0xF);
+
+            reg(Reg::F) = (v > 0xFF ? Flag_C : 0) |
+                          (hV > 0xF ? Flag_H : 0);
+
+            if(opcode == 0xE8)
+            {
+                sp += static_cast<int8_t>(b);
+                cycles += 16;
+            }
+            else
+            {
+                reg(WReg::HL) = sp + static_cast<int8_t>(b);
+                cycles += 12;
+            }
+            break;
+        }
+
+        case 0xF9: // LD SP,HL
+            sp = reg(WReg::HL);
+            cycles += 8;
+            break;
+
+        case 0xCB: // extended ops, registers only
+        {
+            auto &r = reg(regMap[op.operand & 7]);
+            int bit = (op.operand >> 3) & 7;
+
+            switch(op.operand >> 6)
+            {
+                case 0: // rotates/shifts
+                {
+                    auto v = r;
+                    uint8_t res = 0;
+                    uint8_t c = 0;
+
+                    switch(bit)
+                    {
+                        case 0: // RLC
+                            res = (v << 1) | (v >> 7);
+                            c = v >> 7;
+                            break;
+                        case 1: // RRC
+                            res = (v >> 1) | (v << 7);
+                            c = v & 1;
+                            break;
+                        case 2: // RL
+                            res = (v << 1) | ((reg(Reg::F) & Flag_C) >> 4);
+                            c = v >> 7;
+                            break;
+                        case 3: // RR
+                            res = (v >> 1) | ((reg(Reg::F) & Flag_C) << 3);
+                            c = v & 1;
+                            break;
+                        case 4: // SLA
+                            res = v << 1;
+                            c = v >> 7;
+                            break;
+                        case 5: // SRA
+                            res = static_cast<int8_t>(v) >> 1;
+                            c = v & 1;
+                            break;
+                        case 6: // SWAP
+                            res = (v >> 4) | (v << 4);
+                            break;
+                        case 7: // SRL
+                            res = v >> 1;
+                            c = v & 1;
+                            break;
+                    }
+
+                    r = res;
+                    reg(Reg::F) = (c ? Flag_C : 0) | (res == 0 ? Flag_Z : 0);
+                    break;
+                }
+                case 1: // BIT
+                    reg(Reg::F) = (reg(Reg::F) & Flag_C) | Flag_H | ((r & (1 << bit)) ? 0 : Flag_Z);
+                    break;
+                case 2: // RES
+                    r &= ~(1 << bit);
+                    break;
+                case 3: // SET
+                    r |= (1 << bit);
+                    break;
+            }
+
+            cycles += 8;
+            break;
+        }
+
+        default:
+            return false;
+    }
+
+    pc += op.len;
+    return true;
+}
+
+DMGCPU::CodeBlock *DMGCPU::getCodeBlock(uint16_t addr)
+{
+    auto bank = mem.getCurrentROMBank(addr);
+    uint32_t tag = bank << 16 | addr;
+
+    auto &block = codeBlocks[(addr ^ (bank << 5)) & (numCodeBlocks - 1)];
+
+    if(block.tag == tag)
+        return &block;
+
+    // returns the length of an instruction executeCachedOp handles, or 0
+    const auto getCachedOpLength = [](uint8_t opcode, uint8_t nextByte)
+    {
+        if(opcode >= 0x40 && opcode < 0xC0)
+            return opcode == 0x40 /*breakpoint*/ || opcode == 0x76 /*HALT*/ ? 0 : 1;
+
+        switch(opcode)
+        {
+            case 0x00: case 0x02: case 0x03: case 0x04: case 0x05: case 0x07: case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D: case 0x0F:
+            case 0x12: case 0x13: case 0x14: case 0x15: case 0x17: case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1F:
+            case 0x22: case 0x23: case 0x24: case 0x25: case 0x29: case 0x2A: case 0x2B: case 0x2C: case 0x2D: case 0x2F:
+            case 0x32: case 0x33: case 0x34: case 0x35: case 0x37: case 0x39: case 0x3A: case 0x3B: case 0x3C: case 0x3D: case 0x3F:
+            case 0xC1: case 0xC5: case 0xD1: case 0xD5: case 0xE1: case 0xE2: case 0xE5: case 0xF1: case 0xF2: case 0xF5: case 0xF9:
+                return 1;
+
+            case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36: case 0x3E:
+            case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE0: case 0xE6: case 0xE8: case 0xEE: case 0xF0: case 0xF6: case 0xF8: case 0xFE:
+                return 2;
+
+            case 0xCB:
+                return (nextByte & 7) == 6 ? 0 : 2; // not (HL)
+
+            case 0x01: case 0x11: case 0x21: case 0x31: case 0xEA: case 0xFA:
+                return 3;
+        }
+
+        return 0;
+    };
+
+    block.tag = tag;
+    block.numOps = 0;
+
+    // don't cross into the other bank
+    int end = (addr & 0xC000) + 0x4000;
+
+    while(block.numOps < maxBlockOps)
+    {
+        auto opcode = mem.read(addr);
+        int len = addr + 1 < end ? getCachedOpLength(opcode, mem.read(addr + 1)) : getCachedOpLength(opcode, 0);
+
+        if(!len || addr + len > end)
+            break;
+
+        auto &op = block.ops[block.numOps++];
+        op.opcode = opcode;
+        op.len = len;
+        op.operand = 0;
+
+        if(len > 1)
+            op.operand = mem.read(addr + 1);
+        if(len > 2)
+            op.operand |= mem.read(addr + 2) << 8;
+
+        addr += len;
+    }
+
+    return &block;
+}
+#endif
+
 void DMGCPU::cycleExecuted()
 {
     cyclesToRun -= 4;
@@ -2777,6 +3433,118 @@ void DMGCPU::cycleExecuted()
     updateOAMDMA();
 }
 
+// called after a JR back to pc, skips iterations of loops like LDH A,(LY)/CP n/JR NZ
+// that can't exit until the display changes mode or there's an event
+void DMGCPU::checkIdleLoop(int loopLen)
+{
+    if(!idleLoopSkip || pc >= 0x8000 || pc + loopLen > ((pc & 0xC000) + 0x4000))
+        return;
+
+    // tagged by the JR as more than one can branch to the same place
+    uint16_t end = pc + loopLen - 2;
+    auto bank = mem.getCurrentROMBank(pc);
+    uint32_t tag = bank << 16 | end;
+
+    if(tag != idleLoopTag)
+    {
+        idleLoopTag = tag;
+        idleLoopCycles = 0;
+        idleLoopDisplayReg = 0;
+        idleLoopLastCycle = cycleCount;
+
+        // a load to A, anything that only changes A/F, then the JR
+        uint16_t addr = pc;
+        int cycles = 12; // JR taken
+        auto opcode = mem.read(addr);
+
+        if(opcode == 0xF0) // LDH A,(n)
+        {
+            auto reg = mem.read(addr + 1);
+
+            if(reg == IO_LY || reg == IO_STAT)
+                idleLoopDisplayReg = reg;
+            else if(reg < 0x80 || reg == 0xFF)
+                return;
+
+            addr += 2;
+            cycles += 12;
+        }
+        else if(opcode == 0xFA) // LD A,(nn)
+        {
+            uint16_t readAddr = mem.read(addr + 1) | mem.read(addr + 2) << 8;
+
+            // WRAM or HRAM, only changed by interrupt handlers
+            if(!(readAddr >= 0xC000 && readAddr < 0xE000) && !(readAddr >= 0xFF80 && readAddr != 0xFFFF))
+                return;
+
+            addr += 3;
+            cycles += 16;
+        }
+        else
+            return;
+
+        while(addr < end)
+        {
+            opcode = mem.read(addr);
+
+            if(opcode == 0xA7 || opcode == 0xB7) // AND A, OR A
+            {
+                addr++;
+                cycles += 4;
+            }
+            else if(opcode == 0xE6 || opcode == 0xEE || opcode == 0xF6 || opcode == 0xFE) // AND/XOR/OR/CP n
+            {
+                addr += 2;
+                cycles += 8;
+            }
+            else if(opcode == 0xCB && (mem.read(addr + 1) & 0xC7) == 0x47) // BIT b,A
+            {
+                addr += 2;
+                cycles += 8;
+            }
+            else
+                return;
+        }
+
+        // should be the conditional JR we came from
+        opcode = mem.read(end);
+        if(addr == end && (opcode & 0xE7) == 0x20)
+            idleLoopCycles = cycles;
+
+        return;
+    }
+
+    if(!idleLoopCycles)
+        return;
+
+    // only skip after a whole iteration with nothing in between (an interrupt, a different path through the loop...)
+    bool clean = cycleCount - idleLoopLastCycle == static_cast<uint32_t>(idleLoopCycles);
+    idleLoopLastCycle = cycleCount;
+
+    if(!clean || oamDMACount || oamDMADelay || enableInterruptsNextCycle || (serviceableInterrupts && masterInterruptEnable))
+        return;
+
+    int maxSkip = std::min(cyclesToRun, static_cast<int>(nextUpdateCycle - cycleCount));
+
+    // the last iteration synced the display, so these are from the read
+    if(idleLoopDisplayReg == IO_LY)
+        maxSkip = std::min(maxSkip, display.getCyclesToNextLine());
+    else if(idleLoopDisplayReg == IO_STAT)
+        maxSkip = std::min(maxSkip, display.getCyclesToNextUpdate());
+
+    if(maxSkip < idleLoopCycles)
+        return;
+
+    int skip = maxSkip - maxSkip % idleLoopCycles;
+
+    cyclesToRun -= skip;
+    cycleCount += skip;
+    idleLoopLastCycle = cycleCount;
+
+    idleLoopStats.cyclesSkipped += skip;
+    idleLoopStats.loopsSkipped++;
+}
+
 void DMGCPU::updateTimer()
 {
     timerReloaded = false;
@@ -2837,6 +3605,9 @@ void DMGCPU::updateTimer()
 
     lastTimerUpdate = cycleCount;
     divCounter = div;
+
+    if(timerReload && nextTimerInterrupt)
+        scheduleTimerUpdate();
 }
 
 void DMGCPU::incrementTimer()
@@ -2851,6 +3622,7 @@ void DMGCPU::caclulateNextTimerInterrupt(uint32_t cycleCount, uint16_t div)
     if((!timerEnabled && !timerReload) || !(mem.getIOReg(IO_IE) & Int_Timer))
     {
         nextTimerInterrupt = 0;
+        scheduleTimerUpdate();
         return;
     }
 
@@ -2862,6 +3634,8 @@ void DMGCPU::caclulateNextTimerInterrupt(uint32_t cycleCount, uint16_t div)
                        + incs * clockDiv                     // tima increments to overflow
                        + (clockDiv - (div & (clockDiv - 1))) // cycles to next tima increment
                        + 4;                                  // reload/interrupt is a cycle late
+
+    scheduleTimerUpdate();
 }
 
 bool DMGCPU::serviceInterrupts()
@@ -3017,10 +3791,75 @@ void DMGCPU::calculateNextSerialUpdate()
     int clockDiv = clockSpeed / 8192; // TODO
 
     if(!serialMaster || !serialStart)
+        scheduler.remove(Event::Serial);
+    else
+        scheduler.schedule(Event::Serial, lastSerialUpdate + clockDiv + 52); // same offset as updateSerial
+
+    updateNextUpdateCycle();
+}
+
+// handles any events at or before the current cycle
+void DMGCPU::runEvents()
+{
+    while(!scheduler.empty() && static_cast<int32_t>(scheduler.getNextCycle() - cycleCount) <= 0)
     {
-        nextSerialBitCycle = 0;
-        return;
+        auto event = scheduler.getNextEvent();
+        scheduler.remove(event);
+
+        switch(event)
+        {
+            case Event::Timer:
+                updateTimer(); // reschedules on reload
+                if(!scheduler.isScheduled(Event::Timer))
+                    scheduleTimerUpdate();
+                break;
+
+            case Event::Serial:
+                updateSerial(); // reschedules if a bit was sent
+                if(!scheduler.isScheduled(Event::Serial))
+                    calculateNextSerialUpdate();
+                break;
+
+            case Event::Display:
+                display.updateForInterrupts();
+                scheduleDisplayUpdate();
+                idleLoopTag = ~0u; // may have updated after an idle loop read LY/STAT
+                break;
+
+            case Event::Count:
+                break;
+        }
     }
 
-    nextSerialBitCycle = ((cycleCount - 1) & ~(clockDiv - 1)) + clockDiv + 52;
+    updateNextUpdateCycle();
+}
+
+void DMGCPU::scheduleTimerUpdate()
+{
+    if(!nextTimerInterrupt)
+        scheduler.remove(Event::Timer);
+    else if(timerReload || static_cast<int>(nextTimerInterrupt - cycleCount) <= 0)
+        scheduler.schedule(Event::Timer, cycleCount + 1); // after the current instruction
+    else
+        scheduler.schedule(Event::Timer, nextTimerInterrupt);
+
+    updateNextUpdateCycle();
+}
+
+void DMGCPU::scheduleDisplayUpdate()
+{
+    if(display.getInterruptsEnabled())
+        scheduler.schedule(Event::Display, cycleCount + display.getCyclesToNextUpdate());
+    else
+        scheduler.remove(Event::Display);
+
+    updateNextUpdateCycle();
+}
+
+void DMGCPU::updateNextUpdateCycle()
+{
+    if(scheduler.empty())
+        nextUpdateCycle = cycleCount + std::numeric_limits<int>::max();
+    else
+        nextUpdateCycle = scheduler.getNextCycle();
 }
\ No newline at end of file
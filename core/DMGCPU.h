@@ -5,6 +5,7 @@
 #include "DMGAPU.h"
 #include "DMGDisplay.h"
 #include "DMGMemory.h"
+#include "Scheduler.h"
 
 
 enum Interrupts
@@ -26,6 +27,13 @@ public:
         CGB
     };
 
+    struct IdleLoopStats
+    {
+        uint64_t cyclesRun;     // since reset
+        uint64_t cyclesSkipped; // not executed because the CPU was polling something that couldn't change yet
+        uint32_t loopsSkipped;
+    };
+
     DMGCPU();
 
     void reset();
@@ -35,6 +43,9 @@ public:
 
     void run(int ms);
 
+    void setIdleLoopSkip(bool enabled) {idleLoopSkip = enabled;}
+    const IdleLoopStats &getIdleLoopStats() const {return idleLoopStats;}
+
     Console getConsole() {return console;}
     void setConsole(Console c) {console = c;}
 
@@ -99,8 +110,19 @@ private:
     void executeInstruction();
     void executeExInstruction();
 
+#ifndef DMG_NO_BLOCK_CACHE
+    struct CachedOp;
+    struct CodeBlock;
+
+    void executeBlock();
+    bool executeCachedOp(const CachedOp &op, int &cycles);
+    CodeBlock *getCodeBlock(uint16_t addr);
+#endif
+
     void cycleExecuted();
 
+    void checkIdleLoop(int loopLen);
+
     void updateTimer();
     void incrementTimer();
     void caclulateNextTimerInterrupt(uint32_t cycleCount, uint16_t div);
@@ -112,6 +134,11 @@ private:
     void updateSerial();
     void calculateNextSerialUpdate();
 
+    void runEvents();
+    void scheduleTimerUpdate();
+    void scheduleDisplayUpdate();
+    void updateNextUpdateCycle();
+
     static const uint32_t clockSpeed = 4194304;
 
     // internal state
@@ -142,13 +169,57 @@ private:
 
     bool serialStart = false, serialMaster = false;
     uint8_t serialBits = 0;
-    uint32_t nextSerialBitCycle = 0;
     uint32_t lastSerialUpdate = 0;
 
+    // events that need handling at a specific cycle
+    // (the APU is synced when accessed and OAM DMA steps every cycle, so they don't need any)
+    enum class Event
+    {
+        Timer = 0, // TIMA reload, only while the timer interrupt is enabled
+        Serial, // next bit, only while transferring with the internal clock
+        Display, // next mode change, only while display interrupts are enabled
+
+        Count
+    };
+
+    Scheduler<Event, static_cast<int>(Event::Count)> scheduler;
+
+    uint32_t nextUpdateCycle = 0; // next cycle where something needs updated, cached from the scheduler
+
+    // the last loop that was branched back to, checked for polling LY/STAT or RAM
+    bool idleLoopSkip = true;
+    uint32_t idleLoopTag = ~0u; // ROM bank << 16 | JR address
+    int idleLoopCycles = 0; // for one iteration, 0 if not an idle loop
+    uint8_t idleLoopDisplayReg = 0; // LY/STAT if polling the display
+    uint32_t idleLoopLastCycle = 0;
+    IdleLoopStats idleLoopStats{};
+
     // registers
     uint16_t regs[4];
     uint16_t pc, sp;
 
+#ifndef DMG_NO_BLOCK_CACHE
+    // block cache, decoded runs of simple instructions in ROM
+    static const int maxBlockOps = 16;
+    static const int numCodeBlocks = 1024;
+
+    struct CachedOp
+    {
+        uint8_t opcode;
+        uint8_t len;
+        uint16_t operand; // immediate or CB opcode
+    };
+
+    struct CodeBlock
+    {
+        uint32_t tag = ~0u; // ROM bank << 16 | address
+        int numOps; // not including the instruction that ends the block
+        CachedOp ops[maxBlockOps];
+    };
+
+    CodeBlock codeBlocks[numCodeBlocks];
+#endif
+
     // RAM
     DMGMemory mem;
     
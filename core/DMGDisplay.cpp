@@ -314,11 +314,9 @@ void DMGDisplay::updateForInterrupts()
     update();
 }
 
+// next mode/line change, STAT/LY don't change before this even if there are no interrupts
 int DMGDisplay::getCyclesToNextUpdate() const
 {
-    if(!interruptsEnabled)
-        return 0x7FFFFFFF; // this is only used when halted and clamped to something reasonable in the CPU
-
     auto passed = cpu.getCycleCount() - lastUpdateCycle;
     bool doubleSpeed = cpu.getDoubleSpeedMode();
 
@@ -328,6 +326,21 @@ int DMGDisplay::getCyclesToNextUpdate() const
     return (remainingModeCycles - passed) * (doubleSpeed ? 2 : 1);
 }
 
+// LY only changes at the end of a line (and not at all while disabled)
+int DMGDisplay::getCyclesToNextLine() const
+{
+    if(!enabled)
+        return 0x7FFFFFFF;
+
+    auto passed = cpu.getCycleCount() - lastUpdateCycle;
+    bool doubleSpeed = cpu.getDoubleSpeedMode();
+
+    if(doubleSpeed)
+        passed >>= 1;
+
+    return (remainingScanlineCycles - static_cast<int>(passed)) * (doubleSpeed ? 2 : 1);
+}
+
 void DMGDisplay::setFramebuffer(uint16_t *data)
 {
     screenData = data;
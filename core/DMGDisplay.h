@@ -21,6 +21,8 @@ public:
     void update();
     void updateForInterrupts();
     int getCyclesToNextUpdate() const;
+    int getCyclesToNextLine() const;
+    bool getInterruptsEnabled() const {return interruptsEnabled;}
 
     void setFramebuffer(uint16_t *data);
 
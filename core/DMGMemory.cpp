@@ -1,5 +1,8 @@
 #include <cstdio>
 #include <cstring>
+#ifndef DMG_NO_ROM_PREFETCH
+#include <thread>
+#endif
 
 #include "DMGMemory.h"
 #include "DMGCPU.h"
@@ -15,9 +18,10 @@ void DMGMemory::setROMBankCallback(ROMBankCallback callback)
     this->romBankCallback = callback;
 }
 
-void DMGMemory::setCartROM(const uint8_t *rom)
+void DMGMemory::setCartROM(const uint8_t *rom, uint32_t size)
 {
     cartROM = rom;
+    cartROMSize = size;
 }
 
 void DMGMemory::loadCartridgeRAM(const uint8_t *ram, uint32_t len)
@@ -29,11 +33,16 @@ void DMGMemory::addROMCache(uint8_t *ptr, uint32_t size)
 {
     auto end = ptr + size;
 
+    // drop spare RAM, it's added after these at reset
+    numROMCacheEntries = numAddedROMCacheEntries;
+
     while(ptr + 0x4000 <= end)
     {
-        cachedROMBanks.emplace_back(ROMCacheEntry{ptr, 0});
+        addROMCacheEntry(ptr);
         ptr += 0x4000;
     }
+
+    numAddedROMCacheEntries = numROMCacheEntries;
 }
 
 void DMGMemory::reset()
@@ -85,6 +94,9 @@ void DMGMemory::reset()
     // clear vram
     memset(vram, 0, sizeof(vram));
 
+    memset(cartRamDirtyPages, 0, sizeof(cartRamDirtyPages));
+    cartRamWritten = false;
+
     // reset RTC
     for(auto &reg : rtcRegs)
         reg = 0;
@@ -93,19 +105,28 @@ void DMGMemory::reset()
     // load first ROM bank for reading headers
     romBankCallback(0, cartROMBank0);
 
-    // reset cache
-    for(auto it = cachedROMBanks.begin(); it != cachedROMBanks.end();)
+#ifndef DMG_NO_ROM_PREFETCH
+    // drop any prefetched bank before the cache is rebuilt
+    // a request can only be cancelled before the loader takes it, so wait if it's loading
+    auto state = prefetchState.load(std::memory_order_acquire);
+    while(state != PrefetchState::Idle)
     {
-        // remove cart ram/wram, will re-add later if possible
-        if(it->ptr == cartRam || it->ptr == cartRam + 0x4000 || it->ptr == wram + 0x4000)
-        {
-            it = cachedROMBanks.erase(it);
-            continue;
-        }
+        if(state != PrefetchState::Loading && prefetchState.compare_exchange_weak(state, PrefetchState::Idle, std::memory_order_acquire))
+            break;
+
+        // the loader may be reading/inflating the bank
+        if(state == PrefetchState::Loading)
+            std::this_thread::yield();
 
-        it->bank = 0;
-        ++it;
+        state = prefetchState.load(std::memory_order_acquire);
     }
+    memset(romBankTransitions, 0, sizeof(romBankTransitions));
+#endif
+
+    // reset cache, remove cart ram/wram, will re-add later if possible
+    numROMCacheEntries = numAddedROMCacheEntries;
+    memset(romCacheBankEntry, noROMCacheEntry, sizeof(romCacheBankEntry));
+    romCacheStats = {};
 
     // get ROM size
     int size = cartROMBank0[0x148];
@@ -120,6 +141,10 @@ void DMGMemory::reset()
     else
         cartROMBanks = 0; // uhoh
 
+    // don't read past the end of a short ROM, mirror it instead
+    if(cartROM && cartROMSize >= 0x4000 && cartROMBanks > cartROMSize / 0x4000)
+        cartROMBanks = cartROMSize / 0x4000;
+
     // check cart ram size
     static const unsigned int ramSizes[]{
         0, 2048, 8 * 1024, 32 * 1024, 128 * 1024, 64 * 1024
@@ -170,15 +195,27 @@ void DMGMemory::reset()
 
     // use spare RAM as rom cache
     if(cartRamSize == 0 && mbcType != MBCType::MBC2)
-        cachedROMBanks.emplace_back(ROMCacheEntry{cartRam, 0});
+        addROMCacheEntry(cartRam);
     if(cartRamSize <= 0x4000)
-        cachedROMBanks.emplace_back(ROMCacheEntry{cartRam + 0x4000, 0});
+        addROMCacheEntry(cartRam + 0x4000);
 
     if(!(cartROMBank0[0x143] & 0x80))// CGB flag
-        cachedROMBanks.emplace_back(ROMCacheEntry{wram + 0x4000, 0}); // spare WRAM (really 0x6000)
+        addROMCacheEntry(wram + 0x4000); // spare WRAM (really 0x6000)
+
+    // link the LRU list in order
+    for(int i = 0; i < numROMCacheEntries; i++)
+    {
+        romCache[i].bank = 0;
+        romCache[i].prefetched = false;
+        romCache[i].prev = i == 0 ? noROMCacheEntry : i - 1;
+        romCache[i].next = i == numROMCacheEntries - 1 ? noROMCacheEntry : i + 1;
+    }
+
+    romCacheHead = 0;
+    romCacheTail = numROMCacheEntries - 1;
 
     // grab the first bank to use for bank 1
-    auto cartROMBank1 = cachedROMBanks.front().ptr;
+    auto cartROMBank1 = romCache[romCacheHead].ptr;
 
     if(mbcType == MBCType::MBC1 && cartROMBanks == 64)
     {
@@ -198,12 +235,17 @@ void DMGMemory::reset()
 
     // load the second bank too
     romBankCallback(1, cartROMBank1);
+    romCache[romCacheHead].bank = 1;
+    romCacheBankEntry[1] = romCacheHead;
 
     mbcRAMEnabled = false;
     mbcROMBank = 1;
     mbcRAMBank = 0;
     mbcRAMBankMode = false;
 
+    currentROMBanks[0] = 0;
+    currentROMBanks[1] = 1;
+
     regions[0x0] =
     regions[0x1] =
     regions[0x2] =
@@ -220,6 +262,14 @@ void DMGMemory::reset()
     regions[0xD] = wram - 0xC000; // banked
     regions[0xE] = wram - 0xE000;
     regions[0xF] = nullptr;
+
+    for(auto &region : writeRegions)
+        region = nullptr;
+
+    writeRegions[0x8] = writeRegions[0x9] = vram - 0x8000;
+    writeRegions[0xC] = wram - 0xC000;
+    writeRegions[0xD] = wram - 0xC000;
+    writeRegions[0xE] = wram - 0xE000;
 }
 
 void DMGMemory::saveMBCState(std::function<uint32_t(uint32_t, uint32_t, const uint8_t *)> writeFunc, uint32_t &offset)
@@ -397,7 +447,7 @@ const uint8_t *DMGMemory::mapAddress(uint16_t addr) const
     return iohram + (addr & 0xFF);
 }
 
-void DMGMemory::write(uint16_t addr, uint8_t data)
+void DMGMemory::writeSlow(uint16_t addr, uint8_t data)
 {
     int region = addr >> 12;
     if(region < 8)
@@ -408,7 +458,10 @@ void DMGMemory::write(uint16_t addr, uint8_t data)
         {
             // 512 4-bit values
             if(mbcType == MBCType::MBC2)
+            {
                 cartRam[addr & 0x1FF] = data | 0xF0;
+                markCartRamDirty(addr & 0x1FF);
+            }
             else if(mbcType == MBCType::MBC3 && mbcRAMBank >= 8)
             {
                 // RTC write
@@ -433,19 +486,21 @@ void DMGMemory::write(uint16_t addr, uint8_t data)
                 rtcRegs[mbcRAMBank - 8] = data;
             }
             else if(regions[region])
-                const_cast<uint8_t *>(regions[region])[addr] = data;
+            {
+                auto ptr = const_cast<uint8_t *>(regions[region]) + addr;
+                *ptr = data;
+                markCartRamDirty(ptr - cartRam);
+            }
             cartRamWritten = true;
         }
     }
-    else if(regions[region])
-        const_cast<uint8_t *>(regions[region])[addr] = data; // these are the non-const ones...
     else 
     {
         // must be Fxxx
 
         if(addr < 0xFE00) // echo
         {
-            const_cast<uint8_t *>(regions[0xD])[addr - 0x2000] = data;
+            writeRegions[0xD][addr - 0x2000] = data;
             return;
         }
 
@@ -465,14 +520,16 @@ void DMGMemory::write(uint16_t addr, uint8_t data)
 
             vramBank = data & 1;
             data |= 0xFE; // make sure only the low bit reads back
-            regions[0x8] = regions[0x9] = vram + (vramBank * 0x2000) - 0x8000;
+            writeRegions[0x8] = writeRegions[0x9] = vram + (vramBank * 0x2000) - 0x8000;
+            regions[0x8] = regions[0x9] = writeRegions[0x8];
         }
         else if((addr & 0xFF) == IO_SVBK)
         {
             if(!isGBC) return;
 
             wramBank = (data & 0x7) ? (data & 0x7) : 1; // 0 is also 1
-            regions[0xD] = wram + (wramBank * 0x1000) - 0xD000;
+            writeRegions[0xD] = wram + (wramBank * 0x1000) - 0xD000;
+            regions[0xD] = writeRegions[0xD];
         }
         else if(cpu.writeReg(addr, data))
             return;
@@ -486,6 +543,18 @@ void DMGMemory::setCartRamUpdateCallback(CartRamUpdateCallback callback)
     cartRamUpdateCallback = callback;
 }
 
+void DMGMemory::syncCartridgeRAM()
+{
+    if(!cartRamWritten)
+        return;
+
+    if(cartRamUpdateCallback)
+        cartRamUpdateCallback(cartRam, cartRamSize, cartRamDirtyPages);
+
+    memset(cartRamDirtyPages, 0, sizeof(cartRamDirtyPages));
+    cartRamWritten = false;
+}
+
 bool DMGMemory::hasRTC() const
 {
     return mbcType == MBCType::MBC3 && (cartROMBank0[0x147] == 0x0F || cartROMBank0[0x147] == 0x10);
@@ -565,12 +634,7 @@ void DMGMemory::writeMBC(uint16_t addr, uint8_t data)
 
         // on disable sync the ram if changed
         if(!mbcRAMEnabled)
-        {
-            if(cartRamWritten && cartRamUpdateCallback)
-                cartRamUpdateCallback(cartRam, cartRamSize);
-
-            cartRamWritten = false;
-        }
+            syncCartridgeRAM();
     }
     else if(addr < 0x4000)
     {
@@ -673,6 +737,9 @@ void DMGMemory::updateCurrentROMBank(unsigned int bank, int region)
 
     bank %= cartROMBanks;
 
+    unsigned int lastBank = currentROMBanks[region / 4];
+    currentROMBanks[region / 4] = bank;
+
     if(bank == 0)
     {
         for(int i = 0; i < 4; i++)
@@ -688,31 +755,223 @@ void DMGMemory::updateCurrentROMBank(unsigned int bank, int region)
         return;
     }
 
-    for(auto it = cachedROMBanks.begin(); it != cachedROMBanks.end(); ++it)
+#ifndef DMG_NO_ROM_PREFETCH
+    if(prefetchState.load(std::memory_order_acquire) != PrefetchState::Idle)
+        finishROMBankPrefetch(bank);
+
+    if(romBankPrefetch && region == 4 && bank != lastBank)
+        updateROMBankPrediction(lastBank, bank);
+#endif
+
+    int index = romCacheBankEntry[bank];
+
+    if(index != noROMCacheEntry)
     {
-        if(it->bank == bank)
+        auto &entry = romCache[index];
+
+        for(int i = 0; i < 4; i++)
+            regions[region + i] = entry.ptr - offset;
+
+        touchROMCacheEntry(index);
+        romCacheStats.hits++;
+
+        if(entry.prefetched)
         {
-            for(int i = 0; i < 4; i++)
-                regions[region + i] = it->ptr - offset;
+            entry.prefetched = false;
+            romCacheStats.prefetchHits++;
+        }
+    }
+    else
+    {
+        // reuse the last (least recently used) bank
+        index = romCacheTail;
+
+        // make sure it isn't being used by the other region
+        if(mbcType == MBCType::MBC1 && ((region == 0 && regions[4] == romCache[index].ptr - 0x4000) || (region == 4 && regions[0] == romCache[index].ptr)))
+            index = romCache[index].prev; // use the next one instead
+
+        auto &entry = romCache[index];
+
+        if(entry.bank)
+        {
+            romCacheBankEntry[entry.bank] = noROMCacheEntry;
+            romCacheStats.evictions++;
+        }
+
+        for(int i = 0; i < 4; i++)
+            regions[region + i] = entry.ptr - offset;
+
+        romBankCallback(bank, entry.ptr);
+        entry.bank = bank;
+        entry.prefetched = false;
+        romCacheBankEntry[bank] = index;
+        touchROMCacheEntry(index);
+        romCacheStats.misses++;
+    }
+
+#ifndef DMG_NO_ROM_PREFETCH
+    if(romBankPrefetch && region == 4 && prefetchState.load(std::memory_order_relaxed) == PrefetchState::Idle)
+        requestROMBankPrefetch(bank);
+#endif
+}
+
+#ifndef DMG_NO_ROM_PREFETCH
+bool DMGMemory::prefetchROMBank()
+{
+    auto state = PrefetchState::Requested;
+    if(!prefetchState.compare_exchange_strong(state, PrefetchState::Loading, std::memory_order_acquire))
+        return false;
+
+    romBankCallback(prefetchBank, romCache[prefetchEntry].ptr);
+
+    prefetchState.store(PrefetchState::Ready, std::memory_order_release);
+    return true;
+}
+
+void DMGMemory::updateROMBankPrediction(unsigned int lastBank, unsigned int bank)
+{
+    auto &transition = romBankTransitions[lastBank];
+
+    if(transition.next == bank)
+    {
+        if(transition.count < 3)
+            transition.count++;
+    }
+    else if(transition.count)
+        transition.count--;
+    else
+    {
+        // replace after two misses in a row
+        transition.next = bank;
+        transition.count = 1;
+    }
+}
+
+void DMGMemory::requestROMBankPrefetch(unsigned int bank)
+{
+    auto &transition = romBankTransitions[bank];
+
+    if(!transition.count || !transition.next || romCacheBankEntry[transition.next] != noROMCacheEntry)
+        return;
+
+    // need an entry for each region and one to load into
+    if(numROMCacheEntries < 3)
+        return;
+
+    // take the least recently used entry that isn't mapped
+    int index = romCacheTail;
+
+    while(index != noROMCacheEntry && (regions[0] == romCache[index].ptr || regions[4] == romCache[index].ptr - 0x4000))
+        index = romCache[index].prev;
+
+    if(index == noROMCacheEntry)
+        return;
+
+    auto &entry = romCache[index];
+
+    if(entry.bank)
+    {
+        romCacheBankEntry[entry.bank] = noROMCacheEntry;
+        romCacheStats.evictions++;
+        entry.bank = 0;
+    }
+
+    // the loader has it until it's ready
+    unlinkROMCacheEntry(index);
+
+    prefetchEntry = index;
+    prefetchBank = transition.next;
+    prefetchState.store(PrefetchState::Requested, std::memory_order_release);
+}
+
+void DMGMemory::finishROMBankPrefetch(unsigned int bank)
+{
+    auto state = prefetchState.load(std::memory_order_acquire);
+
+    if(state != PrefetchState::Ready)
+    {
+        // leave it with the loader unless we need it now
+        if(bank != prefetchBank)
+            return;
 
-            cachedROMBanks.splice(cachedROMBanks.begin(), cachedROMBanks, it); // move it to the top
+        // cancel if the loader hasn't started yet, it'll be loaded as a miss
+        if(state == PrefetchState::Requested && prefetchState.compare_exchange_strong(state, PrefetchState::Idle, std::memory_order_acquire))
+        {
+            linkROMCacheEntry(prefetchEntry, false);
             return;
         }
+
+        // the loader has it, wait for the read/inflate to finish
+        while(prefetchState.load(std::memory_order_acquire) != PrefetchState::Ready)
+            std::this_thread::yield();
     }
 
-    // reuse the last (least recently used) bank
-    auto it = std::prev(cachedROMBanks.end());
+    // add it back to the cache
+    auto &entry = romCache[prefetchEntry];
+    entry.bank = prefetchBank;
+    entry.prefetched = true;
+    romCacheBankEntry[prefetchBank] = prefetchEntry;
+    linkROMCacheEntry(prefetchEntry, true);
+    romCacheStats.prefetched++;
 
-    // make sure it isn't being used by the other region
-    if(mbcType == MBCType::MBC1 && ((region == 0 && regions[4] == it->ptr - 0x4000) || (region == 4 && regions[0] == it->ptr)))
-        --it; // use the next one instead
+    prefetchState.store(PrefetchState::Idle, std::memory_order_relaxed);
+}
+#endif
 
-    for(int i = 0; i < 4; i++)
-        regions[region + i] = it->ptr - offset;
+void DMGMemory::addROMCacheEntry(uint8_t *ptr)
+{
+    if(numROMCacheEntries == maxROMCacheEntries)
+    {
+        printf("Too many ROM cache banks! (max %i)\n", maxROMCacheEntries);
+        return;
+    }
+
+    romCache[numROMCacheEntries++] = {ptr, 0, noROMCacheEntry, noROMCacheEntry, false}; // linked at reset
+}
+
+void DMGMemory::touchROMCacheEntry(int index)
+{
+    if(index == romCacheHead)
+        return;
+
+    // move it to the top
+    unlinkROMCacheEntry(index);
+    linkROMCacheEntry(index, true);
+}
 
-    romBankCallback(bank, it->ptr);
-    it->bank = bank;
-    cachedROMBanks.splice(cachedROMBanks.begin(), cachedROMBanks, it); // move it to the top
+void DMGMemory::unlinkROMCacheEntry(int index)
+{
+    auto &entry = romCache[index];
+
+    if(entry.prev != noROMCacheEntry)
+        romCache[entry.prev].next = entry.next;
+    else
+        romCacheHead = entry.next;
+
+    if(entry.next != noROMCacheEntry)
+        romCache[entry.next].prev = entry.prev;
+    else
+        romCacheTail = entry.prev;
+}
+
+void DMGMemory::linkROMCacheEntry(int index, bool front)
+{
+    auto &entry = romCache[index];
+
+    if(front)
+    {
+        entry.prev = noROMCacheEntry;
+        entry.next = romCacheHead;
+        romCache[romCacheHead].prev = index;
+        romCacheHead = index;
+    }
+    else
+    {
+        entry.prev = romCacheTail;
+        entry.next = noROMCacheEntry;
+        romCache[romCacheTail].next = index;
+        romCacheTail = index;
+    }
 }
 
 void DMGMemory::updateRTC()
@@ -1,23 +1,44 @@
 #pragma once
+#ifndef DMG_NO_ROM_PREFETCH
+#include <atomic>
+#endif
 #include <cstdint>
 #include <functional>
-#include <list>
 
 class DMGCPU;
 class DMGMemory
 {
 public:
+    struct ROMCacheStats
+    {
+        uint32_t hits;      // since reset
+        uint32_t misses;    // bank loaded through the ROM bank callback
+        uint32_t evictions; // a cached bank was replaced by another one
+        uint32_t prefetched; // bank loaded ahead by prefetchROMBank
+        uint32_t prefetchHits; // first use of a prefetched bank (also counted as a hit)
+    };
+
     DMGMemory(DMGCPU &cpu);
 
     using ROMBankCallback = void(*)(uint8_t, uint8_t *);
 
-    using CartRamUpdateCallback = void(*)(uint8_t *, unsigned int);
+    // cart RAM, size and a bitmap of the 256 byte pages written since the last call
+    using CartRamUpdateCallback = void(*)(uint8_t *, unsigned int, const uint32_t *);
 
     void setROMBankCallback(ROMBankCallback callback);
-    void setCartROM(const uint8_t *rom);
+    void setCartROM(const uint8_t *rom, uint32_t size = 0); // 0 to trust the header
     void loadCartridgeRAM(const uint8_t *ram, uint32_t len);
 
-    void addROMCache(uint8_t *ptr, uint32_t size);
+    void addROMCache(uint8_t *ptr, uint32_t size); // before reset()
+    const ROMCacheStats &getROMCacheStats() const {return romCacheStats;}
+
+#ifndef DMG_NO_ROM_PREFETCH
+    // predict the next ROM bank from previous switches and load it ahead of time
+    void setROMBankPrefetch(bool enabled) {romBankPrefetch = enabled;}
+    // loads a requested bank, returns false if there wasn't one
+    // can be called from another thread, the ROM bank callback needs to be thread-safe if it is
+    bool prefetchROMBank();
+#endif
 
     void reset();
 
@@ -26,10 +47,21 @@ public:
     void setGBC(bool gbc) {isGBC = gbc;}
 
     uint8_t read(uint16_t addr) const;
-    void write(uint16_t addr, uint8_t data);
+
+    void write(uint16_t addr, uint8_t data)
+    {
+        // plain RAM, everything else goes through writeSlow
+        if(auto ptr = writeRegions[addr >> 12])
+            ptr[addr] = data;
+        else
+            writeSlow(addr, data);
+    }
 
     const uint8_t *mapAddress(uint16_t addr) const;
 
+    // bank mapped at 0000-3FFF or 4000-7FFF
+    unsigned int getCurrentROMBank(uint16_t addr) const {return currentROMBanks[(addr >> 14) & 1];}
+
     // fast access to IO regs
     uint8_t readIOReg(uint8_t addr) const {return iohram[addr];}
     uint8_t &getIOReg(uint8_t addr) {return iohram[addr];}
@@ -42,17 +74,32 @@ public:
     uint8_t *getCartridgeRAM() {return cartRam;}
     int getCartridgeRAMSize() {return cartRamSize;}
     void setCartRamUpdateCallback(CartRamUpdateCallback callback);
+    void syncCartridgeRAM(); // calls the update callback if anything was written, also done when the game disables RAM
 
     bool hasRTC() const;
     void getRTCData(uint32_t buf[12]);
     void setRTCData(uint32_t buf[12]);
 
 private:
+    void writeSlow(uint16_t addr, uint8_t data);
     void writeMBC(uint16_t addr, uint8_t data);
     void updateCurrentROMBank(unsigned int bank, int region);
 
+    void addROMCacheEntry(uint8_t *ptr);
+    void touchROMCacheEntry(int index);
+    void unlinkROMCacheEntry(int index);
+    void linkROMCacheEntry(int index, bool front);
+
+#ifndef DMG_NO_ROM_PREFETCH
+    void updateROMBankPrediction(unsigned int lastBank, unsigned int bank);
+    void requestROMBankPrefetch(unsigned int bank);
+    void finishROMBankPrefetch(unsigned int bank);
+#endif
+
     void updateRTC();
 
+    void markCartRamDirty(unsigned int offset) {cartRamDirtyPages[offset >> 13] |= 1u << ((offset >> 8) & 31);}
+
     enum class MBCType : uint8_t
     {
         None = 0,
@@ -66,11 +113,34 @@ private:
     struct ROMCacheEntry
     {
         uint8_t *ptr;
-        uint8_t bank;
+        uint16_t bank; // 0 if unused
+        uint8_t prev, next; // LRU list, most recently used first
+        bool prefetched; // not used since it was prefetched
+    };
+
+#ifndef DMG_NO_ROM_PREFETCH
+    enum class PrefetchState : uint8_t
+    {
+        Idle = 0,
+        Requested, // entry removed from the cache, waiting for prefetchROMBank
+        Loading,
+        Ready // loaded, waiting to be added back to the cache
     };
 
+    struct ROMBankTransition
+    {
+        uint16_t next; // bank that was switched to after this one
+        uint8_t count; // times in a row, 0 if the last switch didn't match
+    };
+#endif
+
+    static const int maxROMCacheEntries = 32;
+    static const uint8_t noROMCacheEntry = 0xFF;
+
     // memory map with pointers offset so that regions[addr >> 12][addr] works
     const uint8_t *regions[16];
+    // same for VRAM/WRAM, nullptr for anything with side effects (MBC, cart RAM, IO)
+    uint8_t *writeRegions[16];
 
     uint8_t iohram[0x100]; // io @ 0xFF00, hram @ 0xFF80, ie & 0xFFFF
 
@@ -89,7 +159,9 @@ private:
     bool cartRamWritten = false;
 
     int mbcROMBank = 1, mbcRAMBank = 0;
+    unsigned int currentROMBanks[2]{0, 1};
     uint8_t cartRam[0x8000];
+    uint32_t cartRamDirtyPages[sizeof(cartRam) >> 13]{}; // 256 byte pages
 
     unsigned int cartRamSize = 0;
 
@@ -100,14 +172,28 @@ private:
 
     uint8_t cartROMBank0[0x4000];
     const uint8_t *cartROM = nullptr; // used if entire rom is loaded somewhere
+    uint32_t cartROMSize = 0;
     unsigned int cartROMBanks = 0; // read from the header
 
     // cache ROM banks in RAM
-    std::list<ROMCacheEntry> cachedROMBanks;
+    ROMCacheEntry romCache[maxROMCacheEntries];
+    int numROMCacheEntries = 0; // including spare RAM
+    int numAddedROMCacheEntries = 0; // from addROMCache
+    uint8_t romCacheHead = noROMCacheEntry, romCacheTail = noROMCacheEntry;
+    uint8_t romCacheBankEntry[512]; // bank -> entry
+    ROMCacheStats romCacheStats{};
+
+#ifndef DMG_NO_ROM_PREFETCH
+    bool romBankPrefetch = false;
+    std::atomic<PrefetchState> prefetchState{PrefetchState::Idle};
+    uint8_t prefetchEntry = noROMCacheEntry; // owned by the loader while Requested/Loading
+    uint16_t prefetchBank = 0;
+    ROMBankTransition romBankTransitions[512];
+#endif
 
     DMGCPU &cpu;
 
     ROMBankCallback romBankCallback;
 
-    CartRamUpdateCallback cartRamUpdateCallback;
+    CartRamUpdateCallback cartRamUpdateCallback = nullptr;
 };
\ No newline at end of file
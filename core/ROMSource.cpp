@@ -0,0 +1,603 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#if !defined(ROM_SOURCE_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define ROM_SOURCE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef ROM_SOURCE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "ROMSource.h"
+
+#ifdef ROM_SOURCE_ZLIB
+// decompresses a raw deflate stream, keeping an index of points to restart from
+// so that reading a bank doesn't have to start from the beginning
+struct ROMSource::Inflater
+{
+    static const uint32_t windowSize = 32768; // max deflate distance
+    static const uint32_t pointSpan = 0x20000; // 8 banks
+
+    struct AccessPoint
+    {
+        uint32_t out; // uncompressed offset
+        uint32_t in; // compressed offset
+        int bits; // unused bits in the byte before in
+        uint32_t windowLen;
+        std::unique_ptr<uint8_t[]> window; // last 32k of output
+    };
+
+    ~Inflater();
+
+    bool read(std::ifstream &file, uint32_t offset, uint32_t len, uint8_t *ptr);
+    bool readAll(std::ifstream &file, uint32_t len, uint8_t *ptr);
+
+    bool restart(std::ifstream &file, const AccessPoint *point);
+    bool fillInput(std::ifstream &file);
+    void addPoint();
+
+    uint32_t start = 0; // of the deflate stream in the file
+    uint32_t compSize = 0;
+
+    z_stream stream{};
+    bool active = false;
+    uint32_t in = 0; // compressed bytes read
+    uint32_t out = 0; // uncompressed bytes output
+
+    std::vector<AccessPoint> points;
+
+    uint8_t inBuf[0x4000];
+    uint8_t window[windowSize]; // output goes here, out % windowSize
+};
+
+ROMSource::Inflater::~Inflater()
+{
+    if(active)
+        inflateEnd(&stream);
+}
+
+bool ROMSource::Inflater::read(std::ifstream &file, uint32_t offset, uint32_t len, uint8_t *ptr)
+{
+    // closest point before the offset
+    const AccessPoint *point = nullptr;
+    for(auto &p : points)
+    {
+        if(p.out > offset)
+            break;
+        point = &p;
+    }
+
+    // continue from the last read if we can
+    if(!active || out > offset || (point && point->out > out))
+    {
+        if(!restart(file, point))
+            return false;
+    }
+
+    while(len)
+    {
+        if(!stream.avail_in && !fillInput(file))
+            return false;
+
+        auto windowPos = out % windowSize;
+        stream.next_out = window + windowPos;
+        stream.avail_out = windowSize - windowPos;
+
+        int ret = inflate(&stream, Z_BLOCK);
+
+        if(ret != Z_OK && ret != Z_STREAM_END)
+        {
+            // corrupt, start again next time
+            inflateEnd(&stream);
+            active = false;
+            return false;
+        }
+
+        uint32_t got = windowSize - windowPos - stream.avail_out;
+
+        // copy anything in the requested range
+        if(out + got > offset)
+        {
+            uint32_t skip = offset > out ? offset - out : 0;
+            uint32_t count = std::min(got - skip, len);
+
+            memcpy(ptr, window + windowPos + skip, count);
+            ptr += count;
+            offset += count;
+            len -= count;
+        }
+
+        out += got;
+
+        if(ret == Z_STREAM_END)
+            break;
+
+        // at the end of a block (that isn't the last one)
+        if((stream.data_type & 128) && !(stream.data_type & 64) && out >= (points.empty() ? 0 : points.back().out) + pointSpan)
+            addPoint();
+    }
+
+    return len == 0;
+}
+
+bool ROMSource::Inflater::readAll(std::ifstream &file, uint32_t len, uint8_t *ptr)
+{
+    // straight into the output, no need for the index
+    if(!restart(file, nullptr))
+        return false;
+
+    stream.next_out = ptr;
+    stream.avail_out = len;
+
+    int ret = Z_OK;
+
+    while(ret == Z_OK && stream.avail_out)
+    {
+        if(!stream.avail_in && !fillInput(file))
+            break;
+
+        ret = inflate(&stream, Z_NO_FLUSH);
+    }
+
+    bool ok = stream.avail_out == 0;
+
+    // next read restarts
+    inflateEnd(&stream);
+    active = false;
+
+    return ok;
+}
+
+bool ROMSource::Inflater::restart(std::ifstream &file, const AccessPoint *point)
+{
+    if(active)
+        inflateReset(&stream);
+    else
+    {
+        stream = {};
+        if(inflateInit2(&stream, -15) != Z_OK) // raw deflate
+            return false;
+        active = true;
+    }
+
+    stream.avail_in = 0;
+
+    if(!point)
+    {
+        in = out = 0;
+        return true;
+    }
+
+    in = point->in;
+
+    if(point->bits)
+    {
+        // finish the partial byte
+        file.seekg(start + in - 1);
+        int byte = file.get();
+
+        if(!file)
+        {
+            file.clear();
+            return false;
+        }
+
+        inflatePrime(&stream, point->bits, byte >> (8 - point->bits));
+    }
+
+    inflateSetDictionary(&stream, point->window.get(), point->windowLen);
+
+    // also need it for adding new points
+    out = point->out;
+    for(uint32_t i = 0; i < point->windowLen; i++)
+        window[(out - point->windowLen + i) % windowSize] = point->window[i];
+
+    return true;
+}
+
+bool ROMSource::Inflater::fillInput(std::ifstream &file)
+{
+    auto count = std::min(uint32_t(sizeof(inBuf)), compSize - in);
+
+    if(!count)
+        return false;
+
+    file.seekg(start + in);
+    file.read(reinterpret_cast<char *>(inBuf), count);
+
+    if(!file)
+    {
+        file.clear();
+        return false;
+    }
+
+    in += count;
+    stream.next_in = inBuf;
+    stream.avail_in = count;
+    return true;
+}
+
+void ROMSource::Inflater::addPoint()
+{
+    AccessPoint point;
+    point.out = out;
+    point.in = in - stream.avail_in;
+    point.bits = stream.data_type & 7;
+    point.windowLen = std::min(out, uint32_t(windowSize));
+    point.window.reset(new uint8_t[point.windowLen]);
+
+    for(uint32_t i = 0; i < point.windowLen; i++)
+        point.window[i] = window[(out - point.windowLen + i) % windowSize];
+
+    points.push_back(std::move(point));
+}
+
+static uint16_t read16(const uint8_t *ptr)
+{
+    return ptr[0] | ptr[1] << 8;
+}
+
+static uint32_t read32(const uint8_t *ptr)
+{
+    return ptr[0] | ptr[1] << 8 | ptr[2] << 16 | uint32_t(ptr[3]) << 24;
+}
+
+static bool endsWith(const std::string &str, const char *suffix)
+{
+    auto len = strlen(suffix);
+    if(str.length() < len)
+        return false;
+
+    return std::equal(str.end() - len, str.end(), suffix, [](char a, char b){return tolower(static_cast<unsigned char>(a)) == b;});
+}
+#else
+struct ROMSource::Inflater {};
+#endif
+
+ROMSource::ROMSource()
+{
+}
+
+ROMSource::~ROMSource()
+{
+    close();
+}
+
+bool ROMSource::open(const std::string &filename)
+{
+    close();
+
+    file.open(filename, std::ios::binary);
+
+    if(!file)
+        return false;
+
+    file.seekg(0, std::ios::end);
+    uint32_t fileSize = file.tellg();
+    file.seekg(0);
+
+    name = filename;
+    size = fileSize;
+
+    // check for archives
+    uint8_t magic[4]{};
+    file.read(reinterpret_cast<char *>(magic), 4);
+    file.clear();
+
+    bool isGzip = magic[0] == 0x1F && magic[1] == 0x8B;
+    bool isZip = magic[0] == 'P' && magic[1] == 'K' && magic[2] == 3 && magic[3] == 4;
+
+    if((isGzip || isZip) && !openArchive(isZip, fileSize))
+        size = 0;
+
+    if(!size)
+    {
+        close();
+        return false;
+    }
+
+    // decompressed as needed
+    if(inflater)
+        return true;
+
+#ifdef ROM_SOURCE_MMAP
+    int fd = ::open(filename.c_str(), O_RDONLY);
+
+    if(fd != -1)
+    {
+        auto ptr = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+
+        ::close(fd); // the mapping keeps the file open
+
+        if(ptr != MAP_FAILED)
+        {
+            mapBase = ptr;
+            mapSize = fileSize;
+            data = static_cast<const uint8_t *>(ptr) + fileOffset;
+            mapped = true;
+            file.close();
+        }
+    }
+#endif
+
+    return true;
+}
+
+void ROMSource::close()
+{
+#ifdef ROM_SOURCE_MMAP
+    if(mapBase)
+        munmap(mapBase, mapSize);
+#endif
+
+    mapBase = nullptr;
+    mapSize = 0;
+
+    data = nullptr;
+    size = 0;
+    mapped = false;
+    name.clear();
+
+    if(file.is_open())
+        file.close();
+    file.clear();
+
+    fileOffset = 0;
+
+    buffer.reset();
+    inflater.reset();
+}
+
+const uint8_t *ROMSource::getData()
+{
+    if(data || !size)
+        return data;
+
+    buffer.reset(new uint8_t[size]);
+
+#ifdef ROM_SOURCE_ZLIB
+    if(inflater)
+    {
+        std::lock_guard<std::mutex> lock(fileMutex);
+
+        // all at once
+        if(!inflater->readAll(file, size, buffer.get()))
+            printf("Failed to decompress %s!\n", name.c_str());
+
+        data = buffer.get();
+        return data;
+    }
+#endif
+
+    read(0, size, buffer.get());
+    data = buffer.get();
+
+    return data;
+}
+
+void ROMSource::read(uint32_t offset, uint32_t len, uint8_t *ptr)
+{
+    // past the end reads as 0xFF
+    uint32_t avail = offset < size ? size - offset : 0;
+    if(len > avail)
+    {
+        memset(ptr + avail, 0xFF, len - avail);
+        len = avail;
+    }
+
+    if(!len)
+        return;
+
+    if(data)
+    {
+        memcpy(ptr, data + offset, len);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(fileMutex);
+
+#ifdef ROM_SOURCE_ZLIB
+    if(inflater)
+    {
+        if(!inflater->read(file, offset, len, ptr))
+            printf("Failed to decompress %s!\n", name.c_str());
+        return;
+    }
+#endif
+
+    file.seekg(fileOffset + offset);
+    file.read(reinterpret_cast<char *>(ptr), len);
+    file.clear();
+}
+
+bool ROMSource::openArchive(bool zip, uint32_t fileSize)
+{
+#ifdef ROM_SOURCE_ZLIB
+    uint32_t dataOffset, compSize;
+    bool deflated = true;
+
+    if(zip)
+    {
+        // find the end of central directory record
+        uint32_t tailLen = std::min(fileSize, 22u + 0xFFFF);
+        std::unique_ptr<uint8_t[]> tail(new uint8_t[tailLen]);
+
+        file.seekg(fileSize - tailLen);
+        file.read(reinterpret_cast<char *>(tail.get()), tailLen);
+
+        int eocd = tailLen - 22;
+        while(eocd >= 0 && read32(tail.get() + eocd) != 0x06054B50)
+            eocd--;
+
+        if(!file || eocd < 0)
+        {
+            printf("%s: not a valid .zip\n", name.c_str());
+            return false;
+        }
+
+        int numEntries = read16(tail.get() + eocd + 10);
+        uint32_t dirSize = read32(tail.get() + eocd + 12);
+        uint32_t dirOffset = read32(tail.get() + eocd + 16);
+
+        std::unique_ptr<uint8_t[]> dir(new uint8_t[dirSize]);
+        file.seekg(dirOffset);
+        file.read(reinterpret_cast<char *>(dir.get()), dirSize);
+
+        if(!file)
+        {
+            printf("%s: not a valid .zip\n", name.c_str());
+            return false;
+        }
+
+        // find a ROM, or anything that isn't a directory
+        const uint8_t *entry = nullptr;
+        std::string entryName;
+
+        for(uint32_t off = 0; numEntries-- && off + 46 <= dirSize && read32(dir.get() + off) == 0x02014B50;)
+        {
+            auto ptr = dir.get() + off;
+            int nameLen = read16(ptr + 28);
+            std::string curName(reinterpret_cast<const char *>(ptr + 46), std::min(uint32_t(nameLen), dirSize - off - 46));
+
+            bool isROM = endsWith(curName, ".gb") || endsWith(curName, ".gbc") || endsWith(curName, ".gba");
+
+            if(isROM || (!entry && !curName.empty() && curName.back() != '/'))
+            {
+                entry = ptr;
+                entryName = curName;
+
+                if(isROM)
+                    break;
+            }
+
+            off += 46 + nameLen + read16(ptr + 30) + read16(ptr + 32);
+        }
+
+        if(!entry)
+        {
+            printf("%s: no ROM in .zip\n", name.c_str());
+            return false;
+        }
+
+        int flags = read16(entry + 8);
+        int method = read16(entry + 10);
+
+        if((flags & 1) || (method != 0 && method != 8))
+        {
+            printf("%s: %s is encrypted or uses an unsupported compression method\n", name.c_str(), entryName.c_str());
+            return false;
+        }
+
+        compSize = read32(entry + 20);
+        size = read32(entry + 24);
+
+        // skip the local header
+        uint8_t local[30];
+        uint32_t localOffset = read32(entry + 42);
+        file.seekg(localOffset);
+        file.read(reinterpret_cast<char *>(local), sizeof(local));
+
+        if(!file || read32(local) != 0x04034B50)
+        {
+            printf("%s: not a valid .zip\n", name.c_str());
+            return false;
+        }
+
+        dataOffset = localOffset + 30 + read16(local + 26) + read16(local + 28);
+        deflated = method == 8;
+        name = entryName;
+    }
+    else
+    {
+        // gzip header
+        uint8_t head[10];
+        file.seekg(0);
+        file.read(reinterpret_cast<char *>(head), sizeof(head));
+
+        if(!file || head[2] != 8 || fileSize < 18)
+        {
+            printf("%s: not a valid .gz\n", name.c_str());
+            return false;
+        }
+
+        int flags = head[3];
+
+        if(flags & (1 << 2)) // extra
+        {
+            uint8_t len[2];
+            file.read(reinterpret_cast<char *>(len), 2);
+            file.seekg(read16(len), std::ios::cur);
+        }
+
+        std::string origName;
+
+        if(flags & (1 << 3)) // name
+            std::getline(file, origName, '\0');
+
+        if(flags & (1 << 4)) // comment
+            file.ignore(std::numeric_limits<std::streamsize>::max(), '\0');
+
+        if(flags & (1 << 1)) // header crc
+            file.seekg(2, std::ios::cur);
+
+        if(!file)
+        {
+            printf("%s: not a valid .gz\n", name.c_str());
+            return false;
+        }
+
+        dataOffset = file.tellg();
+        compSize = fileSize - 8 - dataOffset;
+
+        // size is at the end
+        uint8_t isize[4];
+        file.seekg(fileSize - 4);
+        file.read(reinterpret_cast<char *>(isize), 4);
+        size = read32(isize);
+
+        if(!origName.empty())
+            name = origName;
+        else if(endsWith(name, ".gz"))
+            name = name.substr(0, name.length() - 3);
+    }
+
+    file.clear();
+
+    if(dataOffset > fileSize || (deflated ? compSize : size) > fileSize - dataOffset)
+    {
+        printf("%s: truncated archive\n", name.c_str());
+        return false;
+    }
+
+    if(size > 32 * 1024 * 1024) // largest GBA ROM
+    {
+        printf("%s: too large (%u bytes)\n", name.c_str(), size);
+        return false;
+    }
+
+    if(!deflated)
+    {
+        // stored, can be read/mapped directly
+        fileOffset = dataOffset;
+        return true;
+    }
+
+    inflater.reset(new Inflater);
+    inflater->start = dataOffset;
+    inflater->compSize = compSize;
+
+    return true;
+#else
+    printf("%s is compressed, built without zlib!\n", name.c_str());
+    return false;
+#endif
+}
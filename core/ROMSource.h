@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// read-only ROM file for the desktop frontends
+// mapped into memory if possible so that multiple instances share the same pages,
+// otherwise banks are read from the file as needed
+// .gz and .zip (stored/deflate) files are decompressed if built with zlib (ROM_SOURCE_ZLIB)
+class ROMSource final
+{
+public:
+    ROMSource();
+    ROMSource(const ROMSource &) = delete;
+    ~ROMSource();
+
+    ROMSource &operator=(const ROMSource &) = delete;
+
+    bool open(const std::string &filename);
+    void close();
+
+    bool isOpen() const {return size != 0;}
+    bool isMapped() const {return mapped;}
+    bool isCompressed() const {return inflater != nullptr;}
+
+    uint32_t getSize() const {return size;}
+
+    // filename of the ROM, inside the archive if compressed
+    const std::string &getName() const {return name;}
+
+    // the entire ROM, read into memory if it isn't mapped
+    const uint8_t *getData();
+
+    // for the ROM bank callback, safe to call from multiple threads
+    void read(uint32_t offset, uint32_t len, uint8_t *ptr);
+
+private:
+    struct Inflater;
+
+    bool openArchive(bool zip, uint32_t fileSize);
+
+    const uint8_t *data = nullptr;
+    uint32_t size = 0;
+    bool mapped = false;
+
+    std::string name;
+
+    // mapping of the whole file, data may be inside it
+    void *mapBase = nullptr;
+    size_t mapSize = 0;
+
+    // fallback
+    std::ifstream file;
+    uint32_t fileOffset = 0; // of the ROM data, non-zero if stored in a .zip
+    std::mutex fileMutex;
+    std::unique_ptr<uint8_t[]> buffer;
+
+    std::unique_ptr<Inflater> inflater;
+};
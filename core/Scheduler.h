@@ -0,0 +1,139 @@
+#pragma once
+#include <cstdint>
+
+// fixed size min-heap of timed events, each event can only be scheduled once
+template<class Event, int numEvents>
+class Scheduler final
+{
+public:
+    Scheduler()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        count = 0;
+
+        for(auto &i : heapIndex)
+            i = -1;
+    }
+
+    // adds the event or moves it if already scheduled
+    void schedule(Event event, uint32_t cycle)
+    {
+        int i = heapIndex[static_cast<int>(event)];
+
+        if(i == -1)
+        {
+            i = count++;
+            heap[i].event = event;
+            heap[i].cycle = cycle;
+            siftUp(i);
+            return;
+        }
+
+        auto oldCycle = heap[i].cycle;
+        heap[i].cycle = cycle;
+
+        if(static_cast<int32_t>(cycle - oldCycle) < 0)
+            siftUp(i);
+        else
+            siftDown(i);
+    }
+
+    void remove(Event event)
+    {
+        int i = heapIndex[static_cast<int>(event)];
+
+        if(i == -1)
+            return;
+
+        heapIndex[static_cast<int>(event)] = -1;
+
+        if(i == --count)
+            return;
+
+        // move the last one into the gap
+        heap[i] = heap[count];
+        heapIndex[static_cast<int>(heap[i].event)] = i;
+
+        if(i > 0 && before(heap[i], heap[(i - 1) / 2]))
+            siftUp(i);
+        else
+            siftDown(i);
+    }
+
+    bool isScheduled(Event event) const {return heapIndex[static_cast<int>(event)] != -1;}
+
+    bool empty() const {return count == 0;}
+
+    // only valid if not empty
+    Event getNextEvent() const {return heap[0].event;}
+    uint32_t getNextCycle() const {return heap[0].cycle;}
+
+private:
+    struct Entry
+    {
+        uint32_t cycle;
+        Event event;
+    };
+
+    // cycles are compared relative to each other so that wrapping around works
+    // events at the same cycle run in enum order
+    static bool before(const Entry &a, const Entry &b)
+    {
+        auto diff = static_cast<int32_t>(a.cycle - b.cycle);
+        return diff < 0 || (diff == 0 && a.event < b.event);
+    }
+
+    void siftUp(int i)
+    {
+        auto entry = heap[i];
+
+        while(i > 0)
+        {
+            int parent = (i - 1) / 2;
+
+            if(!before(entry, heap[parent]))
+                break;
+
+            heap[i] = heap[parent];
+            heapIndex[static_cast<int>(heap[i].event)] = i;
+            i = parent;
+        }
+
+        heap[i] = entry;
+        heapIndex[static_cast<int>(entry.event)] = i;
+    }
+
+    void siftDown(int i)
+    {
+        auto entry = heap[i];
+
+        while(true)
+        {
+            int child = i * 2 + 1;
+
+            if(child >= count)
+                break;
+
+            if(child + 1 < count && before(heap[child + 1], heap[child]))
+                child++;
+
+            if(!before(heap[child], entry))
+                break;
+
+            heap[i] = heap[child];
+            heapIndex[static_cast<int>(heap[i].event)] = i;
+            i = child;
+        }
+
+        heap[i] = entry;
+        heapIndex[static_cast<int>(entry.event)] = i;
+    }
+
+    Entry heap[numEvents];
+    int8_t heapIndex[numEvents]; // position of each event in the heap, -1 if not scheduled
+    int count = 0;
+};
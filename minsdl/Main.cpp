@@ -1,3 +1,5 @@
+#include <atomic>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -8,9 +10,12 @@
 
 #include "AGBCPU.h"
 #include "DMGCPU.h"
+#include "ROMSource.h"
+#include "SaveJournal.h"
 
-static bool quit = false;
+static std::atomic<bool> quit = false; // also read by the audio callback and prefetch thread
 static bool turbo = false;
+static bool romPrefetch = false;
 
 static bool isAGB = false;
 
@@ -23,7 +28,9 @@ static uint8_t romBankCache[0x4000];
 
 static uint8_t agbBIOSROM[0x4000];
 
-static std::ifstream romFile;
+static ROMSource romSource;
+
+static SaveJournal saveJournal;
 
 static const std::unordered_map<SDL_Keycode, int> dmgKeyMap {
     {SDLK_RIGHT,  1 << 0},
@@ -55,10 +62,7 @@ static const std::unordered_map<SDL_Keycode, int> agbKeyMap {
 
 static void getROMBank(uint8_t bank, uint8_t *ptr)
 {
-    auto addr = bank * 0x4000;
-
-    romFile.seekg(addr);
-    romFile.read((char *)ptr, 0x4000);
+    romSource.read(bank * 0x4000, 0x4000, ptr);
 }
 
 static void audioCallback(void *userdata, Uint8 *stream, int len)
@@ -91,25 +95,9 @@ static void audioCallback(void *userdata, Uint8 *stream, int len)
     }
 }
 
-static uint8_t *readSave(const std::string &savePath, size_t &saveSize)
+static void updateSave(uint8_t *data, unsigned int size, const uint32_t *dirtyPages)
 {
-    std::ifstream saveFile(savePath, std::ios::binary);
-
-    if(!saveFile)
-    {
-        std::cout << "Could not find " << savePath << ", no save loaded.\n";
-        return nullptr;
-    }
-
-    saveFile.seekg(0, std::ios::end);
-    saveSize = saveFile.tellg();
-    saveFile.seekg(0);
-
-    auto saveData = new uint8_t[saveSize];
-    saveFile.read(reinterpret_cast<char *>(saveData), saveSize);
-    std::cout << "Read " << saveSize << " bytes from " << savePath << "\n";
-
-    return saveData;
+    saveJournal.update(data, size, dirtyPages);
 }
 
 static void pollEvents()
@@ -171,6 +159,19 @@ int main(int argc, char *argv[])
         }
         else if(arg == "--no-bios")
             useBIOS = false;
+        else if(arg == "--interpreter")
+            agbCPU.setExecMode(AGBCPU::ExecMode::Interpreter);
+        else if(arg == "--jit")
+            agbCPU.setExecMode(AGBCPU::ExecMode::JIT);
+        else if(arg == "--no-idle-skip")
+        {
+            agbCPU.setIdleLoopSkip(false);
+            dmgCPU.setIdleLoopSkip(false);
+        }
+        else if(arg == "--m4a-hle")
+            agbCPU.setM4AMixerHLE(true);
+        else if(arg == "--rom-prefetch")
+            romPrefetch = true;
         else
             break;
     }
@@ -192,17 +193,24 @@ int main(int argc, char *argv[])
 
     romFilename = argv[i];
 
-    std::string ext = romFilename.substr(romFilename.find_last_of('.'));
-    isAGB = ext == ".gba";
+    if(!romSource.open(romFilename))
+    {
+        std::cerr << "Failed to open ROM \"" << romFilename << "\"\n";
+        return 1;
+    }
 
-    romFile.open(romFilename, std::ios::binary);
+    // use the name inside the archive if compressed
+    auto &romName = romSource.getName();
+    auto extPos = romName.find_last_of('.');
 
-    if(!romFile)
+    if(extPos == std::string::npos)
     {
-        std::cerr << "Failed to open ROM \"" << romFilename << "\"\n";
+        std::cerr << "Can't tell what \"" << romName << "\" is without an extension\n";
         return 1;
     }
 
+    isAGB = romName.compare(extPos, std::string::npos, ".gba") == 0;
+
     // emu init
     if(isAGB)
     {
@@ -230,31 +238,28 @@ int main(int argc, char *argv[])
         else
             std::cout << "BIOS emulation is unfinished and likely inaccurate!\n";
         
-        // read the entire ROM, this one doesn't have the load callback/caching setup
-        romFile.seekg(0, std::ios::end);
-        auto romSize = romFile.tellg();
-        romFile.seekg(0);
-
-        auto romData = new uint8_t[romSize]; // FIXME: leaky
-        romFile.read(reinterpret_cast<char *>(romData), romSize);
-
+        // need the entire ROM, this one doesn't have the load callback/caching setup
         agbCPU.getDisplay().setFramebuffer(screenData);
 
-        mem.setCartROM(romData, romSize);
+        mem.setCartROM(romSource.getData(), romSource.getSize());
 
         agbCPU.reset();
 
         // attempt to read save
         if(!turbo)
         {
+            saveJournal.setPath(romFilename.substr(0, romFilename.length() - 3) + "sav");
+
             size_t size;
-            auto saveData = readSave(romFilename.substr(0, romFilename.length() - 3) + "sav", size);
+            auto saveData = saveJournal.read(size);
 
             if(saveData)
             {
                 mem.loadCartridgeSave(saveData, size);
                 delete[] saveData;
             }
+
+            mem.setCartRamUpdateCallback(updateSave);
         }
     }
     else
@@ -264,18 +269,27 @@ int main(int argc, char *argv[])
         auto &mem = dmgCPU.getMem();
         mem.setROMBankCallback(getROMBank);
         mem.addROMCache(romBankCache, sizeof(romBankCache));
+        mem.setROMBankPrefetch(romPrefetch);
+
+        // use the entire ROM if it could be mapped, otherwise banks are loaded as needed
+        if(romSource.isMapped())
+            mem.setCartROM(romSource.getData(), romSource.getSize());
 
         dmgCPU.reset();
 
         // attempt to read save
+        saveJournal.setPath(romFilename + ".ram");
+
         size_t size;
-        auto saveData = readSave(romFilename + ".ram", size);
+        auto saveData = saveJournal.read(size);
     
         if(saveData)
         {
             mem.loadCartridgeRAM(saveData, size);
             delete[] saveData;
         }
+
+        mem.setCartRamUpdateCallback(updateSave);
     }
 
     // SDL init
@@ -315,8 +329,24 @@ int main(int argc, char *argv[])
     if(!turbo)
         SDL_PauseAudioDevice(dev, 0);
 
+    // load predicted ROM banks in the background
+    std::thread prefetchThread;
+
+    if(romPrefetch && !isAGB && !romSource.isMapped())
+    {
+        prefetchThread = std::thread([]()
+        {
+            while(!quit)
+            {
+                if(!dmgCPU.getMem().prefetchROMBank())
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    }
+
     auto lastTick = SDL_GetTicks();
     auto startTime = SDL_GetTicks();
+    auto lastSaveSync = startTime;
 
     auto checkTimeLimit = [timeLimit, &timeToRun]()
     {
@@ -406,6 +436,17 @@ int main(int argc, char *argv[])
 
         lastTick = now;
 
+        // append any save changes to the journal
+        if(now - lastSaveSync >= 1000)
+        {
+            if(isAGB)
+                agbCPU.getMem().syncCartridgeSave();
+            else
+                dmgCPU.getMem().syncCartridgeRAM();
+
+            lastSaveSync = now;
+        }
+
         // TODO: sync
         SDL_UpdateTexture(texture, nullptr, screenData, screenWidth * 2);
         SDL_RenderClear(renderer);
@@ -416,41 +457,13 @@ int main(int argc, char *argv[])
     // write save
     if(isAGB)
     {
-        int size = 0;
-        switch(agbCPU.getMem().getCartridgeSaveType())
-        {
-            case AGBMemory::SaveType::Unknown:
-                break;
-            case AGBMemory::SaveType::EEPROM_512:
-                size = 512;
-                break;
-            case AGBMemory::SaveType::EEPROM_8K:
-                size = 8 * 1024;
-                break;
-            case AGBMemory::SaveType::RAM:
-                size = 32 * 1024;
-                break;
-            case AGBMemory::SaveType::Flash:
-                size = 128 * 1024; // TODO: possibly 64k
-                break;
-        }
-        if(size && !turbo)
-        {
-            auto saveFilename = romFilename.substr(0, romFilename.length() - 3) + "sav";
-            std::ofstream saveFile(saveFilename, std::ios::out | std::ios::binary);
-            saveFile.write(reinterpret_cast<char *>(agbCPU.getMem().getCartridgeSave()), size);
+        auto size = agbCPU.getMem().getCartridgeSaveSize();
 
-            if(!saveFile)
-                std::cerr << "Failed to write " << saveFilename << "\n";
-            else
-                std::cout << "Wrote " << size << " bytes to " << saveFilename << "\n";
-        }
+        if(size && !turbo)
+            saveJournal.write(agbCPU.getMem().getCartridgeSave(), size);
     }
     else
-    {
-        std::ofstream saveFile(romFilename + ".ram", std::ios::out | std::ios::binary);
-        saveFile.write(reinterpret_cast<char *>(dmgCPU.getMem().getCartridgeRAM()), dmgCPU.getMem().getCartridgeRAMSize());
-    }
+        saveJournal.write(dmgCPU.getMem().getCartridgeRAM(), dmgCPU.getMem().getCartridgeRAMSize());
 
     if(timeLimit)
     {
@@ -458,6 +471,37 @@ int main(int argc, char *argv[])
         printf("Ran for %ums\n", runTime);
     }
 
+    uint64_t cyclesRun, cyclesSkipped;
+    uint32_t loopsSkipped;
+
+    if(isAGB)
+    {
+        auto &stats = agbCPU.getIdleLoopStats();
+        cyclesRun = stats.cyclesRun;
+        cyclesSkipped = stats.cyclesSkipped;
+        loopsSkipped = stats.loopsSkipped;
+    }
+    else
+    {
+        auto &stats = dmgCPU.getIdleLoopStats();
+        cyclesRun = stats.cyclesRun;
+        cyclesSkipped = stats.cyclesSkipped;
+        loopsSkipped = stats.loopsSkipped;
+    }
+
+    if(prefetchThread.joinable())
+        prefetchThread.join();
+
+    if(!isAGB)
+    {
+        auto &stats = dmgCPU.getMem().getROMCacheStats();
+        printf("ROM cache: %u hits (%u prefetched), %u misses, %u evictions\n", stats.hits, stats.prefetchHits, stats.misses, stats.evictions);
+    }
+
+    if(cyclesRun)
+        printf("Skipped %llu of %llu cycles (%.1f%%) in %u idle loops\n", static_cast<unsigned long long>(cyclesSkipped), static_cast<unsigned long long>(cyclesRun),
+               cyclesSkipped * 100.0 / cyclesRun, loopsSkipped);
+
     SDL_CloseAudioDevice(dev);
 
     SDL_DestroyTexture(texture);
@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <vector>
+
+#include "SaveJournal.h"
+
+uint8_t *SaveJournal::read(size_t &saveSize)
+{
+    std::ifstream saveFile(savePath, std::ios::binary);
+
+    uint8_t *saveData = nullptr;
+    saveSize = 0;
+
+    if(saveFile)
+    {
+        saveFile.seekg(0, std::ios::end);
+        saveSize = saveFile.tellg();
+        saveFile.seekg(0);
+
+        saveData = new uint8_t[saveSize];
+        saveFile.read(reinterpret_cast<char *>(saveData), saveSize);
+        std::cout << "Read " << saveSize << " bytes from " << savePath << "\n";
+    }
+
+    // apply any changes since it was last written
+    std::ifstream journalFile(savePath + ".journal", std::ios::binary);
+    int numRecords = 0;
+
+    uint32_t head[3]; // size, offset, length
+    std::vector<uint8_t> recordData;
+
+    while(journalFile.read(reinterpret_cast<char *>(head), sizeof(head)))
+    {
+        // corrupt, ignore it and anything after
+        if(head[0] > maxSaveSize || head[1] > head[0] || head[2] > head[0] - head[1])
+            break;
+
+        recordData.resize(head[2]);
+
+        if(!journalFile.read(reinterpret_cast<char *>(recordData.data()), head[2]))
+            break; // incomplete, ignore it
+
+        // new or larger (type detected since the last save)
+        if(head[0] > saveSize)
+        {
+            auto newData = new uint8_t[head[0]];
+            memset(newData, 0xFF, head[0]);
+
+            if(saveData)
+            {
+                memcpy(newData, saveData, saveSize);
+                delete[] saveData;
+            }
+
+            saveData = newData;
+            saveSize = head[0];
+        }
+
+        memcpy(saveData + head[1], recordData.data(), head[2]);
+        numRecords++;
+    }
+
+    if(numRecords)
+    {
+        std::cout << "Applied " << numRecords << " changes from " << savePath << ".journal\n";
+        write(saveData, saveSize);
+    }
+    else if(!saveData)
+        std::cout << "Could not find " << savePath << ", no save loaded.\n";
+
+    return saveData;
+}
+
+void SaveJournal::write(const uint8_t *data, uint32_t size)
+{
+    // write the whole thing then replace the old one
+    {
+        std::ofstream saveFile(savePath + ".tmp", std::ios::out | std::ios::binary);
+        saveFile.write(reinterpret_cast<const char *>(data), size);
+
+        if(!saveFile)
+        {
+            std::cerr << "Failed to write " << savePath << "\n";
+            return;
+        }
+    }
+
+    std::error_code err;
+    std::filesystem::rename(savePath + ".tmp", savePath, err);
+
+    if(err)
+    {
+        std::cerr << "Failed to write " << savePath << ": " << err.message() << "\n";
+        return;
+    }
+
+    // journal is no longer needed
+    journal.close();
+    std::filesystem::remove(savePath + ".journal", err);
+    journalSize = 0;
+
+    std::cout << "Wrote " << size << " bytes to " << savePath << "\n";
+}
+
+void SaveJournal::update(const uint8_t *data, uint32_t size, const uint32_t *dirtyPages)
+{
+    if(savePath.empty() || !size)
+        return;
+
+    if(!journal.is_open())
+        journal.open(savePath + ".journal", std::ios::out | std::ios::binary | std::ios::app);
+
+    // a record for each run of 256 byte pages
+    const auto isDirty = [dirtyPages](unsigned int page){return dirtyPages[page / 32] & (1u << (page % 32));};
+
+    for(unsigned int page = 0; page * 256 < size;)
+    {
+        if(!isDirty(page))
+        {
+            page++;
+            continue;
+        }
+
+        unsigned int start = page;
+        while(page * 256 < size && isDirty(page))
+            page++;
+
+        uint32_t head[3]{size, start * 256, std::min(page * 256, size) - start * 256};
+
+        journal.write(reinterpret_cast<const char *>(head), sizeof(head));
+        journal.write(reinterpret_cast<const char *>(data + head[1]), head[2]);
+        journalSize += sizeof(head) + head[2];
+    }
+
+    journal.flush();
+
+    // compact
+    if(journalSize > size * 4)
+        write(data, size);
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+// cartridge save file
+// saves are written in full at exit, changes in between are appended to a journal
+// as (save size, offset, length, data) records
+class SaveJournal final
+{
+public:
+    static const uint32_t maxSaveSize = 128 * 1024; // largest flash/MBC5 RAM
+
+    void setPath(const std::string &path) {savePath = path;}
+    const std::string &getPath() const {return savePath;}
+
+    // reads the save and applies any changes from the journal, nullptr if there isn't one
+    uint8_t *read(size_t &saveSize);
+
+    // writes the whole save and removes the journal
+    void write(const uint8_t *data, uint32_t size);
+
+    // appends the dirty 256 byte pages to the journal, compacting it if it's getting large
+    void update(const uint8_t *data, uint32_t size, const uint32_t *dirtyPages);
+
+    uint32_t getJournalSize() const {return journalSize;}
+
+private:
+    std::string savePath;
+    std::ofstream journal;
+    uint32_t journalSize = 0;
+};
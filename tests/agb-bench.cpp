@@ -0,0 +1,212 @@
+// CPU microbenchmarks for the AGB core
+// only uses the public interface, so it can also be built against older revisions of the core to compare (see CMakeLists.txt)
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "AGBCPU.h"
+
+static uint16_t screenData[240 * 160];
+
+// the ROM starts in ARM mode at 0x8000000, so each of these starts with some ARM setup code
+struct Benchmark
+{
+    const char *name;
+    std::vector<uint32_t> armCode;
+    std::vector<uint16_t> thumbCode; // switched to after armCode if not empty
+};
+
+static const Benchmark benchmarks[]
+{
+    // load/ALU/store loop covering a few THUMB formats, mostly dispatch overhead
+    {
+        "thumb",
+        {
+            0xE3A00403, // mov r0, #0x3000000
+            0xE3A01000, // mov r1, #0
+            0xE3A04000, // mov r4, #0
+            0xE28F5001, // add r5, pc, #1
+            0xE12FFF15, // bx r5
+        },
+        {
+            0x6802, // loop: ldr r2, [r0]
+            0x1852, // adds r2, r2, r1
+            0x00D3, // lsls r3, r2, #3
+            0x4053, // eors r3, r2
+            0x6043, // str r3, [r0, #4]
+            0x8845, // ldrh r5, [r0, #2]
+            0x46A8, // mov r8, r5
+            0x4445, // add r5, r8
+            0x106D, // asrs r5, r5, #1
+            0x7205, // strb r5, [r0, #8]
+            0x3101, // adds r1, #1
+            0x3C01, // subs r4, #1
+            0xD1F2, // bne loop
+        }
+    },
+
+    // the same sort of loop in ARM, using r0-r4 in system mode
+    {
+        "arm",
+        {
+            0xE3A00403, // mov r0, #0x3000000
+            0xE3A01000, // mov r1, #0
+            0xE3A04000, // mov r4, #0
+            0xE5902000, // loop: ldr r2, [r0]
+            0xE0822001, // add r2, r2, r1
+            0xE0223182, // eor r3, r2, r2, lsl #3
+            0xE5803004, // str r3, [r0, #4]
+            0xE2811001, // add r1, r1, #1
+            0xE2544001, // subs r4, r4, #1
+            0x1AFFFFF8, // bne loop
+        },
+        {}
+    },
+
+    // the same again using r8-r12, which are banked in FIQ mode
+    {
+        "arm-irq",
+        {
+            0xE321F0D2, // msr cpsr_c, #0xD2 (IRQ)
+            0xE3A08403, // mov r8, #0x3000000
+            0xE3A09000, // mov r9, #0
+            0xE3A0C000, // mov r12, #0
+            0xE598A000, // loop: ldr r10, [r8]
+            0xE08AA009, // add r10, r10, r9
+            0xE02AB18A, // eor r11, r10, r10, lsl #3
+            0xE588B004, // str r11, [r8, #4]
+            0xE2899001, // add r9, r9, #1
+            0xE25CC001, // subs r12, r12, #1
+            0x1AFFFFF8, // bne loop
+        },
+        {}
+    },
+    {
+        "arm-fiq",
+        {
+            0xE321F0D1, // msr cpsr_c, #0xD1 (FIQ)
+            0xE3A08403, // mov r8, #0x3000000
+            0xE3A09000, // mov r9, #0
+            0xE3A0C000, // mov r12, #0
+            0xE598A000, // loop: ldr r10, [r8]
+            0xE08AA009, // add r10, r10, r9
+            0xE02AB18A, // eor r11, r10, r10, lsl #3
+            0xE588B004, // str r11, [r8, #4]
+            0xE2899001, // add r9, r9, #1
+            0xE25CC001, // subs r12, r12, #1
+            0x1AFFFFF8, // bne loop
+        },
+        {}
+    },
+
+    // switching between modes and using the banked registers, like an interrupt handler
+    {
+        "mode-switch",
+        {
+            0xE3A00403, // mov r0, #0x3000000
+            0xE3A01000, // mov r1, #0
+            0xE3A04000, // mov r4, #0
+            0xE321F0D2, // loop: msr cpsr_c, #0xD2 (IRQ)
+            0xE28DD001, // add sp, sp, #1
+            0xE580D000, // str sp, [r0]
+            0xE321F0D1, // msr cpsr_c, #0xD1 (FIQ)
+            0xE2888001, // add r8, r8, #1
+            0xE5808004, // str r8, [r0, #4]
+            0xE321F0DF, // msr cpsr_c, #0xDF (system)
+            0xE0888001, // add r8, r8, r1
+            0xE2544001, // subs r4, r4, #1
+            0x1AFFFFF5, // bne loop
+        },
+        {}
+    },
+};
+
+// exec mode selection, doesn't exist in older cores
+template<class CPU>
+static auto setExecMode(CPU &cpu, const std::string &mode, int) -> decltype(cpu.setExecMode(CPU::ExecMode::Interpreter), bool())
+{
+    if(mode == "interpreter")
+        cpu.setExecMode(CPU::ExecMode::Interpreter);
+    else if(mode == "cached")
+        cpu.setExecMode(CPU::ExecMode::Cached);
+    else if(mode == "jit")
+        cpu.setExecMode(CPU::ExecMode::JIT);
+    else
+        return false;
+
+    return true;
+}
+
+template<class CPU>
+static bool setExecMode(CPU &cpu, const std::string &mode, long)
+{
+    return mode == "interpreter";
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " benchmark [emulated seconds] [interpreter|cached|jit]\n";
+        std::cerr << "benchmarks:";
+        for(auto &bench : benchmarks)
+            std::cerr << " " << bench.name;
+        std::cerr << "\n";
+        return 1;
+    }
+
+    std::string name = argv[1];
+    int seconds = argc > 2 ? std::stoi(argv[2]) : 10;
+    std::string execMode = argc > 3 ? argv[3] : "";
+
+    const Benchmark *bench = nullptr;
+    for(auto &b : benchmarks)
+    {
+        if(name == b.name)
+            bench = &b;
+    }
+
+    if(!bench)
+    {
+        std::cerr << "Unknown benchmark " << name << "\n";
+        return 1;
+    }
+
+    // code at the start of an otherwise empty ROM
+    static uint8_t rom[0x10000];
+    auto armLen = bench->armCode.size() * 4;
+    memcpy(rom, bench->armCode.data(), armLen);
+    memcpy(rom + armLen, bench->thumbCode.data(), bench->thumbCode.size() * 2);
+
+    auto cpu = new AGBCPU;
+    cpu->getMem().setCartROM(rom, sizeof(rom));
+    cpu->getDisplay().setFramebuffer(screenData);
+    cpu->reset();
+
+    if(!execMode.empty() && !setExecMode(*cpu, execMode, 0))
+    {
+        std::cerr << "Exec mode " << execMode << " not supported\n";
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    for(int i = 0; i < seconds * 100; i++)
+    {
+        cpu->run(10);
+
+        auto &apu = cpu->getAPU();
+        while(apu.getNumSamples())
+            apu.getSample();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    auto time = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+
+    std::cout << name << ": " << seconds << " emulated seconds in " << time << "ms\n";
+
+    delete cpu;
+    return 0;
+}
@@ -0,0 +1,176 @@
+// checks the bulk DMA copy (AGBMemory::dmaCopy) against doing each read/write like the DMA loop in AGBCPU
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <vector>
+
+#include "AGBCPU.h"
+
+struct Region
+{
+    uint32_t addr, size;
+};
+
+// plain memory DMA can read from/write to
+static const Region ramRegions[]
+{
+    {0x2000000, 0x40000}, // EWRAM
+    {0x3000000, 0x8000},  // IWRAM
+    {0x5000000, 0x400},   // palette
+    {0x6000000, 0x18000}, // VRAM
+    {0x7000000, 0x400},   // OAM
+};
+
+static const uint32_t romSize = 0x100000;
+
+static std::mt19937 rng(0xD4A);
+
+static uint32_t randAddr(bool src)
+{
+    // ROM is only a source
+    int numRegions = std::size(ramRegions) + (src ? 1 : 0);
+    int index = rng() % numRegions;
+
+    Region region = index < static_cast<int>(std::size(ramRegions)) ? ramRegions[index] : Region{0x8000000, romSize};
+
+    // mostly near the start/end, sometimes in a mirror
+    uint32_t offset;
+    switch(rng() % 4)
+    {
+        case 0:
+            offset = rng() % 0x100;
+            break;
+        case 1:
+            offset = region.size - rng() % 0x100;
+            break;
+        case 2:
+            offset = region.size * (1 + rng() % 3) + rng() % region.size;
+            break;
+        default:
+            offset = rng() % region.size;
+    }
+
+    return region.addr + offset;
+}
+
+static AGBCPU *createCPU(const uint8_t *rom)
+{
+    auto cpu = new AGBCPU;
+    cpu->getMem().setCartROM(rom, romSize);
+    cpu->reset();
+
+    return cpu;
+}
+
+static bool compareMem(AGBMemory &a, AGBMemory &b)
+{
+    for(auto &region : ramRegions)
+    {
+        if(memcmp(a.mapAddress(region.addr), b.mapAddress(region.addr), region.size) != 0)
+        {
+            std::cerr << "memory differs in region " << std::hex << region.addr << std::dec << "\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template<class T>
+static bool testCopy(AGBMemory &fastMem, AGBMemory &slowMem, uint32_t srcAddr, uint32_t dstAddr, int count, bool fixedSrc, bool sequential, int &numCopied)
+{
+    int fastCycles = 0, slowCycles = 0;
+    uint32_t fastLastVal = 0, slowLastVal = 0;
+
+    if(!fastMem.dmaCopy<T>(srcAddr, dstAddr, count, fixedSrc, fastCycles, sequential, fastLastVal))
+        return compareMem(fastMem, slowMem); // shouldn't have touched anything
+
+    numCopied++;
+
+    for(int i = 0; i < count; i++)
+    {
+        slowLastVal = slowMem.read<T>(srcAddr, slowCycles, sequential);
+        slowMem.write<T>(dstAddr, slowLastVal, slowCycles, sequential);
+
+        dstAddr += sizeof(T);
+        if(!fixedSrc)
+            srcAddr += sizeof(T);
+
+        sequential = true;
+    }
+
+    if(fastCycles != slowCycles)
+    {
+        std::cerr << "cycles " << fastCycles << " != " << slowCycles << "\n";
+        return false;
+    }
+
+    if(fastLastVal != slowLastVal)
+    {
+        std::cerr << "last value " << std::hex << fastLastVal << " != " << slowLastVal << std::dec << "\n";
+        return false;
+    }
+
+    return compareMem(fastMem, slowMem);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? std::stoi(argv[1]) : 20000;
+
+    std::vector<uint8_t> rom(romSize);
+    for(auto &b : rom)
+        b = rng();
+
+    auto fastCPU = createCPU(rom.data());
+    auto slowCPU = createCPU(rom.data());
+    auto &fastMem = fastCPU->getMem();
+    auto &slowMem = slowCPU->getMem();
+
+    for(auto &region : ramRegions)
+    {
+        auto fastPtr = fastMem.mapAddress(region.addr);
+        for(uint32_t i = 0; i < region.size; i++)
+            fastPtr[i] = rng();
+
+        memcpy(slowMem.mapAddress(region.addr), fastPtr, region.size);
+    }
+
+    int numCopied = 0;
+
+    for(int i = 0; i < iterations; i++)
+    {
+        bool is32Bit = rng() & 1;
+        int width = is32Bit ? 4 : 2;
+
+        uint32_t srcAddr = randAddr(true) & ~(width - 1);
+        uint32_t dstAddr = randAddr(false) & ~(width - 1);
+        int count = rng() % 4 ? 1 + rng() % 0x40 : 1 + rng() % 0x4000;
+        bool fixedSrc = (rng() % 4) == 0;
+        bool sequential = rng() & 1;
+
+        bool ok = is32Bit ? testCopy<uint32_t>(fastMem, slowMem, srcAddr, dstAddr, count, fixedSrc, sequential, numCopied)
+                          : testCopy<uint16_t>(fastMem, slowMem, srcAddr, dstAddr, count, fixedSrc, sequential, numCopied);
+
+        if(!ok)
+        {
+            std::cerr << "failed: " << width * 8 << "bit " << std::hex << srcAddr << " -> " << dstAddr << std::dec
+                      << " x " << count << (fixedSrc ? " fixed src" : "") << (sequential ? " sequential" : "") << "\n";
+            return 1;
+        }
+    }
+
+    std::cout << numCopied << "/" << iterations << " transfers copied in bulk, all matched\n";
+
+    // make sure the fallback isn't all we're testing
+    if(numCopied < iterations / 4)
+    {
+        std::cerr << "too few transfers took the bulk path\n";
+        return 1;
+    }
+
+    delete fastCPU;
+    delete slowCPU;
+    return 0;
+}
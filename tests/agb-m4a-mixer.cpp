@@ -0,0 +1,557 @@
+// checks the m4a mixer HLE against a guest mixer, sample for sample, with random channel states
+// the guest code is a reimplementation of the driver's SoundMain/SoundMainRAM written for this test, not the driver itself,
+// so this only shows that the HLE does what it's meant to (agb-m4a compares against a real game)
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <vector>
+
+#include "AGBCPU.h"
+
+static uint16_t screenData[240 * 160];
+
+static const uint32_t romSize = 0x100000;
+static const uint32_t waveOffset = 0x1000; // sample data in ROM
+
+static const uint32_t controlAddr = 0x3000000; // set to start a call, count of finished calls
+static const uint32_t mixerAddr = 0x3001000;
+static const uint32_t infoAddr = 0x3004000;
+static const uint32_t infoPtrAddr = 0x3007FF0; // SOUND_INFO_PTR
+
+static const uint32_t idNumber = 0x68736D53;
+static const uint32_t infoSize = 0x350 + 0x630 * 2; // including the PCM buffers
+static const int numChannels = 12;
+
+static std::mt19937 rng(0x34A);
+
+// sets up the stack and switches to THUMB
+static const uint32_t entryCode[]
+{
+    0xE3A0D403, // entry: mov sp, #0x3000000
+    0xE28DDC7F, // add sp, sp, #0x7F00
+    0xE28F0001, // add r0, pc, #1
+    0xE12FFF10, // bx r0
+};
+
+// calls SoundMain each time controlAddr is set, SoundMain is the same as the driver's up to jumping to the mixer
+static const uint16_t mainCode[]
+{
+    0x4C21, // main: ldr r4, =0x3000000
+    0x6820, // wait: ldr r0, [r4]
+    0x2800, // cmp r0, #0
+    0xD0FC, // beq wait
+    0x2000, // movs r0, #0
+    0x6020, // str r0, [r4]
+    0xF000, 0xF805, // bl SoundMain
+    0x6860, // ldr r0, [r4, #4]
+    0x3001, // adds r0, #1
+    0x6060, // str r0, [r4, #4]
+    0xE7F4, // b wait
+    0x4770, // cgb_stub: bx lr
+    0x481C, // SoundMain: ldr r0, =0x3007FF0
+    0x6800, // ldr r0, [r0]
+    0x4A1C, // ldr r2, =0x68736D53
+    0x6803, // ldr r3, [r0]
+    0x429A, // cmp r2, r3
+    0xD000, // beq SoundMain_1
+    0x4770, // bx lr
+    0x3301, // SoundMain_1: adds r3, #1
+    0x6003, // str r3, [r0]
+    0xB5F0, // push {r4-r7,lr}
+    0x4641, // mov r1, r8
+    0x464A, // mov r2, r9
+    0x4653, // mov r3, r10
+    0x465C, // mov r4, r11
+    0xB41F, // push {r0-r4}
+    0xB086, // sub sp, #0x18
+    0x7B01, // ldrb r1, [r0, #0xC]
+    0x2900, // cmp r1, #0
+    0xD005, // beq SoundMain_3
+    0x4A14, // ldr r2, =0x4000006
+    0x7812, // ldrb r2, [r2]
+    0x2AA0, // cmp r2, #160
+    0xD200, // bhs SoundMain_2
+    0x32E4, // adds r2, #228
+    0x1889, // SoundMain_2: adds r1, r2
+    0x9105, // SoundMain_3: str r1, [sp, #0x14]
+    0x6A03, // ldr r3, [r0, #0x20]
+    0x2B00, // cmp r3, #0
+    0xD003, // beq SoundMain_4
+    0x6A40, // ldr r0, [r0, #0x24]
+    0xF000, 0xF815, // bl call_via_r3
+    0x9806, // ldr r0, [sp, #0x18]
+    0x6A83, // SoundMain_4: ldr r3, [r0, #0x28]
+    0xF000, 0xF811, // bl call_via_r3
+    0x9806, // ldr r0, [sp, #0x18]
+    0x6903, // ldr r3, [r0, #0x10]
+    0x4698, // mov r8, r3
+    0x4D0B, // ldr r5, =0x350
+    0x182D, // adds r5, r0
+    0x7904, // ldrb r4, [r0, #4]
+    0x1E67, // subs r7, r4, #1
+    0xD904, // bls SoundMain_5
+    0x7AC1, // ldrb r1, [r0, #0xB]
+    0x1BC9, // subs r1, r7
+    0x4642, // mov r2, r8
+    0x434A, // muls r2, r1, r2
+    0x18AD, // adds r5, r2
+    0x9502, // SoundMain_5: str r5, [sp, #8]
+    0x4E07, // ldr r6, =0x630
+    0x4B07, // ldr r3, =0x3001001
+    0x4718, // bx r3
+    0x4718, // call_via_r3: bx r3
+    0x46C0, // nop (alignment)
+    0x0000, 0x0300, // .word 0x03000000
+    0x7FF0, 0x0300, // .word 0x03007FF0
+    0x6D53, 0x6873, // .word 0x68736D53
+    0x0006, 0x0400, // .word 0x04000006
+    0x0350, 0x0000, // .word 0x00000350
+    0x0630, 0x0000, // .word 0x00000630
+    0x1001, 0x0300, // .word 0x03001001
+};
+
+static const uint32_t cgbStubAddr = 0x8000000 + sizeof(entryCode) + 12 * 2 + 1; // cgb_stub above
+
+// the mixer, copied to mixerAddr
+// starts with the THUMB code the HLE checks for...
+static const uint16_t mixerTHUMBCode[]
+{
+    0x7943, // SoundMainRAM: ldrb r3, [r0, #5]
+    0x2B00, // cmp r3, #0
+    0xD001, // beq NoReverb
+    0xA10D, // adr r1, Reverb
+    0x4708, // bx r1
+    0x2000, // NoReverb: movs r0, #0
+    0x4641, // mov r1, r8
+    0x1976, // adds r6, r5
+    0x08C9, // lsrs r1, #3
+    0xD301, // bcc 1f
+    0xC501, // stm r5!, {r0}
+    0xC601, // stm r6!, {r0}
+    0x0849, // 1: lsrs r1, #1
+    0xD303, // bcc 2f
+    0xC501, // stm r5!, {r0}
+    0xC601, // stm r6!, {r0}
+    0xC501, // stm r5!, {r0}
+    0xC601, // stm r6!, {r0}
+    0xC501, // 2: stm r5!, {r0}
+    0xC601, // stm r6!, {r0}
+    0xC501, // stm r5!, {r0}
+    0xC601, // stm r6!, {r0}
+    0xC501, // stm r5!, {r0}
+    0xC601, // stm r6!, {r0}
+    0xC501, // stm r5!, {r0}
+    0xC601, // stm r6!, {r0}
+    0x3901, // subs r1, #1
+    0xDCF5, // bgt 2b
+    0xA014, // adr r0, ChanStart
+    0x4700, // bx r0
+};
+
+// ... then the rest is ARM
+static const uint32_t mixerARMCode[]
+{
+    0xE3540002, // Reverb: cmp r4, #2
+    0x02807E35, // addeq r7, r0, #0x350
+    0x10857008, // addne r7, r5, r8
+    0xE1A04008, // mov r4, r8
+    0xE19500D6, // 1: ldrsb r0, [r5, r6]
+    0xE1D510D0, // ldrsb r1, [r5]
+    0xE0800001, // add r0, r0, r1
+    0xE19710D6, // ldrsb r1, [r7, r6]
+    0xE0800001, // add r0, r0, r1
+    0xE0D710D1, // ldrsb r1, [r7], #1
+    0xE0800001, // add r0, r0, r1
+    0xE0010390, // mul r1, r0, r3
+    0xE1A004C1, // mov r0, r1, asr #9
+    0xE3100080, // tst r0, #0x80
+    0x12800001, // addne r0, r0, #1
+    0xE7C50006, // strb r0, [r5, r6]
+    0xE4C50001, // strb r0, [r5], #1
+    0xE2544001, // subs r4, r4, #1
+    0xCAFFFFF0, // bgt 1b
+    0xEAFFFFFF, // b ChanStart
+    0xE58D8000, // ChanStart: str r8, [sp]
+    0xE59D4018, // ldr r4, [sp, #0x18]
+    0xE5D49006, // ldrb r9, [r4, #6]
+    0xE2844050, // add r4, r4, #0x50
+    0xE59D0014, // ldr r0, [sp, #0x14]
+    0xE3500000, // cmp r0, #0
+    0x0A000005, // beq ChanLoop
+    0xE59F12E4, // ldr r1, =0x4000006
+    0xE5D11000, // ldrb r1, [r1]
+    0xE35100A0, // cmp r1, #160
+    0x328110E4, // addlo r1, r1, #228
+    0xE1510000, // cmp r1, r0
+    0x2A0000A9, // bhs Done
+    0xE2599001, // ChanLoop: subs r9, r9, #1
+    0xBA0000A7, // blt Done
+    0xE58D9004, // str r9, [sp, #4]
+    0xE5D46000, // ldrb r6, [r4]
+    0xE31600C7, // tst r6, #0xC7
+    0x0A0000A0, // beq NextChan
+    0xE5943024, // ldr r3, [r4, #0x24]
+    0xE5D45009, // ldrb r5, [r4, #9]
+    0xE3160080, // tst r6, #0x80
+    0x0A00000C, // beq NotStart
+    0xE3160040, // tst r6, #0x40
+    0x1A000098, // bne Stop
+    0xE3A06003, // mov r6, #3
+    0xE2830010, // add r0, r3, #0x10
+    0xE5840028, // str r0, [r4, #0x28]
+    0xE593000C, // ldr r0, [r3, #12]
+    0xE5840018, // str r0, [r4, #0x18]
+    0xE3A05000, // mov r5, #0
+    0xE584501C, // str r5, [r4, #0x1C]
+    0xE5D30003, // ldrb r0, [r3, #3]
+    0xE31000C0, // tst r0, #0xC0
+    0x13866010, // orrne r6, r6, #0x10
+    0xEA000022, // b Attack
+    0xE3160004, // NotStart: tst r6, #4
+    0x0A000004, // beq NotEcho
+    0xE5D4000D, // ldrb r0, [r4, #0xD]
+    0xE2500001, // subs r0, r0, #1
+    0xE5C4000D, // strb r0, [r4, #0xD]
+    0x8A000022, // bhi EnvDone
+    0xEA000086, // b Stop
+    0xE3160040, // NotEcho: tst r6, #0x40
+    0x0A00000A, // beq NotRelease
+    0xE5D40007, // ldrb r0, [r4, #7]
+    0xE0050590, // mul r5, r0, r5
+    0xE1A05425, // mov r5, r5, lsr #8
+    0xE5D4000C, // ldrb r0, [r4, #0xC]
+    0xE1550000, // cmp r5, r0
+    0x8A000019, // bhi EnvDone
+    0xE5D4500C, // EchoStart: ldrb r5, [r4, #0xC]
+    0xE3550000, // cmp r5, #0
+    0x0A00007B, // beq Stop
+    0xE3866004, // orr r6, r6, #4
+    0xEA000014, // b EnvDone
+    0xE2062003, // NotRelease: and r2, r6, #3
+    0xE3520002, // cmp r2, #2
+    0x1A000009, // bne NotDecay
+    0xE5D40005, // ldrb r0, [r4, #5]
+    0xE0050590, // mul r5, r0, r5
+    0xE1A05425, // mov r5, r5, lsr #8
+    0xE5D40006, // ldrb r0, [r4, #6]
+    0xE1550000, // cmp r5, r0
+    0x8A00000B, // bhi EnvDone
+    0xE1B05000, // movs r5, r0
+    0x0AFFFFEF, // beq EchoStart
+    0xE2466001, // sub r6, r6, #1
+    0xEA000007, // b EnvDone
+    0xE3520003, // NotDecay: cmp r2, #3
+    0x1A000005, // bne EnvDone
+    0xE5D40004, // Attack: ldrb r0, [r4, #4]
+    0xE0855000, // add r5, r5, r0
+    0xE35500FF, // cmp r5, #0xFF
+    0x3A000001, // blo EnvDone
+    0xE3A050FF, // mov r5, #0xFF
+    0xE2466001, // sub r6, r6, #1
+    0xE5C46000, // EnvDone: strb r6, [r4]
+    0xE5C45009, // strb r5, [r4, #9]
+    0xE59D0018, // ldr r0, [sp, #0x18]
+    0xE5D00007, // ldrb r0, [r0, #7]
+    0xE2800001, // add r0, r0, #1
+    0xE0010590, // mul r1, r0, r5
+    0xE1A05221, // mov r5, r1, lsr #4
+    0xE5D40002, // ldrb r0, [r4, #2]
+    0xE0010590, // mul r1, r0, r5
+    0xE1A0A421, // mov r10, r1, lsr #8
+    0xE5C4A00A, // strb r10, [r4, #0xA]
+    0xE5D40003, // ldrb r0, [r4, #3]
+    0xE0010590, // mul r1, r0, r5
+    0xE1A0B421, // mov r11, r1, lsr #8
+    0xE5C4B00B, // strb r11, [r4, #0xB]
+    0xE593000C, // ldr r0, [r3, #12]
+    0xE283C010, // add r12, r3, #0x10
+    0xE08CC000, // add r12, r12, r0
+    0xE58DC010, // str r12, [sp, #0x10]
+    0xE3A07000, // mov r7, #0
+    0xE3160010, // tst r6, #0x10
+    0x15931008, // ldrne r1, [r3, #8]
+    0x10407001, // subne r7, r0, r1
+    0xE58D700C, // str r7, [sp, #0xC]
+    0xE5942018, // ldr r2, [r4, #0x18]
+    0xE5943028, // ldr r3, [r4, #0x28]
+    0xE59D5008, // ldr r5, [sp, #8]
+    0xE59D8000, // ldr r8, [sp]
+    0xE5D40001, // ldrb r0, [r4, #1]
+    0xE3100008, // tst r0, #8
+    0x0A000016, // beq Resample
+    0xE3520000, // Fixed: cmp r2, #0
+    0xCA000005, // bgt 1f
+    0xE59D700C, // ldr r7, [sp, #0xC]
+    0xE3570000, // cmp r7, #0
+    0xDA000040, // ble StopMix
+    0xE59DC010, // ldr r12, [sp, #0x10]
+    0xE04C3007, // sub r3, r12, r7
+    0xE1A02007, // mov r2, r7
+    0xE0D300D1, // 1: ldrsb r0, [r3], #1
+    0xE2422001, // sub r2, r2, #1
+    0xE0010A90, // mul r1, r0, r10
+    0xE5D5C000, // ldrb r12, [r5]
+    0xE08CC441, // add r12, r12, r1, asr #8
+    0xE5C5C000, // strb r12, [r5]
+    0xE0010B90, // mul r1, r0, r11
+    0xE3A07E63, // ldr r7, =0x630
+    0xE7D5C007, // ldrb r12, [r5, r7]
+    0xE08CC441, // add r12, r12, r1, asr #8
+    0xE7C5C007, // strb r12, [r5, r7]
+    0xE2855001, // add r5, r5, #1
+    0xE2588001, // subs r8, r8, #1
+    0xCAFFFFE9, // bgt Fixed
+    0xEA00002B, // b StoreMix
+    0xE594901C, // Resample: ldr r9, [r4, #0x1C]
+    0xE5940020, // ldr r0, [r4, #0x20]
+    0xE59D1018, // ldr r1, [sp, #0x18]
+    0xE5911018, // ldr r1, [r1, #0x18]
+    0xE0060190, // mul r6, r0, r1
+    0xE1D300D0, // ldrsb r0, [r3]
+    0xE1D310D1, // ldrsb r1, [r3, #1]
+    0xE0411000, // sub r1, r1, r0
+    0xE00E0199, // 2: mul lr, r9, r1
+    0xE080EBCE, // add lr, r0, lr, asr #23
+    0xE0070A9E, // mul r7, lr, r10
+    0xE5D5C000, // ldrb r12, [r5]
+    0xE08CC447, // add r12, r12, r7, asr #8
+    0xE5C5C000, // strb r12, [r5]
+    0xE0070B9E, // mul r7, lr, r11
+    0xE2855C06, // add r5, r5, #0x600
+    0xE5D5C030, // ldrb r12, [r5, #0x30]
+    0xE08CC447, // add r12, r12, r7, asr #8
+    0xE5C5C030, // strb r12, [r5, #0x30]
+    0xE2455C06, // sub r5, r5, #0x600
+    0xE2855001, // add r5, r5, #1
+    0xE0899006, // add r9, r9, r6
+    0xE1B0EBA9, // movs lr, r9, lsr #23
+    0x0A000007, // beq 3f
+    0xE1A09489, // mov r9, r9, lsl #9
+    0xE1A094A9, // mov r9, r9, lsr #9
+    0xE052200E, // subs r2, r2, lr
+    0xDA000007, // ble 4f
+    0xE083300E, // add r3, r3, lr
+    0xE1D300D0, // 5: ldrsb r0, [r3]
+    0xE1D310D1, // ldrsb r1, [r3, #1]
+    0xE0411000, // sub r1, r1, r0
+    0xE2588001, // 3: subs r8, r8, #1
+    0xCAFFFFE5, // bgt 2b
+    0xE584901C, // str r9, [r4, #0x1C]
+    0xEA000007, // b StoreMix
+    0xE59D700C, // 4: ldr r7, [sp, #0xC]
+    0xE3570000, // cmp r7, #0
+    0xDA000007, // ble StopMix
+    0xE0922007, // 6: adds r2, r2, r7
+    0xDAFFFFFD, // ble 6b
+    0xE59DC010, // ldr r12, [sp, #0x10]
+    0xE04C3002, // sub r3, r12, r2
+    0xEAFFFFF0, // b 5b
+    0xE5842018, // StoreMix: str r2, [r4, #0x18]
+    0xE5843028, // str r3, [r4, #0x28]
+    0xEA000001, // b NextChan
+    0xE3A00000, // Stop: mov r0, #0
+    0xE5C40000, // strb r0, [r4]
+    0xE59D9004, // NextChan: ldr r9, [sp, #4]
+    0xE2844040, // add r4, r4, #0x40
+    0xEAFFFF55, // b ChanLoop
+    0xE59D0018, // Done: ldr r0, [sp, #0x18]
+    0xE59F3024, // ldr r3, =0x68736D53
+    0xE5803000, // str r3, [r0]
+    0xE28DD01C, // add sp, sp, #0x1C
+    0xE8BD00FF, // pop {r0-r7}
+    0xE1A08000, // mov r8, r0
+    0xE1A09001, // mov r9, r1
+    0xE1A0A002, // mov r10, r2
+    0xE1A0B003, // mov r11, r3
+    0xE49D3004, // pop {r3}
+    0xE12FFF13, // bx r3
+    0x04000006, // .word 0x04000006
+    0x68736D53, // .word 0x68736D53
+};
+
+struct Wave
+{
+    uint32_t addr, size;
+};
+
+static void write32(uint8_t *ptr, uint32_t val)
+{
+    memcpy(ptr, &val, 4);
+}
+
+static uint32_t read32(const uint8_t *ptr)
+{
+    uint32_t val;
+    memcpy(&val, ptr, 4);
+    return val;
+}
+
+// random sample data with a 16 byte header (flags, frequency, loop start, size)
+static std::vector<Wave> makeWaves(uint8_t *rom)
+{
+    std::vector<Wave> waves;
+    uint32_t offset = waveOffset;
+
+    for(int i = 0; i < 16; i++)
+    {
+        uint32_t size = rng() % 4 ? 16 + rng() % 4000 : 1 + rng() % 16;
+        uint32_t loopStart = rng() % 8 ? rng() % (size + 1) : size + rng() % 4; // sometimes an empty/negative loop
+
+        write32(rom + offset, rng() % 2 ? 0x40000000 : 0); // looped
+        write32(rom + offset + 4, rng());
+        write32(rom + offset + 8, loopStart);
+        write32(rom + offset + 12, size);
+
+        waves.push_back({0x8000000 + offset, size});
+
+        // + 1 for the interpolated sample past the end
+        offset += (16 + size + 1 + 3) & ~3;
+    }
+
+    return waves;
+}
+
+// SoundInfo and the channels in a random state
+static std::vector<uint8_t> makeInfo(const std::vector<Wave> &waves)
+{
+    std::vector<uint8_t> info(infoSize);
+    for(auto &b : info)
+        b = rng();
+
+    static const int sampleCounts[]{16, 32, 96, 132, 176, 224, 264, 304, 352};
+    uint32_t numSamples = sampleCounts[rng() % std::size(sampleCounts)];
+    uint32_t period = std::min(1584 / numSamples, 255u);
+    uint32_t divFreq = 100 + rng() % 2000;
+
+    write32(info.data(), idNumber);
+    info[4] = 1 + rng() % period; // DMA counter
+    info[5] = rng() % 2 ? 0 : rng(); // reverb
+    info[6] = 1 + rng() % numChannels;
+    info[7] = rng() & 0xF; // volume
+    info[0xB] = period;
+    info[0xC] = 0; // no line limit, the HLE doesn't read VCOUNT at the same time
+    write32(info.data() + 0x10, numSamples);
+    write32(info.data() + 0x18, divFreq);
+    write32(info.data() + 0x20, 0); // no MPlay callback
+    write32(info.data() + 0x28, cgbStubAddr);
+
+    // start/stop, echo, attack/decay/sustain/release, with or without looping
+    static const uint8_t statuses[]{0, 0x80, 0xC0, 0x83, 0x82, 0x81, 0x43, 0x42, 0x41, 0x44, 0x84, 0x04, 0x93, 0x92, 0x91, 0x13, 0x12, 0x11, 0x53, 0x14, 0x03};
+
+    for(int i = 0; i < numChannels; i++)
+    {
+        auto chan = info.data() + 0x50 + i * 0x40;
+        chan[0] = rng() % 8 ? statuses[rng() % std::size(statuses)] : rng();
+        chan[1] = rng() % 2 ? 8 : 0; // fixed frequency
+
+        // unsupported types, the HLE should leave these to the guest code
+        if(rng() % 16 == 0)
+            chan[1] |= rng() & 0xC7;
+
+        auto &wave = waves[rng() % waves.size()];
+        uint32_t pos = rng() % (wave.size + 1);
+        int32_t count = rng() % 8 ? int32_t(wave.size - pos) : int32_t(rng() % 8) - 4;
+
+        write32(chan + 0x18, count);
+        write32(chan + 0x1C, rng() & 0x7FFFFF); // fraction
+        uint32_t maxStep = rng() % 4 ? 1u << 23 : 8u << 23; // usually less than one sample per output sample
+        write32(chan + 0x20, (rng() % maxStep) / divFreq); // frequency
+        write32(chan + 0x24, wave.addr);
+        write32(chan + 0x28, wave.addr + 16 + pos);
+    }
+
+    return info;
+}
+
+static AGBCPU *createCPU(const uint8_t *rom, bool hle)
+{
+    auto cpu = new AGBCPU;
+    auto &mem = cpu->getMem();
+
+    mem.setCartROM(rom, romSize);
+    cpu->getDisplay().setFramebuffer(screenData);
+    cpu->setM4AMixerHLE(hle);
+    cpu->reset();
+
+    memcpy(mem.mapAddress(mixerAddr), mixerTHUMBCode, sizeof(mixerTHUMBCode));
+    memcpy(mem.mapAddress(mixerAddr + sizeof(mixerTHUMBCode)), mixerARMCode, sizeof(mixerARMCode));
+    mem.invalidateCode(mixerAddr, sizeof(mixerTHUMBCode) + sizeof(mixerARMCode));
+
+    write32(mem.mapAddress(infoPtrAddr), infoAddr);
+
+    return cpu;
+}
+
+// runs SoundMain once, false if it doesn't return
+static bool runSoundMain(AGBCPU *cpu, const std::vector<uint8_t> &info)
+{
+    auto &mem = cpu->getMem();
+    auto control = mem.mapAddress(controlAddr);
+
+    memcpy(mem.mapAddress(infoAddr), info.data(), infoSize);
+    mem.invalidateCode(infoAddr, infoSize);
+
+    uint32_t count = read32(control + 4);
+    write32(control, 1);
+
+    for(int i = 0; i < 100 && read32(control + 4) == count; i++)
+        cpu->run(1);
+
+    return read32(control + 4) != count;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? std::stoi(argv[1]) : 300;
+
+    static uint8_t rom[romSize];
+    for(auto &b : rom)
+        b = rng();
+
+    memcpy(rom, entryCode, sizeof(entryCode));
+    memcpy(rom + sizeof(entryCode), mainCode, sizeof(mainCode));
+
+    auto waves = makeWaves(rom);
+
+    auto guestCPU = createCPU(rom, false);
+    auto hleCPU = createCPU(rom, true);
+
+    if(!hleCPU->isM4AMixerReplaced())
+    {
+        std::cerr << "m4a mixer not found in ROM\n";
+        return 1;
+    }
+
+    for(int i = 0; i < iterations; i++)
+    {
+        auto info = makeInfo(waves);
+
+        if(!runSoundMain(guestCPU, info) || !runSoundMain(hleCPU, info))
+        {
+            std::cerr << "SoundMain didn't return (iteration " << i << ")\n";
+            return 1;
+        }
+
+        auto expected = guestCPU->getMem().mapAddress(infoAddr);
+        auto actual = hleCPU->getMem().mapAddress(infoAddr);
+
+        if(memcmp(actual, expected, infoSize) != 0)
+        {
+            uint32_t off = 0;
+            while(actual[off] == expected[off])
+                off++;
+
+            std::cerr << "iteration " << i << ": first difference at SoundInfo+" << std::hex << off
+                      << " (" << int(actual[off]) << " != " << int(expected[off]) << ")\n";
+            return 1;
+        }
+    }
+
+    std::cout << iterations << " mixer calls matched\n";
+
+    delete guestCPU;
+    delete hleCPU;
+    return 0;
+}
@@ -0,0 +1,146 @@
+// checks the m4a mixer HLE against the game's own mixer by comparing the audio output
+// needs a ROM using the m4a/MusicPlayer2000 sound driver, which can't be included here (see CMakeLists.txt)
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "AGBCPU.h"
+#include "ROMSource.h"
+
+static uint16_t screenData[240 * 160];
+
+static bool runAudio(const uint8_t *rom, uint32_t romSize, bool hle, int seconds, std::vector<int16_t> &samples)
+{
+    auto cpu = new AGBCPU;
+    cpu->getMem().setCartROM(rom, romSize);
+    cpu->getDisplay().setFramebuffer(screenData);
+    cpu->setM4AMixerHLE(hle);
+    cpu->reset();
+
+    if(hle && !cpu->isM4AMixerReplaced())
+    {
+        std::cerr << "m4a mixer not found in ROM\n";
+        delete cpu;
+        return false;
+    }
+
+    for(int i = 0; i < seconds * 100; i++)
+    {
+        cpu->run(10);
+
+        auto &apu = cpu->getAPU();
+        while(apu.getNumSamples())
+            samples.push_back(apu.getSample());
+    }
+
+    delete cpu;
+    return true;
+}
+
+// returns the number of differing samples
+static size_t compareSamples(const std::vector<int16_t> &expected, const std::vector<int16_t> &actual)
+{
+    size_t len = std::min(expected.size(), actual.size());
+    size_t numDiffs = 0, firstDiff = len;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        if(expected[i] != actual[i])
+        {
+            if(!numDiffs)
+                firstDiff = i;
+            numDiffs++;
+        }
+    }
+
+    if(expected.size() != actual.size())
+        std::cerr << "sample count " << actual.size() << " != " << expected.size() << "\n";
+
+    if(numDiffs)
+    {
+        std::cerr << numDiffs << "/" << len << " samples differ, first at " << firstDiff
+                  << " (" << actual[firstDiff] << " != " << expected[firstDiff] << ")\n";
+    }
+
+    return numDiffs + (expected.size() != actual.size());
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " rom [emulated seconds] [--dump file | --compare file]\n";
+        std::cerr << "  compares the mixer HLE with the game's mixer, or with a dump of it made with --dump\n";
+        return 1;
+    }
+
+    int seconds = 30;
+    std::string dumpFile, compareFile;
+
+    for(int i = 2; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if(arg == "--dump" && i + 1 < argc)
+            dumpFile = argv[++i];
+        else if(arg == "--compare" && i + 1 < argc)
+            compareFile = argv[++i];
+        else
+            seconds = std::stoi(arg);
+    }
+
+    ROMSource romSource;
+    if(!romSource.open(argv[1]))
+    {
+        std::cerr << "Failed to open " << argv[1] << "\n";
+        return 1;
+    }
+
+    auto rom = romSource.getData();
+    auto romSize = romSource.getSize();
+
+    std::vector<int16_t> expected, actual;
+
+    if(dumpFile.empty() && !runAudio(rom, romSize, true, seconds, actual))
+        return 1;
+
+    if(!compareFile.empty())
+    {
+        std::ifstream in(compareFile, std::ios::binary | std::ios::ate);
+        if(!in)
+        {
+            std::cerr << "Failed to open " << compareFile << "\n";
+            return 1;
+        }
+
+        expected.resize(in.tellg() / sizeof(int16_t));
+        in.seekg(0);
+        in.read(reinterpret_cast<char *>(expected.data()), expected.size() * sizeof(int16_t));
+    }
+    else
+    {
+        // the game's own mixer
+        runAudio(rom, romSize, false, seconds, expected);
+
+        if(!dumpFile.empty())
+        {
+            std::ofstream out(dumpFile, std::ios::binary);
+            out.write(reinterpret_cast<const char *>(expected.data()), expected.size() * sizeof(int16_t));
+            std::cout << "wrote " << expected.size() << " samples to " << dumpFile << "\n";
+            return out ? 0 : 1;
+        }
+    }
+
+    // a dump may be from a longer run
+    if(!compareFile.empty() && expected.size() > actual.size())
+        expected.resize(actual.size());
+
+    if(compareSamples(expected, actual) != 0)
+        return 1;
+
+    std::cout << actual.size() << " samples matched\n";
+    return 0;
+}
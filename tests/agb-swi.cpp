@@ -0,0 +1,224 @@
+// checks the HLE RLUnComp/Diff8bitUnFilter/Diff16bitUnFilter SWIs against a straightforward decoder
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "AGBCPU.h"
+
+static uint16_t screenData[240 * 160];
+
+static const uint32_t romSize = 0x40000;
+static const uint32_t dataOffset = 0x1000; // compressed data in ROM
+
+static std::mt19937 rng(0x5A1);
+
+// RLUnCompWram/Vram, Diff8bitUnFilterWram/Vram, Diff16bitUnFilter
+enum SWI
+{
+    RL8 = 0x14,
+    RL16,
+    Diff8_8,
+    Diff8_16,
+    Diff16
+};
+
+// sets r0/r1 from the literals at 0x18/0x1C, then jumps to the address at 0x20
+static const uint32_t startCode[]
+{
+    0xE59F0010, // ldr r0, [pc, #0x10]
+    0xE59F1010, // ldr r1, [pc, #0x10]
+    0xE59FF010, // ldr pc, [pc, #0x10]
+};
+
+static const uint32_t swiCodeOffset = 0x100; // swi n, b . for each of the above
+
+static std::vector<uint8_t> randomData(SWI swi, uint32_t size)
+{
+    std::vector<uint8_t> data;
+
+    uint32_t header = size << 8 | (swi == RL8 || swi == RL16 ? 0x30 : swi == Diff16 ? 0x82 : 0x81);
+    for(int i = 0; i < 4; i++)
+        data.push_back(header >> (i * 8));
+
+    if(swi == RL8 || swi == RL16)
+    {
+        // random runs/literals until we have enough output
+        uint32_t len = 0;
+        while(len < size)
+        {
+            uint8_t flag = rng();
+            data.push_back(flag);
+
+            if(flag & 0x80)
+            {
+                data.push_back(rng());
+                len += (flag & 0x7F) + 3;
+            }
+            else
+            {
+                for(int i = 0; i < (flag & 0x7F) + 1; i++)
+                    data.push_back(rng());
+                len += (flag & 0x7F) + 1;
+            }
+        }
+    }
+    else
+    {
+        for(uint32_t i = 0; i < size + 2; i++)
+            data.push_back(rng());
+    }
+
+    return data;
+}
+
+// applies what the SWI should do to a copy of the destination memory
+static void referenceDecode(SWI swi, const std::vector<uint8_t> &data, std::vector<uint8_t> &dst)
+{
+    uint32_t size = data[1] | data[2] << 8 | data[3] << 16;
+    size_t src = 4;
+
+    uint32_t dstOff = 0;
+    uint8_t saved = 0;
+
+    // the 16-bit write versions write every other byte as a pair
+    auto out = [&](uint8_t b)
+    {
+        if(swi == RL8 || swi == Diff8_8 || (dstOff & 1))
+            dst[dstOff] = b;
+
+        if(swi != RL8 && swi != Diff8_8)
+        {
+            if(dstOff & 1)
+                dst[dstOff - 1] = saved;
+            else
+                saved = b;
+        }
+
+        dstOff++;
+    };
+
+    if(swi == RL8 || swi == RL16)
+    {
+        while(dstOff < size)
+        {
+            uint8_t flag = data[src++];
+            if(flag & 0x80)
+            {
+                uint8_t b = data[src++];
+                for(int i = 0; i < (flag & 0x7F) + 3; i++)
+                    out(b);
+            }
+            else
+            {
+                for(int i = 0; i < (flag & 0x7F) + 1; i++)
+                    out(data[src++]);
+            }
+        }
+    }
+    else if(swi == Diff8_8 || swi == Diff8_16)
+    {
+        uint8_t v = 0;
+        while(dstOff < size)
+        {
+            v += data[src++];
+            out(v);
+        }
+    }
+    else
+    {
+        uint16_t v = 0;
+        for(; dstOff < size; dstOff += 2, src += 2)
+        {
+            v += data[src] | data[src + 1] << 8;
+            dst[dstOff] = v;
+            dst[dstOff + 1] = v >> 8;
+        }
+    }
+}
+
+static void write32(uint8_t *ptr, uint32_t val)
+{
+    memcpy(ptr, &val, 4);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? std::stoi(argv[1]) : 500;
+
+    static uint8_t rom[romSize];
+
+    memcpy(rom, startCode, sizeof(startCode));
+
+    for(int swi = RL8; swi <= Diff16; swi++)
+    {
+        write32(rom + swiCodeOffset + (swi - RL8) * 8, 0xEF000000 | swi << 16); // swi n
+        write32(rom + swiCodeOffset + (swi - RL8) * 8 + 4, 0xEAFFFFFE); // b .
+    }
+
+    auto cpu = new AGBCPU;
+    auto &mem = cpu->getMem();
+    mem.setCartROM(rom, romSize);
+    cpu->getDisplay().setFramebuffer(screenData);
+
+    for(int i = 0; i < iterations; i++)
+    {
+        auto swi = static_cast<SWI>(RL8 + rng() % 5);
+        bool write16 = swi == RL16 || swi == Diff8_16 || swi == Diff16;
+
+        uint32_t size = rng() % 4 ? 1 + rng() % 0x100 : 1 + rng() % 0x2000;
+        if(swi == Diff16)
+            size &= ~1;
+        if(!size)
+            size = 2;
+
+        auto data = randomData(swi, size);
+
+        // the "Vram" versions are usually used for VRAM, but they work for any 16-bit writable memory
+        uint32_t dstAddr = rng() % 2 ? 0x2000000 + (rng() % 0x8000) : write16 ? 0x6000000 + (rng() % 0x8000) : 0x3000000 + (rng() % 0x4000);
+        if(write16)
+            dstAddr &= ~1;
+
+        // source from ROM or EWRAM
+        bool srcInROM = rng() % 2;
+        uint32_t srcAddr = srcInROM ? 0x8000000 + dataOffset : 0x2020000 + (rng() % 0x1000) * 4;
+
+        cpu->reset();
+
+        // fill the destination with junk to make sure only the right bytes are written
+        uint32_t regionSize = size + 0x100; // RL runs can go past the end
+        auto dst = mem.mapAddress(dstAddr);
+        for(uint32_t j = 0; j < regionSize; j++)
+            dst[j] = rng();
+
+        std::vector<uint8_t> expected(dst, dst + regionSize);
+        referenceDecode(swi, data, expected);
+
+        if(srcInROM)
+            memcpy(rom + dataOffset, data.data(), data.size());
+        else
+            memcpy(mem.mapAddress(srcAddr), data.data(), data.size());
+
+        write32(rom + 0x18, srcAddr);
+        write32(rom + 0x1C, dstAddr);
+        write32(rom + 0x20, 0x8000000 + swiCodeOffset + (swi - RL8) * 8);
+
+        cpu->run(1);
+
+        if(memcmp(dst, expected.data(), regionSize) != 0)
+        {
+            uint32_t off = 0;
+            while(dst[off] == expected[off])
+                off++;
+
+            std::cerr << "SWI " << std::hex << swi << " " << srcAddr << " -> " << dstAddr << " size " << size
+                      << ": first difference at +" << off << " (" << int(dst[off]) << " != " << int(expected[off]) << ")\n";
+            return 1;
+        }
+    }
+
+    std::cout << iterations << " decompressions matched\n";
+
+    delete cpu;
+    return 0;
+}
@@ -0,0 +1,217 @@
+// checks the DMG ROM bank cache used when the ROM is loaded through the bank callback
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "DMGCPU.h"
+
+static const int numCacheBanks = 4;
+static uint8_t romCache[numCacheBanks * 0x4000];
+
+static std::atomic<int> bankLoads{0};
+
+static thread_local bool isLoaderThread = false;
+
+// MBC5, 64 banks, 32K RAM (so there's no spare cart RAM to use as cache), CGB (so no spare WRAM)
+// every other bank is filled with its number
+static void romBankCallback(uint8_t bank, uint8_t *ptr)
+{
+    // be slow in the prefetch thread so that it's more likely to be loading during a reset
+    if(isLoaderThread)
+    {
+        memset(ptr, 0xFF, 0x2000);
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    memset(ptr, bank, 0x4000);
+
+    if(bank == 0)
+    {
+        ptr[0x143] = 0x80;
+        ptr[0x147] = 0x1A;
+        ptr[0x148] = 5;
+        ptr[0x149] = 3;
+    }
+    else
+        bankLoads++;
+}
+
+static DMGMemory::ROMCacheStats getStatsSince(const DMGMemory &mem, const DMGMemory::ROMCacheStats &start)
+{
+    auto &stats = mem.getROMCacheStats();
+    return {stats.hits - start.hits, stats.misses - start.misses, stats.evictions - start.evictions, stats.prefetched - start.prefetched, stats.prefetchHits - start.prefetchHits};
+}
+
+static bool switchBank(DMGMemory &mem, int bank)
+{
+    mem.write(0x2000, bank);
+
+    if(mem.read(0x4000) != bank || mem.read(0x7FFF) != bank)
+    {
+        std::cerr << "bank " << bank << " has the wrong data (" << int(mem.read(0x4000)) << ")\n";
+        return false;
+    }
+
+    return true;
+}
+
+static bool checkStats(const DMGMemory &mem, const DMGMemory::ROMCacheStats &start, uint32_t hits, uint32_t misses, uint32_t evictions)
+{
+    auto stats = getStatsSince(mem, start);
+
+    if(stats.hits != hits || stats.misses != misses || stats.evictions != evictions || int(stats.misses) != bankLoads)
+    {
+        std::cerr << "hits " << stats.hits << " misses " << stats.misses << " evictions " << stats.evictions << " loads " << bankLoads
+                  << ", expected " << hits << "/" << misses << "/" << evictions << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+static bool testCounters(DMGCPU *cpu)
+{
+    auto &mem = cpu->getMem();
+    cpu->reset();
+
+    // bank 1 is mapped at reset
+    auto start = mem.getROMCacheStats();
+    bankLoads = 0;
+
+    // fill the rest of the cache: 2 3 4 1
+    for(int bank = 2; bank <= 4; bank++)
+    {
+        if(!switchBank(mem, bank))
+            return false;
+    }
+
+    if(!checkStats(mem, start, 0, 3, 0))
+        return false;
+
+    // all cached, in reverse order: 1 2 3 4
+    for(int bank = 4; bank >= 1; bank--)
+    {
+        if(!switchBank(mem, bank))
+            return false;
+    }
+
+    if(!checkStats(mem, start, 4, 3, 0))
+        return false;
+
+    // evicts the least recently used: 5 (4) 1 2 3, 6 (3) 5 1 2
+    if(!switchBank(mem, 5) || !switchBank(mem, 6))
+        return false;
+
+    if(!checkStats(mem, start, 4, 5, 2))
+        return false;
+
+    // 1 and 2 should still be there, 4 was evicted: 1 6 5 2, 2 1 6 5, 4 (5) 2 1 6
+    if(!switchBank(mem, 1) || !switchBank(mem, 2) || !switchBank(mem, 4))
+        return false;
+
+    if(!checkStats(mem, start, 6, 6, 3))
+        return false;
+
+    // bank 0 isn't cached
+    if(!switchBank(mem, 0))
+        return false;
+
+    if(!checkStats(mem, start, 6, 6, 3))
+        return false;
+
+    // reset clears the stats
+    cpu->reset();
+    auto &stats = mem.getROMCacheStats();
+    if(stats.hits != 0 || stats.evictions != 0 || stats.misses > 1)
+    {
+        std::cerr << "stats not reset\n";
+        return false;
+    }
+
+    return true;
+}
+
+#ifndef DMG_NO_ROM_PREFETCH
+// resets while another thread is loading prefetched banks, the loader must not write to the cache after it's been rebuilt
+static bool testPrefetchReset(DMGCPU *cpu, int iterations)
+{
+    auto &mem = cpu->getMem();
+    mem.setROMBankPrefetch(true);
+
+    std::atomic<bool> done{false};
+
+    std::thread loader([&mem, &done]
+    {
+        isLoaderThread = true;
+
+        while(!done.load(std::memory_order_relaxed))
+        {
+            if(!mem.prefetchROMBank())
+                std::this_thread::yield();
+        }
+    });
+
+    bool ok = true;
+    uint32_t prefetched = 0;
+
+    for(int i = 0; i < iterations && ok; i++)
+    {
+        prefetched += mem.getROMCacheStats().prefetched; // reset clears this
+        cpu->reset();
+
+        // cycle through more banks than fit in the cache, so the next one is always predictable and not cached
+        for(int j = 0; j < 2 + i % 24 && ok; j++)
+        {
+            ok = switchBank(mem, 1 + j % 8);
+
+            // give the loader a chance, sometimes long enough to finish
+            if(j % 3 == 0)
+                std::this_thread::sleep_for(std::chrono::microseconds(j % 2 ? 100 : 10));
+            else
+                std::this_thread::yield();
+        }
+    }
+
+    done = true;
+    loader.join();
+
+    mem.setROMBankPrefetch(false);
+
+    if(ok && prefetched == 0)
+    {
+        std::cerr << "nothing was prefetched\n";
+        return false;
+    }
+
+    return ok;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? std::stoi(argv[1]) : 250;
+
+    auto cpu = new DMGCPU;
+    auto &mem = cpu->getMem();
+
+    mem.setROMBankCallback(romBankCallback);
+    mem.addROMCache(romCache, sizeof(romCache));
+
+    if(!testCounters(cpu))
+        return 1;
+
+    std::cout << "ROM cache counters matched\n";
+
+#ifndef DMG_NO_ROM_PREFETCH
+    if(!testPrefetchReset(cpu, iterations))
+        return 1;
+
+    std::cout << "resets during prefetch OK\n";
+#endif
+
+    delete cpu;
+    return 0;
+}
@@ -0,0 +1,409 @@
+// reads ROM files through ROMSource and compares with what was written
+// also built with ROM_SOURCE_NO_MMAP to test reading from the file
+// .gz/.zip files are written with zlib if ROMSource was built with it
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef ROM_SOURCE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "ROMSource.h"
+
+#if !defined(ROM_SOURCE_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+static const bool expectMapped = true;
+#else
+static const bool expectMapped = false;
+#endif
+
+static std::mt19937 rng(0x50C);
+
+static std::vector<uint8_t> makeROM(uint32_t size)
+{
+    std::vector<uint8_t> rom(size);
+
+    // somewhat compressible
+    for(uint32_t i = 0; i < size; i++)
+        rom[i] = (i >> 8) % 7 ? i * 13 + (i >> 11) : rng();
+
+    return rom;
+}
+
+static bool writeFile(const std::string &filename, const std::vector<uint8_t> &data)
+{
+    std::ofstream out(filename, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(data.data()), data.size());
+    return bool(out);
+}
+
+static bool checkRead(ROMSource &source, const std::vector<uint8_t> &rom, uint32_t offset, uint32_t len)
+{
+    std::vector<uint8_t> buf(len);
+    source.read(offset, len, buf.data());
+
+    for(uint32_t i = 0; i < len; i++)
+    {
+        // past the end reads as 0xFF
+        uint8_t expected = offset + i < rom.size() ? rom[offset + i] : 0xFF;
+
+        if(buf[i] != expected)
+        {
+            std::cerr << "read " << std::hex << offset << "+" << len << " differs at " << offset + i << std::dec << "\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool checkSource(ROMSource &source, const std::vector<uint8_t> &rom, const std::string &label)
+{
+    if(source.getSize() != rom.size())
+    {
+        std::cerr << label << ": size " << source.getSize() << " != " << rom.size() << "\n";
+        return false;
+    }
+
+    uint32_t numBanks = (rom.size() + 0x3FFF) / 0x4000;
+
+    // banks in random order, including the partial one at the end
+    for(int i = 0; i < 100; i++)
+    {
+        if(!checkRead(source, rom, (rng() % numBanks) * 0x4000, 0x4000))
+        {
+            std::cerr << label << ": bank read failed\n";
+            return false;
+        }
+    }
+
+    // odd offsets/lengths, some past the end
+    for(int i = 0; i < 100; i++)
+    {
+        uint32_t offset = rng() % (rom.size() + 0x100);
+        uint32_t len = rng() % 0x10000;
+
+        if(!checkRead(source, rom, offset, len))
+        {
+            std::cerr << label << ": read failed\n";
+            return false;
+        }
+    }
+
+    // reads from other threads
+    bool threadsOK[4];
+    std::thread threads[4];
+
+    for(int i = 0; i < 4; i++)
+    {
+        threads[i] = std::thread([&source, &rom, &threadsOK, i, numBanks]
+        {
+            threadsOK[i] = true;
+            for(uint32_t bank = i; bank < numBanks * 4; bank += 3)
+                threadsOK[i] = threadsOK[i] && checkRead(source, rom, (bank % numBanks) * 0x4000, 0x4000);
+        });
+    }
+
+    bool ok = true;
+    for(int i = 0; i < 4; i++)
+    {
+        threads[i].join();
+        ok = ok && threadsOK[i];
+    }
+
+    if(!ok)
+    {
+        std::cerr << label << ": threaded read failed\n";
+        return false;
+    }
+
+    auto data = source.getData();
+    if(!data || memcmp(data, rom.data(), rom.size()) != 0)
+    {
+        std::cerr << label << ": getData doesn't match\n";
+        return false;
+    }
+
+    // reads still work after getData
+    if(!checkRead(source, rom, rom.size() - 0x100, 0x200))
+    {
+        std::cerr << label << ": read after getData failed\n";
+        return false;
+    }
+
+    return true;
+}
+
+static bool testFile(const std::string &filename, const std::vector<uint8_t> &fileData, const std::vector<uint8_t> &rom, const std::string &expectedName, bool compressed)
+{
+    if(!writeFile(filename, fileData))
+        return false;
+
+    ROMSource source;
+
+    bool ok = source.open(filename);
+    bool mapped = expectMapped && !compressed;
+
+    if(!ok)
+        std::cerr << "failed to open " << filename << "\n";
+    else if(source.isMapped() != mapped || source.isCompressed() != compressed || source.getName() != expectedName)
+    {
+        std::cerr << filename << ": mapped " << source.isMapped() << " compressed " << source.isCompressed() << " name " << source.getName() << "\n";
+        ok = false;
+    }
+    else
+        ok = checkSource(source, rom, filename);
+
+    source.close();
+    remove(filename.c_str());
+
+    return ok;
+}
+
+static bool testPlain(const std::string &prefix)
+{
+    auto filename = prefix + ".gb";
+    auto rom = makeROM(0x4000 * 5 + 123);
+
+    if(!testFile(filename, rom, rom, filename, false))
+        return false;
+
+    // reopening replaces it
+    ROMSource source;
+    auto rom2 = makeROM(0x8000);
+    bool ok = writeFile(filename, rom) && source.open(filename) && writeFile(filename, rom2) && source.open(filename) && checkSource(source, rom2, filename + " (reopened)");
+
+    source.close();
+    remove(filename.c_str());
+
+    return ok;
+}
+
+#ifdef ROM_SOURCE_ZLIB
+static void append16(std::vector<uint8_t> &vec, uint16_t val)
+{
+    vec.push_back(val);
+    vec.push_back(val >> 8);
+}
+
+static void append32(std::vector<uint8_t> &vec, uint32_t val)
+{
+    append16(vec, val);
+    append16(vec, val >> 16);
+}
+
+// raw deflate, ending a block every 32k so that there are points to restart from
+static std::vector<uint8_t> deflateData(const std::vector<uint8_t> &data)
+{
+    z_stream stream{};
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+
+    std::vector<uint8_t> out(deflateBound(&stream, data.size()) + (data.size() / 0x8000 + 1) * 8);
+
+    stream.next_in = const_cast<uint8_t *>(data.data());
+    stream.next_out = out.data();
+    stream.avail_out = out.size();
+
+    uint32_t offset = 0;
+    int ret;
+    do
+    {
+        uint32_t len = std::min(uint32_t(data.size()) - offset, 0x8000u);
+        offset += len;
+
+        stream.avail_in = len;
+        ret = deflate(&stream, offset == data.size() ? Z_FINISH : Z_BLOCK);
+    }
+    while(ret == Z_OK);
+
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    return out;
+}
+
+static std::vector<uint8_t> makeGzip(const std::vector<uint8_t> &rom, const char *origName)
+{
+    // with a name, also add an extra field and a comment to skip
+    uint8_t flags = origName ? 1 << 2 | 1 << 3 | 1 << 4 : 0;
+    std::vector<uint8_t> gz{0x1F, 0x8B, 8, flags, 0, 0, 0, 0, 0, 3};
+
+    if(origName)
+    {
+        append16(gz, 4);
+        append32(gz, 0x12345678);
+        gz.insert(gz.end(), origName, origName + strlen(origName) + 1);
+        gz.insert(gz.end(), {'h', 'i', 0});
+    }
+
+    auto comp = deflateData(rom);
+    gz.insert(gz.end(), comp.begin(), comp.end());
+
+    append32(gz, crc32(0, rom.data(), rom.size()));
+    append32(gz, rom.size());
+
+    return gz;
+}
+
+struct ZipEntry
+{
+    std::string name;
+    std::vector<uint8_t> data;
+    bool deflated;
+};
+
+static std::vector<uint8_t> makeZip(const std::vector<ZipEntry> &entries)
+{
+    std::vector<uint8_t> zip, dir;
+
+    for(auto &entry : entries)
+    {
+        auto comp = entry.deflated ? deflateData(entry.data) : entry.data;
+        uint32_t crc = crc32(0, entry.data.data(), entry.data.size());
+        uint32_t localOffset = zip.size();
+        uint16_t method = entry.deflated ? 8 : 0;
+
+        // local header, with an extra field that isn't in the central directory
+        append32(zip, 0x04034B50);
+        append16(zip, 20); // version
+        append16(zip, 0); // flags
+        append16(zip, method);
+        append32(zip, 0); // time/date
+        append32(zip, crc);
+        append32(zip, comp.size());
+        append32(zip, entry.data.size());
+        append16(zip, entry.name.length());
+        append16(zip, 8);
+        zip.insert(zip.end(), entry.name.begin(), entry.name.end());
+        append32(zip, 0xCAFE0004);
+        append32(zip, 0);
+        zip.insert(zip.end(), comp.begin(), comp.end());
+
+        // central directory header
+        append32(dir, 0x02014B50);
+        append16(dir, 20); // made by
+        append16(dir, 20); // version
+        append16(dir, 0); // flags
+        append16(dir, method);
+        append32(dir, 0); // time/date
+        append32(dir, crc);
+        append32(dir, comp.size());
+        append32(dir, entry.data.size());
+        append16(dir, entry.name.length());
+        append16(dir, 0); // extra
+        append16(dir, 0); // comment
+        append16(dir, 0); // disk
+        append16(dir, 0); // internal attributes
+        append32(dir, 0); // external attributes
+        append32(dir, localOffset);
+        dir.insert(dir.end(), entry.name.begin(), entry.name.end());
+    }
+
+    uint32_t dirOffset = zip.size();
+    zip.insert(zip.end(), dir.begin(), dir.end());
+
+    // end of central directory
+    append32(zip, 0x06054B50);
+    append16(zip, 0);
+    append16(zip, 0);
+    append16(zip, entries.size());
+    append16(zip, entries.size());
+    append32(zip, dir.size());
+    append32(zip, dirOffset);
+    append16(zip, 0);
+
+    return zip;
+}
+
+static bool testArchives(const std::string &prefix)
+{
+    // large enough to have a few restart points
+    auto rom = makeROM(0x100000 + 0x123);
+    std::vector<uint8_t> readme{'n', 'o', 't', ' ', 'a', ' ', 'R', 'O', 'M'};
+
+    // .gz named after the file or by the header
+    if(!testFile(prefix + ".gb.gz", makeGzip(rom, nullptr), rom, prefix + ".gb", true))
+        return false;
+
+    if(!testFile(prefix + "-named.gz", makeGzip(rom, "inside.gba"), rom, "inside.gba", true))
+        return false;
+
+    // the ROM is preferred over other files
+    if(!testFile(prefix + ".zip", makeZip({{"readme.txt", readme, true}, {"roms/", {}, false}, {"roms/game.GBC", rom, true}}), rom, "roms/game.GBC", true))
+        return false;
+
+    if(!testFile(prefix + "-stored.zip", makeZip({{"readme.txt", readme, false}, {"game.gb", rom, false}}), rom, "game.gb", false))
+        return false;
+
+    // otherwise the first file
+    if(!testFile(prefix + "-other.zip", makeZip({{"dir/", {}, false}, {"game.bin", rom, true}, {"readme.txt", readme, true}}), rom, "game.bin", true))
+        return false;
+
+    // truncated
+    auto zip = makeZip({{"game.gb", rom, true}});
+    zip.erase(zip.begin() + zip.size() / 2, zip.end() - 22);
+
+    ROMSource source;
+    writeFile(prefix + "-truncated.zip", zip);
+    bool opened = source.open(prefix + "-truncated.zip");
+    remove((prefix + "-truncated.zip").c_str());
+
+    if(opened)
+    {
+        std::cerr << "opened a truncated .zip\n";
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+static bool testInvalid(const std::string &prefix)
+{
+    ROMSource source;
+
+    if(source.open(prefix + "-missing.gb"))
+    {
+        std::cerr << "opened a missing file\n";
+        return false;
+    }
+
+    auto filename = prefix + "-empty.gb";
+    writeFile(filename, {});
+
+    bool opened = source.open(filename);
+    remove(filename.c_str());
+
+    if(opened || source.isOpen())
+    {
+        std::cerr << "opened an empty file\n";
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    // files are created in the current directory
+    std::string prefix = argc > 1 ? argv[1] : "rom-source-test";
+
+    if(!testInvalid(prefix) || !testPlain(prefix))
+        return 1;
+
+#ifdef ROM_SOURCE_ZLIB
+    if(!testArchives(prefix))
+        return 1;
+
+    std::cout << "ROMSource reads matched" << (expectMapped ? " (mapped)" : "") << ", including archives\n";
+#else
+    std::cout << "ROMSource reads matched" << (expectMapped ? " (mapped)" : "") << "\n";
+#endif
+    return 0;
+}
@@ -13,9 +13,9 @@
 #include "DMGDisplay.h"
 #include "DMGMemory.h"
 #include "DMGRegs.h"
+#include "ROMSource.h"
 
-static std::ifstream romFile;
-static size_t romSize;
+static ROMSource romSource;
 
 static DMGCPU *cpu;
 static uint16_t screenData[160 * 144];
@@ -25,10 +25,7 @@ static bool takeScreenshot = false;
 
 static void getROMBank(uint8_t bank, uint8_t *ptr)
 {
-    auto addr = (bank * 0x4000);
-
-    romFile.seekg(addr);
-    romFile.read((char *)ptr, 0x4000);
+    romSource.read(bank * 0x4000, 0x4000, ptr);
 }
 
 // PNG load/save
@@ -143,21 +140,16 @@ static bool runTest(const std::string &rom, DMGCPU::Console console = DMGCPU::Co
     for(auto path : paths)
     {
         basePath = path;
-        romFile.open(path + rom);
-        if(romFile)
+        if(romSource.open(path + rom))
             break;
     }
 
-    if(!romFile)
+    if(!romSource.isOpen())
     {
         std::cerr << "Failed to load " << rom << "\n";
         return false;
     }
 
-    romFile.seekg(0, std::ios::end);
-    romSize = romFile.tellg();
-    romFile.seekg(0, std::ios::beg);
-
     // clean instance
     cpu = new DMGCPU;
     cpu->getDisplay().setFramebuffer(screenData);
@@ -166,6 +158,9 @@ static bool runTest(const std::string &rom, DMGCPU::Console console = DMGCPU::Co
     mem.setROMBankCallback(getROMBank);
     mem.addROMCache(romBankCache, sizeof(romBankCache));
 
+    if(romSource.isMapped())
+        mem.setCartROM(romSource.getData(), romSource.getSize());
+
     cpu->setConsole(console);
 
     cpu->reset();
@@ -205,7 +200,7 @@ static bool runTest(const std::string &rom, DMGCPU::Console console = DMGCPU::Co
 
     delete cpu;
 
-    romFile.close();
+    romSource.close();
     return result;
 }
 
@@ -230,18 +225,12 @@ static void replayLog(const std::string &logFilename, DMGCPU::Console console =
     // get rom from first line
     std::getline(logFile, rom);
 
-    romFile.open(logPath + rom);
-
-    if(!romFile)
+    if(!romSource.open(logPath + rom))
     {
         std::cerr << "Failed to load " << logPath + rom << "\n";
         return;
     }
 
-    romFile.seekg(0, std::ios::end);
-    romSize = romFile.tellg();
-    romFile.seekg(0, std::ios::beg);
-
     // clean instance
     cpu = new DMGCPU;
     cpu->getDisplay().setFramebuffer(screenData);
@@ -250,6 +239,9 @@ static void replayLog(const std::string &logFilename, DMGCPU::Console console =
     mem.setROMBankCallback(getROMBank);
     mem.addROMCache(romBankCache, sizeof(romBankCache));
 
+    if(romSource.isMapped())
+        mem.setCartROM(romSource.getData(), romSource.getSize());
+
     cpu->setConsole(console);
 
     cpu->reset();
@@ -304,7 +296,7 @@ static void replayLog(const std::string &logFilename, DMGCPU::Console console =
 
     delete cpu;
 
-    romFile.close();
+    romSource.close();
 }
 
 static void handleSignal(int signal)
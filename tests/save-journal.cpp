@@ -0,0 +1,206 @@
+// checks that the SDL shell's save journal restores the save after updates, compaction and bad records
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "SaveJournal.h"
+
+static std::mt19937 rng(0x5A7);
+
+static std::string savePath;
+
+// appends a record directly, the header isn't checked
+static void appendRecord(uint32_t size, uint32_t offset, uint32_t len, const uint8_t *data)
+{
+    std::ofstream journal(savePath + ".journal", std::ios::out | std::ios::binary | std::ios::app);
+
+    uint32_t head[3]{size, offset, len};
+    journal.write(reinterpret_cast<const char *>(head), sizeof(head));
+    journal.write(reinterpret_cast<const char *>(data), len);
+}
+
+static bool checkSave(const std::vector<uint8_t> &expected, const char *label)
+{
+    // a new one, as if the last one exited without writing the save
+    SaveJournal saveJournal;
+    saveJournal.setPath(savePath);
+
+    size_t size;
+    auto data = saveJournal.read(size);
+
+    bool ok = data && size == expected.size() && memcmp(data, expected.data(), size) == 0;
+    delete[] data;
+
+    if(!ok)
+        std::cerr << label << ": save doesn't match (size " << size << " != " << expected.size() << ")\n";
+    else if(std::filesystem::exists(savePath + ".journal"))
+    {
+        std::cerr << label << ": journal wasn't removed\n";
+        ok = false;
+    }
+    else if(std::filesystem::file_size(savePath) != expected.size())
+    {
+        std::cerr << label << ": save file wasn't written\n";
+        ok = false;
+    }
+
+    return ok;
+}
+
+// random writes, marking the pages dirty
+static void modify(std::vector<uint8_t> &ram, uint32_t *dirtyPages, int count)
+{
+    for(int i = 0; i < count; i++)
+    {
+        uint32_t offset = rng() % ram.size();
+        ram[offset] = rng();
+        dirtyPages[offset / 256 / 32] |= 1u << ((offset / 256) % 32);
+    }
+}
+
+static bool testUpdates()
+{
+    std::vector<uint8_t> ram(0x8000, 0xFF);
+    uint32_t dirtyPages[0x8000 / 256 / 32];
+
+    {
+        SaveJournal saveJournal;
+        saveJournal.setPath(savePath);
+
+        size_t size;
+        if(saveJournal.read(size))
+        {
+            std::cerr << "read a save that doesn't exist\n";
+            return false;
+        }
+
+        for(int i = 0; i < 10; i++)
+        {
+            memset(dirtyPages, 0, sizeof(dirtyPages));
+            modify(ram, dirtyPages, 1 + rng() % 16);
+            saveJournal.update(ram.data(), ram.size(), dirtyPages);
+        }
+
+        // everything at the end
+        memset(dirtyPages, 0, sizeof(dirtyPages));
+        ram.back() = 0x42;
+        dirtyPages[std::size(dirtyPages) - 1] = 1u << 31;
+        saveJournal.update(ram.data(), ram.size(), dirtyPages);
+    }
+
+    if(!checkSave(ram, "journal only"))
+        return false;
+
+    // on top of an existing save, large enough to be compacted a few times
+    SaveJournal saveJournal;
+    saveJournal.setPath(savePath);
+
+    for(int i = 0; i < 100; i++)
+    {
+        memset(dirtyPages, 0, sizeof(dirtyPages));
+        modify(ram, dirtyPages, 1 + rng() % 64);
+        saveJournal.update(ram.data(), ram.size(), dirtyPages);
+
+        if(saveJournal.getJournalSize() > ram.size() * 4)
+        {
+            std::cerr << "journal wasn't compacted\n";
+            return false;
+        }
+    }
+
+    if(!checkSave(ram, "compacted"))
+        return false;
+
+    // full write
+    saveJournal.write(ram.data(), ram.size());
+
+    return checkSave(ram, "written");
+}
+
+static bool testRecords()
+{
+    std::vector<uint8_t> save(0x200);
+    for(auto &b : save)
+        b = rng();
+
+    {
+        SaveJournal saveJournal;
+        saveJournal.setPath(savePath);
+        saveJournal.write(save.data(), save.size());
+    }
+
+    // grows the save, the new part is 0xFF
+    uint8_t data[0x200];
+    for(auto &b : data)
+        b = rng();
+
+    appendRecord(0x1000, 0xF00, 0x100, data);
+    save.resize(0x1000, 0xFF);
+    memcpy(save.data() + 0xF00, data, 0x100);
+
+    // smaller size doesn't shrink it
+    appendRecord(0x100, 0x80, 0x80, data + 0x100);
+    memcpy(save.data() + 0x80, data + 0x100, 0x80);
+
+    // nothing after a bad record is applied
+    // (offset + length wraps, offset past the end, length past the end, too large)
+    const uint32_t badRecords[][3]
+    {
+        {0x1000, 0xFFFFFF00, 0x200},
+        {0x1000, 0x1001, 0},
+        {0x1000, 0xF00, 0x101},
+        {0x80000000, 0x7FFFFF00, 0x100},
+    };
+
+    for(auto &bad : badRecords)
+    {
+        {
+            SaveJournal saveJournal;
+            saveJournal.setPath(savePath);
+            saveJournal.write(save.data(), save.size());
+        }
+
+        appendRecord(0x1000, 0, 0x10, data);
+        memcpy(save.data(), data, 0x10);
+
+        appendRecord(bad[0], bad[1], bad[2], data);
+        appendRecord(0x1000, 0x10, 0x10, data);
+
+        if(!checkSave(save, "bad record"))
+            return false;
+    }
+
+    // incomplete record at the end
+    appendRecord(0x1000, 0x100, 0x100, data);
+    memcpy(save.data() + 0x100, data, 0x100);
+
+    appendRecord(0x1000, 0x200, 0x200, data);
+    std::filesystem::resize_file(savePath + ".journal", std::filesystem::file_size(savePath + ".journal") - 0x100);
+
+    return checkSave(save, "incomplete record");
+}
+
+int main(int argc, char *argv[])
+{
+    // files are created in the current directory
+    savePath = (argc > 1 ? argv[1] : std::string("save-journal-test")) + ".sav";
+
+    std::filesystem::remove(savePath);
+    std::filesystem::remove(savePath + ".journal");
+
+    bool ok = testUpdates() && testRecords();
+
+    std::filesystem::remove(savePath);
+    std::filesystem::remove(savePath + ".journal");
+
+    if(!ok)
+        return 1;
+
+    std::cout << "save journal OK\n";
+    return 0;
+}